@@ -870,14 +870,13 @@ retry:
 						    (struct sockaddr *) &sd,
 						    (struct sockaddr *) &ss);
 			if (ttl == cfg->init_ttl && query == 0 && show_pkt) {
-				struct pkt_buff *pkt;
+				struct pkt_buff pkt;
 
 				printf("Original packet:\n");
 
-				pkt = pkt_alloc(packet, len);
-				hex_ascii(pkt);
+				pkt_init(&pkt, packet, len);
+				hex_ascii(&pkt);
 				tprintf_flush();
-				pkt_free(pkt);
 
 				printf("\n%2d: ", ttl);
 				fflush(stdout);
@@ -905,14 +904,13 @@ retry:
 							(struct sockaddr *) &ss,
 							cfg->dns_resolv);
 				if (is_okay && show_pkt) {
-					struct pkt_buff *pkt;
+					struct pkt_buff pkt;
 
 					printf("\n  Received packet:\n");
 
-					pkt = pkt_alloc(packet_rcv, real_len);
-					hex_ascii(pkt);
+					pkt_init(&pkt, packet_rcv, real_len);
+					hex_ascii(&pkt);
 					tprintf_flush();
-					pkt_free(pkt);
 				}
 			} else {
 				printf("* ");
@@ -9,13 +9,23 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/if_ether.h>
 
 #include "bpf.h"
+/* After bpf.h, whose include guard is BPF_H, the half word size */
+#include <linux/bpf.h>
 #include "xmalloc.h"
 #include "xutils.h"
 #include "die.h"
@@ -29,6 +39,9 @@
 #ifndef BPF_MEMWORDS
 # define BPF_MEMWORDS 16
 #endif
+#ifndef SO_ATTACH_BPF
+# define SO_ATTACH_BPF	50
+#endif
 
 #define BPF_LD_B	(BPF_LD | BPF_B)
 #define BPF_LD_H	(BPF_LD | BPF_H)
@@ -122,6 +135,11 @@ static const char *bpf_dump_linux_k(uint32_t k)
 		return "#vlant";
 	case (SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT):
 		return "#vlanp";
+	/* Our own, for eBPF only */
+	case (SKF_AD_OFF + SKF_AD_L4PROTO):
+		return "#l4proto";
+	case (SKF_AD_OFF + SKF_AD_L4OFF):
+		return "#l4off";
 	}
 }
 
@@ -347,17 +365,976 @@ static char *bpf_dump(const struct sock_filter bpf, int n)
 	return image;
 }
 
-void bpf_dump_all(struct sock_fprog *bpf)
-{
-	int i;
-	for (i = 0; i < bpf->len; ++i)
-		printf("%s\n", bpf_dump(bpf->filter[i], i));
+void bpf_dump_all(struct sock_fprog *bpf)
+{
+	int i;
+	for (i = 0; i < bpf->len; ++i)
+		printf("%s\n", bpf_dump(bpf->filter[i], i));
+}
+
+/* Program listing with how often each instruction ran for num packets */
+void bpf_dump_profile(struct sock_fprog *bpf, const unsigned long *hits,
+		      unsigned long num)
+{
+	unsigned int i;
+
+	for (i = 0; i < bpf->len; ++i)
+		printf("%10lu %6.1f%% %s\n", hits[i],
+		       100.0 * hits[i] / num, bpf_dump(bpf->filter[i], i));
+}
+
+/*
+ * Translation of classic programs into eBPF socket filters. Registers
+ * are the ones the kernel uses for its own conversion: A is r0, where
+ * ld_abs/ld_ind leave their result, X is r7, r6 holds the skb that
+ * ld_abs/ld_ind need and r8 is scratch. M[] lives on the stack. Linux
+ * extensions are loads from struct __sk_buff or helper calls, those
+ * without an equivalent make the translation fail.
+ *
+ * Before the program starts, a prologue may locate the layer 4 header
+ * for #l4proto/#l4off, build a flow key below M[] and drop flows that
+ * are not sampled. Returns then go through an epilogue that counts the
+ * packet in the flow map if the program accepted it.
+ */
+#define EBPF_REG_A		BPF_REG_0
+#define EBPF_REG_X		BPF_REG_7
+#define EBPF_REG_CTX		BPF_REG_6
+#define EBPF_REG_TMP		BPF_REG_8
+#define EBPF_MEM_OFF(k)		(-4 * (BPF_MEMWORDS - (int) (k)))
+
+/* Prologue and epilogue only, the program has not started yet or is done */
+#define EBPF_REG_LEN		BPF_REG_7
+#define EBPF_REG_L4OFF		BPF_REG_8
+#define EBPF_REG_L4PROTO	BPF_REG_9
+#define EBPF_REG_RET		BPF_REG_9
+
+#define EBPF_L4PROTO_OFF	(EBPF_MEM_OFF(0) - 4)
+#define EBPF_L4OFF_OFF		(EBPF_MEM_OFF(0) - 8)
+#define EBPF_KEY_OFF		(EBPF_L4OFF_OFF - (int) sizeof(struct bpf_flow_key))
+#define EBPF_KEY(member)						\
+	(EBPF_KEY_OFF + (int) offsetof(struct bpf_flow_key, member))
+#define EBPF_VAL_OFF		(EBPF_KEY_OFF - (int) sizeof(struct bpf_flow_val))
+#define EBPF_VAL(member)						\
+	(EBPF_VAL_OFF + (int) offsetof(struct bpf_flow_val, member))
+
+/* IPv6 extension headers walked before giving up on the layer 4 header */
+#define EBPF_IPV6_EXTS		8
+#define EBPF_HASH_MUL		0x9e3779b1
+
+enum ebpf_label {
+	EBPF_L_V4,
+	EBPF_L_FAIL,
+	EBPF_L_DONE,
+	EBPF_L_PORTS,
+	EBPF_L_NOPORTS,
+	EBPF_L_KEEP,
+	EBPF_L_RET,
+	EBPF_L_NEW,
+	EBPF_L_OUT,
+	/* Generic, AH and advance, per unrolled extension header */
+	EBPF_L_EXT,
+	__EBPF_L_MAX = EBPF_L_EXT + 3 * EBPF_IPV6_EXTS,
+};
+
+struct ebpf_ctx {
+	/* NULL in the sizing pass */
+	struct bpf_insn *out;
+	uint32_t *start;
+	bool *reach;
+	uint16_t mem_read;
+	bool l4;
+	const struct bpf_ebpf_opts *opts;
+	uint32_t label[__EBPF_L_MAX];
+	size_t pos;
+};
+
+static inline bool ebpf_sampling(const struct ebpf_ctx *ec)
+{
+	return ec->opts && ec->opts->sample > 1;
+}
+
+static inline bool ebpf_counting(const struct ebpf_ctx *ec)
+{
+	return ec->opts && ec->opts->map_fd >= 0;
+}
+
+static void ebpf_emit(struct ebpf_ctx *ec, uint8_t code, uint8_t dst,
+		      uint8_t src, int16_t off, int32_t imm)
+{
+	struct bpf_insn *insn;
+
+	if (ec->out) {
+		insn = &ec->out[ec->pos];
+		insn->code = code;
+		insn->dst_reg = dst;
+		insn->src_reg = src;
+		insn->off = off;
+		insn->imm = imm;
+	}
+
+	ec->pos++;
+}
+
+static inline void ebpf_emit_jmp(struct ebpf_ctx *ec, uint8_t code,
+				 uint8_t dst, uint8_t src, int32_t imm,
+				 uint32_t target)
+{
+	int16_t off = ec->out ? ec->start[target] - ec->pos - 1 : 0;
+
+	ebpf_emit(ec, code, dst, src, off, imm);
+}
+
+/* Labels are only jumped to forward, their place is known from sizing */
+static inline void ebpf_label(struct ebpf_ctx *ec, enum ebpf_label l)
+{
+	ec->label[l] = ec->pos;
+}
+
+static inline void ebpf_emit_to(struct ebpf_ctx *ec, uint8_t code,
+				uint8_t dst, int32_t imm, enum ebpf_label l)
+{
+	int16_t off = ec->out ? ec->label[l] - ec->pos - 1 : 0;
+
+	ebpf_emit(ec, code, dst, 0, off, imm);
+}
+
+static inline void ebpf_emit_ctx(struct ebpf_ctx *ec, uint8_t dst,
+				 int16_t off)
+{
+	ebpf_emit(ec, BPF_LDX | BPF_MEM | BPF_W, dst, EBPF_REG_CTX, off, 0);
+}
+
+static int ebpf_emit_ancillary(struct ebpf_ctx *ec, uint32_t k)
+{
+	switch (k - SKF_AD_OFF) {
+	case SKF_AD_PROTOCOL:
+		ebpf_emit_ctx(ec, EBPF_REG_A,
+			      offsetof(struct __sk_buff, protocol));
+		ebpf_emit(ec, BPF_ALU | BPF_END | BPF_TO_BE, EBPF_REG_A, 0,
+			  0, 16);
+		break;
+	case SKF_AD_PKTTYPE:
+		ebpf_emit_ctx(ec, EBPF_REG_A,
+			      offsetof(struct __sk_buff, pkt_type));
+		break;
+	case SKF_AD_IFINDEX:
+		ebpf_emit_ctx(ec, EBPF_REG_A,
+			      offsetof(struct __sk_buff, ifindex));
+		break;
+	case SKF_AD_MARK:
+		ebpf_emit_ctx(ec, EBPF_REG_A, offsetof(struct __sk_buff, mark));
+		break;
+	case SKF_AD_QUEUE:
+		ebpf_emit_ctx(ec, EBPF_REG_A,
+			      offsetof(struct __sk_buff, queue_mapping));
+		break;
+	case SKF_AD_RXHASH:
+		ebpf_emit_ctx(ec, EBPF_REG_A, offsetof(struct __sk_buff, hash));
+		break;
+	case SKF_AD_VLAN_TAG:
+		ebpf_emit_ctx(ec, EBPF_REG_A,
+			      offsetof(struct __sk_buff, vlan_tci));
+		break;
+	case SKF_AD_VLAN_TAG_PRESENT:
+		ebpf_emit_ctx(ec, EBPF_REG_A,
+			      offsetof(struct __sk_buff, vlan_present));
+		break;
+	case SKF_AD_VLAN_TPID:
+		ebpf_emit_ctx(ec, EBPF_REG_A,
+			      offsetof(struct __sk_buff, vlan_proto));
+		ebpf_emit(ec, BPF_ALU | BPF_END | BPF_TO_BE, EBPF_REG_A, 0,
+			  0, 16);
+		break;
+	case SKF_AD_CPU:
+		ebpf_emit(ec, BPF_JMP | BPF_CALL, 0, 0, 0,
+			  BPF_FUNC_get_smp_processor_id);
+		break;
+	case SKF_AD_RANDOM:
+		ebpf_emit(ec, BPF_JMP | BPF_CALL, 0, 0, 0,
+			  BPF_FUNC_get_prandom_u32);
+		break;
+	case SKF_AD_L4PROTO:
+		ebpf_emit(ec, BPF_LDX | BPF_MEM | BPF_W, EBPF_REG_A,
+			  BPF_REG_10, EBPF_L4PROTO_OFF, 0);
+		break;
+	case SKF_AD_L4OFF:
+		ebpf_emit(ec, BPF_LDX | BPF_MEM | BPF_W, EBPF_REG_A,
+			  BPF_REG_10, EBPF_L4OFF_OFF, 0);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+static int ebpf_emit_ret0(struct ebpf_ctx *ec)
+{
+	ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_K, EBPF_REG_A, 0, 0, 0);
+	ebpf_emit(ec, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	return 0;
+}
+
+/*
+ * Jumps to l unless len bytes at off, relative to the layer 4 offset
+ * register if ind, are in the packet. ld_abs/ld_ind would end the
+ * program and drop packets the classic program never looked at.
+ */
+static void ebpf_emit_need(struct ebpf_ctx *ec, bool ind, int32_t off,
+			   enum ebpf_label l)
+{
+	if (ind) {
+		ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1,
+			  EBPF_REG_L4OFF, 0, 0);
+		ebpf_emit(ec, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0,
+			  off);
+	} else {
+		ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0,
+			  off);
+	}
+
+	ebpf_emit(ec, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_1, EBPF_REG_LEN,
+		  ec->out ? ec->label[l] - ec->pos - 1 : 0, 0);
+}
+
+static inline void ebpf_emit_ldind(struct ebpf_ctx *ec, uint8_t size,
+				   int32_t off)
+{
+	ebpf_emit(ec, BPF_LD | size | BPF_IND, 0, EBPF_REG_L4OFF, 0, off);
+}
+
+/* Next header into the protocol register, header length into r0 */
+static void ebpf_emit_ipv6_ext(struct ebpf_ctx *ec, int32_t add, int32_t shift)
+{
+	ebpf_emit_need(ec, true, 2, EBPF_L_FAIL);
+	ebpf_emit_ldind(ec, BPF_B, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, EBPF_REG_L4PROTO,
+		  BPF_REG_0, 0, 0);
+	ebpf_emit_ldind(ec, BPF_B, 1);
+	ebpf_emit(ec, BPF_ALU | BPF_ADD | BPF_K, BPF_REG_0, 0, 0, add);
+	ebpf_emit(ec, BPF_ALU | BPF_LSH | BPF_K, BPF_REG_0, 0, 0, shift);
+}
+
+static void ebpf_emit_ipv6(struct ebpf_ctx *ec, bool key)
+{
+	int i, l;
+
+	ebpf_emit_need(ec, false, ETH_HLEN + 40, EBPF_L_FAIL);
+	if (key) {
+		for (i = 0; i < 4; ++i) {
+			ebpf_emit(ec, BPF_LD | BPF_W | BPF_ABS, 0, 0, 0,
+				  ETH_HLEN + 8 + 4 * i);
+			ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10,
+				  BPF_REG_0, EBPF_KEY(saddr) + 4 * i, 0);
+			ebpf_emit(ec, BPF_LD | BPF_W | BPF_ABS, 0, 0, 0,
+				  ETH_HLEN + 24 + 4 * i);
+			ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10,
+				  BPF_REG_0, EBPF_KEY(daddr) + 4 * i, 0);
+		}
+		ebpf_emit(ec, BPF_ST | BPF_MEM | BPF_B, BPF_REG_10, 0,
+			  EBPF_KEY(family), 6);
+	}
+
+	ebpf_emit(ec, BPF_LD | BPF_B | BPF_ABS, 0, 0, 0, ETH_HLEN + 6);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, EBPF_REG_L4PROTO,
+		  BPF_REG_0, 0, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_K, EBPF_REG_L4OFF, 0, 0,
+		  ETH_HLEN + 40);
+
+	/* The verifier wants no loops, so the walk is unrolled */
+	for (i = 0; i < EBPF_IPV6_EXTS; ++i) {
+		l = EBPF_L_EXT + 3 * i;
+
+		ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4PROTO,
+			     IPPROTO_HOPOPTS, l);
+		ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4PROTO,
+			     IPPROTO_ROUTING, l);
+		ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4PROTO,
+			     IPPROTO_DSTOPTS, l);
+		ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4PROTO,
+			     135 /* Mobility */, l);
+		ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4PROTO,
+			     IPPROTO_AH, l + 1);
+		ebpf_emit_to(ec, BPF_JMP | BPF_JNE | BPF_K, EBPF_REG_L4PROTO,
+			     IPPROTO_FRAGMENT, EBPF_L_DONE);
+
+		/* Only the first fragment carries the layer 4 header */
+		ebpf_emit_need(ec, true, 8, EBPF_L_FAIL);
+		ebpf_emit_ldind(ec, BPF_B, 0);
+		ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, EBPF_REG_L4PROTO,
+			  BPF_REG_0, 0, 0);
+		ebpf_emit_ldind(ec, BPF_H, 2);
+		ebpf_emit(ec, BPF_ALU | BPF_AND | BPF_K, BPF_REG_0, 0, 0,
+			  0xfff8);
+		ebpf_emit_to(ec, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0,
+			     EBPF_L_FAIL);
+		ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 8);
+		ebpf_emit_to(ec, BPF_JMP | BPF_JA, 0, 0, l + 2);
+
+		ebpf_label(ec, l + 1);
+		ebpf_emit_ipv6_ext(ec, 2, 2);
+		ebpf_emit_to(ec, BPF_JMP | BPF_JA, 0, 0, l + 2);
+
+		ebpf_label(ec, l);
+		ebpf_emit_ipv6_ext(ec, 1, 3);
+
+		ebpf_label(ec, l + 2);
+		ebpf_emit(ec, BPF_ALU64 | BPF_ADD | BPF_X, EBPF_REG_L4OFF,
+			  BPF_REG_0, 0, 0);
+	}
+
+	/* Still an extension header, the layer 4 one is too deep */
+	ebpf_emit_to(ec, BPF_JMP | BPF_JA, 0, 0, EBPF_L_FAIL);
+}
+
+static void ebpf_emit_ipv4(struct ebpf_ctx *ec, bool key)
+{
+	ebpf_label(ec, EBPF_L_V4);
+	ebpf_emit_need(ec, false, ETH_HLEN + 20, EBPF_L_FAIL);
+	if (key) {
+		ebpf_emit(ec, BPF_LD | BPF_W | BPF_ABS, 0, 0, 0,
+			  ETH_HLEN + 12);
+		ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10,
+			  BPF_REG_0, EBPF_KEY(saddr), 0);
+		ebpf_emit(ec, BPF_LD | BPF_W | BPF_ABS, 0, 0, 0,
+			  ETH_HLEN + 16);
+		ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10,
+			  BPF_REG_0, EBPF_KEY(daddr), 0);
+		ebpf_emit(ec, BPF_ST | BPF_MEM | BPF_B, BPF_REG_10, 0,
+			  EBPF_KEY(family), 4);
+	}
+
+	ebpf_emit(ec, BPF_LD | BPF_B | BPF_ABS, 0, 0, 0, ETH_HLEN + 9);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, EBPF_REG_L4PROTO,
+		  BPF_REG_0, 0, 0);
+	ebpf_emit(ec, BPF_LD | BPF_H | BPF_ABS, 0, 0, 0, ETH_HLEN + 6);
+	ebpf_emit(ec, BPF_ALU | BPF_AND | BPF_K, BPF_REG_0, 0, 0, 0x1fff);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0,
+		     EBPF_L_FAIL);
+	ebpf_emit(ec, BPF_LD | BPF_B | BPF_ABS, 0, 0, 0, ETH_HLEN);
+	ebpf_emit(ec, BPF_ALU | BPF_AND | BPF_K, BPF_REG_0, 0, 0, 0xf);
+	ebpf_emit(ec, BPF_ALU | BPF_LSH | BPF_K, BPF_REG_0, 0, 0, 2);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, EBPF_REG_L4OFF,
+		  BPF_REG_0, 0, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_ADD | BPF_K, EBPF_REG_L4OFF, 0, 0,
+		  ETH_HLEN);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JA, 0, 0, EBPF_L_DONE);
+}
+
+/*
+ * Finds the layer 4 protocol and header offset of Ethernet frames, 0 if
+ * there is none, e.g. in later fragments or truncated headers. Fills in
+ * addresses and ports of the flow key on the way if there is one.
+ */
+static void ebpf_emit_l4(struct ebpf_ctx *ec, bool key)
+{
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_K, EBPF_REG_L4PROTO, 0, 0, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_K, EBPF_REG_L4OFF, 0, 0, 0);
+	ebpf_emit_ctx(ec, EBPF_REG_LEN, offsetof(struct __sk_buff, len));
+
+	ebpf_emit_need(ec, false, ETH_HLEN, EBPF_L_FAIL);
+	ebpf_emit(ec, BPF_LD | BPF_H | BPF_ABS, 0, 0, 0, 12);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, ETH_P_IP,
+		     EBPF_L_V4);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, ETH_P_IPV6,
+		     EBPF_L_FAIL);
+
+	ebpf_emit_ipv6(ec, key);
+	ebpf_emit_ipv4(ec, key);
+
+	ebpf_label(ec, EBPF_L_FAIL);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_K, EBPF_REG_L4OFF, 0, 0, 0);
+	ebpf_label(ec, EBPF_L_DONE);
+	ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, EBPF_REG_L4PROTO,
+		  EBPF_L4PROTO_OFF, 0);
+	ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, EBPF_REG_L4OFF,
+		  EBPF_L4OFF_OFF, 0);
+
+	if (!key)
+		return;
+
+	ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_B, BPF_REG_10, EBPF_REG_L4PROTO,
+		  EBPF_KEY(proto), 0);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4OFF, 0,
+		     EBPF_L_NOPORTS);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4PROTO,
+		     IPPROTO_TCP, EBPF_L_PORTS);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4PROTO,
+		     IPPROTO_UDP, EBPF_L_PORTS);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4PROTO,
+		     IPPROTO_UDPLITE, EBPF_L_PORTS);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, EBPF_REG_L4PROTO,
+		     IPPROTO_SCTP, EBPF_L_PORTS);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JNE | BPF_K, EBPF_REG_L4PROTO,
+		     IPPROTO_DCCP, EBPF_L_NOPORTS);
+
+	ebpf_label(ec, EBPF_L_PORTS);
+	ebpf_emit_need(ec, true, 4, EBPF_L_NOPORTS);
+	ebpf_emit_ldind(ec, BPF_H, 0);
+	ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_0,
+		  EBPF_KEY(sport), 0);
+	ebpf_emit_ldind(ec, BPF_H, 2);
+	ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_0,
+		  EBPF_KEY(dport), 0);
+	ebpf_label(ec, EBPF_L_NOPORTS);
+}
+
+static inline void ebpf_emit_hash_add(struct ebpf_ctx *ec, uint8_t size,
+				      int16_t off)
+{
+	ebpf_emit(ec, BPF_LDX | BPF_MEM | size, BPF_REG_2, BPF_REG_10, off, 0);
+	ebpf_emit(ec, BPF_ALU | BPF_ADD | BPF_X, BPF_REG_1, BPF_REG_2, 0, 0);
+}
+
+/*
+ * Keeps 1 in sample flows. Both halves of the key are summed up before
+ * mixing, so both directions of a flow hash the same. Packets without
+ * IP header all have the zero key, which is always kept.
+ */
+static void ebpf_emit_sample(struct ebpf_ctx *ec)
+{
+	int i;
+
+	ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 0);
+	for (i = 0; i < 4; ++i) {
+		ebpf_emit_hash_add(ec, BPF_W, EBPF_KEY(saddr) + 4 * i);
+		ebpf_emit_hash_add(ec, BPF_W, EBPF_KEY(daddr) + 4 * i);
+		ebpf_emit(ec, BPF_ALU | BPF_MUL | BPF_K, BPF_REG_1, 0, 0,
+			  EBPF_HASH_MUL);
+	}
+	ebpf_emit_hash_add(ec, BPF_H, EBPF_KEY(sport));
+	ebpf_emit_hash_add(ec, BPF_H, EBPF_KEY(dport));
+	ebpf_emit(ec, BPF_ALU | BPF_MUL | BPF_K, BPF_REG_1, 0, 0,
+		  EBPF_HASH_MUL);
+	ebpf_emit_hash_add(ec, BPF_B, EBPF_KEY(proto));
+	ebpf_emit(ec, BPF_ALU | BPF_MUL | BPF_K, BPF_REG_1, 0, 0,
+		  EBPF_HASH_MUL);
+	ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_1, 0, 0);
+	ebpf_emit(ec, BPF_ALU | BPF_RSH | BPF_K, BPF_REG_2, 0, 0, 16);
+	ebpf_emit(ec, BPF_ALU | BPF_XOR | BPF_X, BPF_REG_1, BPF_REG_2, 0, 0);
+
+	ebpf_emit(ec, BPF_ALU | BPF_MOD | BPF_K, BPF_REG_1, 0, 0,
+		  ec->opts->sample);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0, EBPF_L_KEEP);
+	ebpf_emit_ret0(ec);
+	ebpf_label(ec, EBPF_L_KEEP);
+}
+
+static void ebpf_emit_lookup(struct ebpf_ctx *ec)
+{
+	ebpf_emit(ec, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD,
+		  0, ec->opts->map_fd);
+	ebpf_emit(ec, 0, 0, 0, 0, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0,
+		  EBPF_KEY_OFF);
+	ebpf_emit(ec, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+}
+
+static void ebpf_emit_add(struct ebpf_ctx *ec)
+{
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1);
+	ebpf_emit(ec, BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1,
+		  offsetof(struct bpf_flow_val, packets), 0);
+	ebpf_emit_ctx(ec, BPF_REG_1, offsetof(struct __sk_buff, len));
+	ebpf_emit(ec, BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1,
+		  offsetof(struct bpf_flow_val, bytes), 0);
+}
+
+/* Every return of the program ends up here with its value in A */
+static void ebpf_emit_count(struct ebpf_ctx *ec)
+{
+	ebpf_label(ec, EBPF_L_RET);
+	ebpf_emit(ec, BPF_JMP | BPF_JNE | BPF_K, EBPF_REG_A, 0, 1, 0);
+	ebpf_emit(ec, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, EBPF_REG_RET, EBPF_REG_A,
+		  0, 0);
+
+	ebpf_emit_lookup(ec);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, EBPF_L_NEW);
+	ebpf_emit_add(ec);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JA, 0, 0, EBPF_L_OUT);
+
+	ebpf_label(ec, EBPF_L_NEW);
+	ebpf_emit(ec, BPF_ST | BPF_MEM | BPF_DW, BPF_REG_10, 0,
+		  EBPF_VAL(packets), 1);
+	ebpf_emit_ctx(ec, BPF_REG_1, offsetof(struct __sk_buff, len));
+	ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_1,
+		  EBPF_VAL(bytes), 0);
+	ebpf_emit(ec, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD,
+		  0, ec->opts->map_fd);
+	ebpf_emit(ec, 0, 0, 0, 0, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0,
+		  EBPF_KEY_OFF);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0);
+	ebpf_emit(ec, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0,
+		  EBPF_VAL_OFF);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0,
+		  BPF_NOEXIST);
+	ebpf_emit(ec, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_update_elem);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, EBPF_L_OUT);
+
+	/* Another CPU created it meanwhile, no way back up without loops */
+	ebpf_emit_lookup(ec);
+	ebpf_emit_to(ec, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, EBPF_L_OUT);
+	ebpf_emit_add(ec);
+
+	ebpf_label(ec, EBPF_L_OUT);
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, EBPF_REG_A, EBPF_REG_RET,
+		  0, 0);
+	ebpf_emit(ec, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+static int ebpf_emit_insn(struct ebpf_ctx *ec, const struct sock_filter *f,
+			  uint32_t i)
+{
+	uint8_t op = BPF_OP(f->code), dst, src;
+	int32_t k = f->k;
+
+	switch (BPF_CLASS(f->code)) {
+	case BPF_RET:
+		if (BPF_RVAL(f->code) == BPF_K)
+			ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_K, EBPF_REG_A,
+				  0, 0, k);
+		else if (BPF_RVAL(f->code) != BPF_A)
+			return -EOPNOTSUPP;
+		if (ebpf_counting(ec) &&
+		    !(BPF_RVAL(f->code) == BPF_K && k == 0))
+			ebpf_emit_to(ec, BPF_JMP | BPF_JA, 0, 0, EBPF_L_RET);
+		else
+			ebpf_emit(ec, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+		break;
+	case BPF_LD:
+	case BPF_LDX:
+		dst = BPF_CLASS(f->code) == BPF_LD ? EBPF_REG_A : EBPF_REG_X;
+
+		switch (f->code) {
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_ABS:
+			if (f->k >= (uint32_t) SKF_AD_OFF)
+				return ebpf_emit_ancillary(ec, f->k);
+			ebpf_emit(ec, f->code, 0, 0, 0, k);
+			break;
+		case BPF_LD | BPF_W | BPF_IND:
+		case BPF_LD | BPF_H | BPF_IND:
+		case BPF_LD | BPF_B | BPF_IND:
+			ebpf_emit(ec, f->code, 0, EBPF_REG_X, 0, k);
+			break;
+		case BPF_LD | BPF_IMM:
+		case BPF_LDX | BPF_IMM:
+			ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_K, dst, 0, 0, k);
+			break;
+		case BPF_LD | BPF_MEM:
+		case BPF_LDX | BPF_MEM:
+			ebpf_emit(ec, BPF_LDX | BPF_MEM | BPF_W, dst,
+				  BPF_REG_10, EBPF_MEM_OFF(f->k), 0);
+			break;
+		case BPF_LD | BPF_W | BPF_LEN:
+		case BPF_LDX | BPF_W | BPF_LEN:
+			ebpf_emit_ctx(ec, dst, offsetof(struct __sk_buff, len));
+			break;
+		case BPF_LDX | BPF_B | BPF_MSH:
+			/* ld_abs can only load into A, so park A meanwhile */
+			ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X,
+				  EBPF_REG_TMP, EBPF_REG_A, 0, 0);
+			ebpf_emit(ec, BPF_LD | BPF_B | BPF_ABS, 0, 0, 0, k);
+			ebpf_emit(ec, BPF_ALU | BPF_AND | BPF_K, EBPF_REG_A,
+				  0, 0, 0xf);
+			ebpf_emit(ec, BPF_ALU | BPF_LSH | BPF_K, EBPF_REG_A,
+				  0, 0, 2);
+			ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_X, EBPF_REG_X,
+				  EBPF_REG_A, 0, 0);
+			ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, EBPF_REG_A,
+				  EBPF_REG_TMP, 0, 0);
+			break;
+		default:
+			return -EOPNOTSUPP;
+		}
+		break;
+	case BPF_ST:
+	case BPF_STX:
+		src = BPF_CLASS(f->code) == BPF_ST ? EBPF_REG_A : EBPF_REG_X;
+		ebpf_emit(ec, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, src,
+			  EBPF_MEM_OFF(f->k), 0);
+		break;
+	case BPF_MISC:
+		if (BPF_MISCOP(f->code) == BPF_TAX)
+			ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_X, EBPF_REG_X,
+				  EBPF_REG_A, 0, 0);
+		else
+			ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_X, EBPF_REG_A,
+				  EBPF_REG_X, 0, 0);
+		break;
+	case BPF_ALU:
+		if (op > BPF_XOR)
+			return -EOPNOTSUPP;
+		if (BPF_SRC(f->code) == BPF_K &&
+		    (((op == BPF_DIV || op == BPF_MOD) && f->k == 0) ||
+		     ((op == BPF_LSH || op == BPF_RSH) && f->k >= 32)))
+			return -EINVAL;
+
+		/* Classic BPF rejects the packet, eBPF would go on */
+		if (BPF_SRC(f->code) == BPF_X &&
+		    (op == BPF_DIV || op == BPF_MOD)) {
+			ebpf_emit(ec, BPF_JMP | BPF_JNE | BPF_K, EBPF_REG_X,
+				  0, 2, 0);
+			ebpf_emit_ret0(ec);
+		}
+
+		if (BPF_SRC(f->code) == BPF_X)
+			ebpf_emit(ec, f->code, EBPF_REG_A, EBPF_REG_X, 0, 0);
+		else
+			ebpf_emit(ec, f->code, EBPF_REG_A, 0, 0,
+				  op == BPF_NEG ? 0 : k);
+		break;
+	case BPF_JMP:
+		if (op == BPF_JA) {
+			ebpf_emit_jmp(ec, BPF_JMP | BPF_JA, 0, 0, 0,
+				      i + 1 + f->k);
+			break;
+		}
+		if (op > BPF_JSET)
+			return -EOPNOTSUPP;
+
+		/* eBPF sign extends immediates to 64 bit compares */
+		if (BPF_SRC(f->code) == BPF_X) {
+			src = EBPF_REG_X;
+			op |= BPF_X;
+			k = 0;
+		} else if (k < 0) {
+			ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_K, EBPF_REG_TMP,
+				  0, 0, k);
+			src = EBPF_REG_TMP;
+			op |= BPF_X;
+			k = 0;
+		} else {
+			src = 0;
+		}
+
+		if (BPF_OP(op) == BPF_JEQ && f->jt == 0 && f->jf != 0) {
+			ebpf_emit_jmp(ec, BPF_JMP | BPF_JNE | BPF_SRC(op),
+				      EBPF_REG_A, src, k, i + 1 + f->jf);
+			break;
+		}
+
+		ebpf_emit_jmp(ec, BPF_JMP | op, EBPF_REG_A, src, k,
+			      i + 1 + f->jt);
+		if (f->jf)
+			ebpf_emit_jmp(ec, BPF_JMP | BPF_JA, 0, 0, 0,
+				      i + 1 + f->jf);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+static inline bool bpf_is_l4_ancillary(const struct sock_filter *f)
+{
+	return BPF_CLASS(f->code) == BPF_LD && BPF_MODE(f->code) == BPF_ABS &&
+	       (f->k == (uint32_t) (SKF_AD_OFF + SKF_AD_L4PROTO) ||
+		f->k == (uint32_t) (SKF_AD_OFF + SKF_AD_L4OFF));
+}
+
+/* #l4proto and #l4off are ours, the kernel reads them as zero */
+static bool bpf_needs_ebpf(const struct sock_fprog *bpf)
+{
+	uint32_t i;
+
+	for (i = 0; i < bpf->len; ++i) {
+		if (bpf_is_l4_ancillary(&bpf->filter[i]))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * The verifier refuses unreachable code, which classic BPF allows, and
+ * reads from uninitialized stack, which classic BPF reads as zero.
+ */
+static void ebpf_scan_prog(struct ebpf_ctx *ec, const struct sock_fprog *bpf)
+{
+	uint32_t i;
+	const struct sock_filter *f;
+
+	ec->reach[0] = true;
+
+	for (i = 0; i < bpf->len; ++i) {
+		f = &bpf->filter[i];
+		if (!ec->reach[i])
+			continue;
+
+		switch (BPF_CLASS(f->code)) {
+		case BPF_RET:
+			break;
+		case BPF_JMP:
+			if (BPF_OP(f->code) == BPF_JA) {
+				ec->reach[i + 1 + f->k] = true;
+			} else {
+				ec->reach[i + 1 + f->jt] = true;
+				ec->reach[i + 1 + f->jf] = true;
+			}
+			break;
+		case BPF_LD:
+		case BPF_LDX:
+			if (BPF_MODE(f->code) == BPF_MEM)
+				ec->mem_read |= 1 << f->k;
+			if (bpf_is_l4_ancillary(f))
+				ec->l4 = true;
+			/* fall through */
+		default:
+			ec->reach[i + 1] = true;
+			break;
+		}
+	}
+}
+
+static int ebpf_emit_prog(struct ebpf_ctx *ec, const struct sock_fprog *bpf)
+{
+	int ret;
+	uint32_t i;
+	bool key = ebpf_sampling(ec) || ebpf_counting(ec);
+
+	ec->pos = 0;
+
+	ebpf_emit(ec, BPF_ALU64 | BPF_MOV | BPF_X, EBPF_REG_CTX, BPF_REG_1,
+		  0, 0);
+
+	if (key) {
+		for (i = 0; i < sizeof(struct bpf_flow_key); i += 8)
+			ebpf_emit(ec, BPF_ST | BPF_MEM | BPF_DW, BPF_REG_10, 0,
+				  EBPF_KEY_OFF + i, 0);
+	}
+	if (ec->l4 || key)
+		ebpf_emit_l4(ec, key);
+	if (ebpf_sampling(ec))
+		ebpf_emit_sample(ec);
+
+	ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_K, EBPF_REG_A, 0, 0, 0);
+	ebpf_emit(ec, BPF_ALU | BPF_MOV | BPF_K, EBPF_REG_X, 0, 0, 0);
+
+	for (i = 0; i < BPF_MEMWORDS; ++i) {
+		if (ec->mem_read & (1 << i))
+			ebpf_emit(ec, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0,
+				  EBPF_MEM_OFF(i), 0);
+	}
+
+	for (i = 0; i < bpf->len; ++i) {
+		ec->start[i] = ec->pos;
+		if (!ec->reach[i])
+			continue;
+
+		ret = ebpf_emit_insn(ec, &bpf->filter[i], i);
+		if (ret)
+			return ret;
+	}
+
+	if (ebpf_counting(ec))
+		ebpf_emit_count(ec);
+
+	return 0;
+}
+
+int bpf_convert_ebpf(const struct sock_fprog *bpf,
+		     const struct bpf_ebpf_opts *opts, struct bpf_insn **insns,
+		     size_t *len)
+{
+	int ret;
+	struct ebpf_ctx ec;
+
+	if (bpf_validate(bpf) == 0)
+		return -EINVAL;
+
+	fmemset(&ec, 0, sizeof(ec));
+	ec.opts = opts;
+	ec.start = xmalloc(bpf->len * sizeof(*ec.start));
+	ec.reach = xzmalloc(bpf->len * sizeof(*ec.reach));
+
+	ebpf_scan_prog(&ec, bpf);
+
+	ret = ebpf_emit_prog(&ec, bpf);
+	if (ret == 0 && ec.pos > BPF_MAXINSNS)
+		ret = -E2BIG;
+	if (ret == 0) {
+		ec.out = xmalloc(ec.pos * sizeof(*ec.out));
+		ebpf_emit_prog(&ec, bpf);
+
+		*insns = ec.out;
+		*len = ec.pos;
+	}
+
+	xfree(ec.reach);
+	xfree(ec.start);
+	return ret;
+}
+
+static int bpf_sys(int cmd, union bpf_attr *attr)
+{
+#ifdef __NR_bpf
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Runs the program through the kernel verifier and returns a file
+ * descriptor for it. The verifier's reasoning ends up in log if one
+ * is given.
+ */
+int bpf_load_ebpf(const struct bpf_insn *insns, size_t len, char *log,
+		  size_t log_len)
+{
+	union bpf_attr attr;
+
+	fmemset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (uintptr_t) insns;
+	attr.insn_cnt = len;
+	attr.license = (uintptr_t) "GPL";
+	if (log && log_len) {
+		log[0] = 0;
+		attr.log_buf = (uintptr_t) log;
+		attr.log_size = log_len;
+		attr.log_level = 1;
+	}
+
+	return bpf_sys(BPF_PROG_LOAD, &attr);
+}
+
+#define BPF_FLOW_MAP_SIZE	65536
+
+/* Shared by all fanout workers, which inherit the descriptor */
+int bpf_flow_map_create(void)
+{
+	int fd;
+	union bpf_attr attr;
+
+	fmemset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_LRU_HASH;
+	attr.key_size = sizeof(struct bpf_flow_key);
+	attr.value_size = sizeof(struct bpf_flow_val);
+	attr.max_entries = BPF_FLOW_MAP_SIZE;
+
+	fd = bpf_sys(BPF_MAP_CREATE, &attr);
+	if (fd < 0 && errno == EINVAL) {
+		/* Before Linux 4.10, new flows are not counted once full */
+		attr.map_type = BPF_MAP_TYPE_HASH;
+		fd = bpf_sys(BPF_MAP_CREATE, &attr);
+	}
+	if (fd < 0)
+		panic("Cannot create eBPF flow map: %s!\n", strerror(errno));
+
+	return fd;
+}
+
+struct bpf_flow {
+	struct bpf_flow_key key;
+	struct bpf_flow_val val;
+};
+
+static int bpf_flow_cmp(const void *a, const void *b)
+{
+	const struct bpf_flow *fa = a, *fb = b;
+
+	if (fa->val.bytes != fb->val.bytes)
+		return fa->val.bytes < fb->val.bytes ? 1 : -1;
+	return 0;
+}
+
+static const char *bpf_flow_endpoint(const struct bpf_flow_key *key,
+				     const uint32_t *addr, uint16_t port,
+				     char *buf, size_t len)
+{
+	int i;
+	uint32_t net[4];
+	char host[INET6_ADDRSTRLEN];
+
+	for (i = 0; i < 4; ++i)
+		net[i] = htonl(addr[i]);
+
+	switch (key->family) {
+	case 4:
+		inet_ntop(AF_INET, net, host, sizeof(host));
+		slprintf(buf, len, "%s:%u", host, port);
+		break;
+	case 6:
+		inet_ntop(AF_INET6, net, host, sizeof(host));
+		slprintf(buf, len, "[%s]:%u", host, port);
+		break;
+	default:
+		slprintf(buf, len, "-");
+		break;
+	}
+
+	return buf;
+}
+
+/* Flows counted by the eBPF filters, the largest first */
+void bpf_flow_map_dump(int map_fd)
+{
+	size_t num = 0, max = 256;
+	union bpf_attr attr;
+	struct bpf_flow *flows, *f;
+	/* A copy, flows may move on xrealloc() */
+	struct bpf_flow_key prev;
+	char src[INET6_ADDRSTRLEN + 8], dst[INET6_ADDRSTRLEN + 8];
+
+	flows = xmalloc(max * sizeof(*flows));
+
+	while (1) {
+		if (num == max) {
+			max *= 2;
+			flows = xrealloc(flows, max, sizeof(*flows));
+		}
+		f = &flows[num];
+
+		fmemset(&attr, 0, sizeof(attr));
+		attr.map_fd = map_fd;
+		attr.key = num ? (uintptr_t) &prev : 0;
+		attr.next_key = (uintptr_t) &f->key;
+		if (bpf_sys(BPF_MAP_GET_NEXT_KEY, &attr) < 0)
+			break;
+
+		fmemset(&attr, 0, sizeof(attr));
+		attr.map_fd = map_fd;
+		attr.key = (uintptr_t) &f->key;
+		attr.value = (uintptr_t) &f->val;
+		if (bpf_sys(BPF_MAP_LOOKUP_ELEM, &attr) < 0)
+			continue;
+
+		prev = f->key;
+		num++;
+	}
+
+	qsort(flows, num, sizeof(*flows), bpf_flow_cmp);
+
+	printf("\r%12zu  flows counted\n", num);
+	for (f = flows; f < flows + num; ++f)
+		printf("%12llu bytes %10llu pkts  proto %3u  %s -> %s\n",
+		       (unsigned long long) f->val.bytes,
+		       (unsigned long long) f->val.packets, f->key.proto,
+		       bpf_flow_endpoint(&f->key, f->key.saddr, f->key.sport,
+					 src, sizeof(src)),
+		       bpf_flow_endpoint(&f->key, f->key.daddr, f->key.dport,
+					 dst, sizeof(dst)));
+
+	xfree(flows);
 }
 
 void bpf_attach_to_sock(int sock, struct sock_fprog *bpf)
 {
 	int ret;
 
+	if (bpf_needs_ebpf(bpf))
+		panic("Filter uses #l4proto or #l4off, attach it as eBPF!\n");
+
 	if (bpf->filter[0].code == BPF_RET &&
 	    bpf->filter[0].k == 0xFFFFFFFF)
 		return;
@@ -368,6 +1345,60 @@ void bpf_attach_to_sock(int sock, struct sock_fprog *bpf)
 		panic("Cannot attach filter to socket!\n");
 }
 
+static int __bpf_attach_ebpf_to_sock(int sock, const struct sock_fprog *bpf,
+				     const struct bpf_ebpf_opts *opts)
+{
+	int ret, fd;
+	size_t len;
+	struct bpf_insn *insns;
+
+	ret = bpf_convert_ebpf(bpf, opts, &insns, &len);
+	if (ret)
+		return ret;
+
+	fd = bpf_load_ebpf(insns, len, NULL, 0);
+	xfree(insns);
+	if (fd < 0)
+		return -errno;
+
+	/* The socket holds its own reference to the program */
+	ret = setsockopt(sock, SOL_SOCKET, SO_ATTACH_BPF, &fd, sizeof(fd));
+	if (ret < 0)
+		ret = -errno;
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Same as bpf_attach_to_sock(), but the filter goes in as eBPF if the
+ * kernel verifier takes it. Old kernels, extensions without an eBPF
+ * equivalent or missing privileges for bpf(2) leave it classic, unless
+ * it needs what only eBPF can do: #l4proto/#l4off, sampling or counting
+ * flows with opts, which may be NULL.
+ */
+void bpf_attach_ebpf_to_sock(int sock, struct sock_fprog *bpf,
+			     const struct bpf_ebpf_opts *opts)
+{
+	int ret;
+	bool needed = bpf_needs_ebpf(bpf) ||
+		      (opts && (opts->sample > 1 || opts->map_fd >= 0));
+
+	if (!needed && bpf->filter[0].code == BPF_RET &&
+	    bpf->filter[0].k == 0xFFFFFFFF)
+		return;
+
+	ret = __bpf_attach_ebpf_to_sock(sock, bpf, opts);
+	if (ret == 0)
+		return;
+	if (needed)
+		panic("Cannot attach filter as eBPF: %s!\n", strerror(-ret));
+
+	whine("Cannot attach filter as eBPF: %s, using classic BPF!\n",
+	      strerror(-ret));
+	bpf_attach_to_sock(sock, bpf);
+}
+
 void bpf_detach_from_sock(int sock)
 {
 	int ret, empty = 0;
@@ -516,8 +1547,13 @@ int bpf_validate(const struct sock_fprog *bpf)
 	return BPF_CLASS(bpf->filter[bpf->len - 1].code) == BPF_RET;
 }
 
-uint32_t bpf_run_filter(const struct sock_fprog * fcode, uint8_t * packet,
-		        size_t plen)
+/*
+ * Counts executed instructions into hits, if given, with the total in
+ * the extra entry after the last instruction.
+ */
+static __always_inline uint32_t __bpf_run_filter(const struct sock_fprog *fcode,
+						 uint8_t *packet, size_t plen,
+						 unsigned long *hits)
 {
 	/* XXX: caplen == len */
 	uint32_t A, X;
@@ -535,6 +1571,10 @@ uint32_t bpf_run_filter(const struct sock_fprog * fcode, uint8_t * packet,
 	--bpf;
 	while (1) {
 		++bpf;
+		if (hits) {
+			hits[bpf - fcode->filter]++;
+			hits[fcode->len]++;
+		}
 		switch (bpf->code) {
 		default:
 			return 0;
@@ -715,6 +1755,444 @@ uint32_t bpf_run_filter(const struct sock_fprog * fcode, uint8_t * packet,
 	}
 }
 
+uint32_t bpf_run_filter(const struct sock_fprog *fcode, uint8_t *packet,
+			size_t plen)
+{
+	return __bpf_run_filter(fcode, packet, plen, NULL);
+}
+
+uint32_t bpf_run_filter_profile(const struct sock_fprog *fcode,
+				uint8_t *packet, size_t plen,
+				unsigned long *hits)
+{
+	return __bpf_run_filter(fcode, packet, plen, hits);
+}
+
+#if defined(__x86_64__)
+/*
+ * x86-64 JIT for the userspace filter. It mirrors bpf_run_filter(), so
+ * verdicts are the same, including its quirks. Registers:
+ *
+ *   eax  A		r9d  X		rdi  packet	rsi  plen
+ *   r8   index	ecx  shift/div	edx  div
+ *
+ * The scratch memory lives in the red zone below rsp, which is ours as
+ * the generated code is a leaf function. All jumps are rel32, so the
+ * length of an instruction never depends on where it jumps to and two
+ * passes are enough: the first one only counts, the second one emits.
+ */
+#define BPF_JIT_MEM_OFF		(-4 * BPF_MEMWORDS)
+
+struct bpf_jit_ctx {
+	uint8_t *image;
+	size_t len;
+	uint32_t *addrs;
+	uint32_t ret0;
+};
+
+static inline void emit(struct bpf_jit_ctx *jc, const uint8_t *bytes,
+			size_t num)
+{
+	if (jc->image)
+		fmemcpy(jc->image + jc->len, bytes, num);
+	jc->len += num;
+}
+
+#define EMIT(jc, ...)							\
+	do {								\
+		const uint8_t __b[] = { __VA_ARGS__ };			\
+		emit(jc, __b, sizeof(__b));				\
+	} while (0)
+
+static inline void emit_u32(struct bpf_jit_ctx *jc, uint32_t val)
+{
+	emit(jc, (uint8_t *) &val, sizeof(val));
+}
+
+/* Jump, resp. conditional jump (cc being the 0x0f 0x8? opcode) */
+static void emit_jmp(struct bpf_jit_ctx *jc, uint8_t cc, uint32_t target)
+{
+	if (cc)
+		EMIT(jc, 0x0f, cc);
+	else
+		EMIT(jc, 0xe9);
+	emit_u32(jc, target - (uint32_t) (jc->len + 4));
+}
+
+#define JIT_JB		0x82
+#define JIT_JAE		0x83
+#define JIT_JE		0x84
+#define JIT_JNE		0x85
+#define JIT_JBE		0x86
+#define JIT_JA		0x87
+
+/* if (plen < k + size) return 0; */
+static void emit_bound(struct bpf_jit_ctx *jc, uint32_t k, uint32_t size)
+{
+	uint64_t end = (uint64_t) k + size;
+
+	/* Offsets beyond 2 GiB cannot be in a packet anyway */
+	if (end > 0x7fffffff) {
+		emit_jmp(jc, 0, jc->ret0);
+		return;
+	}
+
+	EMIT(jc, 0x48, 0x81, 0xfe);			/* cmp rsi, imm32 */
+	emit_u32(jc, end);
+	emit_jmp(jc, JIT_JB, jc->ret0);
+}
+
+/* r8 = (uint32_t) (X + k); if (plen < r8 + size) return 0; */
+static void emit_bound_ind(struct bpf_jit_ctx *jc, uint32_t k, uint8_t size)
+{
+	EMIT(jc, 0x45, 0x89, 0xc8);			/* mov r8d, r9d */
+	EMIT(jc, 0x41, 0x81, 0xc0);			/* add r8d, imm32 */
+	emit_u32(jc, k);
+	EMIT(jc, 0x49, 0x8d, 0x48, size);		/* lea rcx, [r8 + size] */
+	EMIT(jc, 0x48, 0x39, 0xce);			/* cmp rsi, rcx */
+	emit_jmp(jc, JIT_JB, jc->ret0);
+}
+
+static void emit_cond_jmp(struct bpf_jit_ctx *jc, uint8_t cc, uint8_t inv,
+			  uint32_t pc, const struct sock_filter *f)
+{
+	uint32_t jt = jc->addrs[pc + 1 + f->jt];
+	uint32_t jf = jc->addrs[pc + 1 + f->jf];
+
+	if (f->jt == f->jf) {
+		if (f->jt)
+			emit_jmp(jc, 0, jt);
+	} else if (f->jt == 0) {
+		emit_jmp(jc, inv, jf);
+	} else {
+		emit_jmp(jc, cc, jt);
+		if (f->jf)
+			emit_jmp(jc, 0, jf);
+	}
+}
+
+static void bpf_jit_emit(const struct sock_fprog *bpf,
+			 struct bpf_jit_ctx *jc)
+{
+	uint32_t i;
+	int uses_mem = 0;
+	const struct sock_filter *f;
+
+	jc->len = 0;
+
+	for (i = 0; i < bpf->len; ++i) {
+		if (BPF_CLASS(bpf->filter[i].code) <= BPF_LDX &&
+		    BPF_MODE(bpf->filter[i].code) == BPF_MEM)
+			uses_mem = 1;
+	}
+
+	EMIT(jc, 0x31, 0xc0);				/* xor eax, eax */
+	EMIT(jc, 0x45, 0x31, 0xc9);			/* xor r9d, r9d */
+
+	if (uses_mem) {
+		EMIT(jc, 0x45, 0x31, 0xc0);		/* xor r8d, r8d */
+		for (i = 0; i < BPF_MEMWORDS / 2; ++i)	/* mov [rsp + off], r8 */
+			EMIT(jc, 0x4c, 0x89, 0x44, 0x24,
+			     (uint8_t) (BPF_JIT_MEM_OFF + 8 * i));
+	}
+
+	for (i = 0; i < bpf->len; ++i) {
+		f = &bpf->filter[i];
+		jc->addrs[i] = jc->len;
+
+		switch (f->code) {
+		default:
+			EMIT(jc, 0x31, 0xc0, 0xc3);	/* xor eax, eax; ret */
+			break;
+		case BPF_RET | BPF_K:
+			EMIT(jc, 0xb8);			/* mov eax, imm32 */
+			emit_u32(jc, f->k);
+			EMIT(jc, 0xc3);			/* ret */
+			break;
+		case BPF_RET | BPF_A:
+			EMIT(jc, 0xc3);			/* ret */
+			break;
+		case BPF_LD_W | BPF_ABS:
+			emit_bound(jc, f->k, 4);
+			if (f->k <= 0x7fffffff - 4) {
+				EMIT(jc, 0x8b, 0x87);	/* mov eax, [rdi + k] */
+				emit_u32(jc, f->k);
+				EMIT(jc, 0x0f, 0xc8);	/* bswap eax */
+			}
+			break;
+		case BPF_LD_H | BPF_ABS:
+			emit_bound(jc, f->k, 2);
+			if (f->k <= 0x7fffffff - 2) {
+				/* movzx eax, word [rdi + k] */
+				EMIT(jc, 0x0f, 0xb7, 0x87);
+				emit_u32(jc, f->k);
+				/* rol ax, 8 */
+				EMIT(jc, 0x66, 0xc1, 0xc0, 0x08);
+			}
+			break;
+		case BPF_LD_B | BPF_ABS:
+			emit_bound(jc, f->k, 1);
+			if (f->k <= 0x7fffffff - 1) {
+				/* movzx eax, byte [rdi + k] */
+				EMIT(jc, 0x0f, 0xb6, 0x87);
+				emit_u32(jc, f->k);
+			}
+			break;
+		case BPF_LD_W | BPF_LEN:
+			EMIT(jc, 0x89, 0xf0);		/* mov eax, esi */
+			break;
+		case BPF_LDX_W | BPF_LEN:
+			EMIT(jc, 0x41, 0x89, 0xf1);	/* mov r9d, esi */
+			break;
+		case BPF_LD_W | BPF_IND:
+			emit_bound_ind(jc, f->k, 4);
+			/* mov eax, [rdi + r8]; bswap eax */
+			EMIT(jc, 0x42, 0x8b, 0x04, 0x07, 0x0f, 0xc8);
+			break;
+		case BPF_LD_H | BPF_IND:
+			emit_bound_ind(jc, f->k, 2);
+			/* movzx eax, word [rdi + r8]; rol ax, 8 */
+			EMIT(jc, 0x42, 0x0f, 0xb7, 0x04, 0x07,
+			     0x66, 0xc1, 0xc0, 0x08);
+			break;
+		case BPF_LD_B | BPF_IND:
+			emit_bound_ind(jc, f->k, 1);
+			/* movzx eax, byte [rdi + r8] */
+			EMIT(jc, 0x42, 0x0f, 0xb6, 0x04, 0x07);
+			break;
+		case BPF_LDX_B | BPF_MSH:
+			emit_bound(jc, f->k, 1);
+			if (f->k <= 0x7fffffff - 1) {
+				/* movzx r9d, byte [rdi + k] */
+				EMIT(jc, 0x44, 0x0f, 0xb6, 0x8f);
+				emit_u32(jc, f->k);
+				/* and r9d, 0xf; shl r9d, 2 */
+				EMIT(jc, 0x41, 0x83, 0xe1, 0x0f,
+				     0x41, 0xc1, 0xe1, 0x02);
+			}
+			break;
+		case BPF_LD | BPF_IMM:
+			EMIT(jc, 0xb8);			/* mov eax, imm32 */
+			emit_u32(jc, f->k);
+			break;
+		case BPF_LDX | BPF_IMM:
+			EMIT(jc, 0x41, 0xb9);		/* mov r9d, imm32 */
+			emit_u32(jc, f->k);
+			break;
+		case BPF_LD | BPF_MEM:
+			/* mov eax, [rsp + off] */
+			EMIT(jc, 0x8b, 0x44, 0x24,
+			     (uint8_t) (BPF_JIT_MEM_OFF + 4 * f->k));
+			break;
+		case BPF_LDX | BPF_MEM:
+			/* mov r9d, [rsp + off] */
+			EMIT(jc, 0x44, 0x8b, 0x4c, 0x24,
+			     (uint8_t) (BPF_JIT_MEM_OFF + 4 * f->k));
+			break;
+		case BPF_ST:
+			/* mov [rsp + off], eax */
+			EMIT(jc, 0x89, 0x44, 0x24,
+			     (uint8_t) (BPF_JIT_MEM_OFF + 4 * f->k));
+			break;
+		case BPF_STX:
+			/* mov [rsp + off], r9d */
+			EMIT(jc, 0x44, 0x89, 0x4c, 0x24,
+			     (uint8_t) (BPF_JIT_MEM_OFF + 4 * f->k));
+			break;
+		case BPF_JMP_JA:
+			emit_jmp(jc, 0, jc->addrs[i + 1 + f->k]);
+			break;
+		case BPF_JMP_JGT | BPF_K:
+		case BPF_JMP_JGE | BPF_K:
+		case BPF_JMP_JEQ | BPF_K:
+			EMIT(jc, 0x3d);			/* cmp eax, imm32 */
+			emit_u32(jc, f->k);
+			goto cond;
+		case BPF_JMP_JSET | BPF_K:
+			EMIT(jc, 0xa9);			/* test eax, imm32 */
+			emit_u32(jc, f->k);
+			goto cond;
+		case BPF_JMP_JGT | BPF_X:
+		case BPF_JMP_JGE | BPF_X:
+		case BPF_JMP_JEQ | BPF_X:
+			EMIT(jc, 0x44, 0x39, 0xc8);	/* cmp eax, r9d */
+			goto cond;
+		case BPF_JMP_JSET | BPF_X:
+			EMIT(jc, 0x44, 0x85, 0xc8);	/* test eax, r9d */
+		cond:
+			switch (BPF_OP(f->code)) {
+			case BPF_JGT:
+				emit_cond_jmp(jc, JIT_JA, JIT_JBE, i, f);
+				break;
+			case BPF_JGE:
+				emit_cond_jmp(jc, JIT_JAE, JIT_JB, i, f);
+				break;
+			case BPF_JEQ:
+				emit_cond_jmp(jc, JIT_JE, JIT_JNE, i, f);
+				break;
+			case BPF_JSET:
+				emit_cond_jmp(jc, JIT_JNE, JIT_JE, i, f);
+				break;
+			}
+			break;
+		case BPF_ALU_ADD | BPF_X:
+			EMIT(jc, 0x44, 0x01, 0xc8);	/* add eax, r9d */
+			break;
+		case BPF_ALU_SUB | BPF_X:
+			EMIT(jc, 0x44, 0x29, 0xc8);	/* sub eax, r9d */
+			break;
+		case BPF_ALU_MUL | BPF_X:
+			EMIT(jc, 0x41, 0x0f, 0xaf, 0xc1); /* imul eax, r9d */
+			break;
+		case BPF_ALU_DIV | BPF_X:
+		case BPF_ALU_MOD | BPF_X:
+			EMIT(jc, 0x45, 0x85, 0xc9);	/* test r9d, r9d */
+			emit_jmp(jc, JIT_JE, jc->ret0);
+			/* xor edx, edx; div r9d */
+			EMIT(jc, 0x31, 0xd2, 0x41, 0xf7, 0xf1);
+			if (BPF_OP(f->code) == BPF_MOD)
+				EMIT(jc, 0x89, 0xd0);	/* mov eax, edx */
+			break;
+		case BPF_ALU_AND | BPF_X:
+			EMIT(jc, 0x44, 0x21, 0xc8);	/* and eax, r9d */
+			break;
+		case BPF_ALU_OR | BPF_X:
+			EMIT(jc, 0x44, 0x09, 0xc8);	/* or eax, r9d */
+			break;
+		case BPF_ALU_XOR | BPF_X:
+			EMIT(jc, 0x44, 0x31, 0xc8);	/* xor eax, r9d */
+			break;
+		case BPF_ALU_LSH | BPF_X:
+			/* mov ecx, r9d; shl eax, cl */
+			EMIT(jc, 0x44, 0x89, 0xc9, 0xd3, 0xe0);
+			break;
+		case BPF_ALU_RSH | BPF_X:
+			/* mov ecx, r9d; shr eax, cl */
+			EMIT(jc, 0x44, 0x89, 0xc9, 0xd3, 0xe8);
+			break;
+		case BPF_ALU_ADD | BPF_K:
+			EMIT(jc, 0x05);			/* add eax, imm32 */
+			emit_u32(jc, f->k);
+			break;
+		case BPF_ALU_SUB | BPF_K:
+			EMIT(jc, 0x2d);			/* sub eax, imm32 */
+			emit_u32(jc, f->k);
+			break;
+		case BPF_ALU_MUL | BPF_K:
+			EMIT(jc, 0x69, 0xc0);		/* imul eax, eax, imm32 */
+			emit_u32(jc, f->k);
+			break;
+		case BPF_ALU_DIV | BPF_K:
+		case BPF_ALU_MOD | BPF_K:
+			/* Rejected by bpf_validate(), but be sure */
+			if (f->k == 0) {
+				emit_jmp(jc, 0, jc->ret0);
+				break;
+			}
+			EMIT(jc, 0xb9);			/* mov ecx, imm32 */
+			emit_u32(jc, f->k);
+			/* xor edx, edx; div ecx */
+			EMIT(jc, 0x31, 0xd2, 0xf7, 0xf1);
+			if (BPF_OP(f->code) == BPF_MOD)
+				EMIT(jc, 0x89, 0xd0);	/* mov eax, edx */
+			break;
+		case BPF_ALU_AND | BPF_K:
+			EMIT(jc, 0x25);			/* and eax, imm32 */
+			emit_u32(jc, f->k);
+			break;
+		case BPF_ALU_OR | BPF_K:
+			EMIT(jc, 0x0d);			/* or eax, imm32 */
+			emit_u32(jc, f->k);
+			break;
+		case BPF_ALU_XOR | BPF_K:
+			EMIT(jc, 0x35);			/* xor eax, imm32 */
+			emit_u32(jc, f->k);
+			break;
+		case BPF_ALU_LSH | BPF_K:
+			EMIT(jc, 0xc1, 0xe0, (uint8_t) f->k); /* shl eax, k */
+			break;
+		case BPF_ALU_RSH | BPF_K:
+			EMIT(jc, 0xc1, 0xe8, (uint8_t) f->k); /* shr eax, k */
+			break;
+		case BPF_ALU_NEG:
+			EMIT(jc, 0xf7, 0xd8);		/* neg eax */
+			break;
+		case BPF_MISC_TAX:
+			EMIT(jc, 0x41, 0x89, 0xc1);	/* mov r9d, eax */
+			break;
+		case BPF_MISC_TXA:
+			EMIT(jc, 0x44, 0x89, 0xc8);	/* mov eax, r9d */
+			break;
+		}
+	}
+
+	jc->ret0 = jc->len;
+	EMIT(jc, 0x31, 0xc0, 0xc3);			/* xor eax, eax; ret */
+}
+
+int bpf_jit_compile(const struct sock_fprog *bpf, struct bpf_jit *jit)
+{
+	uint8_t *image;
+	struct bpf_jit_ctx jc;
+
+	fmemset(jit, 0, sizeof(*jit));
+	jit->bpf = bpf;
+
+	/* Relies on what bpf_validate() guarantees, e.g. jump targets */
+	if (!bpf_validate(bpf))
+		return -EINVAL;
+
+	fmemset(&jc, 0, sizeof(jc));
+	jc.addrs = xzmalloc((bpf->len + 1) * sizeof(*jc.addrs));
+
+	/* Sizes and addresses only, then for real */
+	bpf_jit_emit(bpf, &jc);
+
+	image = mmap(NULL, jc.len, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (image == MAP_FAILED) {
+		xfree(jc.addrs);
+		return -ENOMEM;
+	}
+
+	jc.image = image;
+	bpf_jit_emit(bpf, &jc);
+	xfree(jc.addrs);
+
+	if (mprotect(image, jc.len, PROT_READ | PROT_EXEC)) {
+		munmap(image, jc.len);
+		return -EPERM;
+	}
+
+	jit->func = (bpf_jit_func_t) image;
+	jit->size = jc.len;
+
+	return 0;
+}
+
+void bpf_jit_release(struct bpf_jit *jit)
+{
+	if (jit->func)
+		munmap(jit->func, jit->size);
+
+	jit->func = NULL;
+	jit->size = 0;
+}
+#else
+int bpf_jit_compile(const struct sock_fprog *bpf, struct bpf_jit *jit)
+{
+	fmemset(jit, 0, sizeof(*jit));
+	jit->bpf = bpf;
+
+	/* No JIT for this architecture, bpf_jit_run() interprets */
+	return -EOPNOTSUPP;
+}
+
+void bpf_jit_release(struct bpf_jit *jit)
+{
+}
+#endif /* __x86_64__ */
+
 void bpf_parse_rules(char *rulefile, struct sock_fprog *bpf)
 {
 	int ret;
@@ -764,3 +2242,102 @@ void bpf_parse_rules(char *rulefile, struct sock_fprog *bpf)
 	if (bpf_validate(bpf) == 0)
 		panic("This is not a valid BPF program!\n");
 }
+
+/* Instructions a return of the filter turns into once it is capped */
+static inline int bpf_snaplen_insns(const struct sock_filter *f)
+{
+	if (BPF_CLASS(f->code) != BPF_RET)
+		return 1;
+
+	switch (BPF_RVAL(f->code)) {
+	case BPF_A:
+		return 3;
+	case BPF_X:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+static inline uint8_t bpf_snaplen_jmp(const int *map, int i, uint8_t off)
+{
+	int rel = map[i + 1 + off] - map[i] - 1;
+
+	if (rel > 255)
+		panic("Cannot apply snaplen, BPF jump at rule %d "
+		      "out of range!\n", i);
+
+	return rel;
+}
+
+/*
+ * The kernel truncates a packet to what the filter returns, so capping
+ * the return values of accepting rules gives us a snaplen. Returns of
+ * A or X are rewritten to compare against the snaplen first:
+ *
+ *   [ txa ]  jgt #snaplen, 0, 1  ret #snaplen  ret a
+ */
+void bpf_set_snaplen(struct sock_fprog *bpf, uint32_t snaplen)
+{
+	int i, len = 0;
+	int *map;
+	struct sock_filter *f, *out, *o;
+
+	map = xmalloc((bpf->len + 1) * sizeof(*map));
+	for (i = 0; i < bpf->len; ++i) {
+		map[i] = len;
+		len += bpf_snaplen_insns(&bpf->filter[i]);
+	}
+	map[bpf->len] = len;
+
+	if (len > BPF_MAXINSNS)
+		panic("Cannot apply snaplen, BPF program grows too large!\n");
+
+	out = xzmalloc(len * sizeof(*out));
+
+	for (i = 0; i < bpf->len; ++i) {
+		f = &bpf->filter[i];
+		o = &out[map[i]];
+		*o = *f;
+
+		if (BPF_CLASS(f->code) == BPF_JMP) {
+			if (BPF_OP(f->code) == BPF_JA) {
+				o->k = map[i + 1 + f->k] - map[i] - 1;
+			} else {
+				o->jt = bpf_snaplen_jmp(map, i, f->jt);
+				o->jf = bpf_snaplen_jmp(map, i, f->jf);
+			}
+			continue;
+		}
+
+		if (BPF_CLASS(f->code) != BPF_RET)
+			continue;
+
+		switch (BPF_RVAL(f->code)) {
+		case BPF_K:
+			o->k = min(f->k, snaplen);
+			break;
+		case BPF_X:
+			*o++ = (struct sock_filter)
+				BPF_STMT(BPF_MISC | BPF_TXA, 0);
+			/* fall through */
+		case BPF_A:
+			*o++ = (struct sock_filter)
+				BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, snaplen, 0, 1);
+			*o++ = (struct sock_filter)
+				BPF_STMT(BPF_RET | BPF_K, snaplen);
+			*o = (struct sock_filter)
+				BPF_STMT(BPF_RET | BPF_A, 0);
+			break;
+		}
+	}
+
+	xfree(bpf->filter);
+	xfree(map);
+
+	bpf->filter = out;
+	bpf->len = len;
+
+	if (bpf_validate(bpf) == 0)
+		panic("BPF program became invalid after applying snaplen!\n");
+}
@@ -19,16 +19,84 @@ extern void bpf_dump_all(struct sock_fprog *bpf);
 extern int bpf_validate(const struct sock_fprog *bpf);
 extern uint32_t bpf_run_filter(const struct sock_fprog *bpf, uint8_t *packet,
 			       size_t plen);
+/* hits has len + 1 entries, the last one for all executed instructions */
+extern uint32_t bpf_run_filter_profile(const struct sock_fprog *bpf,
+				       uint8_t *packet, size_t plen,
+				       unsigned long *hits);
+extern void bpf_dump_profile(struct sock_fprog *bpf, const unsigned long *hits,
+			     unsigned long num);
+
+/*
+ * What an eBPF socket filter does on top of the classic program: keep
+ * only every sample-th flow (by a hash of its addresses and ports, so
+ * both directions go together), and count packets and bytes of accepted
+ * packets per flow in the map from bpf_flow_map_create().
+ */
+struct bpf_ebpf_opts {
+	uint32_t sample;
+	int map_fd;
+};
+
+/* Key and value of the per flow map, addresses and ports in host order */
+struct bpf_flow_key {
+	uint32_t saddr[4], daddr[4];
+	uint16_t sport, dport;
+	uint8_t proto, family;
+	uint8_t pad[2];
+};
+
+struct bpf_flow_val {
+	uint64_t packets, bytes;
+};
+
 extern void bpf_attach_to_sock(int sock, struct sock_fprog *bpf);
+extern void bpf_attach_ebpf_to_sock(int sock, struct sock_fprog *bpf,
+				    const struct bpf_ebpf_opts *opts);
 extern void bpf_detach_from_sock(int sock);
 extern int enable_kernel_bpf_jit_compiler(void);
 extern void bpf_parse_rules(char *rulefile, struct sock_fprog *bpf);
+extern void bpf_set_snaplen(struct sock_fprog *bpf, uint32_t snaplen);
+
+struct bpf_insn;
+
+extern int bpf_convert_ebpf(const struct sock_fprog *bpf,
+			    const struct bpf_ebpf_opts *opts,
+			    struct bpf_insn **insns, size_t *len);
+extern int bpf_load_ebpf(const struct bpf_insn *insns, size_t len, char *log,
+			 size_t log_len);
+extern int bpf_flow_map_create(void);
+extern void bpf_flow_map_dump(int map_fd);
 
 static inline void bpf_release(struct sock_fprog *bpf)
 {
 	free(bpf->filter);
 }
 
+/*
+ * Natively compiled userspace filter for the offline and replay paths.
+ * Without a JIT for the architecture, func stays NULL and the program
+ * is interpreted.
+ */
+typedef uint32_t (*bpf_jit_func_t)(const uint8_t *packet, size_t plen);
+
+struct bpf_jit {
+	const struct sock_fprog *bpf;
+	bpf_jit_func_t func;
+	size_t size;
+};
+
+extern int bpf_jit_compile(const struct sock_fprog *bpf, struct bpf_jit *jit);
+extern void bpf_jit_release(struct bpf_jit *jit);
+
+static inline uint32_t bpf_jit_run(const struct bpf_jit *jit, uint8_t *packet,
+				   size_t plen)
+{
+	if (jit->func)
+		return jit->func(packet, plen);
+
+	return bpf_run_filter(jit->bpf, packet, plen);
+}
+
 /*
  * The instruction encodings.
  */
@@ -138,4 +206,12 @@ static inline void bpf_release(struct sock_fprog *bpf)
 # define SKF_AD_VLAN_TAG_PRESENT 48
 #endif
 
+/*
+ * Our own extensions, far above what the kernel uses. Only eBPF socket
+ * filters have them: the layer 4 protocol and its offset, found after
+ * walking up to 8 IPv6 extension headers (or the IPv4 header).
+ */
+#define SKF_AD_L4PROTO 0x800
+#define SKF_AD_L4OFF 0x804
+
 #endif /* BPF_H */
@@ -9,19 +9,27 @@
 /* yaac-func-prefix: zz */
 
 /*
-    TODO:
-	- intermediate representation
-	- code optimization (symbolic reduction?)
-	- linearization (jumps, etc)
-	- bpf emitter
+ * High-level BPF. Expressions are parsed into trees, statements are
+ * translated right away into low-level BPF (the assembler understood by
+ * bpf_parser.y) with symbolic labels:
+ *
+ *  - values are computed in A, packet offsets and right hand operands go
+ *    to X, variables and spilled intermediate results live in M[],
+ *  - conditions are translated into jumps (short circuit), so && and ||
+ *    never materialize a truth value,
+ *  - conditional jumps that end up further away than 255 instructions
+ *    are bounced through an unconditional jump.
  */
 
 %{
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
 
 #include "bpf.h"
@@ -38,34 +46,1030 @@
 #define YYLTYPE_IS_TRIVIAL	1
 #define ENABLE_NLS		1
 
+#define MAX_SYMBOLS		512
+#define MAX_JUMP		255
+
 extern FILE *zzin;
 extern int zzlex(void);
 extern void zzerror(const char *);
 extern int zzlineno;
 extern char *zztext;
 
-int compile_hla_filter(char *file, int verbose, int debug);
+int compile_hla_filter(char *file, char *out, int verbose, int debug);
+
+enum hla_op {
+	HLA_NUM,
+	HLA_VAR,
+	HLA_ANC,
+	HLA_PKT,
+	HLA_ADD,
+	HLA_SUB,
+	HLA_MUL,
+	HLA_DIV,
+	HLA_MOD,
+	HLA_AND,
+	HLA_OR,
+	HLA_XOR,
+	HLA_LSH,
+	HLA_RSH,
+	HLA_NEG,
+	HLA_INV,
+	HLA_EQ,
+	HLA_NE,
+	HLA_LT,
+	HLA_LE,
+	HLA_GT,
+	HLA_GE,
+	HLA_LAND,
+	HLA_LOR,
+	HLA_LNOT,
+};
+
+struct hla_node {
+	enum hla_op op;
+	/* Constant, slot of a variable, ancillary index or load size */
+	uint32_t k;
+	/* Constant that was a condition before folding */
+	bool truth;
+	struct hla_node *l, *r;
+};
+
+enum hla_insn_type {
+	HLA_INSN_PLAIN,
+	HLA_INSN_JA,
+	HLA_INSN_JCC,
+};
+
+struct hla_insn {
+	enum hla_insn_type type;
+	int label;
+	char op[48];
+	int jt, jf;
+};
+
+struct hla_anc {
+	const char *name;
+	const char *lla;
+};
+
+/* Linux extensions, as named in the high-level and low-level language */
+static const struct hla_anc hla_anc[] = {
+	{ "len",		"#len" },
+	{ "proto",		"#proto" },
+	{ "pkttype",		"#type" },
+	{ "ifindex",		"#ifidx" },
+	{ "mark",		"#mark" },
+	{ "queue",		"#queue" },
+	{ "hatype",		"#hatype" },
+	{ "rxhash",		"#rxhash" },
+	{ "cpu",		"#cpu" },
+	{ "vlan_tci",		"#vlant" },
+	{ "vlan_present",	"#vlanp" },
+	/* Ours, eBPF only */
+	{ "l4proto",		"#l4proto" },
+	{ "l4off",		"#l4off" },
+};
+
+static const char * const hla_alu[] = {
+	[HLA_ADD] = "add",
+	[HLA_SUB] = "sub",
+	[HLA_MUL] = "mul",
+	[HLA_DIV] = "div",
+	[HLA_MOD] = "mod",
+	[HLA_AND] = "and",
+	[HLA_OR]  = "or",
+	[HLA_XOR] = "xor",
+	[HLA_LSH] = "lsh",
+	[HLA_RSH] = "rsh",
+};
+
+static struct hla_insn *insns;
+static size_t nr_insns, max_insns;
+
+static int *label_alias;
+static int nr_labels, max_labels, pending_label = -1;
+
+/* Scratch memory: slots in use, ever used as temporary, by variable */
+static uint16_t slots_used, slots_tmp;
+static int var_slot[MAX_SYMBOLS];
+static uint16_t vars_nested;
+static int depth;
+
+static struct hla_node *node_new(enum hla_op op, uint32_t k,
+				 struct hla_node *l, struct hla_node *r)
+{
+	struct hla_node *n = xzmalloc(sizeof(*n));
+
+	n->op = op;
+	n->k = k;
+	n->l = l;
+	n->r = r;
+
+	return n;
+}
+
+static void node_free(struct hla_node *n)
+{
+	if (!n)
+		return;
+
+	node_free(n->l);
+	node_free(n->r);
+	xfree(n);
+}
+
+static inline struct hla_node *node_num(uint32_t k)
+{
+	return node_new(HLA_NUM, k, NULL, NULL);
+}
+
+static inline struct hla_node *node_pkt(struct hla_node *off, uint32_t size)
+{
+	if (size != 1 && size != 2 && size != 4)
+		panic("Packet loads are 1, 2 or 4 bytes wide, not %u!\n", size);
+
+	return node_new(HLA_PKT, size, off, NULL);
+}
+
+static inline bool node_is_num(const struct hla_node *n, uint32_t k)
+{
+	return n->op == HLA_NUM && n->k == k;
+}
+
+static inline bool node_is_cond(const struct hla_node *n)
+{
+	return n->op >= HLA_EQ;
+}
+
+static bool fold(enum hla_op op, uint32_t a, uint32_t b, uint32_t *res)
+{
+	switch (op) {
+	case HLA_ADD: *res = a + b; break;
+	case HLA_SUB: *res = a - b; break;
+	case HLA_MUL: *res = a * b; break;
+	case HLA_AND: *res = a & b; break;
+	case HLA_OR:  *res = a | b; break;
+	case HLA_XOR: *res = a ^ b; break;
+	case HLA_EQ:  *res = a == b; break;
+	case HLA_NE:  *res = a != b; break;
+	case HLA_LT:  *res = a < b; break;
+	case HLA_LE:  *res = a <= b; break;
+	case HLA_GT:  *res = a > b; break;
+	case HLA_GE:  *res = a >= b; break;
+	case HLA_LAND: *res = a && b; break;
+	case HLA_LOR: *res = a || b; break;
+	case HLA_DIV:
+	case HLA_MOD:
+		if (b == 0)
+			panic("Division by zero at line %d!\n", zzlineno);
+		*res = op == HLA_DIV ? a / b : a % b;
+		break;
+	case HLA_LSH:
+	case HLA_RSH:
+		if (b >= 32)
+			panic("Shift by %u at line %d!\n", b, zzlineno);
+		*res = op == HLA_LSH ? a << b : a >> b;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Binary node with constants folded and, for commutative operators, the
+ * constant moved to the right, where it can be an immediate operand.
+ */
+static struct hla_node *node_binop(enum hla_op op, struct hla_node *l,
+				   struct hla_node *r)
+{
+	uint32_t res;
+	struct hla_node *t;
+
+	if (l->op == HLA_NUM && r->op == HLA_NUM && fold(op, l->k, r->k, &res)) {
+		node_free(l);
+		node_free(r);
+
+		t = node_num(res);
+		t->truth = op >= HLA_EQ;
+		return t;
+	}
+
+	switch (op) {
+	case HLA_ADD:
+	case HLA_MUL:
+	case HLA_AND:
+	case HLA_OR:
+	case HLA_XOR:
+	case HLA_EQ:
+	case HLA_NE:
+		if (l->op == HLA_NUM) {
+			t = l;
+			l = r;
+			r = t;
+		}
+		break;
+	case HLA_LT:
+	case HLA_LE:
+	case HLA_GT:
+	case HLA_GE:
+		if (l->op == HLA_NUM) {
+			t = l;
+			l = r;
+			r = t;
+			op = op == HLA_LT ? HLA_GT : op == HLA_LE ? HLA_GE :
+			     op == HLA_GT ? HLA_LT : HLA_LE;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if ((op == HLA_DIV || op == HLA_MOD) && node_is_num(r, 0))
+		panic("Division by zero at line %d!\n", zzlineno);
+	if ((op == HLA_LSH || op == HLA_RSH) && r->op == HLA_NUM && r->k >= 32)
+		panic("Shift by %u at line %d!\n", r->k, zzlineno);
+
+	/* (e + c1) + c2 */
+	if (op == HLA_ADD && r->op == HLA_NUM && l->op == HLA_ADD &&
+	    l->r->op == HLA_NUM) {
+		l->r->k += r->k;
+		node_free(r);
+		return l;
+	}
+
+	return node_new(op, 0, l, r);
+}
+
+static struct hla_node *node_unop(enum hla_op op, struct hla_node *l)
+{
+	if (l->op == HLA_NUM) {
+		switch (op) {
+		case HLA_NEG:
+			l->k = -l->k;
+			l->truth = false;
+			return l;
+		case HLA_INV:
+			l->k = ~l->k;
+			l->truth = false;
+			return l;
+		case HLA_LNOT:
+			l->k = !l->k;
+			l->truth = true;
+			return l;
+		default:
+			break;
+		}
+	}
+
+	return node_new(op, 0, l, NULL);
+}
+
+static struct hla_node *node_ether_type(uint32_t type)
+{
+	return node_binop(HLA_EQ, node_pkt(node_num(12), 2), node_num(type));
+}
+
+/* Layer 4 protocol at its offset for IPv4 and IPv6 without extensions */
+static struct hla_node *node_l4_proto(uint32_t proto)
+{
+	struct hla_node *v4, *v6;
+
+	v4 = node_binop(HLA_LAND, node_ether_type(0x0800),
+			node_binop(HLA_EQ, node_pkt(node_num(23), 1),
+				   node_num(proto)));
+	v6 = node_binop(HLA_LAND, node_ether_type(0x86dd),
+			node_binop(HLA_EQ, node_pkt(node_num(20), 1),
+				   node_num(proto)));
+
+	return node_binop(HLA_LOR, v4, v6);
+}
+
+static struct hla_node *node_macro(int token)
+{
+	switch (token) {
+	case K_MACRO_IPV4:
+		return node_ether_type(0x0800);
+	case K_MACRO_IPV6:
+		return node_ether_type(0x86dd);
+	case K_MACRO_IP:
+		return node_binop(HLA_LOR, node_ether_type(0x0800),
+				  node_ether_type(0x86dd));
+	case K_MACRO_UDP:
+		return node_l4_proto(17);
+	case K_MACRO_TCP:
+		return node_l4_proto(6);
+	default:
+		bug();
+		return NULL;
+	}
+}
+
+static struct hla_node *node_anc(int idx)
+{
+	size_t i;
+	const char *name = bpf_symtab_name(idx);
+
+	for (i = 0; i < array_size(hla_anc); ++i) {
+		if (!strcasecmp(hla_anc[i].name, name))
+			return node_new(HLA_ANC, i, NULL, NULL);
+	}
+
+	bug();
+	return NULL;
+}
+
+static int slot_find(uint16_t busy, bool from_top)
+{
+	int i, slot;
+
+	for (i = 0; i < BPF_MEMWORDS; ++i) {
+		slot = from_top ? BPF_MEMWORDS - 1 - i : i;
+		if (!(busy & (1 << slot)))
+			return slot;
+	}
+
+	panic("Out of scratch memory at line %d!\n", zzlineno);
+	return -1;
+}
+
+/* Intermediate results are taken from the top, variables from the bottom */
+static int slot_alloc_tmp(void)
+{
+	int slot = slot_find(slots_used, true);
+
+	slots_used |= 1 << slot;
+	slots_tmp |= 1 << slot;
+
+	return slot;
+}
+
+static inline void slot_free(int slot)
+{
+	slots_used &= ~(1 << slot);
+}
+
+/*
+ * Variables defined in a block are zeroed up front, so their slot must
+ * not have been used for anything else before.
+ */
+static void var_define(int idx)
+{
+	int slot;
+
+	if (bpf_symtab_declared(idx))
+		panic("Variable %s defined twice!\n", bpf_symtab_name(idx));
+
+	if (depth > 0) {
+		slot = slot_find(slots_used | slots_tmp, false);
+		vars_nested |= 1 << slot;
+	} else {
+		slot = slot_find(slots_used, false);
+	}
+
+	bpf_symtab_declare(idx);
+	slots_used |= 1 << slot;
+	var_slot[idx] = slot;
+}
+
+static int var_lookup(int idx)
+{
+	if (!bpf_symtab_declared(idx))
+		panic("Variable %s used before definition at line %d!\n",
+		      bpf_symtab_name(idx), zzlineno);
+
+	return var_slot[idx];
+}
+
+static int label_new(void)
+{
+	if (nr_labels == max_labels) {
+		max_labels = max_labels ? max_labels << 1 : 64;
+		label_alias = xrealloc(label_alias, max_labels,
+				       sizeof(*label_alias));
+	}
+
+	label_alias[nr_labels] = nr_labels;
+
+	return nr_labels++;
+}
+
+static int label_resolve(int label)
+{
+	while (label_alias[label] != label)
+		label = label_alias[label];
+
+	return label;
+}
+
+/* Several labels for the same instruction become one */
+static void label_place(int label)
+{
+	if (pending_label >= 0)
+		label_alias[label] = pending_label;
+	else
+		pending_label = label;
+}
+
+static struct hla_insn *insn_insert(size_t pos, enum hla_insn_type type)
+{
+	struct hla_insn *insn;
+
+	if (nr_insns == max_insns) {
+		max_insns = max_insns ? max_insns << 1 : 256;
+		insns = xrealloc(insns, max_insns, sizeof(*insns));
+	}
+
+	memmove(&insns[pos + 1], &insns[pos],
+		(nr_insns - pos) * sizeof(*insns));
+	nr_insns++;
+
+	insn = &insns[pos];
+	fmemset(insn, 0, sizeof(*insn));
+	insn->type = type;
+	insn->label = -1;
+
+	return insn;
+}
+
+static struct hla_insn *insn_new(enum hla_insn_type type)
+{
+	struct hla_insn *insn = insn_insert(nr_insns, type);
+
+	insn->label = pending_label;
+	pending_label = -1;
+
+	return insn;
+}
+
+static void __check_format_printf(1, 2) emit(const char *fmt, ...)
+{
+	va_list vl;
+	struct hla_insn *insn = insn_new(HLA_INSN_PLAIN);
+
+	va_start(vl, fmt);
+	vsnprintf(insn->op, sizeof(insn->op), fmt, vl);
+	va_end(vl);
+}
+
+static void emit_ja(int label)
+{
+	insn_new(HLA_INSN_JA)->jt = label;
+}
+
+static void emit_jcc(const char *op, const char *operand, int jt, int jf)
+{
+	struct hla_insn *insn = insn_new(HLA_INSN_JCC);
+
+	slprintf(insn->op, sizeof(insn->op), "%s %s", op, operand);
+	insn->jt = jt;
+	insn->jf = jf;
+}
+
+static void gen_value(struct hla_node *n);
+static void gen_cond(struct hla_node *n, int lt, int lf);
+
+/* 4 * (pkt(k) & 0xf), the IPv4 header length idiom, has its own load */
+static bool node_is_msh(const struct hla_node *n)
+{
+	if (!((n->op == HLA_MUL && node_is_num(n->r, 4)) ||
+	      (n->op == HLA_LSH && node_is_num(n->r, 2))))
+		return false;
+
+	n = n->l;
+
+	return n->op == HLA_AND && node_is_num(n->r, 0xf) &&
+	       n->l->op == HLA_PKT && n->l->k == 1 && n->l->l->op == HLA_NUM;
+}
+
+/* Loads X without touching A, if possible */
+static bool gen_x_direct(struct hla_node *n)
+{
+	switch (n->op) {
+	case HLA_NUM:
+		emit("ldx #0x%x", n->k);
+		return true;
+	case HLA_VAR:
+		emit("ldx M[%u]", n->k);
+		return true;
+	default:
+		if (!node_is_msh(n))
+			return false;
+		emit("ldxb 4*([%u]&0xf)", n->l->l->l->k);
+		return true;
+	}
+}
+
+static void gen_x(struct hla_node *n)
+{
+	if (gen_x_direct(n))
+		return;
+
+	gen_value(n);
+	emit("tax");
+}
+
+static void gen_pkt(struct hla_node *n)
+{
+	const char *op = n->k == 1 ? "ldb" : n->k == 2 ? "ldh" : "ld";
+	struct hla_node *off = n->l;
+
+	/* The kernel takes negative offsets for its own extensions */
+	if (off->op == HLA_NUM) {
+		if (off->k > INT32_MAX)
+			panic("Packet offset %d out of range!\n", (int) off->k);
+		emit("%s [%u]", op, off->k);
+	} else if (off->op == HLA_ADD && off->r->op == HLA_NUM &&
+		   off->r->k <= INT32_MAX) {
+		gen_x(off->l);
+		emit("%s [x + %u]", op, off->r->k);
+	} else {
+		gen_x(off);
+		emit("%s [x + 0]", op);
+	}
+}
+
+/* Whether computing n into A clobbers X */
+static bool node_uses_x(const struct hla_node *n)
+{
+	switch (n->op) {
+	case HLA_NUM:
+	case HLA_VAR:
+	case HLA_ANC:
+		return false;
+	case HLA_PKT:
+		return n->l->op != HLA_NUM;
+	case HLA_NEG:
+	case HLA_INV:
+		return node_uses_x(n->l);
+	default:
+		if (node_is_cond(n))
+			return true;
+		if (n->r->op == HLA_NUM)
+			return node_uses_x(n->l);
+		return true;
+	}
+}
+
+/*
+ * Left operand to A, right one to X. If the right hand side needs A to
+ * be computed and the left one then needs X, it is parked in M[].
+ */
+static void gen_operands(struct hla_node *n)
+{
+	int tmp;
+
+	if (n->r->op == HLA_VAR || node_is_msh(n->r)) {
+		gen_value(n->l);
+		gen_x_direct(n->r);
+	} else if (!node_uses_x(n->l)) {
+		gen_value(n->r);
+		emit("tax");
+		gen_value(n->l);
+	} else {
+		tmp = slot_alloc_tmp();
+		gen_value(n->r);
+		emit("st M[%d]", tmp);
+		gen_value(n->l);
+		emit("ldx M[%d]", tmp);
+		slot_free(tmp);
+	}
+}
+
+/* Binary operator with the result in A */
+static void gen_binop(struct hla_node *n)
+{
+	const char *op = hla_alu[n->op];
+
+	if (n->r->op == HLA_NUM) {
+		gen_value(n->l);
+		emit("%s #0x%x", op, n->r->k);
+		return;
+	}
+
+	if (n->op == HLA_SUB && n->l->op == HLA_NUM) {
+		gen_value(n->r);
+		emit("neg");
+		emit("add #0x%x", n->l->k);
+		return;
+	}
+
+	gen_operands(n);
+	emit("%s x", op);
+}
+
+static void gen_value(struct hla_node *n)
+{
+	int lt, lf, end;
+
+	switch (n->op) {
+	case HLA_NUM:
+		emit("ld #0x%x", n->k);
+		break;
+	case HLA_VAR:
+		emit("ld M[%u]", n->k);
+		break;
+	case HLA_ANC:
+		emit("ld %s", hla_anc[n->k].lla);
+		break;
+	case HLA_PKT:
+		gen_pkt(n);
+		break;
+	case HLA_NEG:
+		gen_value(n->l);
+		emit("neg");
+		break;
+	case HLA_INV:
+		gen_value(n->l);
+		emit("xor #0xffffffff");
+		break;
+	default:
+		if (!node_is_cond(n)) {
+			gen_binop(n);
+			break;
+		}
+
+		/* Truth value as a number */
+		lt = label_new();
+		lf = label_new();
+		end = label_new();
+
+		gen_cond(n, lt, lf);
+		label_place(lt);
+		emit("ld #1");
+		emit_ja(end);
+		label_place(lf);
+		emit("ld #0");
+		label_place(end);
+		break;
+	}
+}
+
+static void gen_compare(struct hla_node *n, int lt, int lf)
+{
+	int tmp;
+	char operand[16];
+	const char *op;
+
+	/* a < b is !(a >= b) and so on */
+	switch (n->op) {
+	case HLA_NE:
+	case HLA_LT:
+	case HLA_LE:
+		tmp = lt;
+		lt = lf;
+		lf = tmp;
+		break;
+	default:
+		break;
+	}
+
+	switch (n->op) {
+	case HLA_EQ:
+	case HLA_NE:
+		op = "jeq";
+		break;
+	case HLA_GT:
+	case HLA_LE:
+		op = "jgt";
+		break;
+	default:
+		op = "jge";
+		break;
+	}
+
+	if (n->r->op == HLA_NUM) {
+		gen_value(n->l);
+		slprintf(operand, sizeof(operand), "#0x%x", n->r->k);
+	} else {
+		gen_operands(n);
+		slprintf(operand, sizeof(operand), "x");
+	}
+
+	emit_jcc(op, operand, lt, lf);
+}
+
+/* Jumps to lt if n holds, to lf otherwise */
+static void gen_cond(struct hla_node *n, int lt, int lf)
+{
+	int mid;
+	char operand[16];
+
+	switch (n->op) {
+	case HLA_NUM:
+		emit_ja(n->k ? lt : lf);
+		break;
+	case HLA_LAND:
+		mid = label_new();
+		gen_cond(n->l, mid, lf);
+		label_place(mid);
+		gen_cond(n->r, lt, lf);
+		break;
+	case HLA_LOR:
+		mid = label_new();
+		gen_cond(n->l, lt, mid);
+		label_place(mid);
+		gen_cond(n->r, lt, lf);
+		break;
+	case HLA_LNOT:
+		gen_cond(n->l, lf, lt);
+		break;
+	case HLA_EQ:
+	case HLA_NE:
+	case HLA_LT:
+	case HLA_LE:
+	case HLA_GT:
+	case HLA_GE:
+		gen_compare(n, lt, lf);
+		break;
+	case HLA_AND:
+		if (n->r->op == HLA_NUM) {
+			gen_value(n->l);
+			slprintf(operand, sizeof(operand), "#0x%x", n->r->k);
+			emit_jcc("jset", operand, lt, lf);
+			break;
+		}
+		/* fall through */
+	default:
+		gen_value(n);
+		emit_jcc("jeq", "#0x0", lf, lt);
+		break;
+	}
+}
+
+/* A condition keeps the whole packet or drops it, a value is a snap length */
+static void gen_ret(struct hla_node *n)
+{
+	int lt, lf;
+
+	if (n->op == HLA_NUM && n->truth) {
+		emit("ret #0x%x", n->k ? UINT32_MAX : 0);
+	} else if (n->op == HLA_NUM) {
+		emit("ret #0x%x", n->k);
+	} else if (node_is_cond(n)) {
+		lt = label_new();
+		lf = label_new();
+
+		gen_cond(n, lt, lf);
+		label_place(lt);
+		emit("ret #0xffffffff");
+		label_place(lf);
+		emit("ret #0x0");
+	} else {
+		gen_value(n);
+		emit("ret a");
+	}
+
+	node_free(n);
+}
+
+static void gen_store(int slot, struct hla_node *n)
+{
+	gen_value(n);
+	emit("st M[%d]", slot);
+
+	node_free(n);
+}
+
+/* Places lt and returns the label for when the condition does not hold */
+static int gen_if(struct hla_node *n)
+{
+	int lt = label_new(), lf = label_new();
+
+	gen_cond(n, lt, lf);
+	label_place(lt);
+
+	node_free(n);
+
+	return lf;
+}
+
+/*
+ * Variables defined in a block may be read after it on paths that did
+ * not define them, which the kernel refuses, so they start out as zero.
+ */
+static void gen_prologue(void)
+{
+	int i;
+	size_t pos = 0;
+	struct hla_insn *insn;
+
+	for (i = 0; i < BPF_MEMWORDS; ++i) {
+		if (!(vars_nested & (1 << i)))
+			continue;
+
+		if (pos == 0) {
+			insn = insn_insert(pos++, HLA_INSN_PLAIN);
+			slprintf(insn->op, sizeof(insn->op), "ld #0x0");
+		}
+
+		insn = insn_insert(pos++, HLA_INSN_PLAIN);
+		slprintf(insn->op, sizeof(insn->op), "st M[%d]", i);
+	}
+}
+
+static int label_distance(const int *pos, size_t from, int label)
+{
+	return pos[label_resolve(label)] - (int) from - 1;
+}
+
+/* Bounces conditional jumps that are too far through a ja */
+static void gen_fixup_jumps(void)
+{
+	int *pos = NULL;
+	size_t i;
+	bool again, far_jf;
+	struct hla_insn *insn;
+
+	if (nr_labels == 0)
+		return;
+
+	do {
+		again = false;
+
+		pos = xrealloc(pos, nr_labels, sizeof(*pos));
+		for (i = 0; i < nr_insns; ++i) {
+			if (insns[i].label >= 0)
+				pos[insns[i].label] = i;
+		}
+
+		for (i = 0; i < nr_insns; ++i) {
+			if (insns[i].type != HLA_INSN_JCC)
+				continue;
+
+			if (label_distance(pos, i, insns[i].jf) > MAX_JUMP)
+				far_jf = true;
+			else if (label_distance(pos, i, insns[i].jt) > MAX_JUMP)
+				far_jf = false;
+			else
+				continue;
+
+			insn = insn_insert(i + 1, HLA_INSN_JA);
+			insn->label = label_new();
+			if (far_jf) {
+				insn->jt = insns[i].jf;
+				insns[i].jf = insn->label;
+			} else {
+				insn->jt = insns[i].jt;
+				insns[i].jt = insn->label;
+			}
+
+			again = true;
+			break;
+		}
+	} while (again);
+
+	xfree(pos);
+}
+
+static void gen_finish(void)
+{
+	size_t i;
+	struct hla_insn *insn;
+
+	/* Falling off the end drops the packet */
+	emit("ret #0x0");
+
+	gen_prologue();
+	gen_fixup_jumps();
+
+	for (i = 0; i < nr_insns; ++i) {
+		insn = &insns[i];
+
+		if (insn->label >= 0)
+			printf("L%d:", insn->label);
+		printf("\t");
+
+		switch (insn->type) {
+		case HLA_INSN_PLAIN:
+			printf("%s\n", insn->op);
+			break;
+		case HLA_INSN_JA:
+			printf("jmp L%d\n", label_resolve(insn->jt));
+			break;
+		case HLA_INSN_JCC:
+			printf("%s, L%d, L%d\n", insn->op,
+			       label_resolve(insn->jt),
+			       label_resolve(insn->jf));
+			break;
+		}
+	}
+}
 
 %}
 
 %union {
 	int idx;
 	long int number;
+	struct hla_node *node;
+	int label;
 }
 
-%token K_NAME K_DEF K_PKT K_RET K_IF K_ELIF K_ELSE
+%token K_NAME K_DEF K_PKT K_RET K_IF K_ELIF K_ELSE K_ANC
 %token K_MACRO_IPV4 K_MACRO_IPV6 K_MACRO_IP K_MACRO_UDP K_MACRO_TCP
 
+%token OP_EQ OP_NE OP_LE OP_GE OP_LSH OP_RSH OP_LAND OP_LOR
+
 %token number
 
 %token '(' ')' '{' '}' '=' ';' '+' '-' '&' '|' '^' '!' '<' '>' '*' '/' '%' ','
+%token '~'
+
+%left OP_LOR
+%left OP_LAND
+%left OP_EQ OP_NE '<' '>' OP_LE OP_GE
+%left '|'
+%left '^'
+%left '&'
+%left OP_LSH OP_RSH
+%left '+' '-'
+%left '*' '/' '%'
+%right UNARY
 
 %type <number> number
+%type <idx> K_NAME K_ANC
+%type <node> expr
+%type <label> if_head
 
 %%
 
 program
-	: { printf("Not supported yet!\n"); }
+	: stmts { gen_finish(); }
+	;
+
+stmts
+	: /* empty */
+	| stmts stmt
+	;
+
+stmt
+	: K_DEF K_NAME '=' expr {
+		var_define($2);
+		gen_store(var_slot[$2], $4); }
+	| K_NAME '=' expr {
+		gen_store(var_lookup($1), $3); }
+	| K_RET expr {
+		gen_ret($2); }
+	| if_head opt_else {
+		label_place($1); }
+	| block
+	| ';'	/* statements may be terminated */
+	;
+
+block
+	: '{' { depth++; } stmts '}' { depth--; }
+	;
+
+if_head
+	: K_IF '(' expr ')' { $<label>$ = gen_if($3); } block {
+		$$ = label_new();
+		emit_ja($$);
+		label_place($<label>5); }
+	| if_head K_ELIF '(' expr ')' { $<label>$ = gen_if($4); } block {
+		$$ = $1;
+		emit_ja($$);
+		label_place($<label>6); }
+	;
+
+opt_else
+	: /* empty */
+	| K_ELSE block
+	;
+
+expr
+	: number { $$ = node_num($1); }
+	| K_NAME { $$ = node_new(HLA_VAR, var_lookup($1), NULL, NULL); }
+	| K_ANC { $$ = node_anc($1); }
+	| K_PKT '(' expr ')' { $$ = node_pkt($3, 1); }
+	| K_PKT '(' expr ',' number ')' { $$ = node_pkt($3, $5); }
+	| K_MACRO_IPV4 { $$ = node_macro(K_MACRO_IPV4); }
+	| K_MACRO_IPV6 { $$ = node_macro(K_MACRO_IPV6); }
+	| K_MACRO_IP { $$ = node_macro(K_MACRO_IP); }
+	| K_MACRO_UDP { $$ = node_macro(K_MACRO_UDP); }
+	| K_MACRO_TCP { $$ = node_macro(K_MACRO_TCP); }
+	| '(' expr ')' { $$ = $2; }
+	| expr '+' expr { $$ = node_binop(HLA_ADD, $1, $3); }
+	| expr '-' expr { $$ = node_binop(HLA_SUB, $1, $3); }
+	| expr '*' expr { $$ = node_binop(HLA_MUL, $1, $3); }
+	| expr '/' expr { $$ = node_binop(HLA_DIV, $1, $3); }
+	| expr '%' expr { $$ = node_binop(HLA_MOD, $1, $3); }
+	| expr '&' expr { $$ = node_binop(HLA_AND, $1, $3); }
+	| expr '|' expr { $$ = node_binop(HLA_OR, $1, $3); }
+	| expr '^' expr { $$ = node_binop(HLA_XOR, $1, $3); }
+	| expr OP_LSH expr { $$ = node_binop(HLA_LSH, $1, $3); }
+	| expr OP_RSH expr { $$ = node_binop(HLA_RSH, $1, $3); }
+	| expr OP_EQ expr { $$ = node_binop(HLA_EQ, $1, $3); }
+	| expr OP_NE expr { $$ = node_binop(HLA_NE, $1, $3); }
+	| expr '<' expr { $$ = node_binop(HLA_LT, $1, $3); }
+	| expr '>' expr { $$ = node_binop(HLA_GT, $1, $3); }
+	| expr OP_LE expr { $$ = node_binop(HLA_LE, $1, $3); }
+	| expr OP_GE expr { $$ = node_binop(HLA_GE, $1, $3); }
+	| expr OP_LAND expr { $$ = node_binop(HLA_LAND, $1, $3); }
+	| expr OP_LOR expr { $$ = node_binop(HLA_LOR, $1, $3); }
+	| '!' expr %prec UNARY { $$ = node_unop(HLA_LNOT, $2); }
+	| '-' expr %prec UNARY { $$ = node_unop(HLA_NEG, $2); }
+	| '~' expr %prec UNARY { $$ = node_unop(HLA_INV, $2); }
 	;
 
 %%
@@ -75,14 +1079,25 @@ static void stage_1_compile(void)
 	zzparse();
 }
 
-int compile_hla_filter(char *file, int verbose, int debug)
+static void stage_reset(void)
 {
-	int fd;
-	fpos_t pos;
-	char file_tmp[128];
+	if (insns)
+		xfree(insns);
+	if (label_alias)
+		xfree(label_alias);
+
+	insns = NULL;
+	nr_insns = max_insns = 0;
+	label_alias = NULL;
+	nr_labels = max_labels = 0;
+	pending_label = -1;
+	slots_used = slots_tmp = vars_nested = 0;
+	depth = 0;
+}
 
-	/* XXX */
-	verbose = verbose;
+int compile_hla_filter(char *file, char *out, int verbose, int debug)
+{
+	int fd = -1;
 
 	if (!strncmp("-", file, strlen("-")))
 		zzin = stdin;
@@ -91,10 +1106,10 @@ int compile_hla_filter(char *file, int verbose, int debug)
 	if (!zzin)
 		panic("Cannot open file!\n");
 	if (!debug) {
+		fflush(stdout);
 		fd = dup(fileno(stdout));
 
-		slprintf(file_tmp, sizeof(file_tmp), ".%s", file);
-		if (freopen(file_tmp, "w", stdout) == NULL)
+		if (freopen(out, "w", stdout) == NULL)
 			panic("Cannot reopen file!\n");
 	}
 
@@ -106,11 +1121,14 @@ int compile_hla_filter(char *file, int verbose, int debug)
 
 		close(fd);
 		clearerr(stdout);
-		fsetpos(stdout, &pos);
 	}
 
+	if (verbose)
+		printf("Generated %zu instructions\n", nr_insns);
+
 	fclose(zzin);
 
+	stage_reset();
 	bpf_symtab_cleanup();
 	if (debug)
 		die();
@@ -122,4 +1140,4 @@ void zzerror(const char *err)
 {
 	panic("Syntax error at line %d: %s! %s!\n",
 	      zzlineno, zztext, err);
-} 
+}
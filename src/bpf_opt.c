@@ -0,0 +1,894 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ *
+ * Optimizer for classic BPF programs. The program is treated as a DAG of
+ * instructions (classic BPF only jumps forward), so every analysis is a
+ * single pass in program order or in reverse. Passes are repeated until
+ * nothing changes anymore:
+ *
+ *   - reachability, which removes dead blocks,
+ *   - value numbering of A, X and the scratch memory, which removes
+ *     redundant loads and stores, folds constants and decides jumps
+ *     whose outcome is known,
+ *   - liveness, which removes computations nobody reads,
+ *   - jump threading, which retargets jumps whose outcome at the target
+ *     is implied by the jump itself and collapses jump chains.
+ *
+ * Instructions are only ever removed or replaced in place, so a jump
+ * never gets longer than it was in the input and the 8 bit conditional
+ * offsets cannot overflow when the program is laid out again.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bpf.h"
+#include "bpf_opt.h"
+#include "xmalloc.h"
+#include "built_in.h"
+#include "die.h"
+
+#define OPT_MAX_PASSES		32
+
+/* Slots tracked by value numbering: A, X and the scratch memory */
+#define SLOT_A			0
+#define SLOT_X			1
+#define SLOT_MEM(k)		(2 + (k))
+#define NR_SLOTS		(2 + BPF_MEMWORDS)
+
+/* Reserved value numbers: no state arrived yet, predecessors disagree */
+#define VN_NONE			0
+#define VN_CONFLICT		1
+
+#define LIVE_A			(1U << SLOT_A)
+#define LIVE_X			(1U << SLOT_X)
+#define LIVE_MEM(k)		(1U << SLOT_MEM(k))
+
+enum vn_kind {
+	VN_CONST,
+	VN_EXPR,
+	VN_FRESH,
+};
+
+struct vn {
+	enum vn_kind kind;
+	uint16_t code;
+	uint32_t k, a, x;
+};
+
+struct bpf_opt {
+	struct sock_filter *insn;
+	uint32_t len;
+	/* Absolute jump targets, jt is also used for ja */
+	uint32_t *jt, *jf;
+	bool *dead;
+	uint32_t (*in)[NR_SLOTS];
+	struct vn *vn;
+	uint32_t nr_vn, max_vn;
+	bool changed;
+};
+
+static bool opt_supported(uint16_t code)
+{
+	switch (code) {
+	case BPF_RET | BPF_K:
+	case BPF_RET | BPF_A:
+	case BPF_LD | BPF_W | BPF_ABS:
+	case BPF_LD | BPF_H | BPF_ABS:
+	case BPF_LD | BPF_B | BPF_ABS:
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+	case BPF_LD | BPF_W | BPF_LEN:
+	case BPF_LDX | BPF_W | BPF_LEN:
+	case BPF_LDX | BPF_B | BPF_MSH:
+	case BPF_LD | BPF_IMM:
+	case BPF_LDX | BPF_IMM:
+	case BPF_LD | BPF_MEM:
+	case BPF_LDX | BPF_MEM:
+	case BPF_ST:
+	case BPF_STX:
+	case BPF_MISC | BPF_TAX:
+	case BPF_MISC | BPF_TXA:
+	case BPF_JMP | BPF_JA:
+		return true;
+	}
+
+	switch (BPF_CLASS(code)) {
+	case BPF_ALU:
+		return BPF_OP(code) <= BPF_XOR;
+	case BPF_JMP:
+		return BPF_OP(code) >= BPF_JEQ && BPF_OP(code) <= BPF_JSET;
+	default:
+		return false;
+	}
+}
+
+static inline bool is_cond_jmp(const struct sock_filter *f)
+{
+	return BPF_CLASS(f->code) == BPF_JMP && BPF_OP(f->code) != BPF_JA;
+}
+
+static inline uint32_t next_live(const struct bpf_opt *o, uint32_t i)
+{
+	while (i < o->len - 1 && o->dead[i])
+		i++;
+	return i;
+}
+
+static inline void opt_kill(struct bpf_opt *o, uint32_t i)
+{
+	o->dead[i] = true;
+	o->changed = true;
+}
+
+static inline void opt_make_ja(struct bpf_opt *o, uint32_t i, uint32_t t)
+{
+	o->insn[i].code = BPF_JMP | BPF_JA;
+	o->insn[i].jt = o->insn[i].jf = 0;
+	o->insn[i].k = 0;
+	o->jt[i] = t;
+	o->changed = true;
+}
+
+static uint32_t vn_get(struct bpf_opt *o, enum vn_kind kind, uint16_t code,
+		       uint32_t k, uint32_t a, uint32_t x)
+{
+	uint32_t i;
+	struct vn *v;
+
+	if (kind != VN_FRESH) {
+		for (i = 2; i < o->nr_vn; ++i) {
+			v = &o->vn[i];
+			if (v->kind == kind && v->code == code && v->k == k &&
+			    v->a == a && v->x == x)
+				return i;
+		}
+	}
+
+	if (o->nr_vn == o->max_vn) {
+		o->max_vn <<= 1;
+		o->vn = xrealloc(o->vn, o->max_vn, sizeof(*o->vn));
+	}
+
+	v = &o->vn[o->nr_vn];
+	v->kind = kind;
+	v->code = code;
+	v->k = k;
+	v->a = a;
+	v->x = x;
+
+	return o->nr_vn++;
+}
+
+static inline uint32_t vn_const(struct bpf_opt *o, uint32_t k)
+{
+	return vn_get(o, VN_CONST, 0, k, 0, 0);
+}
+
+static inline uint32_t vn_fresh(struct bpf_opt *o)
+{
+	return vn_get(o, VN_FRESH, 0, 0, 0, 0);
+}
+
+static inline bool vn_is_const(const struct bpf_opt *o, uint32_t v,
+			       uint32_t *k)
+{
+	if (o->vn[v].kind != VN_CONST)
+		return false;
+	*k = o->vn[v].k;
+	return true;
+}
+
+static void opt_merge(struct bpf_opt *o, uint32_t i, const uint32_t *st)
+{
+	int s;
+
+	if (i >= o->len || st[0] == VN_NONE)
+		return;
+
+	if (o->in[i][0] == VN_NONE) {
+		memcpy(o->in[i], st, sizeof(o->in[i]));
+		return;
+	}
+
+	for (s = 0; s < NR_SLOTS; ++s) {
+		if (o->in[i][s] != st[s])
+			o->in[i][s] = VN_CONFLICT;
+	}
+}
+
+static void opt_reach(struct bpf_opt *o)
+{
+	uint32_t i;
+	bool *reach = xzmalloc(o->len * sizeof(*reach));
+	const struct sock_filter *f;
+
+	reach[0] = true;
+
+	for (i = 0; i < o->len; ++i) {
+		f = &o->insn[i];
+
+		if (!reach[i]) {
+			if (!o->dead[i])
+				opt_kill(o, i);
+			continue;
+		}
+
+		if (o->dead[i]) {
+			reach[i + 1] = true;
+			continue;
+		}
+
+		switch (BPF_CLASS(f->code)) {
+		case BPF_RET:
+			break;
+		case BPF_JMP:
+			reach[o->jt[i]] = true;
+			if (is_cond_jmp(f))
+				reach[o->jf[i]] = true;
+			break;
+		default:
+			reach[i + 1] = true;
+			break;
+		}
+	}
+
+	xfree(reach);
+}
+
+static bool alu_fold(uint16_t op, uint32_t a, uint32_t k, uint32_t *res)
+{
+	switch (op) {
+	case BPF_ADD: *res = a + k; return true;
+	case BPF_SUB: *res = a - k; return true;
+	case BPF_MUL: *res = a * k; return true;
+	case BPF_OR:  *res = a | k; return true;
+	case BPF_AND: *res = a & k; return true;
+	case BPF_XOR: *res = a ^ k; return true;
+	case BPF_NEG: *res = -a; return true;
+	case BPF_DIV:
+		if (k == 0)
+			return false;
+		*res = a / k;
+		return true;
+	case BPF_MOD:
+		if (k == 0)
+			return false;
+		*res = a % k;
+		return true;
+	/* Shifts by 32 and more differ between implementations */
+	case BPF_LSH:
+		if (k >= 32)
+			return false;
+		*res = a << k;
+		return true;
+	case BPF_RSH:
+		if (k >= 32)
+			return false;
+		*res = a >> k;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool jmp_fold(uint16_t op, uint32_t a, uint32_t k)
+{
+	switch (op) {
+	case BPF_JEQ:  return a == k;
+	case BPF_JGT:  return a > k;
+	case BPF_JGE:  return a >= k;
+	default:       return (a & k) != 0;
+	}
+}
+
+static uint32_t opt_load(struct bpf_opt *o, struct sock_filter *f,
+			 const uint32_t *st)
+{
+	uint32_t c;
+
+	switch (BPF_MODE(f->code)) {
+	case BPF_IMM:
+		return vn_const(o, f->k);
+	case BPF_LEN:
+		return vn_get(o, VN_EXPR, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+	case BPF_MEM:
+		return st[SLOT_MEM(f->k)];
+	case BPF_MSH:
+		return vn_get(o, VN_EXPR, f->code, f->k, 0, 0);
+	case BPF_IND:
+		/* Known index, turn it into an absolute load */
+		if (vn_is_const(o, st[SLOT_X], &c) &&
+		    (uint64_t) f->k + c < 0x80000000ULL) {
+			f->code = BPF_LD | BPF_SIZE(f->code) | BPF_ABS;
+			f->k += c;
+			o->changed = true;
+			return opt_load(o, f, st);
+		}
+		return vn_get(o, VN_EXPR, f->code, f->k, 0, st[SLOT_X]);
+	case BPF_ABS:
+	default:
+		/* Ancillary data like SKF_AD_RANDOM may change each time */
+		if (f->k >= (uint32_t) SKF_AD_OFF)
+			return vn_fresh(o);
+		return vn_get(o, VN_EXPR, f->code, f->k, 0, 0);
+	}
+}
+
+static uint32_t opt_alu(struct bpf_opt *o, struct sock_filter *f,
+			const uint32_t *st)
+{
+	uint16_t op = BPF_OP(f->code);
+	uint32_t a = st[SLOT_A], c, res;
+
+	if (op == BPF_NEG) {
+		if (vn_is_const(o, a, &c) && alu_fold(op, c, 0, &res))
+			return vn_const(o, res);
+		return vn_get(o, VN_EXPR, f->code, 0, a, 0);
+	}
+
+	if (BPF_SRC(f->code) == BPF_X) {
+		if (!vn_is_const(o, st[SLOT_X], &c) ||
+		    ((op == BPF_DIV || op == BPF_MOD) && c == 0))
+			return vn_get(o, VN_EXPR, f->code, 0, a, st[SLOT_X]);
+
+		f->code = BPF_ALU | op | BPF_K;
+		f->k = c;
+		o->changed = true;
+	}
+
+	if (vn_is_const(o, a, &c) && alu_fold(op, c, f->k, &res))
+		return vn_const(o, res);
+
+	switch (op) {
+	case BPF_ADD:
+	case BPF_SUB:
+	case BPF_OR:
+	case BPF_XOR:
+	case BPF_LSH:
+	case BPF_RSH:
+		if (f->k == 0)
+			return a;
+		break;
+	case BPF_MUL:
+		if (f->k == 0)
+			return vn_const(o, 0);
+		/* fall through */
+	case BPF_DIV:
+		if (f->k == 1)
+			return a;
+		break;
+	case BPF_AND:
+		if (f->k == 0)
+			return vn_const(o, 0);
+		if (f->k == 0xffffffff)
+			return a;
+		break;
+	}
+
+	return vn_get(o, VN_EXPR, f->code, f->k, a, 0);
+}
+
+/*
+ * Instruction i sets register slot dst to value v. Drop it if the
+ * register already holds v, otherwise use the cheapest way to get v.
+ * A packet load can only produce a value that is already around if the
+ * very same load succeeded before, so dropping it does not lose a
+ * bounds check.
+ */
+static void opt_set(struct bpf_opt *o, uint32_t i, int dst, uint32_t v,
+		    uint32_t *st)
+{
+	struct sock_filter *f = &o->insn[i];
+	int other = dst == SLOT_A ? SLOT_X : SLOT_A;
+	uint16_t imm = dst == SLOT_A ? BPF_LD | BPF_IMM : BPF_LDX | BPF_IMM;
+	uint16_t mov = dst == SLOT_A ? BPF_MISC | BPF_TXA : BPF_MISC | BPF_TAX;
+	uint32_t c;
+
+	if (st[dst] == v) {
+		opt_kill(o, i);
+		return;
+	}
+
+	if (vn_is_const(o, v, &c)) {
+		if (f->code != imm || f->k != c) {
+			f->code = imm;
+			f->k = c;
+			o->changed = true;
+		}
+	} else if (st[other] == v && f->code != mov) {
+		f->code = mov;
+		f->k = 0;
+		o->changed = true;
+	}
+
+	st[dst] = v;
+}
+
+static void opt_jmp(struct bpf_opt *o, uint32_t i, uint32_t *st)
+{
+	struct sock_filter *f = &o->insn[i];
+	uint16_t op = BPF_OP(f->code);
+	uint32_t a, c;
+
+	if (BPF_SRC(f->code) == BPF_X) {
+		if (vn_is_const(o, st[SLOT_X], &c)) {
+			f->code = BPF_JMP | op | BPF_K;
+			f->k = c;
+			o->changed = true;
+		} else if (st[SLOT_A] == st[SLOT_X] && op != BPF_JSET) {
+			opt_make_ja(o, i, op == BPF_JGT ? o->jf[i] : o->jt[i]);
+			return;
+		}
+	}
+
+	if (BPF_SRC(f->code) == BPF_K && vn_is_const(o, st[SLOT_A], &a))
+		opt_make_ja(o, i, jmp_fold(op, a, f->k) ? o->jt[i] : o->jf[i]);
+}
+
+static void opt_values(struct bpf_opt *o)
+{
+	int s;
+	uint32_t i, st[NR_SLOTS];
+	struct sock_filter *f;
+
+	o->nr_vn = 2;
+	memset(o->in, 0, o->len * sizeof(*o->in));
+
+	/* A and X start out as zero, scratch memory is undefined */
+	o->in[0][SLOT_A] = vn_const(o, 0);
+	o->in[0][SLOT_X] = o->in[0][SLOT_A];
+	for (s = SLOT_MEM(0); s < NR_SLOTS; ++s)
+		o->in[0][s] = vn_fresh(o);
+
+	for (i = 0; i < o->len; ++i) {
+		f = &o->insn[i];
+
+		if (o->dead[i]) {
+			opt_merge(o, i + 1, o->in[i]);
+			continue;
+		}
+
+		/* Only reached through jumps that were just folded away */
+		if (o->in[i][0] == VN_NONE) {
+			opt_kill(o, i);
+			continue;
+		}
+
+		memcpy(st, o->in[i], sizeof(st));
+		for (s = 0; s < NR_SLOTS; ++s) {
+			if (st[s] == VN_CONFLICT)
+				st[s] = vn_fresh(o);
+		}
+
+		switch (BPF_CLASS(f->code)) {
+		case BPF_LD:
+			opt_set(o, i, SLOT_A, opt_load(o, f, st), st);
+			break;
+		case BPF_LDX:
+			opt_set(o, i, SLOT_X, opt_load(o, f, st), st);
+			break;
+		case BPF_ALU:
+			opt_set(o, i, SLOT_A, opt_alu(o, f, st), st);
+			break;
+		case BPF_MISC:
+			if (BPF_MISCOP(f->code) == BPF_TAX)
+				opt_set(o, i, SLOT_X, st[SLOT_A], st);
+			else
+				opt_set(o, i, SLOT_A, st[SLOT_X], st);
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			s = BPF_CLASS(f->code) == BPF_ST ? SLOT_A : SLOT_X;
+			if (st[SLOT_MEM(f->k)] == st[s])
+				opt_kill(o, i);
+			else
+				st[SLOT_MEM(f->k)] = st[s];
+			break;
+		case BPF_JMP:
+			if (is_cond_jmp(f))
+				opt_jmp(o, i, st);
+			opt_merge(o, o->jt[i], st);
+			if (is_cond_jmp(f))
+				opt_merge(o, o->jf[i], st);
+			continue;
+		case BPF_RET:
+			continue;
+		}
+
+		opt_merge(o, i + 1, st);
+	}
+}
+
+/* Removes instructions whose result is never used and that cannot fail */
+static void opt_liveness(struct bpf_opt *o)
+{
+	uint32_t i, in, out, use, def, *live;
+	bool can_fail;
+	const struct sock_filter *f;
+
+	live = xzmalloc(o->len * sizeof(*live));
+
+	for (i = o->len; i-- > 0;) {
+		f = &o->insn[i];
+
+		if (o->dead[i]) {
+			live[i] = i + 1 < o->len ? live[i + 1] : 0;
+			continue;
+		}
+
+		out = use = def = 0;
+		can_fail = false;
+
+		switch (BPF_CLASS(f->code)) {
+		case BPF_RET:
+			live[i] = BPF_RVAL(f->code) == BPF_A ? LIVE_A : 0;
+			continue;
+		case BPF_JMP:
+			in = live[o->jt[i]];
+			if (is_cond_jmp(f)) {
+				in |= live[o->jf[i]] | LIVE_A;
+				if (BPF_SRC(f->code) == BPF_X)
+					in |= LIVE_X;
+			}
+			live[i] = in;
+			continue;
+		case BPF_LD:
+			def = LIVE_A;
+			if (BPF_MODE(f->code) == BPF_MEM)
+				use = LIVE_MEM(f->k);
+			if (BPF_MODE(f->code) == BPF_IND)
+				use = LIVE_X;
+			can_fail = BPF_MODE(f->code) == BPF_ABS ||
+				   BPF_MODE(f->code) == BPF_IND;
+			break;
+		case BPF_LDX:
+			def = LIVE_X;
+			if (BPF_MODE(f->code) == BPF_MEM)
+				use = LIVE_MEM(f->k);
+			can_fail = BPF_MODE(f->code) == BPF_MSH;
+			break;
+		case BPF_ST:
+			def = LIVE_MEM(f->k);
+			use = LIVE_A;
+			break;
+		case BPF_STX:
+			def = LIVE_MEM(f->k);
+			use = LIVE_X;
+			break;
+		case BPF_ALU:
+			def = use = LIVE_A;
+			if (BPF_SRC(f->code) == BPF_X &&
+			    BPF_OP(f->code) != BPF_NEG) {
+				use |= LIVE_X;
+				can_fail = BPF_OP(f->code) == BPF_DIV ||
+					   BPF_OP(f->code) == BPF_MOD;
+			}
+			break;
+		case BPF_MISC:
+			if (BPF_MISCOP(f->code) == BPF_TAX) {
+				def = LIVE_X;
+				use = LIVE_A;
+			} else {
+				def = LIVE_A;
+				use = LIVE_X;
+			}
+			break;
+		}
+
+		out = live[i + 1];
+		if (!can_fail && !(out & def)) {
+			opt_kill(o, i);
+			live[i] = out;
+		} else {
+			live[i] = (out & ~def) | use;
+		}
+	}
+
+	xfree(live);
+}
+
+/*
+ * Outcome of jump u when jump c went the way given by taken and A has
+ * not changed since. Returns 1 or 0 for taken or not, -1 if unknown.
+ */
+static int jmp_implies(const struct sock_filter *c, bool taken,
+		       const struct sock_filter *u)
+{
+	uint16_t op = BPF_OP(c->code), uop = BPF_OP(u->code);
+	uint32_t lo = 0, hi = 0xffffffff, k = c->k, uk = u->k;
+
+	if (c->code == u->code && (BPF_SRC(c->code) == BPF_X || k == uk))
+		return taken;
+	if (BPF_SRC(c->code) == BPF_X || BPF_SRC(u->code) == BPF_X)
+		return -1;
+
+	/* Range of A on this edge */
+	switch (op) {
+	case BPF_JEQ:
+		if (!taken)
+			return -1;
+		lo = hi = k;
+		break;
+	case BPF_JGT:
+		if (taken)
+			lo = k + 1;
+		else
+			hi = k;
+		break;
+	case BPF_JGE:
+		if (taken)
+			lo = k;
+		else
+			hi = k - 1;
+		break;
+	case BPF_JSET:
+		if (uop != BPF_JSET)
+			return -1;
+		if (taken && (k & ~uk) == 0)
+			return 1;
+		if (!taken && (uk & ~k) == 0)
+			return 0;
+		return -1;
+	}
+
+	if (lo == hi)
+		return jmp_fold(uop, lo, uk);
+
+	switch (uop) {
+	case BPF_JEQ:
+		return uk < lo || uk > hi ? 0 : -1;
+	case BPF_JGT:
+		return lo > uk ? 1 : hi <= uk ? 0 : -1;
+	case BPF_JGE:
+		return lo >= uk ? 1 : hi < uk ? 0 : -1;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Follow the edge of conditional jump i that goes to t as long as the
+ * way onwards is known, without leaving the 8 bit jump range.
+ */
+static uint32_t opt_thread_edge(struct bpf_opt *o, uint32_t i, bool taken,
+				uint32_t t)
+{
+	int res;
+	uint32_t nt;
+	const struct sock_filter *u;
+
+	for (t = next_live(o, t);; t = nt) {
+		u = &o->insn[t];
+		if (BPF_CLASS(u->code) != BPF_JMP)
+			break;
+
+		if (!is_cond_jmp(u)) {
+			nt = o->jt[t];
+		} else {
+			res = jmp_implies(&o->insn[i], taken, u);
+			if (res < 0)
+				break;
+			nt = res ? o->jt[t] : o->jf[t];
+		}
+
+		nt = next_live(o, nt);
+		if (nt - i - 1 > 255)
+			break;
+	}
+
+	return t;
+}
+
+static void opt_thread(struct bpf_opt *o)
+{
+	uint32_t i, t, jt, jf;
+	struct sock_filter *f;
+
+	for (i = 0; i < o->len; ++i) {
+		f = &o->insn[i];
+		if (o->dead[i] || BPF_CLASS(f->code) != BPF_JMP)
+			continue;
+
+		if (!is_cond_jmp(f)) {
+			t = next_live(o, o->jt[i]);
+			while (BPF_CLASS(o->insn[t].code) == BPF_JMP &&
+			       !is_cond_jmp(&o->insn[t]))
+				t = next_live(o, o->jt[t]);
+
+			if (BPF_CLASS(o->insn[t].code) == BPF_RET) {
+				*f = o->insn[t];
+				o->changed = true;
+			} else if (t == next_live(o, i + 1)) {
+				opt_kill(o, i);
+			} else if (t != o->jt[i]) {
+				o->jt[i] = t;
+				o->changed = true;
+			}
+			continue;
+		}
+
+		jt = opt_thread_edge(o, i, true, o->jt[i]);
+		jf = opt_thread_edge(o, i, false, o->jf[i]);
+
+		if (jt == jf) {
+			opt_make_ja(o, i, jt);
+		} else if (jt != o->jt[i] || jf != o->jf[i]) {
+			o->jt[i] = jt;
+			o->jf[i] = jf;
+			o->changed = true;
+		}
+	}
+}
+
+static uint32_t opt_layout(struct bpf_opt *o)
+{
+	uint32_t i, n = 0, *idx;
+	struct sock_filter f;
+
+	idx = xmalloc(o->len * sizeof(*idx));
+	for (i = 0; i < o->len; ++i)
+		idx[i] = o->dead[i] ? 0 : n++;
+
+	for (i = 0; i < o->len; ++i) {
+		if (o->dead[i])
+			continue;
+
+		f = o->insn[i];
+		if (BPF_CLASS(f.code) == BPF_JMP) {
+			if (is_cond_jmp(&f)) {
+				f.jt = idx[next_live(o, o->jt[i])] - idx[i] - 1;
+				f.jf = idx[next_live(o, o->jf[i])] - idx[i] - 1;
+			} else {
+				f.k = idx[next_live(o, o->jt[i])] - idx[i] - 1;
+			}
+		}
+		o->insn[idx[i]] = f;
+	}
+
+	xfree(idx);
+	return n;
+}
+
+/*
+ * The kernel checks that scratch memory is written before it is read in
+ * a single pass in program order, where a jump merges what is valid into
+ * its targets, but a return does not clear it for the instruction after
+ * it. Code only reached by jumps then has to be valid for whatever falls
+ * out of the return before it, which dead store removal can break.
+ * Returns the slots the kernel would complain about.
+ */
+static uint16_t opt_mem_unchecked(const struct sock_fprog *bpf)
+{
+	uint32_t i;
+	uint16_t valid = 0, bad = 0, *masks;
+	const struct sock_filter *f;
+
+	masks = xmalloc(bpf->len * sizeof(*masks));
+	for (i = 0; i < bpf->len; ++i)
+		masks[i] = 0xffff;
+
+	for (i = 0; i < bpf->len; ++i) {
+		f = &bpf->filter[i];
+		valid &= masks[i];
+
+		switch (f->code) {
+		case BPF_ST:
+		case BPF_STX:
+			valid |= 1 << f->k;
+			break;
+		case BPF_LD | BPF_MEM:
+		case BPF_LDX | BPF_MEM:
+			if (!(valid & (1 << f->k)))
+				bad |= 1 << f->k;
+			break;
+		default:
+			if (BPF_CLASS(f->code) != BPF_JMP)
+				break;
+			if (is_cond_jmp(f)) {
+				masks[i + 1 + f->jt] &= valid;
+				masks[i + 1 + f->jf] &= valid;
+			} else {
+				masks[i + 1 + f->k] &= valid;
+			}
+			valid = 0xffff;
+			break;
+		}
+	}
+
+	xfree(masks);
+	return bad;
+}
+
+/* A is zero on entry, so storing it up front makes a slot always valid */
+static bool opt_mem_init(struct sock_fprog *bpf, uint32_t max_len)
+{
+	uint32_t k, n = 0, stores;
+	uint16_t bad = opt_mem_unchecked(bpf);
+
+	if (bad == 0)
+		return true;
+
+	stores = __builtin_popcount(bad);
+	if (bpf->len + stores > max_len)
+		return false;
+
+	memmove(&bpf->filter[stores], bpf->filter,
+		bpf->len * sizeof(*bpf->filter));
+	for (k = 0; k < BPF_MEMWORDS; ++k) {
+		if (bad & (1 << k))
+			bpf->filter[n++] = (struct sock_filter)
+					   BPF_STMT(BPF_ST, k);
+	}
+	bpf->len += n;
+
+	return true;
+}
+
+void bpf_optimize(struct sock_fprog *bpf)
+{
+	uint32_t i, pass = 0;
+	struct bpf_opt o;
+	struct sock_filter *orig;
+	const struct sock_filter *f;
+
+	if (bpf_validate(bpf) == 0)
+		return;
+	for (i = 0; i < bpf->len; ++i) {
+		if (!opt_supported(bpf->filter[i].code))
+			return;
+	}
+
+	fmemset(&o, 0, sizeof(o));
+	o.insn = bpf->filter;
+	o.len = bpf->len;
+	o.jt = xzmalloc(o.len * sizeof(*o.jt));
+	o.jf = xzmalloc(o.len * sizeof(*o.jf));
+	o.dead = xzmalloc(o.len * sizeof(*o.dead));
+	o.in = xmalloc(o.len * sizeof(*o.in));
+	o.max_vn = 64;
+	o.vn = xmalloc(o.max_vn * sizeof(*o.vn));
+
+	orig = xmemdupz(bpf->filter, bpf->len * sizeof(*orig));
+
+	for (i = 0; i < o.len; ++i) {
+		f = &o.insn[i];
+		if (BPF_CLASS(f->code) != BPF_JMP)
+			continue;
+		if (is_cond_jmp(f)) {
+			o.jt[i] = i + 1 + f->jt;
+			o.jf[i] = i + 1 + f->jf;
+		} else {
+			o.jt[i] = i + 1 + f->k;
+		}
+	}
+
+	do {
+		o.changed = false;
+		opt_reach(&o);
+		opt_values(&o);
+		opt_reach(&o);
+		opt_liveness(&o);
+		opt_thread(&o);
+	} while (o.changed && ++pass < OPT_MAX_PASSES);
+
+	bpf->len = opt_layout(&o);
+
+	if (!opt_mem_init(bpf, o.len) || bpf_validate(bpf) == 0) {
+		whine("BPF optimizer produced an invalid program, "
+		      "keeping the original one!\n");
+		bpf->len = o.len;
+		fmemcpy(bpf->filter, orig, o.len * sizeof(*orig));
+	}
+
+	xfree(orig);
+	xfree(o.vn);
+	xfree(o.in);
+	xfree(o.dead);
+	xfree(o.jf);
+	xfree(o.jt);
+}
@@ -0,0 +1,13 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef BPF_OPT_H
+#define BPF_OPT_H
+
+#include "bpf.h"
+
+extern void bpf_optimize(struct sock_fprog *bpf);
+
+#endif /* BPF_OPT_H */
@@ -15,9 +15,14 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
 
 #include "bpf.h"
+#include "bpf_opt.h"
+/* After bpf.h, whose include guard is BPF_H, the half word size */
+#include <linux/bpf.h>
 #include "xmalloc.h"
 #include "bpf_parser.tab.h"
 #include "built_in.h"
@@ -25,7 +30,41 @@
 
 #define MAX_INSTRUCTIONS	4096
 
-int compile_filter(char *file, int verbose, int bypass);
+static void print_ebpf(const struct sock_fprog *res, int verbose)
+{
+	int fd;
+	size_t i, len;
+	char log[4096];
+	struct bpf_insn *insns;
+
+	if (bpf_convert_ebpf(res, NULL, &insns, &len))
+		panic("Program cannot be expressed as eBPF socket filter!\n");
+
+	if (verbose) {
+		printf("Verifying: ");
+		fflush(stdout);
+
+		fd = bpf_load_ebpf(insns, len, log, sizeof(log));
+		if (fd >= 0) {
+			printf("accepted by the kernel!\n");
+			close(fd);
+		} else {
+			printf("%s!\n%s", strerror(errno), log);
+		}
+
+		printf("Result:\n");
+	}
+
+	for (i = 0; i < len; ++i)
+		printf("{ 0x%02x, %u, %u, %d, 0x%08x },\n",
+		       insns[i].code, insns[i].dst_reg, insns[i].src_reg,
+		       insns[i].off, insns[i].imm);
+
+	xfree(insns);
+}
+
+int compile_filter(char *file, int verbose, int bypass, int optimize,
+		   int ebpf);
 
 static int curr_instr = 0;
 
@@ -132,7 +171,7 @@ static int find_intr_offset_or_panic(char *label_to_search)
 %token OP_LDXI
 
 %token K_PKT_LEN K_PROTO K_TYPE K_NLATTR K_NLATTR_NEST K_MARK K_QUEUE K_HATYPE
-%token K_RXHASH K_CPU K_IFIDX K_VLANT K_VLANP
+%token K_RXHASH K_CPU K_IFIDX K_VLANT K_VLANP K_L4PROTO K_L4OFF
 
 %token ':' ',' '[' ']' '(' ')' 'x' 'a' '+' 'M' '*' '&' '#'
 
@@ -235,6 +274,12 @@ ldb
 	| OP_LDB K_VLANP {
 		set_curr_instr(BPF_LD | BPF_B | BPF_ABS, 0, 0,
 			       SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT); }
+	| OP_LDB K_L4PROTO {
+		set_curr_instr(BPF_LD | BPF_B | BPF_ABS, 0, 0,
+			       SKF_AD_OFF + SKF_AD_L4PROTO); }
+	| OP_LDB K_L4OFF {
+		set_curr_instr(BPF_LD | BPF_B | BPF_ABS, 0, 0,
+			       SKF_AD_OFF + SKF_AD_L4OFF); }
 	;
 
 ldh
@@ -278,6 +323,12 @@ ldh
 	| OP_LDH K_VLANP {
 		set_curr_instr(BPF_LD | BPF_H | BPF_ABS, 0, 0,
 			       SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT); }
+	| OP_LDH K_L4PROTO {
+		set_curr_instr(BPF_LD | BPF_H | BPF_ABS, 0, 0,
+			       SKF_AD_OFF + SKF_AD_L4PROTO); }
+	| OP_LDH K_L4OFF {
+		set_curr_instr(BPF_LD | BPF_H | BPF_ABS, 0, 0,
+			       SKF_AD_OFF + SKF_AD_L4OFF); }
 	;
 
 ldi
@@ -326,6 +377,12 @@ ld
 	| OP_LD K_VLANP {
 		set_curr_instr(BPF_LD | BPF_W | BPF_ABS, 0, 0,
 			       SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT); }
+	| OP_LD K_L4PROTO {
+		set_curr_instr(BPF_LD | BPF_W | BPF_ABS, 0, 0,
+			       SKF_AD_OFF + SKF_AD_L4PROTO); }
+	| OP_LD K_L4OFF {
+		set_curr_instr(BPF_LD | BPF_W | BPF_ABS, 0, 0,
+			       SKF_AD_OFF + SKF_AD_L4OFF); }
 	| OP_LD 'M' '[' number ']' {
 		set_curr_instr(BPF_LD | BPF_MEM, 0, 0, $4); }
 	| OP_LD '[' 'x' '+' number ']' {
@@ -584,6 +641,9 @@ static void stage_2_label_reduce(void)
 	for (i = 0; i < max; ++i) {
 		if (labels_jt[i] != NULL) {
 			off = find_intr_offset_or_panic(labels_jt[i]);
+			if (off - i - 1 < 0 || off - i - 1 > 255)
+				panic("Jump to %s out of range!\n",
+				      labels_jt[i]);
 			out[i].jt = (uint8_t) (off - i -1);
 		}
 	}
@@ -592,14 +652,19 @@ static void stage_2_label_reduce(void)
 	for (i = 0; i < max; ++i) {
 		if (labels_jf[i] != NULL) {
 			off = find_intr_offset_or_panic(labels_jf[i]);
+			if (off - i - 1 < 0 || off - i - 1 > 255)
+				panic("Jump to %s out of range!\n",
+				      labels_jf[i]);
 			out[i].jf = (uint8_t) (off - i - 1);
 		}
 	}
 }
 
-int compile_filter(char *file, int verbose, int bypass)
+int compile_filter(char *file, int verbose, int bypass, int optimize,
+		   int ebpf)
 {
 	int i;
+	unsigned short len;
 	struct sock_fprog res;
 
 	if (!strncmp("-", file, strlen("-")))
@@ -644,12 +709,33 @@ int compile_filter(char *file, int verbose, int bypass)
 		}
 	}
 
+	if (optimize) {
+		len = res.len;
+		bpf_optimize(&res);
+
+		if (verbose) {
+			printf("Optimized program:\n");
+			bpf_dump_all(&res);
+		}
+
+		fprintf(stderr, "Optimized %u to %u instructions\n",
+			len, res.len);
+	}
+
+	if (ebpf) {
+		print_ebpf(&res, verbose);
+		goto out;
+	}
+
 	if (verbose)
 		printf("Result:\n");
-	for (i = 0; i < res.len; ++i) {
+	for (i = 0; i < res.len; ++i)
 		printf("{ 0x%x, %u, %u, 0x%08x },\n",
 		       res.filter[i].code, res.filter[i].jt,
 		       res.filter[i].jf, res.filter[i].k);
+
+out:
+	for (i = 0; i < curr_instr; ++i) {
 		if (labels[i] != NULL)
 			xfree(labels[i]);
 		if (labels_jt[i] != NULL)
@@ -21,23 +21,75 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <getopt.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/fsuid.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "xmalloc.h"
 #include "xutils.h"
 #include "die.h"
 #include "bpf.h"
+#include "pcap.h"
 
-static const char *short_options = "vhi:VdbHLg";
+/* Run the trace as often as needed to see this many packets */
+#define BENCH_MIN_PKTS		(10 * 1000 * 1000UL)
+/* Differing verdicts of two programs that are listed */
+#define BENCH_MAX_DIFFS		10
+/* Random programs of the JIT self test and what they run on */
+#define SELFTEST_MAX_INSNS	64
+#define SELFTEST_MAX_PKTLEN	128
+#define SELFTEST_PKTS		50
+
+struct bench_pkt {
+	uint8_t *data;
+	uint32_t len;
+};
+
+/* Everything the interpreter knows, bar the final return */
+static const uint16_t selftest_ops[] = {
+	BPF_LD | BPF_W | BPF_ABS, BPF_LD | BPF_H | BPF_ABS,
+	BPF_LD | BPF_B | BPF_ABS, BPF_LD | BPF_W | BPF_IND,
+	BPF_LD | BPF_H | BPF_IND, BPF_LD | BPF_B | BPF_IND,
+	BPF_LD | BPF_W | BPF_LEN, BPF_LDX | BPF_W | BPF_LEN,
+	BPF_LDX | BPF_B | BPF_MSH, BPF_LD | BPF_IMM, BPF_LDX | BPF_IMM,
+	BPF_LD | BPF_MEM, BPF_LDX | BPF_MEM, BPF_ST, BPF_STX,
+	BPF_JMP | BPF_JA, BPF_JMP | BPF_JGT | BPF_K,
+	BPF_JMP | BPF_JGE | BPF_K, BPF_JMP | BPF_JEQ | BPF_K,
+	BPF_JMP | BPF_JSET | BPF_K, BPF_JMP | BPF_JGT | BPF_X,
+	BPF_JMP | BPF_JGE | BPF_X, BPF_JMP | BPF_JEQ | BPF_X,
+	BPF_JMP | BPF_JSET | BPF_X, BPF_ALU | BPF_ADD | BPF_K,
+	BPF_ALU | BPF_SUB | BPF_K, BPF_ALU | BPF_MUL | BPF_K,
+	BPF_ALU | BPF_DIV | BPF_K, BPF_ALU | BPF_MOD | BPF_K,
+	BPF_ALU | BPF_AND | BPF_K, BPF_ALU | BPF_OR | BPF_K,
+	BPF_ALU | BPF_XOR | BPF_K, BPF_ALU | BPF_LSH | BPF_K,
+	BPF_ALU | BPF_RSH | BPF_K, BPF_ALU | BPF_ADD | BPF_X,
+	BPF_ALU | BPF_SUB | BPF_X, BPF_ALU | BPF_MUL | BPF_X,
+	BPF_ALU | BPF_DIV | BPF_X, BPF_ALU | BPF_MOD | BPF_X,
+	BPF_ALU | BPF_AND | BPF_X, BPF_ALU | BPF_OR | BPF_X,
+	BPF_ALU | BPF_XOR | BPF_X, BPF_ALU | BPF_LSH | BPF_X,
+	BPF_ALU | BPF_RSH | BPF_X, BPF_ALU | BPF_NEG,
+	BPF_MISC | BPF_TAX, BPF_MISC | BPF_TXA,
+};
+
+static const char *short_options = "vhi:VdbHLgOeB:c:S:";
 static const struct option long_options[] = {
 	{"input",	required_argument,	NULL, 'i'},
 	{"verbose",	no_argument,		NULL, 'V'},
 	{"hla",		no_argument,		NULL, 'H'},
 	{"lla",		no_argument,		NULL, 'L'},
 	{"hla-debug",	no_argument,		NULL, 'g'},
+	{"optimize",	no_argument,		NULL, 'O'},
+	{"ebpf",	no_argument,		NULL, 'e'},
+	{"bench",	required_argument,	NULL, 'B'},
+	{"compare",	required_argument,	NULL, 'c'},
+	{"selftest",	required_argument,	NULL, 'S'},
 	{"bypass",	no_argument,		NULL, 'b'},
 	{"dump",	no_argument,		NULL, 'd'},
 	{"version",	no_argument,		NULL, 'v'},
@@ -45,8 +97,9 @@ static const struct option long_options[] = {
 	{NULL, 0, NULL, 0}
 };
 
-extern int compile_filter(char *file, int verbose, int bypass);
-extern int compile_hla_filter(char *file, int verbose, int debug);
+extern int compile_filter(char *file, int verbose, int bypass,
+			  int optimize, int ebpf);
+extern int compile_hla_filter(char *file, char *out, int verbose, int debug);
 
 static void help(void)
 {
@@ -60,7 +113,15 @@ static void help(void)
 	     "  -V|--verbose           Be more verbose\n"
 	     "  -b|--bypass            Bypass filter validation (e.g. for bug testing)\n"
 	     "  -g|--hla-debug         Print BPF expressions to stdout\n"
+	     "  -O|--optimize          Optimize the generated program\n"
+	     "  -e|--ebpf              Emit an eBPF socket filter instead\n"
 	     "  -d|--dump              Dump supported instruction table\n"
+	     "  -B|--bench <pcap>      Run compiled program over pcap, interpreted\n"
+	     "                         and JIT compiled, with profile\n"
+	     "  -c|--compare <program> With -B, check that a second compiled\n"
+	     "                         program has the same verdicts\n"
+	     "  -S|--selftest <num>    Check JIT against interpreter on num\n"
+	     "                         random programs\n"
 	     "  -v|--version           Print version\n"
 	     "  -h|--help              Print this help\n\n"
 	     "Examples:\n"
@@ -68,7 +129,12 @@ static void help(void)
 	     "  bpfc -Hgi fubar\n"
 	     "  bpfc -Li fubar\n"
 	     "  bpfc -Lbi fubar\n"
-	     "  bpfc -Li -    (read from stdin)\n\n"
+	     "  bpfc -HOi fubar\n"
+	     "  bpfc -LeVi fubar\n"
+	     "  bpfc -Li -    (read from stdin)\n"
+	     "  bpfc -Li fubar > fubar.bpf && bpfc -B trace.pcap -i fubar.bpf\n"
+	     "  bpfc -B trace.pcap -i fubar.bpf -c fubar-opt.bpf\n"
+	     "  bpfc -S 100000\n\n"
 	     "Please report bugs to <bugs@netsniff-ng.org>\n"
 	     "Copyright (C) 2011-2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>,\n"
 	     "Swiss federal institute of technology (ETH Zurich)\n"
@@ -91,10 +157,347 @@ static void version(void)
 	die();
 }
 
+static struct bench_pkt *bench_load(const char *trace, uint8_t **map,
+				    size_t *map_len, unsigned long *num)
+{
+	int fd;
+	size_t off, max = 1024;
+	struct stat sb;
+	struct pcap_pkthdr *phdr;
+	struct bench_pkt *pkts;
+
+	fd = open(trace, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) ||
+	    sb.st_size < sizeof(struct pcap_filehdr))
+		panic("Cannot read pcap %s!\n", trace);
+
+	*map_len = sb.st_size;
+	*map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+		    fd, 0);
+	if (*map == MAP_FAILED)
+		panic("mmap of file failed!\n");
+	close(fd);
+
+	pcap_validate_header((struct pcap_filehdr *) *map);
+
+	pkts = xmalloc(max * sizeof(*pkts));
+	*num = 0;
+
+	for (off = sizeof(struct pcap_filehdr);
+	     off + sizeof(*phdr) <= *map_len;
+	     off += sizeof(*phdr) + phdr->caplen) {
+		phdr = (struct pcap_pkthdr *) (*map + off);
+		if (off + sizeof(*phdr) + phdr->caplen > *map_len)
+			break;
+
+		if (*num == max) {
+			max <<= 1;
+			pkts = xrealloc(pkts, max, sizeof(*pkts));
+		}
+
+		pkts[*num].data = (uint8_t *) (phdr + 1);
+		pkts[*num].len = phdr->caplen;
+		(*num)++;
+	}
+
+	if (*num == 0)
+		panic("No packets in %s!\n", trace);
+
+	return pkts;
+}
+
+static inline uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Verdicts go into res, so the compiler cannot throw the loop away */
+static double bench_run(const struct bpf_jit *jit, struct bench_pkt *pkts,
+			unsigned long num, unsigned long rounds,
+			uint32_t *res)
+{
+	unsigned long i, r;
+	uint64_t start = bench_now();
+
+	for (r = 0; r < rounds; ++r) {
+		for (i = 0; i < num; ++i)
+			res[i] = bpf_jit_run(jit, pkts[i].data, pkts[i].len);
+	}
+
+	return (double) (bench_now() - start) / (num * rounds);
+}
+
+/*
+ * One round through the interpreter, counting how often every instruction
+ * runs and how many instructions every packet takes.
+ */
+static void bench_profile(struct sock_fprog *bpf, struct bench_pkt *pkts,
+			  unsigned long num)
+{
+	unsigned long i, n, *hits, *path;
+	unsigned long min = ULONG_MAX, max = 0;
+
+	hits = xzmalloc((bpf->len + 1) * sizeof(*hits));
+	/* Jumps only go forward, so no packet runs more than len */
+	path = xzmalloc((bpf->len + 1) * sizeof(*path));
+
+	for (i = 0; i < num; ++i) {
+		n = hits[bpf->len];
+		bpf_run_filter_profile(bpf, pkts[i].data, pkts[i].len, hits);
+		n = hits[bpf->len] - n;
+
+		path[n]++;
+		min = min(min, n);
+		max = max(max, n);
+	}
+
+	printf("%.2f instructions/pkt (min %lu, max %lu)\n",
+	       (double) hits[bpf->len] / num, min, max);
+	for (n = 0; n <= bpf->len; ++n) {
+		if (path[n])
+			printf("%10lu %6.1f%% %lu instructions\n", path[n],
+			       100.0 * path[n] / num, n);
+	}
+
+	printf("Executed instructions:\n");
+	bpf_dump_profile(bpf, hits, num);
+
+	xfree(path);
+	xfree(hits);
+}
+
+static int bench_filter(char *file, char *trace, char *cmp)
+{
+	uint8_t *map;
+	size_t map_len;
+	uint32_t *res_int, *res_jit, *res_cmp = NULL;
+	unsigned long i, num, rounds, accepted = 0, diff = 0, diff_cmp = 0;
+	unsigned long listed;
+	double ns_int, ns_jit, ns_cmp = 0;
+	struct sock_fprog bpf, bpf_cmp;
+	struct bpf_jit jit, interp, jit_cmp;
+	struct bench_pkt *pkts;
+
+	fmemset(&bpf, 0, sizeof(bpf));
+	bpf_parse_rules(file, &bpf);
+
+	pkts = bench_load(trace, &map, &map_len, &num);
+	rounds = (BENCH_MIN_PKTS + num - 1) / num;
+
+	res_int = xmalloc(num * sizeof(*res_int));
+	res_jit = xmalloc(num * sizeof(*res_jit));
+
+	/* An interpreting handle is one without native code */
+	fmemset(&interp, 0, sizeof(interp));
+	interp.bpf = &bpf;
+
+	if (bpf_jit_compile(&bpf, &jit))
+		whine("No JIT for this program or architecture!\n");
+
+	ns_int = bench_run(&interp, pkts, num, rounds, res_int);
+	ns_jit = bench_run(&jit, pkts, num, rounds, res_jit);
+
+	if (cmp) {
+		fmemset(&bpf_cmp, 0, sizeof(bpf_cmp));
+		bpf_parse_rules(cmp, &bpf_cmp);
+
+		res_cmp = xmalloc(num * sizeof(*res_cmp));
+		if (bpf_jit_compile(&bpf_cmp, &jit_cmp))
+			whine("No JIT for %s!\n", cmp);
+
+		ns_cmp = bench_run(&jit_cmp, pkts, num, rounds, res_cmp);
+	}
+
+	for (i = 0; i < num; ++i) {
+		accepted += !!res_int[i];
+		diff += res_int[i] != res_jit[i];
+		if (cmp)
+			diff_cmp += res_int[i] != res_cmp[i];
+	}
+
+	printf("%lu packets, %u instructions, %zu bytes native code\n",
+	       num, bpf.len, jit.size);
+	printf("%lu packets accepted (%.2f%%), %lu rounds\n", accepted,
+	       100.0 * accepted / num, rounds);
+	printf("interpreter %8.2f ns/pkt\n", ns_int);
+	printf("jit         %8.2f ns/pkt (%.1fx)\n", ns_jit, ns_int / ns_jit);
+	printf("%lu verdicts differ\n", diff);
+
+	bench_profile(&bpf, pkts, num);
+
+	if (cmp) {
+		printf("%s: %u instructions, jit %8.2f ns/pkt (%.0f%%)\n",
+		       cmp, bpf_cmp.len, ns_cmp, 100.0 * ns_cmp / ns_jit);
+		printf("%lu verdicts differ from %s\n", diff_cmp, cmp);
+
+		for (i = 0, listed = 0; i < num && listed < BENCH_MAX_DIFFS;
+		     ++i) {
+			if (res_int[i] == res_cmp[i])
+				continue;
+			printf("packet %lu: %u vs. %u\n", i + 1, res_int[i],
+			       res_cmp[i]);
+			listed++;
+		}
+
+		bpf_jit_release(&jit_cmp);
+		bpf_release(&bpf_cmp);
+		xfree(res_cmp);
+	}
+
+	bpf_jit_release(&jit);
+	bpf_release(&bpf);
+
+	xfree(res_int);
+	xfree(res_jit);
+	xfree(pkts);
+	munmap(map, map_len);
+
+	return diff || diff_cmp ? 1 : 0;
+}
+
+static inline uint32_t selftest_rand(void)
+{
+	return ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+}
+
+/* Mostly offsets into the packet, some at and beyond its end */
+static uint32_t selftest_off(void)
+{
+	static const uint32_t edges[] = {
+		0x7ffffffb, 0x7ffffffc, 0x7fffffff, 0x80000000,
+		0xfffff000, 0xfffffffc, 0xffffffff,
+	};
+
+	if (rand() % 8)
+		return rand() % (SELFTEST_MAX_PKTLEN + 8);
+
+	return edges[rand() % array_size(edges)];
+}
+
+static void selftest_gen(struct sock_fprog *bpf)
+{
+	uint32_t i, left;
+	struct sock_filter *f;
+
+	bpf->len = 1 + rand() % SELFTEST_MAX_INSNS;
+
+	for (i = 0; i < bpf->len - 1; ++i) {
+		f = &bpf->filter[i];
+		/* Jumps must end on an instruction, the last one at most */
+		left = bpf->len - 2 - i;
+
+		f->code = selftest_ops[rand() % array_size(selftest_ops)];
+		f->jt = f->jf = 0;
+		f->k = selftest_rand();
+
+		switch (BPF_CLASS(f->code)) {
+		case BPF_LD:
+		case BPF_LDX:
+			if (BPF_MODE(f->code) == BPF_MEM)
+				f->k %= BPF_MEMWORDS;
+			else if (BPF_MODE(f->code) != BPF_IMM)
+				f->k = selftest_off();
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			f->k %= BPF_MEMWORDS;
+			break;
+		case BPF_JMP:
+			if (BPF_OP(f->code) == BPF_JA) {
+				f->k = rand() % (left + 1);
+				break;
+			}
+			f->jt = rand() % (min(left, 255U) + 1);
+			f->jf = rand() % (min(left, 255U) + 1);
+			/* Give the compare a chance to go both ways */
+			if (rand() % 2)
+				f->k %= 4;
+			break;
+		case BPF_ALU:
+			if (BPF_OP(f->code) == BPF_LSH ||
+			    BPF_OP(f->code) == BPF_RSH)
+				f->k %= 32;
+			else if ((BPF_OP(f->code) == BPF_DIV ||
+				  BPF_OP(f->code) == BPF_MOD) && f->k == 0)
+				f->k = 1;
+			break;
+		}
+	}
+
+	f = &bpf->filter[bpf->len - 1];
+	f->code = BPF_RET | (rand() % 2 ? BPF_A : BPF_K);
+	f->jt = f->jf = 0;
+	f->k = selftest_rand();
+}
+
+/*
+ * Runs random programs through interpreter and JIT and stops at the
+ * first verdict they disagree on, with program and packet to repeat it.
+ */
+static int selftest_jit(unsigned long progs)
+{
+	uint8_t pkt[SELFTEST_MAX_PKTLEN];
+	uint32_t len, res_int, res_jit;
+	unsigned long i, j, k, runs = 0;
+	unsigned int seed = time(NULL);
+	struct sock_filter insns[SELFTEST_MAX_INSNS];
+	struct sock_fprog bpf = { .filter = insns };
+	struct bpf_jit jit;
+
+	srand(seed);
+	printf("JIT self test, seed %u\n", seed);
+
+	for (i = 0; i < progs; ++i) {
+		selftest_gen(&bpf);
+		if (!bpf_validate(&bpf))
+			panic("Generated an invalid program!\n");
+		if (bpf_jit_compile(&bpf, &jit)) {
+			whine("No JIT for this architecture!\n");
+			return 1;
+		}
+
+		for (j = 0; j < SELFTEST_PKTS; ++j) {
+			len = rand() % (SELFTEST_MAX_PKTLEN + 1);
+			for (k = 0; k < len; ++k)
+				pkt[k] = rand();
+
+			res_int = bpf_run_filter(&bpf, pkt, len);
+			res_jit = bpf_jit_run(&jit, pkt, len);
+			runs++;
+
+			if (res_int == res_jit)
+				continue;
+
+			printf("Program %lu, %u byte packet: interpreter "
+			       "%u vs. jit %u\n", i + 1, len, res_int,
+			       res_jit);
+			bpf_dump_all(&bpf);
+			for (k = 0; k < len; ++k)
+				printf("%02x%s", pkt[k],
+				       (k + 1) % 16 && k + 1 < len ? " " : "\n");
+
+			bpf_jit_release(&jit);
+			return 1;
+		}
+
+		bpf_jit_release(&jit);
+	}
+
+	printf("%lu programs, %lu runs, no verdict differs\n", progs, runs);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int ret, verbose = 0, c, opt_index, bypass = 0, hla = 0, debug = 0;
-	char *file = NULL;
+	int optimize = 0, ebpf = 0;
+	char *file = NULL, *trace = NULL, *cmp = NULL;
+	unsigned long selftest = 0;
 
 	setfsuid(getuid());
 	setfsgid(getgid());
@@ -123,6 +526,12 @@ int main(int argc, char **argv)
 		case 'V':
 			verbose = 1;
 			break;
+		case 'O':
+			optimize = 1;
+			break;
+		case 'e':
+			ebpf = 1;
+			break;
 		case 'b':
 			bypass = 1;
 			break;
@@ -132,9 +541,23 @@ int main(int argc, char **argv)
 		case 'i':
 			file = xstrdup(optarg);
 			break;
+		case 'B':
+			trace = xstrdup(optarg);
+			break;
+		case 'c':
+			cmp = xstrdup(optarg);
+			break;
+		case 'S':
+			selftest = strtoul(optarg, NULL, 0);
+			if (selftest == 0)
+				panic("Self test needs a number of programs!\n");
+			break;
 		case '?':
 			switch (optopt) {
 			case 'i':
+			case 'B':
+			case 'c':
+			case 'S':
 				panic("Option -%c requires an argument!\n",
 				      optopt);
 			default:
@@ -150,20 +573,41 @@ int main(int argc, char **argv)
 	if (argc == 2)
 		file = xstrdup(argv[1]);
 
+	if (selftest)
+		return selftest_jit(selftest);
+
 	if (!file)
 		panic("No Berkeley Packet Filter program specified!\n");
 
-	if (hla) {
-		ret = compile_hla_filter(file, verbose, debug);
-		if (!ret) {
-			char file_tmp[128];
+	if (cmp && !trace)
+		panic("Comparing programs needs a pcap to run them on (-B)!\n");
 
+	if (trace) {
+		ret = bench_filter(file, trace, cmp);
+		xfree(trace);
+		if (cmp)
+			xfree(cmp);
+	} else if (hla) {
+		char file_tmp[PATH_MAX];
+		char *base = strrchr(file, '/');
+
+		/* Low-level code goes next to the source as a dot file */
+		if (base)
+			slprintf(file_tmp, sizeof(file_tmp), "%.*s.%s",
+				 (int) (base - file + 1), file, base + 1);
+		else
 			slprintf(file_tmp, sizeof(file_tmp), ".%s", file);
-			ret = compile_filter(file_tmp, verbose, bypass);
+
+		ret = compile_hla_filter(file, file_tmp, verbose, debug);
+		if (!ret) {
+			/* Generated code leaves a lot to the optimizer */
+			ret = compile_filter(file_tmp, verbose, bypass, 1,
+					     ebpf);
 			unlink(file_tmp);
 		}
 	} else {
-		ret = compile_filter(file, verbose, bypass);
+		ret = compile_filter(file, verbose, bypass, optimize,
+				     ebpf);
 	}
 
 	xfree(file);
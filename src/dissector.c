@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 
 #include "built_in.h"
@@ -17,30 +18,102 @@
 #include "dissector.h"
 #include "dissector_eth.h"
 #include "dissector_80211.h"
+#include "xmalloc.h"
 
-int dissector_set_print_type(void *ptr, int type)
+/* Odd multipliers with well mixed upper bits, tried in this order */
+static const uint32_t proto_table_mults[] = {
+	0x9e3779b1, 0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f,
+	0x165667b1, 0xcc9e2d51, 0x1b873593, 0xe6546b64,
+};
+
+void dissector_set_print_type(struct protocol *proto, int type)
 {
-	struct protocol *proto;
+	switch (type) {
+	case PRINT_NORM:
+		proto->process = proto->print_full;
+		break;
+	case PRINT_LESS:
+		proto->process = proto->print_less;
+		break;
+	case PRINT_JSON:
+	case PRINT_BIN:
+		proto->process = proto->print_struct;
+		break;
+	case PRINT_HEX:
+	case PRINT_ASCII:
+	case PRINT_HEX_ASCII:
+	case PRINT_NONE:
+	default:
+		proto->process = NULL;
+		break;
+	}
+}
 
-	for (proto = (struct protocol *) ptr; proto; proto = proto->next) {
-		switch (type) {
-		case PRINT_NORM:
-			proto->process = proto->print_full;
-			break;
-		case PRINT_LESS:
-			proto->process = proto->print_less;
-			break;
-		case PRINT_HEX:
-		case PRINT_ASCII:
-		case PRINT_HEX_ASCII:
-		case PRINT_NONE:
-		default:
-			proto->process = NULL;
-			break;
+static bool dissector_fill_table(struct proto_table *table, unsigned int bits,
+				 uint32_t mult, struct protocol **protos,
+				 size_t num)
+{
+	size_t i;
+	struct protocol **slot;
+
+	table->slots = xzmalloc((1UL << bits) * sizeof(*table->slots));
+	table->mult = mult;
+	table->shift = 32 - bits;
+
+	for (i = 0; i < num; ++i) {
+		slot = &table->slots[proto_table_slot(table, protos[i]->key)];
+		if (*slot) {
+			xfree(table->slots);
+			return false;
 		}
+		*slot = protos[i];
 	}
 
-	return 0;
+	return true;
+}
+
+/*
+ * Keys of up to 8 bit, like IP protocol numbers, index the table
+ * directly. For wider ones, like ethertypes, the smallest table is used
+ * where one of the multipliers above spreads the keys without collision.
+ */
+void dissector_init_table(struct proto_table *table, struct protocol **protos,
+			  size_t num, unsigned int key_bits, int type)
+{
+	size_t i;
+	unsigned int bits = key_bits;
+
+	bug_on(key_bits == 0 || key_bits > 16);
+
+	for (i = 0; i < num; ++i) {
+		bug_on(protos[i]->key >> key_bits);
+		dissector_set_print_type(protos[i], type);
+	}
+
+	if (key_bits > 8) {
+		for (bits = 1; (1UL << bits) < num; bits++)
+			;
+	}
+
+	for (; bits < key_bits; bits++) {
+		for (i = 0; i < array_size(proto_table_mults); ++i) {
+			if (dissector_fill_table(table, bits,
+						 proto_table_mults[i],
+						 protos, num))
+				return;
+		}
+	}
+
+	/* Maps each key onto itself, so only a duplicate key collides */
+	if (!dissector_fill_table(table, key_bits, 1U << (32 - key_bits),
+				  protos, num))
+		panic("Protocol registered twice in dissector table!\n");
+}
+
+void dissector_cleanup_table(struct proto_table *table)
+{
+	if (table->slots)
+		xfree(table->slots);
 }
 
 static void dissector_main(struct pkt_buff *pkt, struct protocol *start,
@@ -68,12 +141,12 @@ void dissector_entry_point(uint8_t *packet, size_t len, int linktype, int mode)
 {
 	struct protocol *proto_start = NULL;
 	struct protocol *proto_end = NULL;
-	struct pkt_buff *pkt = NULL;
+	struct pkt_buff pkt;
 
 	if (mode == PRINT_NONE)
 		return;
 
-	pkt = pkt_alloc(packet, len);
+	pkt_init(&pkt, packet, len);
 
 	switch (linktype) {
 	case LINKTYPE_EN10MB:
@@ -88,26 +161,32 @@ void dissector_entry_point(uint8_t *packet, size_t len, int linktype, int mode)
 		panic("Linktype not supported!\n");
 	};
 
-	dissector_main(pkt, proto_start, proto_end);
+	dissector_main(&pkt, proto_start, proto_end);
 
 	switch (mode) {
 	case PRINT_HEX:
-		hex(pkt);
+		hex(&pkt);
 		break;
 	case PRINT_ASCII:
-		ascii(pkt);
+		ascii(&pkt);
 		break;
 	case PRINT_HEX_ASCII:
-		hex_ascii(pkt);
+		hex_ascii(&pkt);
+		break;
+	case PRINT_JSON:
+	case PRINT_BIN:
+		record_end();
 		break;
 	}
 
-	tprintf_flush();
-	pkt_free(pkt);
+	tprintf_flush_lazy();
 }
 
 void dissector_init_all(int fnttype)
 {
+	if (print_mode_is_struct(fnttype))
+		record_init(fnttype == PRINT_JSON ? RECORD_JSON : RECORD_BIN);
+
 	dissector_init_ethernet(fnttype);
 	dissector_init_ieee80211(fnttype);
 }
@@ -10,8 +10,11 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "ring.h"
+#include "proto.h"
+#include "record.h"
 #include "tprintf.h"
 
 #define LINKTYPE_NULL       	0	/* BSD loopback encapsulation */
@@ -33,11 +36,22 @@
 #define PRINT_ASCII	3
 #define PRINT_HEX_ASCII 4
 #define PRINT_NONE	5
+#define PRINT_JSON	6
+#define PRINT_BIN	7
+
+static inline bool print_mode_is_struct(int mode)
+{
+	return mode == PRINT_JSON || mode == PRINT_BIN;
+}
 
 extern void dissector_init_all(int fnttype);
 extern void dissector_entry_point(uint8_t *packet, size_t len, int linktype, int mode);
 extern void dissector_cleanup_all(void);
-extern int dissector_set_print_type(void *ptr, int type);
+extern void dissector_set_print_type(struct protocol *proto, int type);
+extern void dissector_init_table(struct proto_table *table,
+				 struct protocol **protos, size_t num,
+				 unsigned int key_bits, int type);
+extern void dissector_cleanup_table(struct proto_table *table);
 
 static char *packet_types[]={
 	"<", /* Incoming */
@@ -48,20 +62,26 @@ static char *packet_types[]={
 	"?", /* Unknown */
 };
 
-static inline void show_frame_hdr(struct frame_map *hdr, int mode,
-				  enum ring_mode rmode)
+static inline void __show_frame_hdr(struct sockaddr_ll *s_ll, uint32_t len,
+				    uint32_t sec, uint32_t nsec, int mode,
+				    enum ring_mode rmode)
 {
 	if (mode == PRINT_NONE)
 		return;
 
 	switch (mode) {
+	case PRINT_JSON:
+	case PRINT_BIN:
+		record_begin(sec, nsec, len,
+			     rmode == RING_MODE_INGRESS ? s_ll : NULL);
+		break;
 	case PRINT_LESS:
 		if (rmode == RING_MODE_INGRESS) {
 			tprintf("%s %d %u",
-				packet_types[hdr->s_ll.sll_pkttype],
-				hdr->s_ll.sll_ifindex, hdr->tp_h.tp_len);
+				packet_types[s_ll->sll_pkttype],
+				s_ll->sll_ifindex, len);
 		} else {
-			tprintf("%u ", hdr->tp_h.tp_len);
+			tprintf("%u ", len);
 		}
 		break;
 	case PRINT_NORM:
@@ -71,15 +91,27 @@ static inline void show_frame_hdr(struct frame_map *hdr, int mode,
 	default:
 		if (rmode == RING_MODE_INGRESS) {
 			tprintf("%s %d %u %us.%uns\n",
-				packet_types[hdr->s_ll.sll_pkttype],
-				hdr->s_ll.sll_ifindex, hdr->tp_h.tp_len,
-				hdr->tp_h.tp_sec, hdr->tp_h.tp_nsec);
+				packet_types[s_ll->sll_pkttype],
+				s_ll->sll_ifindex, len, sec, nsec);
 		} else {
-			tprintf("%u %us.%uns\n", hdr->tp_h.tp_len,
-				hdr->tp_h.tp_sec, hdr->tp_h.tp_nsec);
+			tprintf("%u %us.%uns\n", len, sec, nsec);
 		}
 		break;
 	}
 }
 
+static inline void show_frame_hdr(struct frame_map *hdr, int mode,
+				  enum ring_mode rmode)
+{
+	__show_frame_hdr(&hdr->s_ll, hdr->tp_h.tp_len, hdr->tp_h.tp_sec,
+			 hdr->tp_h.tp_nsec, mode, rmode);
+}
+
+static inline void show_frame_hdr_v3(struct frame_map_v3 *hdr, int mode,
+				     enum ring_mode rmode)
+{
+	__show_frame_hdr(&hdr->s_ll, hdr->tp_h.tp_len, hdr->tp_h.tp_sec,
+			 hdr->tp_h.tp_nsec, mode, rmode);
+}
+
 #endif /* DISSECTOR_H */
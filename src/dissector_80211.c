@@ -7,7 +7,6 @@
 
 #include <stdint.h>
 
-#include "hash.h"
 #include "protos.h"
 #include "pkt_buff.h"
 #include "dissector.h"
@@ -15,7 +14,7 @@
 #include "xmalloc.h"
 #include "oui.h"
 
-struct hash_table ieee80211_lay2;
+struct proto_table ieee80211_lay2;
 
 #ifdef __WITH_PROTOS
 static inline void dissector_init_entry(int type)
@@ -30,9 +29,8 @@ static inline void dissector_init_exit(int type)
 
 static void dissector_init_layer_2(int type)
 {
-	init_hash(&ieee80211_lay2);
-//	INSERT_HASH_PROTOS(blubber_ops, ieee80211_lay2);
-	for_each_hash_int(&ieee80211_lay2, dissector_set_print_type, type);
+	/* Nothing is dissected on top of 802.11 yet */
+	dissector_init_table(&ieee80211_lay2, NULL, 0, 16, type);
 }
 #else
 static inline void dissector_init_entry(int type) {}
@@ -50,6 +48,6 @@ void dissector_init_ieee80211(int fnttype)
 
 void dissector_cleanup_ieee80211(void)
 {
-	free_hash(&ieee80211_lay2);
+	dissector_cleanup_table(&ieee80211_lay2);
 	dissector_cleanup_oui();
 }
@@ -15,7 +15,7 @@
 #include "xutils.h"
 #include "oui.h"
 
-extern struct hash_table ieee80211_lay2;
+extern struct proto_table ieee80211_lay2;
 
 extern void dissector_init_ieee80211(int fnttype);
 extern void dissector_cleanup_ieee80211(void);
@@ -15,8 +15,8 @@
 #include "xutils.h"
 #include "oui.h"
 
-extern struct hash_table eth_lay2;
-extern struct hash_table eth_lay3;
+extern struct proto_table eth_lay2;
+extern struct proto_table eth_lay3;
 
 extern void dissector_init_ethernet(int fnttype);
 extern void dissector_cleanup_ethernet(void);
@@ -0,0 +1,444 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ *
+ * Flow accounting on the capture side. Instead of printing every packet,
+ * packets are counted into flows, and a flow is printed once it ends:
+ * after it has been idle for a while, after it has been active for too
+ * long (it goes on as a new flow then) or when the capture stops.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+
+#include "flow.h"
+#include "dissector.h"
+#include "record.h"
+#include "tprintf.h"
+#include "xmalloc.h"
+#include "built_in.h"
+
+#define FLOW_NSEC_PER_SEC	1000000000ULL
+#define FLOW_NSEC_PER_MSEC	1000000ULL
+
+/* Extension headers to walk through before giving up on an IPv6 packet */
+#define FLOW_IPV6_EXT_MAX	8
+
+static const char *flow_end_names[] = {
+	[FLOW_END_IDLE]		= "idle",
+	[FLOW_END_ACTIVE]	= "active",
+	[FLOW_END_EXIT]		= "exit",
+};
+
+static inline uint16_t flow_be16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static inline uint64_t flow_mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * FLOW_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static bool flow_parse(const uint8_t *pkt, uint32_t len, struct flow_key *key,
+		       uint8_t *tcp_flags)
+{
+	const uint8_t *end = pkt + len;
+	size_t hlen;
+	uint16_t type;
+	uint8_t proto;
+	int i;
+
+	fmemset(key, 0, sizeof(*key));
+
+	if (len < ETH_HLEN)
+		return false;
+
+	type = flow_be16(pkt + 12);
+	pkt += ETH_HLEN;
+
+	while (type == ETH_P_8021Q || type == ETH_P_8021AD ||
+	       type == ETH_P_QINQ1) {
+		if (end - pkt < 4)
+			return false;
+		/* The outer tag is the one the switch port is about */
+		if (key->vlan == 0)
+			key->vlan = flow_be16(pkt) & 0x0FFF;
+		type = flow_be16(pkt + 2);
+		pkt += 4;
+	}
+
+	switch (type) {
+	case ETH_P_IP:
+		if (end - pkt < 20)
+			return false;
+		hlen = (pkt[0] & 0x0F) * 4;
+		if (hlen < 20 || end - pkt < hlen)
+			return false;
+
+		key->family = 4;
+		memcpy(key->saddr, pkt + 12, 4);
+		memcpy(key->daddr, pkt + 16, 4);
+		proto = pkt[9];
+
+		/* Only the first fragment has the ports */
+		if (flow_be16(pkt + 6) & 0x1FFF) {
+			key->proto = proto;
+			return true;
+		}
+
+		pkt += hlen;
+		break;
+	case ETH_P_IPV6:
+		if (end - pkt < 40)
+			return false;
+
+		key->family = 6;
+		memcpy(key->saddr, pkt + 8, 16);
+		memcpy(key->daddr, pkt + 24, 16);
+		proto = pkt[6];
+		pkt += 40;
+
+		for (i = 0; i < FLOW_IPV6_EXT_MAX && end - pkt >= 8; ++i) {
+			switch (proto) {
+			case IPPROTO_HOPOPTS:
+			case IPPROTO_ROUTING:
+			case IPPROTO_DSTOPTS:
+				hlen = (pkt[1] + 1) * 8;
+				break;
+			case IPPROTO_AH:
+				hlen = (pkt[1] + 2) * 4;
+				break;
+			case IPPROTO_FRAGMENT:
+				if (flow_be16(pkt + 2) & 0xFFF8) {
+					key->proto = pkt[0];
+					return true;
+				}
+				hlen = 8;
+				break;
+			default:
+				goto l4;
+			}
+
+			if (end - pkt < hlen)
+				break;
+
+			proto = pkt[0];
+			pkt += hlen;
+		}
+		break;
+	default:
+		return false;
+	}
+l4:
+	key->proto = proto;
+
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (end - pkt >= 14)
+			*tcp_flags = pkt[13];
+		/* fall through */
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+		if (end - pkt >= 4) {
+			key->sport = flow_be16(pkt);
+			key->dport = flow_be16(pkt + 2);
+		}
+		break;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		if (end - pkt >= 2)
+			key->dport = flow_be16(pkt);
+		break;
+	}
+
+	return true;
+}
+
+static inline uint32_t flow_hash(const struct flow_key *key)
+{
+	uint64_t w[sizeof(*key) / sizeof(uint64_t)], h = 0x9E3779B97F4A7C15ULL;
+	unsigned int i;
+
+	/* The key has no tail beyond full words, see struct flow_key */
+	memcpy(w, key, sizeof(w));
+	for (i = 0; i < array_size(w); ++i) {
+		h = (h ^ w[i]) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+
+	/* 0 is taken for free slots */
+	return (uint32_t) h ? : 1;
+}
+
+static void flow_export(struct flow_table *t, const struct flow_entry *e,
+			enum flow_end why)
+{
+	char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+	int family = e->key.family == 4 ? AF_INET : AF_INET6;
+	uint64_t dur = e->last - e->first;
+
+	t->exported++;
+
+	if (t->print_mode == PRINT_NONE)
+		return;
+
+	if (print_mode_is_struct(t->print_mode)) {
+		record_begin(e->first / FLOW_NSEC_PER_SEC,
+			     e->first % FLOW_NSEC_PER_SEC, 0, NULL);
+		record_layer("flow");
+		if (e->key.vlan)
+			record_uint("vlan", e->key.vlan);
+		record_addr("src", family, e->key.saddr);
+		record_addr("dst", family, e->key.daddr);
+		record_uint("ipproto", e->key.proto);
+		record_uint("sport", e->key.sport);
+		record_uint("dport", e->key.dport);
+		record_uint("packets", e->packets);
+		record_uint("bytes", e->bytes);
+		if (e->key.proto == IPPROTO_TCP)
+			record_uint("flags", e->tcp_flags);
+		record_uint("duration", dur);
+		record_str("end", flow_end_names[why]);
+		record_end();
+		return;
+	}
+
+	inet_ntop(family, e->key.saddr, src, sizeof(src));
+	inet_ntop(family, e->key.daddr, dst, sizeof(dst));
+
+	tprintf(" [ Flow ");
+	if (e->key.vlan)
+		tprintf("Vlan (%u), ", e->key.vlan);
+	tprintf("Src (%s), Dst (%s), Proto (%u), ", src, dst, e->key.proto);
+	tprintf("SPort (%u), DPort (%u), ", e->key.sport, e->key.dport);
+	tprintf("Pkts (%llu), Bytes (%llu), ", (unsigned long long) e->packets,
+		(unsigned long long) e->bytes);
+	if (e->key.proto == IPPROTO_TCP)
+		tprintf("Flags (0x%02x), ", e->tcp_flags);
+	tprintf("Start (%llu.%09llu), Dur (%llu.%03llus), End (%s) ]\n",
+		(unsigned long long) (e->first / FLOW_NSEC_PER_SEC),
+		(unsigned long long) (e->first % FLOW_NSEC_PER_SEC),
+		(unsigned long long) (dur / FLOW_NSEC_PER_SEC),
+		(unsigned long long) (dur % FLOW_NSEC_PER_SEC /
+				      FLOW_NSEC_PER_MSEC),
+		flow_end_names[why]);
+}
+
+static void flow_table_alloc(struct flow_table *t, uint32_t size)
+{
+	t->tags = xzmalloc_aligned(size * sizeof(*t->tags),
+				   CO_CACHE_LINE_SIZE);
+	t->entries = xmalloc_aligned(size * sizeof(*t->entries),
+				     CO_CACHE_LINE_SIZE);
+	t->mask = size - 1;
+}
+
+static void flow_table_resize(struct flow_table *t, uint32_t size)
+{
+	uint32_t i, j, old_mask = t->mask;
+	uint32_t *old_tags = t->tags;
+	struct flow_entry *old_entries = t->entries;
+
+	flow_table_alloc(t, size);
+
+	for (i = 0; i <= old_mask; ++i) {
+		if (old_tags[i] == 0)
+			continue;
+
+		for (j = old_tags[i] & t->mask; t->tags[j];
+		     j = (j + 1) & t->mask)
+			;
+
+		t->tags[j] = old_tags[i];
+		t->entries[j] = old_entries[i];
+	}
+
+	xfree(old_tags);
+	xfree(old_entries);
+}
+
+static struct flow_entry *flow_table_get(struct flow_table *t,
+					 const struct flow_key *key)
+{
+	uint32_t i, hash = flow_hash(key);
+	struct flow_entry *e;
+
+	for (i = hash & t->mask; t->tags[i]; i = (i + 1) & t->mask) {
+		if (t->tags[i] == hash &&
+		    !memcmp(&t->entries[i].key, key, sizeof(*key)))
+			return &t->entries[i];
+	}
+
+	/* Keep the load at 3/4 at most, or probing gets long */
+	if ((t->used + 1) * 4 > (t->mask + 1) * 3) {
+		if (t->mask + 1 >= FLOW_TABLE_MAX)
+			return NULL;
+
+		flow_table_resize(t, (t->mask + 1) * 2);
+		for (i = hash & t->mask; t->tags[i]; i = (i + 1) & t->mask)
+			;
+	}
+
+	e = &t->entries[i];
+	fmemset(e, 0, sizeof(*e));
+	e->key = *key;
+
+	t->tags[i] = hash;
+	t->used++;
+
+	return e;
+}
+
+/* Backward shift deletion, so that no tombstones are needed */
+static void flow_table_remove(struct flow_table *t, uint32_t i)
+{
+	uint32_t j = i, home;
+
+	for (;;) {
+		j = (j + 1) & t->mask;
+		if (t->tags[j] == 0)
+			break;
+
+		/* Flows that would not be found from i on stay where they are */
+		home = t->tags[j] & t->mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		t->tags[i] = t->tags[j];
+		t->entries[i] = t->entries[j];
+		i = j;
+	}
+
+	t->tags[i] = 0;
+	t->used--;
+}
+
+static void flow_table_expire(struct flow_table *t, bool all)
+{
+	uint32_t i = 0;
+	struct flow_entry *e;
+	enum flow_end why;
+
+	while (i <= t->mask) {
+		e = &t->entries[i];
+
+		if (t->tags[i] == 0) {
+			i++;
+			continue;
+		}
+
+		if (all)
+			why = FLOW_END_EXIT;
+		else if (e->last + t->idle <= t->now)
+			why = FLOW_END_IDLE;
+		else if (e->first + t->active <= t->now)
+			why = FLOW_END_ACTIVE;
+		else {
+			i++;
+			continue;
+		}
+
+		flow_export(t, e, why);
+		/* Slot i gets the next flow of the cluster, look at it again */
+		flow_table_remove(t, i);
+	}
+
+	/* Scans run over all of the table, so do not keep it larger than needed */
+	if (t->mask + 1 > FLOW_TABLE_MIN && t->used * 8 < t->mask + 1)
+		flow_table_resize(t, (t->mask + 1) / 2);
+
+	t->next_scan = t->now + FLOW_SCAN_MS * FLOW_NSEC_PER_MSEC;
+}
+
+void flow_table_init(struct flow_table *t, unsigned long idle,
+		     unsigned long active, int print_mode)
+{
+	fmemset(t, 0, sizeof(*t));
+
+	flow_table_alloc(t, FLOW_TABLE_MIN);
+
+	t->idle = idle * FLOW_NSEC_PER_SEC;
+	t->active = active * FLOW_NSEC_PER_SEC;
+	t->print_mode = print_mode;
+}
+
+void flow_table_destroy(struct flow_table *t)
+{
+	flow_table_expire(t, true);
+
+	xfree(t->tags);
+	xfree(t->entries);
+}
+
+void flow_table_update(struct flow_table *t, const uint8_t *packet,
+		       uint32_t caplen, uint32_t len, uint32_t sec,
+		       uint32_t nsec)
+{
+	uint64_t ts = sec * FLOW_NSEC_PER_SEC + nsec;
+	struct flow_key key;
+	struct flow_entry *e;
+	uint8_t tcp_flags = 0;
+
+	/* Traces are not always sorted, never go back in time */
+	if (ts > t->now)
+		t->now = ts;
+	t->idle_since = 0;
+
+	if (unlikely(t->now >= t->next_scan))
+		flow_table_expire(t, false);
+
+	if (!flow_parse(packet, caplen, &key, &tcp_flags)) {
+		t->skipped++;
+		return;
+	}
+
+	e = flow_table_get(t, &key);
+	if (unlikely(!e)) {
+		t->dropped++;
+		return;
+	}
+
+	if (e->packets == 0 || ts < e->first)
+		e->first = ts;
+	if (ts > e->last)
+		e->last = ts;
+
+	e->packets++;
+	e->bytes += len;
+	e->tcp_flags |= tcp_flags;
+}
+
+/*
+ * Without packets there is no time, so while the capture is idle, the
+ * clock of the flows is moved on by what passes on the monotonic clock.
+ */
+void flow_table_idle(struct flow_table *t)
+{
+	uint64_t now = flow_mono_ns();
+
+	if (t->idle_since)
+		t->now += now - t->idle_since;
+	t->idle_since = now;
+
+	if (t->now >= t->next_scan)
+		flow_table_expire(t, false);
+}
+
+void flow_table_print_stats(const struct flow_table *t)
+{
+	printf("\r%12lu flows exported\n", t->exported);
+	printf("\r%12lu packets not in a flow\n", t->skipped);
+	printf("\r%12lu packets dropped, flow table full\n", t->dropped);
+}
@@ -0,0 +1,72 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Timeouts in seconds, as NetFlow/IPFIX exporters usually have them */
+#define FLOW_IDLE_DEF		15
+#define FLOW_ACTIVE_DEF		1800
+
+/* Table size in flows, it doubles up to the maximum as it fills up */
+#define FLOW_TABLE_MIN		(1 << 10)
+#define FLOW_TABLE_MAX		(1 << 21)
+
+/* Flows are checked for timeouts once per that many milliseconds */
+#define FLOW_SCAN_MS		1000
+
+/* Addresses of IPv4 flows only take the first 4 bytes */
+struct flow_key {
+	uint8_t saddr[16];
+	uint8_t daddr[16];
+	/* For ICMP, dport is type << 8 | code */
+	uint16_t sport, dport;
+	uint8_t family, proto;
+	uint16_t vlan;
+};
+
+struct flow_entry {
+	struct flow_key key;
+	uint64_t first, last;
+	uint64_t packets, bytes;
+	uint8_t tcp_flags;
+};
+
+enum flow_end {
+	FLOW_END_IDLE,
+	FLOW_END_ACTIVE,
+	FLOW_END_EXIT,
+};
+
+/*
+ * Unidirectional flows keyed by VLAN and 5-tuple, in an open addressing
+ * table with linear probing. The hashes of the flows are kept in an array
+ * of their own, where 0 marks a free slot, so probing runs over 16 slots
+ * per cache line and only a matching hash touches the flow itself. Time
+ * is taken from the packets, in nanoseconds.
+ */
+struct flow_table {
+	uint32_t *tags;
+	struct flow_entry *entries;
+	uint32_t mask, used;
+	int print_mode;
+	uint64_t idle, active;
+	uint64_t now, next_scan, idle_since;
+	unsigned long exported, skipped, dropped;
+};
+
+extern void flow_table_init(struct flow_table *t, unsigned long idle,
+			    unsigned long active, int print_mode);
+extern void flow_table_destroy(struct flow_table *t);
+extern void flow_table_update(struct flow_table *t, const uint8_t *packet,
+			      uint32_t caplen, uint32_t len, uint32_t sec,
+			      uint32_t nsec);
+extern void flow_table_idle(struct flow_table *t);
+extern void flow_table_print_stats(const struct flow_table *t);
+
+#endif /* FLOW_H */
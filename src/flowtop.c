@@ -18,6 +18,7 @@
 #define _LGPL_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <getopt.h>
@@ -36,8 +37,14 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/fsuid.h>
+#include <fcntl.h>
+#include <time.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
 #include <urcu.h>
 #include <libgen.h>
+#include <ifaddrs.h>
 
 #include "die.h"
 #include "xmalloc.h"
@@ -53,6 +60,27 @@ struct geo_ip_db {
 	char *path4, *path6;
 };
 
+/*
+ * Names, places and the process of a flow. The presenter reads them
+ * without a lock, so they are never changed in place: workers replace
+ * the whole block with rcu_assign_pointer() and the old one is freed
+ * after a grace period.
+ */
+struct flow_extended {
+	char country_src[128], country_dst[128];
+	char city_src[128], city_dst[128];
+	char rev_dns_src[256], rev_dns_dst[256];
+	char cmdline[256];
+	int procnum, inode;
+	struct rcu_head rcu;
+};
+
+enum flow_enrich_state {
+	FLOW_ENRICH_NONE,
+	FLOW_ENRICH_QUEUED,
+	FLOW_ENRICH_DONE,
+};
+
 struct flow_entry {
 	uint32_t flow_id, use, status;
 	uint8_t  l3_proto, l4_proto;
@@ -62,19 +90,30 @@ struct flow_entry {
 	uint8_t  tcp_state, tcp_flags, sctp_state, dccp_state;
 	uint64_t counter_pkts, counter_bytes;
 	uint64_t timestamp_start, timestamp_stop;
-	char country_src[128], country_dst[128];
-	char city_src[128], city_dst[128];
-	char rev_dns_src[256], rev_dns_dst[256];
-	char cmdline[256];
+	uint64_t rate_bytes, rate_ms, rate;
+	struct flow_extended *ext;
+	uint32_t enrich;
 	struct flow_entry *next;
-	int procnum, inode;
+	struct rcu_head rcu;
 };
 
-struct flow_list {
+struct flow_bucket {
 	struct flow_entry *head;
 	struct spinlock lock;
 };
 
+/*
+ * Flows hashed by their conntrack ID. The presenter walks the chains
+ * under RCU only, the collector takes the lock of the bucket it changes
+ * and entries that are taken out are freed after a grace period, so
+ * neither of them ever waits for the other.
+ */
+struct flow_list {
+	struct flow_bucket *buckets;
+	unsigned int shift;
+	unsigned long nr;
+};
+
 #ifndef ATTR_TIMESTAMP_START
 # define ATTR_TIMESTAMP_START 63
 #endif
@@ -84,6 +123,113 @@ struct flow_list {
 
 #define SCROLL_MAX 1000
 
+#define PRESENTER_TICK_MS	100
+#define PRESENTER_UPDATE_MS	500
+#define PRESENTER_RATE_MS	1000
+
+#define COLLECTOR_TIMEOUT_MS	250
+
+#define FLOW_LIST_BUCKETS_MIN	(1 << 10)
+#define FLOW_LIST_BUCKETS_MAX	(1 << 20)
+
+#define ENRICH_WORKERS		4
+#define ENRICH_QUEUE_LEN	1024
+
+#define ADDR_CACHE_SIZE		4096
+#define ADDR_CACHE_BUCKETS	1024
+
+#define SOCK_INDEX_REFRESH_MS	1000
+#define SOCK_MAP_MIN		(1 << 10)
+
+/* What a worker needs to know to look up names, places and processes */
+struct enrich_job {
+	uint32_t flow_id;
+	uint8_t  l3_proto, l4_proto;
+	uint32_t ip4_src_addr, ip4_dst_addr;
+	uint32_t ip6_src_addr[4], ip6_dst_addr[4];
+	uint16_t port_src, port_dst;
+};
+
+/*
+ * New flows are shown right away with numeric addresses, reverse DNS,
+ * GeoIP and the owning process are looked up by a pool of workers and
+ * filled in later. Jobs that do not fit into the queue are dropped and
+ * counted, the flow is queued again on its next update.
+ */
+struct enrich_pool {
+	struct enrich_job jobs[ENRICH_QUEUE_LEN];
+	unsigned int head, tail;
+	unsigned long dropped;
+	int stop;
+	struct mutexlock lock;
+	pthread_cond_t cond;
+	pthread_t tids[ENRICH_WORKERS];
+};
+
+struct addr_cache_entry {
+	uint8_t family, addr[16];
+	char rev_dns[256], country[128], city[128];
+	struct addr_cache_entry *hnext, *prev, *next;
+};
+
+/* Recently looked up addresses, the least recently used one goes first */
+struct addr_cache {
+	struct addr_cache_entry *entries;
+	struct addr_cache_entry *buckets[ADDR_CACHE_BUCKETS];
+	struct addr_cache_entry *newest, *oldest;
+	unsigned int used;
+	struct mutexlock lock;
+};
+
+/* Flows on the screen and the ones that were drawn the last time */
+struct presenter_view {
+	struct flow_entry **heap;
+	unsigned int heap_size, heap_len;
+	struct flow_entry *rows, *shown;
+	struct flow_extended *rows_ext, *shown_ext;
+	unsigned int rows_size, nr_rows, nr_shown;
+	unsigned int max_rows, row_lines;
+	unsigned long nr_flows;
+	uint64_t updated_ms;
+	bool redraw;
+};
+
+struct sock_map_entry {
+	uint64_t key;
+	uint32_t val, next;
+};
+
+/* Chained hash table, chains are 1-based indices into the entries */
+struct sock_map {
+	struct sock_map_entry *entries;
+	uint32_t *heads;
+	uint32_t size, mask, used;
+};
+
+/* Sockets by local address and port, their owners and local addresses */
+struct sock_tables {
+	struct sock_map ports, inodes, locals;
+};
+
+/*
+ * Which process a flow belongs to: sock_diag tells the inode of the
+ * socket on the local address and port and the fds in /proc tell which
+ * process has that socket open. Both are dumped into hash tables, which
+ * are dumped again when a lookup misses and the last dump is older than
+ * SOCK_INDEX_REFRESH_MS, so most flows take two probes and no scan.
+ * Port pairs that missed are kept in misses until the next dump, so
+ * flows of other hosts, e.g. forwarded ones, do not ask for dumps.
+ * Dumps are built without the lock, dump_lock keeps them one at a time.
+ */
+struct sock_index {
+	struct sock_tables tables;
+	struct sock_map misses;
+	uint64_t dumped_ms;
+	int nl_fd;
+	uint32_t nl_seq;
+	struct mutexlock lock, dump_lock;
+};
+
 #define INCLUDE_IPV4	(1 << 0)
 #define INCLUDE_IPV6	(1 << 1)
 #define INCLUDE_UDP	(1 << 2)
@@ -99,6 +245,9 @@ static int what = INCLUDE_IPV4 | INCLUDE_IPV6 | INCLUDE_TCP, show_src = 0;
 struct geo_ip_db geo_country, geo_city;
 
 static struct flow_list flow_list;
+static struct enrich_pool enrich_pool;
+static struct addr_cache addr_cache;
+static struct sock_index sock_index;
 
 static const char *short_options = "vhTULKsOPDIS46";
 static const struct option long_options[] = {
@@ -146,6 +295,11 @@ static const char *const l4proto2str[IPPROTO_MAX] = {
 	[IPPROTO_COMP]			= "comp",
 };
 
+/* Protocols whose sockets sock_diag can dump */
+static const uint8_t sock_index_protos[] = {
+	IPPROTO_TCP, IPPROTO_UDP, IPPROTO_UDPLITE, IPPROTO_DCCP, IPPROTO_SCTP,
+};
+
 static const char *const tcp_state2str[TCP_CONNTRACK_MAX] = {
 	[TCP_CONNTRACK_NONE]		= "NOSTATE",
 	[TCP_CONNTRACK_SYN_SENT]	= "SYN_SENT",
@@ -243,7 +397,8 @@ static void signal_handler(int number)
 }
 
 static void flow_entry_from_ct(struct flow_entry *n, struct nf_conntrack *ct);
-static void flow_entry_get_extended(struct flow_entry *n);
+static void flow_entry_get_numeric(struct flow_entry *n);
+static void enrich_queue_push(struct enrich_pool *p, struct flow_entry *n);
 
 static void help(void)
 {
@@ -298,35 +453,85 @@ static void version(void)
 
 static inline struct flow_entry *flow_entry_xalloc(void)
 {
-	return xzmalloc(sizeof(struct flow_entry));
+	struct flow_entry *n = xzmalloc(sizeof(struct flow_entry));
+
+	n->ext = xzmalloc(sizeof(struct flow_extended));
+
+	return n;
 }
 
 static inline void flow_entry_xfree(struct flow_entry *n)
 {
+	xfree(n->ext);
 	xfree(n);
 }
 
-static inline void flow_list_init(struct flow_list *fl)
+static void flow_extended_xfree_rcu(struct rcu_head *head)
 {
-	fl->head = NULL;
-	spinlock_init(&fl->lock);
+	struct flow_extended *e = container_of(head, struct flow_extended, rcu);
+
+	xfree(e);
 }
 
-static void flow_list_new_entry(struct flow_list *fl, struct nf_conntrack *ct)
+static void flow_entry_xfree_rcu(struct rcu_head *head)
 {
-	struct flow_entry *n = flow_entry_xalloc();
+	flow_entry_xfree(container_of(head, struct flow_entry, rcu));
+}
 
-	flow_entry_from_ct(n, ct);
-	flow_entry_get_extended(n);
+/* As many buckets as the kernel has for conntrack itself */
+static unsigned int flow_list_buckets(void)
+{
+	int fd;
+	long val = 0;
+	ssize_t ret;
+	char buff[64];
+	unsigned int n = FLOW_LIST_BUCKETS_MIN;
+
+	fd = open("/proc/sys/net/netfilter/nf_conntrack_buckets", O_RDONLY);
+	if (fd >= 0) {
+		ret = read(fd, buff, sizeof(buff) - 1);
+		if (ret > 0) {
+			buff[ret] = 0;
+			val = atol(buff);
+		}
+		close(fd);
+	}
+
+	while (n < val && n < FLOW_LIST_BUCKETS_MAX)
+		n <<= 1;
+
+	return n;
+}
+
+static inline struct flow_bucket *flow_list_bucket(struct flow_list *fl,
+						   uint32_t id)
+{
+	return &fl->buckets[(uint32_t) (id * 0x9E3779B1U) >> fl->shift];
+}
+
+static void flow_list_init(struct flow_list *fl)
+{
+	unsigned int i, n = flow_list_buckets();
+
+	fl->buckets = xmalloc(n * sizeof(*fl->buckets));
+	for (i = 0; i < n; ++i) {
+		fl->buckets[i].head = NULL;
+		spinlock_init(&fl->buckets[i].lock);
+	}
+
+	fl->shift = 32 - __builtin_ctz(n);
+	fl->nr = 0;
+}
 
-	rcu_assign_pointer(n->next, fl->head);
-	rcu_assign_pointer(fl->head, n);
+static inline unsigned int flow_list_size(const struct flow_list *fl)
+{
+	return 1U << (32 - fl->shift);
 }
 
-static struct flow_entry *flow_list_find_id(struct flow_list *fl,
+static struct flow_entry *flow_list_find_id(struct flow_bucket *b,
 					    uint32_t id)
 {
-	struct flow_entry *n = rcu_dereference(fl->head);
+	struct flow_entry *n = rcu_dereference(b->head);
 
 	while (n != NULL) {
 		if (n->flow_id == id)
@@ -338,19 +543,23 @@ static struct flow_entry *flow_list_find_id(struct flow_list *fl,
 	return NULL;
 }
 
-static struct flow_entry *flow_list_find_prev_id(struct flow_list *fl,
-						 uint32_t id)
+/* Flow after n or the first one if n is NULL, under rcu_read_lock() */
+static struct flow_entry *flow_list_next(struct flow_list *fl,
+					 struct flow_entry *n, unsigned int *b)
 {
-	struct flow_entry *n = rcu_dereference(fl->head), *tmp;
+	unsigned int size = flow_list_size(fl);
 
-	if (n->flow_id == id)
-		return NULL;
+	if (n == NULL)
+		*b = 0;
+	else if ((n = rcu_dereference(n->next)) != NULL)
+		return n;
+	else
+		(*b)++;
 
-	while ((tmp = rcu_dereference(n->next)) != NULL) {
-		if (tmp->flow_id == id)
+	for (; *b < size; (*b)++) {
+		n = rcu_dereference(fl->buckets[*b].head);
+		if (n != NULL)
 			return n;
-
-		n = tmp;
 	}
 
 	return NULL;
@@ -359,166 +568,638 @@ static struct flow_entry *flow_list_find_prev_id(struct flow_list *fl,
 static void flow_list_update_entry(struct flow_list *fl,
 				   struct nf_conntrack *ct)
 {
-	int do_ext = 0;
+	uint32_t id = nfct_get_attr_u32(ct, ATTR_ID);
+	struct flow_bucket *b = flow_list_bucket(fl, id);
 	struct flow_entry *n;
 
-	n = flow_list_find_id(fl, nfct_get_attr_u32(ct, ATTR_ID));
-	if (n == NULL) {
-		n = flow_entry_xalloc();
-		do_ext = 1;
+	spinlock_lock(&b->lock);
+	n = flow_list_find_id(b, id);
+	if (n)
+		flow_entry_from_ct(n, ct);
+	spinlock_unlock(&b->lock);
+
+	/* Its job may not have fit into the queue the last time */
+	if (n) {
+		enrich_queue_push(&enrich_pool, n);
+		return;
 	}
 
+	n = flow_entry_xalloc();
+
 	flow_entry_from_ct(n, ct);
-	if (do_ext) {
-		flow_entry_get_extended(n);
+	flow_entry_get_numeric(n);
+
+	spinlock_lock(&b->lock);
+	if (flow_list_find_id(b, id) == NULL) {
+		n->next = b->head;
+		rcu_assign_pointer(b->head, n);
+		__atomic_fetch_add(&fl->nr, 1, __ATOMIC_RELAXED);
+	} else {
+		/* Someone else was faster, and nobody has seen ours */
+		flow_entry_xfree(n);
+		n = NULL;
+	}
+	spinlock_unlock(&b->lock);
+
+	/* Only the collector frees flows, so n is still there */
+	if (n)
+		enrich_queue_push(&enrich_pool, n);
+}
+
+/* Hands the results of a worker over to the flow, if it is still there */
+static void flow_list_set_extended(struct flow_list *fl,
+				   struct flow_entry *e)
+{
+	struct flow_bucket *b = flow_list_bucket(fl, e->flow_id);
+	struct flow_extended *old = NULL;
+	struct flow_entry *n;
 
-		rcu_assign_pointer(n->next, fl->head);
-		rcu_assign_pointer(fl->head, n);
+	spinlock_lock(&b->lock);
+	n = flow_list_find_id(b, e->flow_id);
+	if (n) {
+		old = n->ext;
+		rcu_assign_pointer(n->ext, e->ext);
+		__atomic_store_n(&n->enrich, FLOW_ENRICH_DONE,
+				 __ATOMIC_RELAXED);
 	}
+	spinlock_unlock(&b->lock);
+
+	if (old)
+		call_rcu(&old->rcu, flow_extended_xfree_rcu);
+	else
+		xfree(e->ext);
 }
 
 static void flow_list_destroy_entry(struct flow_list *fl,
 				    struct nf_conntrack *ct)
 {
-	struct flow_entry *n1, *n2;
 	uint32_t id = nfct_get_attr_u32(ct, ATTR_ID);
+	struct flow_bucket *b = flow_list_bucket(fl, id);
+	struct flow_entry *n, **prev;
 
-	n1 = flow_list_find_id(fl, id);
-	if (n1) {
-		n2 = flow_list_find_prev_id(fl, id);
-		if (n2) {
-			rcu_assign_pointer(n2->next, n1->next);
-			rcu_assign_pointer(n1->next, NULL);
+	spinlock_lock(&b->lock);
+	for (prev = &b->head; (n = *prev) != NULL; prev = &n->next) {
+		if (n->flow_id == id) {
+			rcu_assign_pointer(*prev, n->next);
+			break;
+		}
+	}
+	spinlock_unlock(&b->lock);
 
-			flow_entry_xfree(n1);
-		} else {
-			flow_entry_xfree(fl->head);
+	if (n) {
+		__atomic_fetch_sub(&fl->nr, 1, __ATOMIC_RELAXED);
+		/* Readers may still be on it, or on the ones behind it */
+		call_rcu(&n->rcu, flow_entry_xfree_rcu);
+	}
+}
 
-			rcu_assign_pointer(fl->head, NULL);
+/* Only after the presenter returned and the collector was joined */
+static void flow_list_destroy(struct flow_list *fl)
+{
+	unsigned int i, size = flow_list_size(fl);
+	struct flow_entry *n, *next;
+
+	for (i = 0; i < size; ++i) {
+		for (n = fl->buckets[i].head; n != NULL; n = next) {
+			next = n->next;
+			flow_entry_xfree(n);
 		}
+
+		spinlock_destroy(&fl->buckets[i].lock);
 	}
+
+	/* Flows and enrichment replaced before may still wait for call_rcu */
+	rcu_barrier();
+
+	xfree(fl->buckets);
+	fl->nr = 0;
 }
 
-static void flow_list_destroy(struct flow_list *fl)
+/* Keys are made unique per table by the caller, the first value stays */
+static inline uint32_t sock_map_hash(uint64_t key)
 {
-	struct flow_entry *n;
+	return (key * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static bool sock_map_find(const struct sock_map *m, uint64_t key,
+			  uint32_t *val)
+{
+	uint32_t i;
 
-	while (fl->head != NULL) {
-		n = rcu_dereference(fl->head->next);
-		rcu_assign_pointer(fl->head->next, NULL);
+	if (m->heads == NULL)
+		return false;
 
-		flow_entry_xfree(fl->head);
-		rcu_assign_pointer(fl->head, n);
+	for (i = m->heads[sock_map_hash(key) & m->mask]; i;
+	     i = m->entries[i - 1].next) {
+		if (m->entries[i - 1].key == key) {
+			*val = m->entries[i - 1].val;
+			return true;
+		}
 	}
 
-	synchronize_rcu();
-	spinlock_destroy(&fl->lock);
+	return false;
 }
 
-static int walk_process(char *process, struct flow_entry *n)
+static void sock_map_grow(struct sock_map *m)
 {
-	int ret;
-	DIR *dir;
-	struct dirent *ent;
-	char path[1024];
+	uint32_t i, h;
 
-	if (snprintf(path, sizeof(path), "/proc/%s/fd", process) == -1)
-		panic("giant process name! %s\n", process);
+	m->size = m->size ? m->size * 2 : SOCK_MAP_MIN;
+	m->mask = m->size - 1;
+	m->entries = xrealloc(m->entries, m->size, sizeof(*m->entries));
 
-	dir = opendir(path);
-	if (!dir)
-        	return 0;
+	if (m->heads)
+		xfree(m->heads);
+	m->heads = xzmalloc(m->size * sizeof(*m->heads));
 
-	while ((ent = readdir(dir))) {
-		struct stat statbuf;
+	for (i = 0; i < m->used; ++i) {
+		h = sock_map_hash(m->entries[i].key) & m->mask;
+		m->entries[i].next = m->heads[h];
+		m->heads[h] = i + 1;
+	}
+}
 
-		if (snprintf(path, sizeof(path), "/proc/%s/fd/%s",
-			     process, ent->d_name) < 0)
-			continue;
+static void sock_map_add(struct sock_map *m, uint64_t key, uint32_t val)
+{
+	uint32_t h, old;
+	struct sock_map_entry *e;
 
-		if (stat(path, &statbuf) < 0)
-			continue;
+	if (sock_map_find(m, key, &old))
+		return;
+	if (m->used == m->size)
+		sock_map_grow(m);
 
-		if (S_ISSOCK(statbuf.st_mode) && n->inode == statbuf.st_ino) {
-			memset(n->cmdline, 0, sizeof(n->cmdline));
+	h = sock_map_hash(key) & m->mask;
+	e = &m->entries[m->used];
 
-            		snprintf(path, sizeof(path), "/proc/%s/exe", process);
+	e->key = key;
+	e->val = val;
+	e->next = m->heads[h];
 
-			ret = readlink(path, n->cmdline,
-				       sizeof(n->cmdline) - 1);
-			if (ret < 0)
-				panic("readlink error: %s\n", strerror(errno));
+	m->heads[h] = ++m->used;
+}
 
-			n->procnum = atoi(process);
-			return 1;
-		}
+static void sock_map_reset(struct sock_map *m)
+{
+	if (m->heads)
+		memset(m->heads, 0, m->size * sizeof(*m->heads));
+	m->used = 0;
+}
+
+static void sock_map_free(struct sock_map *m)
+{
+	if (m->heads)
+		xfree(m->heads);
+	if (m->entries)
+		xfree(m->entries);
+}
+
+static inline bool sock_index_addr_v4mapped(const uint32_t *addr)
+{
+	return addr[0] == 0 && addr[1] == 0 && addr[2] == htonl(0xffff);
+}
+
+static inline bool sock_index_addr_any(int family, const uint32_t *addr)
+{
+	if (family == AF_INET)
+		return addr[0] == 0;
+
+	return (addr[0] | addr[1] | addr[2] | addr[3]) == 0;
+}
+
+/*
+ * Addresses are in network order as in conntrack and sock_diag. IPv6
+ * ones are folded into 32 bits, IPv4-mapped ones are keyed as IPv4, so
+ * dual-stack sockets match IPv4 flows. The any address keys as 0.
+ */
+static inline uint64_t sock_index_key(int family, int proto,
+				      const uint32_t *addr, uint16_t port)
+{
+	uint64_t hi, lo;
+	uint32_t a;
+
+	if (family == AF_INET) {
+		a = addr[0];
+	} else if (sock_index_addr_v4mapped(addr)) {
+		family = AF_INET;
+		a = addr[3];
+	} else {
+		hi = (uint64_t) addr[0] << 32 | addr[1];
+		lo = (uint64_t) addr[2] << 32 | addr[3];
+		a = sock_map_hash((hi * 0x9E3779B97F4A7C15ULL) ^ lo);
 	}
 
-	closedir(dir);
-	return 0;
+	return (uint64_t) a << 32 | (uint64_t) (family == AF_INET6) << 24 |
+	       proto << 16 | port;
 }
 
-static void walk_processes(struct flow_entry *n)
+static inline bool sock_index_has_proto(int proto)
 {
-	int ret;
-	DIR *dir;
-	struct dirent *ent;
+	unsigned int i;
 
-	/* n->inode must be set */
-	if (n->inode <= 0) {
-		memset(n->cmdline, 0, sizeof(n->cmdline));
+	for (i = 0; i < array_size(sock_index_protos); ++i)
+		if (sock_index_protos[i] == proto)
+			return true;
+
+	return false;
+}
+
+static inline uint64_t flowtop_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sock_index_add_local(struct sock_tables *t, int family,
+				 const uint32_t *addr)
+{
+	if (!sock_index_addr_any(family, addr))
+		sock_map_add(&t->locals, sock_index_key(family, 0, addr, 0), 1);
+}
+
+static void sock_index_add(struct sock_tables *t, int family, int proto,
+			   const uint32_t *addr, uint16_t port, uint32_t inode)
+{
+	sock_map_add(&t->ports, sock_index_key(family, proto, addr, port),
+		     inode);
+	/* Also covers addresses bound with IP_FREEBIND or IP_TRANSPARENT */
+	sock_index_add_local(t, family, addr);
+}
+
+static int sock_index_dump_diag(struct sock_index *si, struct sock_tables *t,
+				int family, int proto)
+{
+	int len;
+	uint32_t buff[8192];
+	struct nlmsghdr *nlh;
+	struct inet_diag_msg *msg;
+	struct sockaddr_nl nladdr = {
+		.nl_family = AF_NETLINK,
+	};
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} req;
+
+	if (si->nl_fd < 0)
+		return -EIO;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = ++si->nl_seq;
+	req.req.sdiag_family = family;
+	req.req.sdiag_protocol = proto;
+	req.req.idiag_states = ~0U;
+
+	if (sendto(si->nl_fd, &req, sizeof(req), 0, (struct sockaddr *) &nladdr,
+		   sizeof(nladdr)) < 0)
+		return -EIO;
+
+	for (;;) {
+		len = recv(si->nl_fd, buff, sizeof(buff), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -EIO;
+		}
+
+		for (nlh = (struct nlmsghdr *) buff; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != si->nl_seq)
+				continue;
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			/* Mostly a protocol whose diag module is not there */
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+				return -EIO;
+
+			msg = NLMSG_DATA(nlh);
+			if (msg->idiag_inode == 0)
+				continue;
+
+			sock_index_add(t, family, proto, msg->id.idiag_src,
+				       ntohs(msg->id.idiag_sport),
+				       msg->idiag_inode);
+		}
+	}
+}
+
+static void sock_index_dump_proc_net(struct sock_tables *t, int family,
+				     int proto)
+{
+	char path[128], buff[1024];
+	FILE *proc;
+
+	snprintf(path, sizeof(path), "/proc/net/%s%s",
+		 l4proto2str[proto], family == AF_INET6 ? "6" : "");
+
+	proc = fopen(path, "r");
+	if (!proc)
 		return;
+
+	/* Addresses are printed as the 32 bit words they are in memory */
+	while (fgets(buff, sizeof(buff), proc) != NULL) {
+		unsigned int lport = 0, inode = 0;
+		uint32_t addr[4] = { 0 };
+		int ret;
+
+		if (family == AF_INET6)
+			ret = sscanf(buff, "%*u: %8X%8X%8X%8X:%X %*X:%*X %*X "
+				     "%*X:%*X %*X:%*X %*X %*u %*u %u",
+				     &addr[0], &addr[1], &addr[2], &addr[3],
+				     &lport, &inode) == 6;
+		else
+			ret = sscanf(buff, "%*u: %X:%X %*X:%*X %*X %*X:%*X "
+				     "%*X:%*X %*X %*u %*u %u", &addr[0],
+				     &lport, &inode) == 3;
+
+		if (ret && inode)
+			sock_index_add(t, family, proto, addr, lport, inode);
 	}
 
+	fclose(proc);
+}
+
+static void sock_index_dump_procs(struct sock_tables *t)
+{
+	DIR *dir, *fds;
+	struct dirent *ent, *fd;
+	char path[512], link[64];
+	unsigned long inode;
+	ssize_t len;
+	uint32_t pid;
+
 	dir = opendir("/proc");
 	if (!dir)
 		panic("Cannot open /proc!\n");
 
 	while ((ent = readdir(dir))) {
-		if (strspn(ent->d_name, "0123456789") == strlen(ent->d_name)) {
-			ret = walk_process(ent->d_name, n);
-			if (ret > 0)
-				break;
+		if (strspn(ent->d_name, "0123456789") != strlen(ent->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%s/fd", ent->d_name);
+		fds = opendir(path);
+		if (!fds)
+			continue;
+
+		pid = atoi(ent->d_name);
+
+		while ((fd = readdir(fds))) {
+			if (fd->d_name[0] == '.')
+				continue;
+
+			snprintf(path, sizeof(path), "/proc/%s/fd/%s",
+				 ent->d_name, fd->d_name);
+
+			len = readlink(path, link, sizeof(link) - 1);
+			if (len < 0)
+				continue;
+			link[len] = 0;
+
+			if (sscanf(link, "socket:[%lu]", &inode) == 1)
+				sock_map_add(&t->inodes, inode, pid);
 		}
+
+		closedir(fds);
 	}
 
 	closedir(dir);
 }
 
-static int get_port_inode(uint16_t port, int proto, int is_ip6)
+static void sock_index_dump_ifaddrs(struct sock_tables *t)
 {
-	int ret = -ENOENT;
-	char path[128], buff[1024];
-	FILE *proc;
-
-	memset(path, 0, sizeof(path));
-	snprintf(path, sizeof(path), "/proc/net/%s%s",
-		 l4proto2str[proto], is_ip6 ? "6" : "");
+	struct ifaddrs *ifaddr, *ifa;
+	uint32_t addr[4];
 
-	proc = fopen(path, "r");
-	if (!proc)
-		return -EIO;
+	if (getifaddrs(&ifaddr) < 0)
+		return;
 
-	memset(buff, 0, sizeof(buff));
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL)
+			continue;
 
-	while (fgets(buff, sizeof(buff), proc) != NULL) {
-		int inode = 0;
-		unsigned int lport = 0;
-
-		buff[sizeof(buff) - 1] = 0;
-		if (sscanf(buff, "%*u: %*X:%X %*X:%*X %*X %*X:%*X %*X:%*X "
-			   "%*X %*u %*u %u", &lport, &inode) == 2) {
-			if ((uint16_t) lport == port) {
-				ret = inode;
-				break;
-			}
+		switch (ifa->ifa_addr->sa_family) {
+		case AF_INET:
+			memcpy(addr, &((struct sockaddr_in *)
+				       ifa->ifa_addr)->sin_addr, 4);
+			break;
+		case AF_INET6:
+			memcpy(addr, &((struct sockaddr_in6 *)
+				       ifa->ifa_addr)->sin6_addr, 16);
+			break;
+		default:
+			continue;
 		}
 
-		memset(buff, 0, sizeof(buff));
+		sock_index_add_local(t, ifa->ifa_addr->sa_family, addr);
 	}
 
-	fclose(proc);
-	return ret;
+	freeifaddrs(ifaddr);
+}
+
+static void sock_index_free_tables(struct sock_tables *t)
+{
+	sock_map_free(&t->ports);
+	sock_map_free(&t->inodes);
+	sock_map_free(&t->locals);
+}
+
+/* Walks /proc/net and /proc/[pid]/fd, so it never runs under si->lock */
+static void sock_index_dump(struct sock_index *si)
+{
+	struct sock_tables t, old;
+	unsigned int i;
+
+	mutexlock_lock(&si->dump_lock);
+
+	/* Another worker may just have dumped */
+	mutexlock_lock(&si->lock);
+	if (flowtop_now_ms() - si->dumped_ms < SOCK_INDEX_REFRESH_MS) {
+		mutexlock_unlock(&si->lock);
+		mutexlock_unlock(&si->dump_lock);
+		return;
+	}
+	mutexlock_unlock(&si->lock);
+
+	memset(&t, 0, sizeof(t));
+
+	for (i = 0; i < array_size(sock_index_protos); ++i) {
+		if (sock_index_dump_diag(si, &t, AF_INET,
+					 sock_index_protos[i]))
+			sock_index_dump_proc_net(&t, AF_INET,
+						 sock_index_protos[i]);
+		if (sock_index_dump_diag(si, &t, AF_INET6,
+					 sock_index_protos[i]))
+			sock_index_dump_proc_net(&t, AF_INET6,
+						 sock_index_protos[i]);
+	}
+
+	sock_index_dump_ifaddrs(&t);
+	sock_index_dump_procs(&t);
+
+	mutexlock_lock(&si->lock);
+	old = si->tables;
+	si->tables = t;
+	sock_map_reset(&si->misses);
+	si->dumped_ms = flowtop_now_ms();
+	mutexlock_unlock(&si->lock);
+
+	mutexlock_unlock(&si->dump_lock);
+
+	sock_index_free_tables(&old);
+}
+
+static bool sock_index_is_local(struct sock_index *si, int family,
+				const uint32_t *addr)
+{
+	uint32_t val;
+
+	/* All of 127.0.0.0/8 is loopback, but only 127.0.0.1 is on lo */
+	if (family == AF_INET && (ntohl(addr[0]) >> 24) == 127)
+		return true;
+
+	return sock_map_find(&si->tables.locals,
+			     sock_index_key(family, 0, addr, 0), &val);
+}
+
+static bool sock_index_find(struct sock_index *si, uint64_t key,
+			    uint32_t *inode, uint32_t *pid)
+{
+	return sock_map_find(&si->tables.ports, key, inode) &&
+	       sock_map_find(&si->tables.inodes, *inode, pid);
+}
+
+/*
+ * A socket on the address itself, else one bound to any address. The
+ * latter may be an IPv6 one that takes IPv4 as well. Only addresses of
+ * this host are looked up, so flows of others never hit a local port.
+ */
+static bool sock_index_find_addr(struct sock_index *si, int family,
+				 int proto, const uint32_t *addr,
+				 uint16_t port, uint32_t *inode,
+				 uint32_t *pid)
+{
+	static const uint32_t any[4];
+
+	if (!sock_index_is_local(si, family, addr))
+		return false;
+
+	return sock_index_find(si, sock_index_key(family, proto, addr, port),
+			       inode, pid) ||
+	       sock_index_find(si, sock_index_key(family, proto, any, port),
+			       inode, pid) ||
+	       (family == AF_INET &&
+		sock_index_find(si, sock_index_key(AF_INET6, proto, any, port),
+				inode, pid));
+}
+
+/*
+ * The local end is the source of outgoing, the destination of incoming
+ * ones. Flows keep IPv4 addresses in host order, the index does not.
+ */
+static bool sock_index_find_flow(struct sock_index *si,
+				 const struct flow_entry *n, uint32_t *inode,
+				 uint32_t *pid)
+{
+	int family = n->l3_proto == AF_INET6 ? AF_INET6 : AF_INET;
+	uint32_t src4 = htonl(n->ip4_src_addr);
+	uint32_t dst4 = htonl(n->ip4_dst_addr);
+
+	if (family == AF_INET)
+		return sock_index_find_addr(si, family, n->l4_proto, &src4,
+					    n->port_src, inode, pid) ||
+		       sock_index_find_addr(si, family, n->l4_proto, &dst4,
+					    n->port_dst, inode, pid);
+
+	return sock_index_find_addr(si, family, n->l4_proto, n->ip6_src_addr,
+				    n->port_src, inode, pid) ||
+	       sock_index_find_addr(si, family, n->l4_proto, n->ip6_dst_addr,
+				    n->port_dst, inode, pid);
+}
+
+static void sock_index_init(struct sock_index *si)
+{
+	memset(si, 0, sizeof(*si));
+
+	/* Without sock_diag, ports are looked up in /proc/net instead */
+	si->nl_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+			   NETLINK_SOCK_DIAG);
+
+	mutexlock_init(&si->lock);
+	mutexlock_init(&si->dump_lock);
+}
+
+static void sock_index_destroy(struct sock_index *si)
+{
+	if (si->nl_fd >= 0)
+		close(si->nl_fd);
+
+	sock_index_free_tables(&si->tables);
+	sock_map_free(&si->misses);
+
+	mutexlock_destroy(&si->dump_lock);
+	mutexlock_destroy(&si->lock);
+}
+
+static void flow_entry_get_process(struct sock_index *si,
+				   struct flow_entry *n)
+{
+	bool found, dump = false;
+	char path[64];
+	ssize_t ret;
+	uint32_t inode = 0, pid = 0, missed;
+	uint64_t key_miss = (uint64_t) (n->l3_proto == AF_INET6) << 40 |
+			    (uint64_t) n->l4_proto << 32 |
+			    (uint64_t) n->port_src << 16 | n->port_dst;
+
+	memset(n->ext->cmdline, 0, sizeof(n->ext->cmdline));
+
+	if (!sock_index_has_proto(n->l4_proto))
+		return;
+
+	mutexlock_lock(&si->lock);
+	found = sock_index_find_flow(si, n, &inode, &pid);
+	/*
+	 * New sockets only show up in a new dump, but not too often and
+	 * not for port pairs that missed since the last one already.
+	 */
+	if (!found && !sock_map_find(&si->misses, key_miss, &missed)) {
+		dump = flowtop_now_ms() - si->dumped_ms >=
+		       SOCK_INDEX_REFRESH_MS;
+		if (!dump)
+			sock_map_add(&si->misses, key_miss, 1);
+	}
+	mutexlock_unlock(&si->lock);
+
+	if (dump) {
+		sock_index_dump(si);
+
+		mutexlock_lock(&si->lock);
+		found = sock_index_find_flow(si, n, &inode, &pid);
+		if (!found)
+			sock_map_add(&si->misses, key_miss, 1);
+		mutexlock_unlock(&si->lock);
+	}
+
+	n->ext->inode = inode;
+	if (!found)
+		return;
+
+	snprintf(path, sizeof(path), "/proc/%u/exe", pid);
+
+	/* The process may be gone by now */
+	ret = readlink(path, n->ext->cmdline, sizeof(n->ext->cmdline) - 1);
+	if (ret < 0) {
+		memset(n->ext->cmdline, 0, sizeof(n->ext->cmdline));
+		return;
+	}
+
+	n->ext->procnum = pid;
 }
 
 #define CP_NFCT(elem, attr, x)				\
@@ -634,15 +1315,18 @@ flow_entry_geo_city_lookup_generic(struct flow_entry *n,
 	if (gir != NULL)
 		city = gir->city;
 
-	bug_on(sizeof(n->city_src) != sizeof(n->city_dst));
+	bug_on(sizeof(n->ext->city_src) != sizeof(n->ext->city_dst));
 
 	if (city) {
-		memcpy(SELFLD(dir, city_src, city_dst), city,
-		       min(sizeof(n->city_src), strlen(city)));
+		memcpy(SELFLD(dir, ext->city_src, ext->city_dst), city,
+		       min(sizeof(n->ext->city_src), strlen(city)));
 	} else {
-		memset(SELFLD(dir, city_src, city_dst), 0,
-		       sizeof(n->city_src));
+		memset(SELFLD(dir, ext->city_src, ext->city_dst), 0,
+		       sizeof(n->ext->city_src));
 	}
+
+	if (gir != NULL)
+		GeoIPRecord_delete(gir);
 }
 
 static void
@@ -673,9 +1357,9 @@ flow_entry_geo_country_lookup_generic(struct flow_entry *n,
 
 	country = make_na(country);
 
-	bug_on(sizeof(n->country_src) != sizeof(n->country_dst));
-	memcpy(SELFLD(dir, country_src, country_dst), country,
-	       min(sizeof(n->country_src), strlen(country)));
+	bug_on(sizeof(n->ext->country_src) != sizeof(n->ext->country_dst));
+	memcpy(SELFLD(dir, ext->country_src, ext->country_dst), country,
+	       min(sizeof(n->ext->country_src), strlen(country)));
 }
 
 static void flow_entry_get_extended_geo(struct flow_entry *n,
@@ -685,14 +1369,19 @@ static void flow_entry_get_extended_geo(struct flow_entry *n,
 	flow_entry_geo_country_lookup_generic(n, dir);
 }
 
+/*
+ * Workers run this in parallel, so no gethostbyaddr() with its static
+ * buffer. Falls back to the numeric address if there is no name.
+ */
 static void flow_entry_get_extended_revdns(struct flow_entry *n,
-					   enum flow_entry_direction dir)
+					   enum flow_entry_direction dir,
+					   int flags)
 {
 	size_t sa_len;
 	struct sockaddr_in sa4;
 	struct sockaddr_in6 sa6;
 	struct sockaddr *sa;
-	struct hostent *hent;
+	char *host = SELFLD(dir, ext->rev_dns_src, ext->rev_dns_dst);
 
 	switch (n->l3_proto) {
 	default:
@@ -702,29 +1391,187 @@ static void flow_entry_get_extended_revdns(struct flow_entry *n,
 		flow_entry_get_sain4_obj(n, dir, &sa4);
 		sa = (struct sockaddr *) &sa4;
 		sa_len = sizeof(sa4);
-		hent = gethostbyaddr(&sa4.sin_addr, sizeof(sa4.sin_addr),
-				     AF_INET);
 		break;
 
 	case AF_INET6:
 		flow_entry_get_sain6_obj(n, dir, &sa6);
 		sa = (struct sockaddr *) &sa6;
 		sa_len = sizeof(sa6);
-		hent = gethostbyaddr(&sa6.sin6_addr, sizeof(sa6.sin6_addr),
-				     AF_INET6);
 		break;
 	}
 
-	bug_on(sizeof(n->rev_dns_src) != sizeof(n->rev_dns_dst));
-	getnameinfo(sa, sa_len, SELFLD(dir, rev_dns_src, rev_dns_dst),
-		    sizeof(n->rev_dns_src), NULL, 0, NI_NUMERICHOST);
+	bug_on(sizeof(n->ext->rev_dns_src) != sizeof(n->ext->rev_dns_dst));
+	if (getnameinfo(sa, sa_len, host, sizeof(n->ext->rev_dns_src), NULL,
+			0, flags))
+		getnameinfo(sa, sa_len, host, sizeof(n->ext->rev_dns_src), NULL,
+			    0, NI_NUMERICHOST);
+}
+
+static void addr_cache_key(struct flow_entry *n, enum flow_entry_direction dir,
+			   uint8_t *family, uint8_t *addr)
+{
+	uint32_t ip4 = htonl(SELFLD(dir, ip4_src_addr, ip4_dst_addr));
+
+	*family = n->l3_proto;
 
-	if (hent) {
-		memset(n->rev_dns_dst, 0, sizeof(n->rev_dns_dst));
-		memcpy(SELFLD(dir, rev_dns_src, rev_dns_dst),
-		       hent->h_name, min(sizeof(n->rev_dns_src),
-					 strlen(hent->h_name)));
+	memset(addr, 0, 16);
+	if (n->l3_proto == AF_INET)
+		memcpy(addr, &ip4, sizeof(ip4));
+	else
+		memcpy(addr, SELFLD(dir, ip6_src_addr, ip6_dst_addr), 16);
+}
+
+static inline unsigned int addr_cache_hash(uint8_t family,
+					   const uint8_t *addr)
+{
+	unsigned int i, hash = 2166136261U ^ family;
+
+	for (i = 0; i < 16; ++i)
+		hash = (hash ^ addr[i]) * 16777619U;
+
+	return hash & (ADDR_CACHE_BUCKETS - 1);
+}
+
+static struct addr_cache_entry *addr_cache_find(struct addr_cache *c,
+						uint8_t family,
+						const uint8_t *addr)
+{
+	struct addr_cache_entry *e = c->buckets[addr_cache_hash(family, addr)];
+
+	while (e && (e->family != family ||
+		     memcmp(e->addr, addr, sizeof(e->addr))))
+		e = e->hnext;
+
+	return e;
+}
+
+static void addr_cache_unlink(struct addr_cache *c, struct addr_cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		c->newest = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		c->oldest = e->prev;
+}
+
+static void addr_cache_push(struct addr_cache *c, struct addr_cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = c->newest;
+
+	if (c->newest)
+		c->newest->prev = e;
+	else
+		c->oldest = e;
+
+	c->newest = e;
+}
+
+static int addr_cache_get(struct addr_cache *c, struct flow_entry *n,
+			  enum flow_entry_direction dir)
+{
+	uint8_t family, addr[16];
+	struct addr_cache_entry *e;
+
+	addr_cache_key(n, dir, &family, addr);
+
+	mutexlock_lock(&c->lock);
+	e = addr_cache_find(c, family, addr);
+	if (e) {
+		addr_cache_unlink(c, e);
+		addr_cache_push(c, e);
+
+		memcpy(SELFLD(dir, ext->rev_dns_src, ext->rev_dns_dst),
+		       e->rev_dns, sizeof(e->rev_dns));
+		memcpy(SELFLD(dir, ext->country_src, ext->country_dst),
+		       e->country, sizeof(e->country));
+		memcpy(SELFLD(dir, ext->city_src, ext->city_dst), e->city,
+		       sizeof(e->city));
 	}
+	mutexlock_unlock(&c->lock);
+
+	return e != NULL;
+}
+
+static void addr_cache_put(struct addr_cache *c, struct flow_entry *n,
+			   enum flow_entry_direction dir)
+{
+	unsigned int hash;
+	uint8_t family, addr[16];
+	struct addr_cache_entry *e, **prev;
+
+	addr_cache_key(n, dir, &family, addr);
+	hash = addr_cache_hash(family, addr);
+
+	mutexlock_lock(&c->lock);
+	if (addr_cache_find(c, family, addr)) {
+		mutexlock_unlock(&c->lock);
+		return;
+	}
+
+	if (c->used < ADDR_CACHE_SIZE) {
+		e = &c->entries[c->used++];
+	} else {
+		e = c->oldest;
+		addr_cache_unlink(c, e);
+
+		prev = &c->buckets[addr_cache_hash(e->family, e->addr)];
+		while (*prev != e)
+			prev = &(*prev)->hnext;
+		*prev = e->hnext;
+	}
+
+	e->family = family;
+	memcpy(e->addr, addr, sizeof(e->addr));
+	memcpy(e->rev_dns, SELFLD(dir, ext->rev_dns_src, ext->rev_dns_dst),
+	       sizeof(e->rev_dns));
+	memcpy(e->country, SELFLD(dir, ext->country_src, ext->country_dst),
+	       sizeof(e->country));
+	memcpy(e->city, SELFLD(dir, ext->city_src, ext->city_dst),
+	       sizeof(e->city));
+
+	e->hnext = c->buckets[hash];
+	c->buckets[hash] = e;
+	addr_cache_push(c, e);
+	mutexlock_unlock(&c->lock);
+}
+
+static void addr_cache_init(struct addr_cache *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->entries = xzmalloc(ADDR_CACHE_SIZE * sizeof(*c->entries));
+	mutexlock_init(&c->lock);
+}
+
+static void addr_cache_destroy(struct addr_cache *c)
+{
+	mutexlock_destroy(&c->lock);
+	xfree(c->entries);
+}
+
+static void flow_entry_get_extended_addr(struct flow_entry *n,
+					 enum flow_entry_direction dir)
+{
+	if (addr_cache_get(&addr_cache, n, dir))
+		return;
+
+	flow_entry_get_extended_revdns(n, dir, NI_NAMEREQD);
+	flow_entry_get_extended_geo(n, dir);
+
+	addr_cache_put(&addr_cache, n, dir);
+}
+
+static void flow_entry_get_numeric(struct flow_entry *n)
+{
+	if (n->flow_id == 0 || flow_entry_get_extended_is_dns(n))
+		return;
+
+	flow_entry_get_extended_revdns(n, flow_entry_src, NI_NUMERICHOST);
+	flow_entry_get_extended_revdns(n, flow_entry_dst, NI_NUMERICHOST);
 }
 
 static void flow_entry_get_extended(struct flow_entry *n)
@@ -732,17 +1579,121 @@ static void flow_entry_get_extended(struct flow_entry *n)
 	if (n->flow_id == 0 || flow_entry_get_extended_is_dns(n))
 		return;
 
-	flow_entry_get_extended_revdns(n, flow_entry_src);
-	flow_entry_get_extended_geo(n, flow_entry_src);
+	flow_entry_get_extended_addr(n, flow_entry_src);
+	flow_entry_get_extended_addr(n, flow_entry_dst);
+
+	flow_entry_get_process(&sock_index, n);
+}
+
+static void enrich_queue_push(struct enrich_pool *p, struct flow_entry *n)
+{
+	uint32_t state = FLOW_ENRICH_NONE;
+	struct enrich_job *job;
+
+	if (n->flow_id == 0 || flow_entry_get_extended_is_dns(n))
+		return;
+	if (!__atomic_compare_exchange_n(&n->enrich, &state,
+					 FLOW_ENRICH_QUEUED, false,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	mutexlock_lock(&p->lock);
+	if (p->tail - p->head >= ENRICH_QUEUE_LEN) {
+		mutexlock_unlock(&p->lock);
 
-	flow_entry_get_extended_revdns(n, flow_entry_dst);
-	flow_entry_get_extended_geo(n, flow_entry_dst);
+		__atomic_fetch_add(&p->dropped, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&n->enrich, FLOW_ENRICH_NONE,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+
+	job = &p->jobs[p->tail++ % ENRICH_QUEUE_LEN];
+
+	job->flow_id = n->flow_id;
+	job->l3_proto = n->l3_proto;
+	job->l4_proto = n->l4_proto;
+	job->ip4_src_addr = n->ip4_src_addr;
+	job->ip4_dst_addr = n->ip4_dst_addr;
+	memcpy(job->ip6_src_addr, n->ip6_src_addr, sizeof(job->ip6_src_addr));
+	memcpy(job->ip6_dst_addr, n->ip6_dst_addr, sizeof(job->ip6_dst_addr));
+	job->port_src = n->port_src;
+	job->port_dst = n->port_dst;
+
+	pthread_cond_signal(&p->cond);
+	mutexlock_unlock(&p->lock);
+}
+
+static void *enrich_worker(void *arg)
+{
+	struct enrich_pool *p = arg;
+	struct enrich_job job;
+	struct flow_entry n;
 
-	/* Lookup application */
-	n->inode = get_port_inode(n->port_src, n->l4_proto,
-				  n->l3_proto == AF_INET6);
-	if (n->inode > 0)
-		walk_processes(n);
+	rcu_register_thread();
+	for (;;) {
+		mutexlock_lock(&p->lock);
+		while (p->head == p->tail && !p->stop)
+			pthread_cond_wait(&p->cond, &p->lock.lock);
+		if (p->stop) {
+			mutexlock_unlock(&p->lock);
+			break;
+		}
+		job = p->jobs[p->head++ % ENRICH_QUEUE_LEN];
+		mutexlock_unlock(&p->lock);
+
+		memset(&n, 0, sizeof(n));
+		n.flow_id = job.flow_id;
+		n.l3_proto = job.l3_proto;
+		n.l4_proto = job.l4_proto;
+		n.ip4_src_addr = job.ip4_src_addr;
+		n.ip4_dst_addr = job.ip4_dst_addr;
+		memcpy(n.ip6_src_addr, job.ip6_src_addr, sizeof(n.ip6_src_addr));
+		memcpy(n.ip6_dst_addr, job.ip6_dst_addr, sizeof(n.ip6_dst_addr));
+		n.port_src = job.port_src;
+		n.port_dst = job.port_dst;
+		n.ext = xzmalloc(sizeof(*n.ext));
+
+		flow_entry_get_extended(&n);
+		flow_list_set_extended(&flow_list, &n);
+	}
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+static void enrich_pool_start(struct enrich_pool *p)
+{
+	int i, ret;
+
+	p->head = p->tail = 0;
+	p->dropped = 0;
+	p->stop = 0;
+
+	mutexlock_init(&p->lock);
+	pthread_cond_init(&p->cond, NULL);
+
+	for (i = 0; i < ENRICH_WORKERS; ++i) {
+		ret = pthread_create(&p->tids[i], NULL, enrich_worker, p);
+		if (ret)
+			panic("Cannot create enrichment worker!\n");
+	}
+}
+
+static void enrich_pool_stop(struct enrich_pool *p)
+{
+	int i;
+
+	mutexlock_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	mutexlock_unlock(&p->lock);
+
+	/* A worker may still sit in a DNS lookup for a while */
+	for (i = 0; i < ENRICH_WORKERS; ++i)
+		pthread_join(p->tids[i], NULL);
+
+	pthread_cond_destroy(&p->cond);
+	mutexlock_destroy(&p->lock);
 }
 
 static uint16_t presenter_get_port(uint16_t src, uint16_t dst, int tcp)
@@ -779,7 +1730,16 @@ static void presenter_screen_init(WINDOW **screen)
 	noecho();
 	cbreak();
 	keypad(stdscr, TRUE);
-	nodelay(*screen, TRUE);
+	/* Keys are handled right away, otherwise getch() is our clock */
+	wtimeout(*screen, PRESENTER_TICK_MS);
+	curs_set(0);
+
+	start_color();
+	init_pair(1, COLOR_RED, COLOR_BLACK);
+	init_pair(2, COLOR_BLUE, COLOR_BLACK);
+	init_pair(3, COLOR_YELLOW, COLOR_BLACK);
+	init_pair(4, COLOR_GREEN, COLOR_BLACK);
+
 	refresh();
 	wrefresh(*screen);
 }
@@ -793,9 +1753,9 @@ static void presenter_screen_do_line(WINDOW *screen, struct flow_entry *n,
 	mvwprintw(screen, *line, 2, "");
 
 	/* PID, application name */
-	if (n->procnum > 0) {
-		slprintf(tmp, sizeof(tmp), "%s(%u)", basename(n->cmdline),
-			 n->procnum);
+	if (n->ext->procnum > 0) {
+		slprintf(tmp, sizeof(tmp), "%s(%u)", basename(n->ext->cmdline),
+			 n->ext->procnum);
 
 		printw("[");
 		attron(COLOR_PAIR(3));
@@ -851,152 +1811,317 @@ static void presenter_screen_do_line(WINDOW *screen, struct flow_entry *n,
 	if (n->counter_pkts > 0 && n->counter_bytes > 0)
 		printw(" (%llu pkts, %llu bytes) ->",
 		       n->counter_pkts, n->counter_bytes);
+	if (n->rate > 0)
+		printw(" %llu bytes/s ->", n->rate);
 
 	/* Show source information: reverse DNS, port, country, city */
 	if (show_src) {
 		attron(COLOR_PAIR(1));
-		mvwprintw(screen, ++(*line), 8, "src: %s", n->rev_dns_src);
+		mvwprintw(screen, ++(*line), 8, "src: %s", n->ext->rev_dns_src);
 		attroff(COLOR_PAIR(1));
 
 		printw(":%u (", n->port_src);
 
 		attron(COLOR_PAIR(4));
-		printw("%s", n->country_src);
+		printw("%s", n->ext->country_src);
 		attroff(COLOR_PAIR(4));
 
-		if (n->city_src[0])
-			printw(", %s", n->city_src);
+		if (n->ext->city_src[0])
+			printw(", %s", n->ext->city_src);
 		printw(") => ");
 	}
 
 	/* Show dest information: reverse DNS, port, country, city */
 	attron(COLOR_PAIR(2));
-	mvwprintw(screen, ++(*line), 8, "dst: %s", n->rev_dns_dst);
+	mvwprintw(screen, ++(*line), 8, "dst: %s", n->ext->rev_dns_dst);
 	attroff(COLOR_PAIR(2));
 
 	printw(":%u (", n->port_dst);
 
 	attron(COLOR_PAIR(4));
-	printw("%s", n->country_dst);
+	printw("%s", n->ext->country_dst);
 	attroff(COLOR_PAIR(4));
 
-	if (n->city_dst[0])
-		printw(", %s", n->city_dst);
+	if (n->ext->city_dst[0])
+		printw(", %s", n->ext->city_dst);
 	printw(")");
 }
 
-static inline int presenter_flow_wrong_state(struct flow_entry *n, int state)
+static int presenter_state_index(const uint8_t *states, size_t num,
+				  uint8_t state)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		if (states[i] == state)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Where a flow goes when rates are equal, or -1 if it is not shown */
+static int presenter_flow_rank(const struct flow_entry *n)
 {
-	int ret = 1;
+	int idx;
 
 	switch (n->l4_proto) {
 	case IPPROTO_TCP:
-		if (n->tcp_state == state)
-			ret = 0;
-		break;
-	case IPPROTO_SCTP:
-		if (n->sctp_state == state)
-			ret = 0;
-		break;
+		return presenter_state_index(tcp_states, array_size(tcp_states),
+					     n->tcp_state);
 	case IPPROTO_DCCP:
-		if (n->dccp_state == state)
-			ret = 0;
-		break;
+		idx = presenter_state_index(dccp_states, array_size(dccp_states),
+					    n->dccp_state);
+		return idx < 0 ? -1 : 1 << 8 | idx;
+	case IPPROTO_SCTP:
+		idx = presenter_state_index(sctp_states, array_size(sctp_states),
+					    n->sctp_state);
+		return idx < 0 ? -1 : 2 << 8 | idx;
 	case IPPROTO_UDP:
+		return 3 << 8;
 	case IPPROTO_UDPLITE:
+		return 4 << 8;
 	case IPPROTO_ICMP:
+		return 5 << 8;
 	case IPPROTO_ICMPV6:
-		ret = 0;
-		break;
+		return 6 << 8;
 	}
 
-	return ret;
+	return -1;
 }
 
-static void presenter_screen_update(WINDOW *screen, struct flow_list *fl,
-				    int skip_lines)
+static inline bool presenter_flow_before(const struct flow_entry *a,
+					 const struct flow_entry *b)
+{
+	int rank_a, rank_b;
+
+	if (a->rate != b->rate)
+		return a->rate > b->rate;
+
+	rank_a = presenter_flow_rank(a);
+	rank_b = presenter_flow_rank(b);
+	if (rank_a != rank_b)
+		return rank_a < rank_b;
+
+	return a->flow_id < b->flow_id;
+}
+
+/* Only the presenter touches the rate fields */
+static void presenter_flow_rate(struct flow_entry *n, uint64_t now)
 {
-	int i, j, maxy;
-	unsigned int line = 3;
+	uint64_t bytes = n->counter_bytes;
+
+	if (n->rate_ms != 0 && now - n->rate_ms < PRESENTER_RATE_MS)
+		return;
+
+	if (n->rate_ms != 0 && bytes >= n->rate_bytes)
+		n->rate = (bytes - n->rate_bytes) * 1000 / (now - n->rate_ms);
+
+	n->rate_bytes = bytes;
+	n->rate_ms = now;
+}
+
+/* The heap has the flow that goes last on top */
+static void presenter_heap_up(struct flow_entry **heap, unsigned int i)
+{
+	unsigned int p;
+	struct flow_entry *n = heap[i];
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (!presenter_flow_before(heap[p], n))
+			break;
+		heap[i] = heap[p];
+		i = p;
+	}
+
+	heap[i] = n;
+}
+
+static void presenter_heap_down(struct flow_entry **heap, unsigned int len,
+				unsigned int i)
+{
+	unsigned int c;
+	struct flow_entry *n = heap[i];
+
+	while ((c = 2 * i + 1) < len) {
+		if (c + 1 < len && presenter_flow_before(heap[c], heap[c + 1]))
+			c++;
+		if (!presenter_flow_before(n, heap[c]))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+
+	heap[i] = n;
+}
+
+static void presenter_heap_push(struct presenter_view *v, unsigned int k,
+				struct flow_entry *n)
+{
+	if (v->heap_len < k) {
+		v->heap[v->heap_len] = n;
+		presenter_heap_up(v->heap, v->heap_len++);
+	} else if (k > 0 && presenter_flow_before(n, v->heap[0])) {
+		v->heap[0] = n;
+		presenter_heap_down(v->heap, v->heap_len, 0);
+	}
+}
+
+static void presenter_heap_sort(struct presenter_view *v)
+{
+	unsigned int len = v->heap_len;
 	struct flow_entry *n;
-	uint8_t protocols[] = {
-		IPPROTO_TCP,
-		IPPROTO_DCCP,
-		IPPROTO_SCTP,
-		IPPROTO_UDP,
-		IPPROTO_UDPLITE,
-		IPPROTO_ICMP,
-		IPPROTO_ICMPV6,
-	};
-	size_t protocol_state_size[] = {
-		[IPPROTO_TCP] = array_size(tcp_states),
-		[IPPROTO_DCCP] = array_size(dccp_states),
-		[IPPROTO_SCTP] = array_size(sctp_states),
-		[IPPROTO_UDP] = 1,
-		[IPPROTO_UDPLITE] = 1,
-		[IPPROTO_ICMP] = 1,
-		[IPPROTO_ICMPV6] = 1,
-	};
 
-	curs_set(0);
+	while (len > 1) {
+		n = v->heap[0];
+		v->heap[0] = v->heap[--len];
+		v->heap[len] = n;
+		presenter_heap_down(v->heap, len, 0);
+	}
+}
 
-	maxy = getmaxy(screen);
-	maxy -= 6;
+static void presenter_view_resize(struct presenter_view *v, WINDOW *screen,
+				  int skip_lines)
+{
+	int maxy = getmaxy(screen);
+	unsigned int k;
+
+	v->row_lines = 3 + show_src;
+	v->max_rows = maxy > 3 ? (maxy - 3) / v->row_lines : 0;
+
+	/* shown[].ext points into shown_ext, which may move: draw all anew */
+	if (v->max_rows > v->rows_size) {
+		v->rows = xrealloc(v->rows, v->max_rows, sizeof(*v->rows));
+		v->shown = xrealloc(v->shown, v->max_rows, sizeof(*v->shown));
+		v->rows_ext = xrealloc(v->rows_ext, v->max_rows,
+				       sizeof(*v->rows_ext));
+		v->shown_ext = xrealloc(v->shown_ext, v->max_rows,
+					sizeof(*v->shown_ext));
+		v->rows_size = v->max_rows;
+		v->redraw = true;
+	}
 
-	start_color();
-	init_pair(1, COLOR_RED, COLOR_BLACK);
-	init_pair(2, COLOR_BLUE, COLOR_BLACK);
-	init_pair(3, COLOR_YELLOW, COLOR_BLACK);
-	init_pair(4, COLOR_GREEN, COLOR_BLACK);
+	k = skip_lines + v->max_rows;
+	if (k > v->heap_size) {
+		v->heap = xrealloc(v->heap, k, sizeof(*v->heap));
+		v->heap_size = k;
+	}
+}
 
-	wclear(screen);
-	clear();
+/*
+ * One walk over all flows, which keeps the ones that are on the screen,
+ * the fastest ones first, in a heap as big as the screen and the rows
+ * scrolled over. They are copied out, so drawing needs no RCU.
+ */
+static void presenter_snapshot(struct presenter_view *v, struct flow_list *fl,
+			       int skip_lines, uint64_t now)
+{
+	unsigned int b, i, k = skip_lines + v->max_rows;
+	struct flow_entry *n;
 
-	mvwprintw(screen, 1, 2, "Kernel netfilter TCP/UDP "
-		  "flow statistics, [+%d]", skip_lines);
+	v->heap_len = 0;
+	v->nr_rows = 0;
 
 	rcu_read_lock();
 
-	if (rcu_dereference(fl->head) == NULL)
-		mvwprintw(screen, line, 2, "(No active sessions! "
-			  "Is netfilter running?)");
+	v->nr_flows = __atomic_load_n(&fl->nr, __ATOMIC_RELAXED);
 
-	for (i = 0; i < array_size(protocols); i++) {
-		for (j = 0; j < protocol_state_size[protocols[i]]; j++) {
-			n = rcu_dereference(fl->head);
-			while (n && maxy > 0) {
-				int skip_entry = 0;
-
-				if (n->l4_proto != protocols[i])
-					skip_entry = 1;
-				if (presenter_flow_wrong_state(n, j))
-					skip_entry = 1;
-				if (presenter_get_port(n->port_src,
-						       n->port_dst, 0) == 53)
-					skip_entry = 1;
-				if (skip_entry) {
-					n = rcu_dereference(n->next);
-					continue;
-				}
-				if (skip_lines > 0) {
-					n = rcu_dereference(n->next);
-					skip_lines--;
-					continue;
-				}
-
-				presenter_screen_do_line(screen, n, &line);
-
-				line++;
-				maxy -= (2 + 1 * show_src);
-				n = rcu_dereference(n->next);
-			}
-		}
+	for (n = flow_list_next(fl, NULL, &b); n;
+	     n = flow_list_next(fl, n, &b)) {
+		presenter_flow_rate(n, now);
+
+		if (presenter_flow_rank(n) < 0)
+			continue;
+		if (presenter_get_port(n->port_src, n->port_dst, 0) == 53)
+			continue;
+
+		presenter_heap_push(v, k, n);
+	}
+
+	presenter_heap_sort(v);
+
+	for (i = skip_lines; i < v->heap_len; i++, v->nr_rows++) {
+		v->rows[v->nr_rows] = *v->heap[i];
+		v->rows_ext[v->nr_rows] = *rcu_dereference(v->heap[i]->ext);
+		v->rows[v->nr_rows].ext = &v->rows_ext[v->nr_rows];
 	}
 
 	rcu_read_unlock();
+}
+
+static bool presenter_row_changed(const struct flow_entry *a,
+				  const struct flow_entry *b)
+{
+	return a->flow_id != b->flow_id || a->ext->procnum != b->ext->procnum ||
+	       a->l3_proto != b->l3_proto || a->l4_proto != b->l4_proto ||
+	       a->tcp_state != b->tcp_state ||
+	       a->sctp_state != b->sctp_state ||
+	       a->dccp_state != b->dccp_state ||
+	       a->port_src != b->port_src || a->port_dst != b->port_dst ||
+	       a->counter_pkts != b->counter_pkts ||
+	       a->counter_bytes != b->counter_bytes || a->rate != b->rate ||
+	       strcmp(a->ext->cmdline, b->ext->cmdline) ||
+	       strcmp(a->ext->rev_dns_src, b->ext->rev_dns_src) ||
+	       strcmp(a->ext->rev_dns_dst, b->ext->rev_dns_dst) ||
+	       strcmp(a->ext->country_src, b->ext->country_src) ||
+	       strcmp(a->ext->country_dst, b->ext->country_dst) ||
+	       strcmp(a->ext->city_src, b->ext->city_src) ||
+	       strcmp(a->ext->city_dst, b->ext->city_dst);
+}
+
+/* Only rows that differ from what is on the screen are drawn again */
+static void presenter_screen_update(WINDOW *screen, struct presenter_view *v,
+				    int skip_lines)
+{
+	unsigned int i, j, line;
+	unsigned long dropped;
+	struct flow_extended *tmp_ext;
+	struct flow_entry *tmp;
+
+	if (v->redraw)
+		wclear(screen);
+
+	mvwprintw(screen, 1, 2, "Kernel netfilter TCP/UDP "
+		  "flow statistics, [+%d]", skip_lines);
+	dropped = __atomic_load_n(&enrich_pool.dropped, __ATOMIC_RELAXED);
+	if (dropped)
+		printw(", %lu lookups deferred", dropped);
+	wclrtoeol(screen);
+
+	for (i = 0; i < v->nr_rows; i++) {
+		if (!v->redraw && i < v->nr_shown &&
+		    !presenter_row_changed(&v->rows[i], &v->shown[i]))
+			continue;
+
+		line = 3 + i * v->row_lines;
+		for (j = 0; j < v->row_lines; j++) {
+			wmove(screen, line + j, 0);
+			wclrtoeol(screen);
+		}
+
+		presenter_screen_do_line(screen, &v->rows[i], &line);
+	}
+
+	if (v->nr_rows < v->nr_shown || v->nr_rows == 0) {
+		wmove(screen, 3 + v->nr_rows * v->row_lines, 0);
+		wclrtobot(screen);
+	}
+
+	if (v->nr_flows == 0)
+		mvwprintw(screen, 3, 2, "(No active sessions! "
+			  "Is netfilter running?)");
+
+	tmp = v->shown;
+	v->shown = v->rows;
+	v->rows = tmp;
+	tmp_ext = v->shown_ext;
+	v->shown_ext = v->rows_ext;
+	v->rows_ext = tmp_ext;
+	v->nr_shown = v->nr_rows;
+	v->redraw = false;
 
 	wrefresh(screen);
-	refresh();
 }
 
 static inline void presenter_screen_end(void)
@@ -1007,13 +2132,21 @@ static inline void presenter_screen_end(void)
 static void presenter(void)
 {
 	int skip_lines = 0;
+	bool update;
+	uint64_t now;
 	WINDOW *screen = NULL;
+	struct presenter_view view;
+
+	memset(&view, 0, sizeof(view));
+	view.redraw = true;
 
 	dissector_init_ethernet(0);
 	presenter_screen_init(&screen);
 
 	rcu_register_thread();
 	while (!sigint) {
+		update = true;
+
 		switch (getch()) {
 		case 'q':
 			sigint = 1;
@@ -1032,18 +2165,42 @@ static void presenter(void)
 			if (skip_lines > SCROLL_MAX)
 				skip_lines = SCROLL_MAX;
 			break;
+		case KEY_RESIZE:
+			view.redraw = true;
+			break;
+		case ERR:
+			update = false;
+			break;
 		default:
 			fflush(stdin);
 			break;
 		}
 
-		presenter_screen_update(screen, &flow_list, skip_lines);
-		usleep(100000);
+		now = flowtop_now_ms();
+		if (!update && now - view.updated_ms < PRESENTER_UPDATE_MS)
+			continue;
+
+		presenter_view_resize(&view, screen, skip_lines);
+		presenter_snapshot(&view, &flow_list, skip_lines, now);
+		presenter_screen_update(screen, &view, skip_lines);
+
+		view.updated_ms = now;
 	}
 	rcu_unregister_thread();
 
 	presenter_screen_end();
 	dissector_cleanup_ethernet();
+
+	if (view.heap)
+		xfree(view.heap);
+	if (view.rows)
+		xfree(view.rows);
+	if (view.shown)
+		xfree(view.shown);
+	if (view.rows_ext)
+		xfree(view.rows_ext);
+	if (view.shown_ext)
+		xfree(view.shown_ext);
 }
 
 static int collector_cb(enum nf_conntrack_msg_type type,
@@ -1052,13 +2209,8 @@ static int collector_cb(enum nf_conntrack_msg_type type,
 	if (sigint)
 		return NFCT_CB_STOP;
 
-	synchronize_rcu();
-	spinlock_lock(&flow_list.lock);
-
 	switch (type) {
 	case NFCT_T_NEW:
-		flow_list_new_entry(&flow_list, ct);
-		break;
 	case NFCT_T_UPDATE:
 		flow_list_update_entry(&flow_list, ct);
 		break;
@@ -1069,8 +2221,6 @@ static int collector_cb(enum nf_conntrack_msg_type type,
 		break;
 	}
 
-	spinlock_unlock(&flow_list.lock);
-
 	return NFCT_CB_CONTINUE;
 }
 
@@ -1130,6 +2280,9 @@ static void *collector(void *null)
 	int ret;
 	struct nfct_handle *handle;
 	struct nfct_filter *filter;
+	struct timeval timeout = {
+		.tv_usec = COLLECTOR_TIMEOUT_MS * 1000,
+	};
 
 	handle = nfct_open(CONNTRACK, NF_NETLINK_CONNTRACK_NEW |
 				      NF_NETLINK_CONNTRACK_UPDATE |
@@ -1181,19 +2334,32 @@ static void *collector(void *null)
 
 	nfct_filter_destroy(filter);
 
+	/* nfct_catch() retries on EINTR, so it has to time out to see sigint */
+	ret = setsockopt(nfct_fd(handle), SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			 sizeof(timeout));
+	if (ret < 0)
+		panic("Cannot set receive timeout on nfct handle!\n");
+
 	collector_load_geoip();
 
-	flow_list_init(&flow_list);
+	addr_cache_init(&addr_cache);
+	sock_index_init(&sock_index);
+	enrich_pool_start(&enrich_pool);
 
 	rcu_register_thread();
 
-	while (!sigint && ret >= 0)
+	while (!sigint) {
 		ret = nfct_catch(handle);
+		if (ret < 0 && errno != EAGAIN)
+			break;
+	}
 
 	rcu_unregister_thread();
 
-	flow_list_destroy(&flow_list);
+	enrich_pool_stop(&enrich_pool);
 
+	sock_index_destroy(&sock_index);
+	addr_cache_destroy(&addr_cache);
 	collector_destroy_geoip();
 
 	nfct_close(handle);
@@ -1281,6 +2447,9 @@ int main(int argc, char **argv)
 
 	rcu_init();
 
+	/* Before the collector, the presenter looks at it right away */
+	flow_list_init(&flow_list);
+
 	register_signal(SIGINT, signal_handler);
 	register_signal(SIGHUP, signal_handler);
 
@@ -1290,6 +2459,11 @@ int main(int argc, char **argv)
 
 	presenter();
 
+	/* The presenter only returns on sigint, the collector sees it too */
+	pthread_join(tid, NULL);
+
+	flow_list_destroy(&flow_list);
+
 	free(geo_country.path4);
 	free(geo_country.path6);
 
@@ -31,16 +31,6 @@
 #include <stdio.h>
 
 #define alloc_nr(x) (((x) + 16) * 3 / 2)
-#define INSERT_HASH_PROTOS(ops, table)					\
-	do {								\
-		void **pos = insert_hash((ops).key, &(ops), &(table));	\
-		/* We already had an entry there? */			\
-		if (pos) {						\
-			(ops).next = *pos;				\
-			*pos = &(ops);					\
-		}							\
-	} while (0)
-
 struct hash_table_entry {
 	unsigned int hash;
 	void *ptr;
@@ -37,6 +37,12 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <dirent.h>
 
 #include "ring_rx.h"
 #include "ring_tx.h"
@@ -50,27 +56,44 @@
 #include "tprintf.h"
 #include "dissector.h"
 #include "xmalloc.h"
+#include "spsc.h"
+#include "pacer.h"
+#include "flow.h"
 
 enum dump_mode {
 	DUMP_INTERVAL_TIME,
 	DUMP_INTERVAL_SIZE,
 };
 
+#define MAX_FANOUT_WORKERS	64
+
 struct ctx {
 	char *device_in, *device_out, *device_trans, *filter, *prefix;
 	int cpu, rfraw, dump, print_mode, dump_dir, jumbo_support, packet_type, verbose;
+	int worker;
+	unsigned int fanout_workers, fanout_group;
 	unsigned long kpull, dump_interval, reserve_size, tx_bytes, tx_packets;
-	bool randomize, promiscuous;
+	bool randomize, promiscuous, odirect, flows, ebpf;
+	unsigned long flow_idle, flow_active;
 	enum pcap_ops_groups pcap;
 	enum dump_mode dump_mode;
-	uint32_t link_type;
+	uint32_t link_type, magic, snaplen;
+	struct bpf_ebpf_opts ebpf_opts;
+	double speed;
+	uint64_t rate;
+	enum pacer_unit rate_unit;
+};
+
+struct fanout_stats {
+	int cpu;
+	unsigned long packets, drops, tv_sec, tv_usec;
 };
 
 volatile sig_atomic_t sigint = 0;
 
 static volatile bool next_dump = false;
 
-static const char *short_options = "d:i:o:rf:MJt:S:k:n:b:B:HQmcsqXlvhF:RgAP:V";
+static const char *short_options = "d:i:o:rf:ey:CMJt:S:k:n:b:B:HQmcsqXlvhF:RgAP:VT:uDNZL:x:p:E:wW:";
 static const struct option long_options[] = {
 	{"dev",			required_argument,	NULL, 'd'},
 	{"in",			required_argument,	NULL, 'i'},
@@ -84,11 +107,22 @@ static const struct option long_options[] = {
 	{"bind-cpu",		required_argument,	NULL, 'b'},
 	{"unbind-cpu",		required_argument,	NULL, 'B'},
 	{"prefix",		required_argument,	NULL, 'P'},
+	{"threads",		required_argument,	NULL, 'T'},
+	{"snaplen",		required_argument,	NULL, 'L'},
+	{"speed",		required_argument,	NULL, 'x'},
+	{"rate",		required_argument,	NULL, 'p'},
+	{"sample",		required_argument,	NULL, 'y'},
 	{"rand",		no_argument,		NULL, 'r'},
+	{"ebpf",		no_argument,		NULL, 'e'},
+	{"ebpf-counters",	no_argument,		NULL, 'C'},
 	{"rfraw",		no_argument,		NULL, 'R'},
 	{"mmap",		no_argument,		NULL, 'm'},
 	{"sg",			no_argument,		NULL, 'g'},
 	{"clrw",		no_argument,		NULL, 'c'},
+	{"uring",		no_argument,		NULL, 'u'},
+	{"odirect",		no_argument,		NULL, 'D'},
+	{"pcapng",		no_argument,		NULL, 'N'},
+	{"nsec",		no_argument,		NULL, 'Z'},
 	{"jumbo-support",	no_argument,		NULL, 'J'},
 	{"no-promisc",		no_argument,		NULL, 'M'},
 	{"prio-high",		no_argument,		NULL, 'H'},
@@ -97,6 +131,9 @@ static const struct option long_options[] = {
 	{"less",		no_argument,		NULL, 'q'},
 	{"hex",			no_argument,		NULL, 'X'},
 	{"ascii",		no_argument,		NULL, 'l'},
+	{"export",		required_argument,	NULL, 'E'},
+	{"flows",		no_argument,		NULL, 'w'},
+	{"flow-timeouts",	required_argument,	NULL, 'W'},
 	{"no-sock-mem",		no_argument,		NULL, 'A'},
 	{"verbose",		no_argument,		NULL, 'V'},
 	{"version",		no_argument,		NULL, 'v'},
@@ -167,23 +204,311 @@ static void timer_next_dump(int unused)
 	setitimer(ITIMER_REAL, &itimer, NULL);
 }
 
+static inline void flows_check_link_type(struct ctx *ctx)
+{
+	if (ctx->link_type != LINKTYPE_EN10MB)
+		panic("Flows can only be taken from Ethernet frames!\n");
+}
+
 static inline bool dump_to_pcap(struct ctx *ctx)
 {
 	return ctx->dump;
 }
 
+struct pcap_in_file {
+	char *name;
+	uint64_t ts;
+};
+
+/*
+ * Replay input, either a single pcap or a directory of them, e.g. one
+ * written with --interval. Files are played in the order of the timestamp
+ * of their first packet, while one is played the next one is already
+ * read into the page cache.
+ */
+struct pcap_in {
+	struct pcap_in_file *files;
+	unsigned int nr, cur;
+	int fd, fd_next;
+	enum pcap_ops_groups pcap;
+	/* From pcapng interfaces with a link type we could not take */
+	unsigned long other_link;
+};
+
+static inline bool link_type_dissectable(uint32_t link_type)
+{
+	return link_type == LINKTYPE_EN10MB ||
+	       link_type == LINKTYPE_IEEE802_11;
+}
+
+static int pcap_in_filter(const struct dirent *ent)
+{
+	const char *ext = strrchr(ent->d_name, '.');
+
+	return ext && (!strcmp(ext, ".pcap") || !strcmp(ext, ".pcapng"));
+}
+
+static int pcap_in_cmp(const void *a, const void *b)
+{
+	const struct pcap_in_file *fa = a, *fb = b;
+
+	if (fa->ts != fb->ts)
+		return fa->ts < fb->ts ? -1 : 1;
+
+	return strcmp(fa->name, fb->name);
+}
+
+/* Checked up front, pull_file_header() panics on a bad pcap header */
+static bool pcap_in_header_ok(int fd)
+{
+	struct pcap_filehdr hdr;
+
+	if (pcap_is_pcapng(fd))
+		return true;
+
+	return pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	       pcap_header_is_valid(&hdr);
+}
+
+static int pcap_in_first_ts(const char *name, uint8_t *buf, size_t len,
+			    uint64_t *ts)
+{
+	int fd, ret;
+	uint32_t magic, link_type;
+	struct pcap_pkthdr phdr;
+	struct pcap_pkt_meta meta;
+	const struct pcap_file_ops *ops;
+
+	fd = open(name, O_RDONLY | O_LARGEFILE | O_NOATIME);
+	if (fd < 0) {
+		ret = -errno;
+		whine("Skipping %s: %s\n", name, strerror(-ret));
+		return ret;
+	}
+
+	if (!pcap_in_header_ok(fd)) {
+		whine("Skipping %s: not a valid pcap file\n", name);
+		close(fd);
+		return -EINVAL;
+	}
+
+	/* Plain reads, so the actual backend's state stays untouched */
+	ops = pcap_ops[pcap_is_pcapng(fd) ? PCAP_OPS_NG : PCAP_OPS_RW];
+
+	ret = ops->pull_file_header(fd, &magic, &link_type);
+	if (ret) {
+		whine("Skipping %s: not a valid pcap file\n", name);
+	} else if ((ops->read_pcap_pkt_meta ?
+		    ops->read_pcap_pkt_meta(fd, &phdr, &meta, buf, len) :
+		    ops->read_pcap_pkt(fd, &phdr, buf, len)) <= 0) {
+		/* Files without a single packet have nothing to play */
+		whine("Skipping %s: no readable packets\n", name);
+		ret = -EIO;
+	} else {
+		*ts = pcap_pkthdr_ts_ns(&phdr, magic);
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+static void pcap_in_scan_dir(struct pcap_in *in, const char *dir)
+{
+	int i, num;
+	uint8_t *buf;
+	size_t len = round_up(1024 * 1024, PAGE_SIZE);
+	struct dirent **ents;
+	struct pcap_in_file *file;
+	char name[PATH_MAX];
+
+	num = scandir(dir, &ents, pcap_in_filter, alphasort);
+	if (num < 0)
+		panic("Cannot read directory %s!\n", dir);
+
+	buf = xmalloc(len);
+	in->files = xzmalloc((num ? : 1) * sizeof(*in->files));
+
+	for (i = 0; i < num; i++) {
+		file = &in->files[in->nr];
+
+		slprintf(name, sizeof(name), "%s/%s", dir, ents[i]->d_name);
+		free(ents[i]);
+
+		if (pcap_in_first_ts(name, buf, len, &file->ts))
+			continue;
+
+		file->name = xstrdup(name);
+		in->nr++;
+	}
+
+	free(ents);
+	xfree(buf);
+
+	if (in->nr == 0)
+		panic("No pcap files with packets found in %s!\n", dir);
+
+	qsort(in->files, in->nr, sizeof(*in->files), pcap_in_cmp);
+}
+
+static void pcap_in_start(struct ctx *ctx, struct pcap_in *in)
+{
+	int ret;
+	uint32_t link_type;
+	const char *name = in->files[in->cur].name;
+
+	if (in->fd_next >= 0) {
+		in->fd = in->fd_next;
+		in->fd_next = -1;
+	} else {
+		in->fd = open_or_die(name, O_RDONLY | O_LARGEFILE | O_NOATIME);
+	}
+
+	/* pcapng files can only be parsed by their own backend */
+	ctx->pcap = pcap_is_pcapng(in->fd) ? PCAP_OPS_NG : in->pcap;
+
+	ret = __pcap_io->pull_file_header(in->fd, &ctx->magic, &link_type);
+	if (ret)
+		panic("Error reading pcap header of %s!\n", name);
+
+	if (in->cur > 0 && link_type != ctx->link_type)
+		panic("Link type of %s differs from previous files!\n", name);
+	ctx->link_type = link_type;
+
+	if (__pcap_io->prepare_reading_pcap) {
+		ret = __pcap_io->prepare_reading_pcap(in->fd);
+		if (ret)
+			panic("Error prepare reading pcap!\n");
+	}
+
+	if (in->cur + 1 < in->nr) {
+		in->fd_next = open_or_die(in->files[in->cur + 1].name,
+					  O_RDONLY | O_LARGEFILE | O_NOATIME);
+		posix_fadvise(in->fd_next, 0, 0, POSIX_FADV_WILLNEED);
+	}
+}
+
+static void pcap_in_stop(struct ctx *ctx, struct pcap_in *in)
+{
+	if (__pcap_io->prepare_close_pcap)
+		__pcap_io->prepare_close_pcap(in->fd, PCAP_MODE_READ);
+
+	close(in->fd);
+}
+
+static void pcap_in_open(struct ctx *ctx, struct pcap_in *in)
+{
+	struct stat stats;
+
+	fmemset(in, 0, sizeof(*in));
+
+	in->fd_next = -1;
+	in->pcap = ctx->pcap;
+
+	if (stat(ctx->device_in, &stats) == 0 && S_ISDIR(stats.st_mode)) {
+		pcap_in_scan_dir(in, ctx->device_in);
+	} else {
+		in->files = xzmalloc(sizeof(*in->files));
+		in->files[0].name = xstrdup(ctx->device_in);
+		in->nr = 1;
+	}
+
+	pcap_in_start(ctx, in);
+}
+
+static ssize_t pcap_in_read_pkt(struct ctx *ctx, struct pcap_in *in,
+				struct pcap_pkthdr *phdr,
+				struct pcap_pkt_meta *meta, uint8_t *packet,
+				size_t len)
+{
+	ssize_t ret;
+
+	if (__pcap_io->read_pcap_pkt_meta)
+		return __pcap_io->read_pcap_pkt_meta(in->fd, phdr, meta,
+						     packet, len);
+
+	ret = __pcap_io->read_pcap_pkt(in->fd, phdr, packet, len);
+
+	meta->tv_nsec = pcap_magic_is_nsec(ctx->magic) ? phdr->ts.tv_nsec :
+			phdr->ts.tv_usec * 1000;
+	meta->ifindex = 0;
+	meta->linktype = ctx->link_type;
+
+	return ret;
+}
+
+/*
+ * Packets of pcapng interfaces with a link type other than the first
+ * one's are skipped, unless any_link is set and we can dissect them.
+ */
+static ssize_t pcap_in_read(struct ctx *ctx, struct pcap_in *in,
+			    struct pcap_pkthdr *phdr,
+			    struct pcap_pkt_meta *meta, uint8_t *packet,
+			    size_t len, bool any_link)
+{
+	ssize_t ret;
+
+	while (1) {
+		/* Only a clean EOF moves on, a broken file ends the reading */
+		while ((ret = pcap_in_read_pkt(ctx, in, phdr, meta, packet,
+					       len)) == 0 &&
+		       in->cur + 1 < in->nr) {
+			pcap_in_stop(ctx, in);
+			in->cur++;
+			pcap_in_start(ctx, in);
+		}
+
+		if (ret <= 0 || meta->linktype == ctx->link_type ||
+		    (any_link && link_type_dissectable(meta->linktype)))
+			break;
+
+		in->other_link++;
+	}
+
+	if (ret < 0)
+		whine("Error reading packet from %s: %s!\n",
+		      in->files[in->cur].name, strerror((int) -ret));
+
+	return ret;
+}
+
+static void pcap_in_close(struct ctx *ctx, struct pcap_in *in)
+{
+	unsigned int i;
+
+	pcap_in_stop(ctx, in);
+
+	if (in->fd_next >= 0)
+		close(in->fd_next);
+
+	for (i = 0; i < in->nr; i++)
+		xfree(in->files[i].name);
+	xfree(in->files);
+
+	if (in->other_link)
+		whine("Skipped %lu packets of interfaces with another link "
+		      "type!\n", in->other_link);
+}
+
 static void pcap_to_xmit(struct ctx *ctx)
 {
 	__label__ out;
 	uint8_t *out = NULL;
-	int irq, ifindex, fd = 0, ret;
+	int irq, ifindex, ret;
 	unsigned int size, it = 0;
 	unsigned long trunced = 0;
 	struct ring tx_ring;
 	struct frame_map *hdr;
 	struct sock_fprog bpf_ops;
+	struct bpf_jit bpf_jit;
 	struct timeval start, end, diff;
 	struct pcap_pkthdr phdr;
+	struct pcap_pkt_meta meta;
+	struct pcap_in in;
+	struct pacer pacer;
+	struct pollfd tx_poll;
+	unsigned int queued = 0;
+	uint64_t deadline;
 
 	if (!device_up_and_running(ctx->device_out) && !ctx->rfraw)
 		panic("Device not up and running!\n");
@@ -192,20 +517,13 @@ static void pcap_to_xmit(struct ctx *ctx)
 
 	tx_sock = pf_socket();
 
-	fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
-
-	ret = __pcap_io->pull_file_header(fd, &ctx->link_type);
-	if (ret)
-		panic("Error reading pcap header!\n");
-
-	if (__pcap_io->prepare_reading_pcap) {
-		ret = __pcap_io->prepare_reading_pcap(fd);
-		if (ret)
-			panic("Error prepare reading pcap!\n");
-	}
+	pcap_in_open(ctx, &in);
 
 	fmemset(&tx_ring, 0, sizeof(tx_ring));
 	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+	fmemset(&tx_poll, 0, sizeof(tx_poll));
+
+	pacer_init(&pacer, ctx->speed, ctx->rate, ctx->rate_unit);
 
 	if (ctx->rfraw) {
 		ctx->device_trans = xstrdup(ctx->device_out);
@@ -221,6 +539,7 @@ static void pcap_to_xmit(struct ctx *ctx)
 	size = ring_size(ctx->device_out, ctx->reserve_size);
 
 	bpf_parse_rules(ctx->filter, &bpf_ops);
+	bpf_jit_compile(&bpf_ops, &bpf_jit);
 
 	set_packet_loss_discard(tx_sock);
 	set_sockopt_hwtimestamp(tx_sock, ctx->device_out);
@@ -249,7 +568,22 @@ static void pcap_to_xmit(struct ctx *ctx)
 		printf("BPF:\n");
 		bpf_dump_all(&bpf_ops);
 
-		printf("MD: TX %luus %s ", interval, pcap_ops[ctx->pcap]->name);
+		if (pacer_enabled(&pacer))
+			printf("MD: TX paced %s ", pcap_ops[ctx->pcap]->name);
+		else
+			printf("MD: TX %luus %s ", interval,
+			       pcap_ops[ctx->pcap]->name);
+		if (bpf_jit.func)
+			printf("jit ");
+		if (ctx->speed > 0)
+			printf("%gx ", ctx->speed);
+		if (ctx->rate > 0)
+			printf("%llu%s ", (unsigned long long) ctx->rate,
+			       ctx->rate_unit == PACER_BPS ? "bit/s" : "pps");
+		if (in.nr > 1)
+			printf("%u files ", in.nr);
+		if (pcap_magic_is_nsec(ctx->magic))
+			printf("nsec ");
 		if (ctx->rfraw)
 			printf("802.11 raw via %s ", ctx->device_out);
 #ifdef _LARGEFILE64_SOURCE
@@ -261,13 +595,19 @@ static void pcap_to_xmit(struct ctx *ctx)
 	printf("Running! Hang up with ^C!\n\n");
 	fflush(stdout);
 
-	itimer.it_interval.tv_sec = 0;
-	itimer.it_interval.tv_usec = interval;
+	/* Paced replay kicks the kernel itself, right when packets are due */
+	if (!pacer_enabled(&pacer)) {
+		itimer.it_interval.tv_sec = 0;
+		itimer.it_interval.tv_usec = interval;
 
-	itimer.it_value.tv_sec = 0;
-	itimer.it_value.tv_usec = interval;
+		itimer.it_value.tv_sec = 0;
+		itimer.it_value.tv_usec = interval;
 
-	setitimer(ITIMER_REAL, &itimer, NULL); 
+		setitimer(ITIMER_REAL, &itimer, NULL);
+	}
+
+	tx_poll.fd = tx_sock;
+	tx_poll.events = POLLOUT;
 
 	bug_on(gettimeofday(&start, NULL));
 
@@ -280,20 +620,40 @@ static void pcap_to_xmit(struct ctx *ctx)
 			out = ((uint8_t *) hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
 
 			do {
-				ret = __pcap_io->read_pcap_pkt(fd, &phdr, out,
-							       ring_frame_size(&tx_ring));
+				ret = pcap_in_read(ctx, &in, &phdr, &meta, out,
+						   ring_frame_size(&tx_ring),
+						   false);
 				if (unlikely(ret <= 0))
 					goto out;
 
-				if (ring_frame_size(&tx_ring) < phdr.len) {
-					phdr.len = ring_frame_size(&tx_ring);
+				if (ring_frame_size(&tx_ring) < phdr.caplen) {
+					phdr.caplen = ring_frame_size(&tx_ring);
 					trunced++;
 				}
-			} while (ctx->filter && !bpf_run_filter(&bpf_ops, out, phdr.len));
-
-			pcap_pkthdr_to_tpacket_hdr(&phdr, &hdr->tp_h);
+			} while (ctx->filter &&
+				 !bpf_jit_run(&bpf_jit, out, phdr.caplen));
+
+			pcap_pkthdr_to_tpacket_hdr(&phdr, &hdr->tp_h,
+						   ctx->magic);
+
+			if (pacer_enabled(&pacer)) {
+				deadline = pacer_deadline(&pacer,
+						hdr->tp_h.tp_sec * NSEC_PER_SEC +
+						hdr->tp_h.tp_nsec, phdr.caplen);
+
+				/* Send what is due before going to sleep */
+				if (deadline > pacer_now()) {
+					if (queued) {
+						pull_and_flush_tx_ring(tx_sock);
+						queued = 0;
+					}
+					pacer_wait_until(deadline);
+				}
+			}
 
-			ctx->tx_bytes += hdr->tp_h.tp_len;;
+			/* Account the original size, but send what we have */
+			ctx->tx_bytes += hdr->tp_h.tp_len;
+			hdr->tp_h.tp_len = phdr.caplen;
 			ctx->tx_packets++;
 
 			show_frame_hdr(hdr, ctx->print_mode, RING_MODE_EGRESS);
@@ -303,6 +663,11 @@ static void pcap_to_xmit(struct ctx *ctx)
 
 			kernel_may_pull_from_tx(&hdr->tp_h);
 
+			if (pacer_enabled(&pacer) && ++queued >= PACER_BATCH) {
+				pull_and_flush_tx_ring(tx_sock);
+				queued = 0;
+			}
+
 			it++;
 			if (it >= tx_ring.layout.tp_frame_nr)
 				it = 0;
@@ -317,13 +682,25 @@ static void pcap_to_xmit(struct ctx *ctx)
 				}
 			}
 		}
+
+		/* Ring is full, wait for the kernel to free up a slot */
+		if (pacer_enabled(&pacer)) {
+			pull_and_flush_tx_ring(tx_sock);
+			queued = 0;
+
+			poll(&tx_poll, 1, 1);
+		}
 	}
 
 	out:
 
+	tprintf_flush();
+	pull_and_flush_tx_ring(tx_sock);
+
 	bug_on(gettimeofday(&end, NULL));
 	diff = tv_subtract(end, start);
 
+	bpf_jit_release(&bpf_jit);
 	bpf_release(&bpf_ops);
 
 	dissector_cleanup_all();
@@ -332,10 +709,7 @@ static void pcap_to_xmit(struct ctx *ctx)
 	if (ctx->rfraw)
 		leave_rfmon_mac80211(ctx->device_trans, ctx->device_out);
 
-	if (__pcap_io->prepare_close_pcap)
-		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_READ);
-
-	close(fd);
+	pcap_in_close(ctx, &in);
 	close(tx_sock);
 
 	fflush(stdout);
@@ -382,9 +756,12 @@ static void receive_to_xmit(struct ctx *ctx)
 	enable_kernel_bpf_jit_compiler();
 
 	bpf_parse_rules(ctx->filter, &bpf_ops);
-	bpf_attach_to_sock(rx_sock, &bpf_ops);
+	if (ctx->ebpf)
+		bpf_attach_ebpf_to_sock(rx_sock, &bpf_ops, &ctx->ebpf_opts);
+	else
+		bpf_attach_to_sock(rx_sock, &bpf_ops);
 
-	setup_rx_ring_layout(rx_sock, &rx_ring, size_in, ctx->jumbo_support);
+	setup_rx_ring_layout(rx_sock, &rx_ring, size_in, ctx->jumbo_support, 0);
 	create_rx_ring(rx_sock, &rx_ring, ctx->verbose);
 	mmap_rx_ring(rx_sock, &rx_ring);
 	alloc_rx_ring_frames(&rx_ring);
@@ -489,12 +866,14 @@ static void receive_to_xmit(struct ctx *ctx)
 				goto out;
 		}
 
+		tprintf_flush();
 		poll(&rx_poll, 1, -1);
 		poll_error_maybe_die(rx_sock, &rx_poll);
 	}
 
 	out:
 
+	tprintf_flush();
 	sock_print_net_stats(rx_sock, 0);
 
 	bpf_release(&bpf_ops);
@@ -544,127 +923,661 @@ static void translate_pcap_to_txf(int fdo, uint8_t *out, size_t len)
 	write_or_die(fdo, bout, strlen(bout));
 }
 
-static void read_pcap(struct ctx *ctx)
+static int fanout_worker_cpu(cpu_set_t *cpus, unsigned int worker)
 {
-	__label__ out;
-	uint8_t *out;
-	int ret, fd, fdo = 0;
-	unsigned long trunced = 0;
-	size_t out_len;
-	struct pcap_pkthdr phdr;
-	struct sock_fprog bpf_ops;
-	struct frame_map fm;
-	struct timeval start, end, diff;
+	int cpu, n = worker % CPU_COUNT(cpus);
 
-	bug_on(!__pcap_io);
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, cpus) && n-- == 0)
+			return cpu;
+	}
 
-	fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
+	return -1;
+}
 
-	ret = __pcap_io->pull_file_header(fd, &ctx->link_type);
-	if (ret)
-		panic("Error reading pcap header!\n");
+/*
+ * Offline analysis with several workers: the pcap is mapped and cut into
+ * chunks, chunk k is done by worker k % n. A chunk starts at the first
+ * offset from which PCAP_SYNC_DEPTH sane record headers follow each other,
+ * so neighbouring workers agree on where one chunk ends and the next one
+ * begins without ever looking at what lies in between. Each worker's stdout
+ * is a pipe that carries length prefixed pieces of output and an empty
+ * piece at the end of each chunk, the parent passes them on chunk by chunk.
+ * A record that cannot be read makes the worker search for the next sane
+ * one, the bytes in between are counted as skipped. Records carried in
+ * the payload of another one can still pass as a boundary; the worker
+ * before it then runs past its end, and the parent drops the next chunk
+ * and reads it again from where the previous one really ended.
+ */
+#define PCAP_CHUNK_SIZE		(64UL << 20)
+#define PCAP_SYNC_DEPTH		8
+/* Same packet buffer the serial reader uses */
+#define PCAP_READ_BUFSIZ	round_up(1024 * 1024, PAGE_SIZE)
+
+struct pcap_map {
+	uint8_t *base;
+	size_t size;
+	uint32_t magic;
+};
 
-	if (__pcap_io->prepare_reading_pcap) {
-		ret = __pcap_io->prepare_reading_pcap(fd);
-		if (ret)
-			panic("Error prepare reading pcap!\n");
-	}
+/* One per chunk, where it was started and where it really ended */
+struct read_stats {
+	unsigned long packets, bytes, trunced, skipped, allocs;
+	size_t start, reached;
+} __cacheline_aligned;
 
-	fmemset(&fm, 0, sizeof(fm));
-	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+/* What the serial reader accepts, the snaplen in the header is no limit */
+static struct pcap_pkthdr *pcap_map_record(struct pcap_map *map, size_t off)
+{
+	struct pcap_pkthdr *phdr = (struct pcap_pkthdr *) (map->base + off);
 
-	bpf_parse_rules(ctx->filter, &bpf_ops);
+	if (off + sizeof(*phdr) > map->size)
+		return NULL;
+	if (phdr->caplen > PCAP_READ_BUFSIZ ||
+	    off + sizeof(*phdr) + phdr->caplen > map->size)
+		return NULL;
 
-	dissector_init_all(ctx->print_mode);
+	return phdr;
+}
 
-	out_len = round_up(1024 * 1024, PAGE_SIZE);
-	out = xmalloc_aligned(out_len, CO_CACHE_LINE_SIZE);
+/* Stricter, so that finding a record boundary is no guesswork */
+static struct pcap_pkthdr *pcap_map_record_sane(struct pcap_map *map,
+						size_t off)
+{
+	struct pcap_pkthdr *phdr = pcap_map_record(map, off);
 
-	if (ctx->verbose) {
-		printf("BPF:\n");
-		bpf_dump_all(&bpf_ops);
+	if (!phdr || phdr->caplen == 0 || phdr->caplen > phdr->len)
+		return NULL;
+	if ((uint32_t) phdr->ts.tv_usec >=
+	    (pcap_magic_is_nsec(map->magic) ? 1000000000U : 1000000U))
+		return NULL;
 
-		printf("MD: RD %s ", __pcap_io->name);
-#ifdef _LARGEFILE64_SOURCE
-		printf("lf64 ");
-#endif 
-		ioprio_print();
-		printf("\n");
+	return phdr;
+}
+
+static size_t pcap_map_sync(struct pcap_map *map, size_t off)
+{
+	int i;
+	size_t pos;
+	struct pcap_pkthdr *phdr, *first;
+
+	for (; off < map->size; off++) {
+		first = pcap_map_record_sane(map, off);
+
+		for (pos = off, i = 0; i < PCAP_SYNC_DEPTH && pos < map->size;
+		     i++) {
+			phdr = pcap_map_record_sane(map, pos);
+			/*
+			 * Successive records lie within a day of each other,
+			 * and empty ones would let any run of zeroes pass.
+			 */
+			if (!phdr ||
+			    labs((long) phdr->ts.tv_sec -
+				 (long) first->ts.tv_sec) > 86400)
+				break;
+
+			pos += sizeof(*phdr) + phdr->caplen;
+		}
+
+		if (i == PCAP_SYNC_DEPTH || pos == map->size)
+			return off;
 	}
-	printf("Running! Hang up with ^C!\n\n");
-	fflush(stdout);
 
-	if (ctx->device_out)
-		fdo = open_or_die_m(ctx->device_out, O_RDWR | O_CREAT |
-				    O_TRUNC | O_LARGEFILE, DEFFILEMODE);
+	return map->size;
+}
 
-	bug_on(gettimeofday(&start, NULL));
+static size_t pcap_map_chunk_start(struct pcap_map *map, unsigned int chunk)
+{
+	if (chunk == 0)
+		return sizeof(struct pcap_filehdr);
 
-	while (likely(sigint == 0)) {
-		do {
-			ret = __pcap_io->read_pcap_pkt(fd, &phdr, out, out_len);
-			if (unlikely(ret < 0))
-				goto out;
+	return pcap_map_sync(map, (size_t) chunk * PCAP_CHUNK_SIZE);
+}
 
-			if (unlikely(phdr.len == 0)) {
-				trunced++;
-				continue;
-			}
+static ssize_t chunk_out_write(void *cookie, const char *buf, size_t len)
+{
+	uint32_t num = len;
+	struct iovec iov[2] = {
+		{ .iov_base = &num,		.iov_len = sizeof(num) },
+		{ .iov_base = (void *) buf,	.iov_len = len },
+	};
 
-			if (unlikely(phdr.len > out_len)) {
-				phdr.len = out_len;
-				trunced++;
-			}
-		} while (ctx->filter && !bpf_run_filter(&bpf_ops, out, phdr.len));
+	writev_or_die((int) (long) cookie, iov, array_size(iov));
 
-		pcap_pkthdr_to_tpacket_hdr(&phdr, &fm.tp_h);
+	return len;
+}
 
-		ctx->tx_bytes += fm.tp_h.tp_len;
-		ctx->tx_packets++;
+static void chunk_out_end(int fd)
+{
+	uint32_t num = 0;
 
-		show_frame_hdr(&fm, ctx->print_mode, RING_MODE_EGRESS);
+	tprintf_flush();
+	fflush(stdout);
 
-		dissector_entry_point(out, fm.tp_h.tp_snaplen,
-				      ctx->link_type, ctx->print_mode);
+	write_or_die(fd, &num, sizeof(num));
+}
 
-		if (ctx->device_out)
-			translate_pcap_to_txf(fdo, out, fm.tp_h.tp_snaplen);
+/* Returns where it stopped, which is past end if a record spans it */
+static size_t read_pcap_range(struct ctx *ctx, struct pcap_map *map,
+			      struct bpf_jit *bpf_jit, size_t off, size_t end,
+			      struct read_stats *st)
+{
+	size_t next;
+	uint8_t *packet;
+	struct pcap_pkthdr *phdr;
+	struct frame_map fm;
 
-		if (frame_count_max != 0) {
-			if (ctx->tx_packets >= frame_count_max) {
-				sigint = 1;
-				break;
-			}
+	fmemset(&fm, 0, sizeof(fm));
+
+	while (off < end && likely(sigint == 0)) {
+		phdr = pcap_map_record(map, off);
+		if (unlikely(!phdr)) {
+			/* end is a sane record, so we never pass it */
+			next = pcap_map_sync(map, off + 1);
+			st->skipped += next - off;
+			off = next;
+			continue;
 		}
-	}
 
-	out:
+		packet = (uint8_t *) (phdr + 1);
+		off += sizeof(*phdr) + phdr->caplen;
 
-	bug_on(gettimeofday(&end, NULL));
-	diff = tv_subtract(end, start);
+		if (unlikely(phdr->caplen == 0)) {
+			st->trunced++;
+			continue;
+		}
 
-	bpf_release(&bpf_ops);
+		if (ctx->filter &&
+		    !bpf_jit_run(bpf_jit, packet, phdr->caplen))
+			continue;
 
-	dissector_cleanup_all();
+		pcap_pkthdr_to_tpacket_hdr(phdr, &fm.tp_h, map->magic);
 
-	if (__pcap_io->prepare_close_pcap)
-		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_READ);
+		st->bytes += fm.tp_h.tp_len;
+		st->packets++;
 
-	close(fd);
-	if (ctx->device_out)
-		close(fdo);
+		show_frame_hdr(&fm, ctx->print_mode, RING_MODE_EGRESS);
 
-	xfree(out);
+		dissector_entry_point(packet, fm.tp_h.tp_snaplen,
+				      ctx->link_type, ctx->print_mode);
+	}
 
-	fflush(stdout);
-	printf("\n");
-	printf("\r%12lu packets outgoing\n", ctx->tx_packets);
-	printf("\r%12lu packets truncated in file\n", trunced);
-	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
-	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+	return off;
 }
 
-static void finish_multi_pcap_file(struct ctx *ctx, int fd)
+static inline size_t pcap_map_chunk_end(struct pcap_map *map,
+					unsigned int chunk,
+					unsigned int chunks)
+{
+	return chunk + 1 < chunks ? pcap_map_chunk_start(map, chunk + 1) :
+	       map->size;
+}
+
+static void read_pcap_worker(struct ctx *ctx, struct pcap_map *map,
+			     struct bpf_jit *bpf_jit, unsigned int chunks,
+			     int fd, struct read_stats *st)
+{
+	unsigned int chunk;
+	size_t off, end, pad;
+	unsigned long allocs;
+	cookie_io_functions_t out_ops = { .write = chunk_out_write, };
+
+	stdout = fopencookie((void *) (long) fd, "w", out_ops);
+	if (!stdout)
+		panic("Cannot set up worker output!\n");
+	setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+	/* Records have to go through the chunk stream as well */
+	tprintf_set_fd(-1);
+
+	for (chunk = ctx->worker; chunk < chunks && !sigint;
+	     chunk += ctx->fanout_workers) {
+		off = pcap_map_chunk_start(map, chunk);
+		end = pcap_map_chunk_end(map, chunk, chunks);
+		pad = off & (PAGE_SIZE - 1);
+
+		if (end > off)
+			madvise(map->base + off - pad, end - off + pad,
+				MADV_WILLNEED);
+
+		/* Before any output, the parent looks at it on the first piece */
+		st[chunk].start = off;
+
+		allocs = xmalloc_count();
+		st[chunk].reached = read_pcap_range(ctx, map, bpf_jit, off, end,
+						    &st[chunk]);
+		/* Filtering and dissecting are meant to never touch the heap */
+		st[chunk].allocs = xmalloc_count() - allocs;
+
+		chunk_out_end(fd);
+	}
+
+	fclose(stdout);
+}
+
+/*
+ * Passes the output of the workers on in chunk order. A chunk that did
+ * not start where the one before it ended is dropped and read here.
+ * Returns the number of chunks read again.
+ */
+static unsigned int read_pcap_merge(struct ctx *ctx, struct pcap_map *map,
+				    struct bpf_jit *bpf_jit, int *fds,
+				    unsigned int chunks, struct read_stats *st)
+{
+	uint8_t *buf;
+	uint32_t num;
+	ssize_t ret;
+	size_t len = 64 * 1024, off = sizeof(struct pcap_filehdr), end;
+	unsigned int chunk, workers = ctx->fanout_workers, again = 0;
+	bool first, drop;
+	int fd;
+
+	buf = xmalloc(len);
+
+	for (chunk = 0; chunk < chunks && likely(sigint == 0); chunk++) {
+		fd = fds[chunk % workers];
+		first = true;
+		drop = false;
+
+		while (fd >= 0) {
+			ret = read_exact(fd, &num, sizeof(num), 0);
+			if (ret != sizeof(num)) {
+				close(fd);
+				fd = fds[chunk % workers] = -1;
+				break;
+			}
+
+			if (first) {
+				drop = st[chunk].start != off;
+				first = false;
+			}
+
+			if (num == 0)
+				break;
+
+			while (num > 0) {
+				ret = read_exact(fd, buf, min((size_t) num,
+							      len), 0);
+				if (ret <= 0)
+					break;
+
+				if (!drop)
+					write_or_die(tprintf_get_fd(), buf,
+						     ret);
+				num -= ret;
+			}
+		}
+
+		/* Without its worker, the chunk is taken as it was cut */
+		if (fd < 0) {
+			off = pcap_map_chunk_end(map, chunk, chunks);
+			continue;
+		}
+
+		if (drop) {
+			st[chunk].packets = st[chunk].bytes = 0;
+			st[chunk].trunced = st[chunk].skipped = 0;
+
+			end = pcap_map_chunk_end(map, chunk, chunks);
+			st[chunk].reached = read_pcap_range(ctx, map, bpf_jit,
+							    off, end,
+							    &st[chunk]);
+			tprintf_flush();
+			again++;
+		}
+
+		off = st[chunk].reached;
+	}
+
+	xfree(buf);
+
+	return again;
+}
+
+static bool read_pcap_splittable(struct ctx *ctx)
+{
+	int fd;
+	bool ret;
+	struct stat stats;
+
+	if (ctx->device_out || frame_count_max != 0 || ctx->flows)
+		return false;
+	if (stat(ctx->device_in, &stats) || !S_ISREG(stats.st_mode))
+		return false;
+
+	fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE);
+	ret = !pcap_is_pcapng(fd);
+	close(fd);
+
+	return ret;
+}
+
+static void read_pcap_parallel(struct ctx *ctx)
+{
+	int fd, cpu, status, pipefd[2], fds[MAX_FANOUT_WORKERS];
+	unsigned int i, chunks, again;
+	pid_t pid, pids[MAX_FANOUT_WORKERS];
+	struct pcap_filehdr *hdr;
+	struct pcap_map map;
+	struct read_stats *st, sum;
+	struct sock_fprog bpf_ops;
+	struct bpf_jit bpf_jit;
+	struct timeval start, end, diff;
+	struct stat stats;
+	cpu_set_t cpus;
+
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) || CPU_COUNT(&cpus) == 0)
+		panic("Cannot get cpu affinity!\n");
+
+	fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
+
+	if (fstat(fd, &stats))
+		panic("Cannot fstat pcap file!\n");
+	if (stats.st_size < sizeof(*hdr))
+		panic("Error reading pcap header!\n");
+
+	fmemset(&map, 0, sizeof(map));
+	map.size = stats.st_size;
+	map.base = mmap(0, map.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map.base == MAP_FAILED)
+		panic("mmap of file failed!\n");
+	close(fd);
+
+	hdr = (struct pcap_filehdr *) map.base;
+	pcap_validate_header(hdr);
+
+	ctx->magic = map.magic = hdr->magic;
+	ctx->link_type = hdr->linktype;
+
+	chunks = (map.size + PCAP_CHUNK_SIZE - 1) / PCAP_CHUNK_SIZE;
+
+	st = mmap(0, chunks * sizeof(*st), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (st == MAP_FAILED)
+		panic("Cannot setup shared worker stats!\n");
+
+	fmemset(st, 0, chunks * sizeof(*st));
+	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+
+	bpf_parse_rules(ctx->filter, &bpf_ops);
+	bpf_jit_compile(&bpf_ops, &bpf_jit);
+
+	dissector_init_all(ctx->print_mode);
+
+	if (ctx->verbose) {
+		printf("BPF:\n");
+		bpf_dump_all(&bpf_ops);
+
+		printf("MD: RD parallel %u workers %u chunks ",
+		       ctx->fanout_workers, chunks);
+		if (bpf_jit.func)
+			printf("jit ");
+		if (pcap_magic_is_nsec(ctx->magic))
+			printf("nsec ");
+#ifdef _LARGEFILE64_SOURCE
+		printf("lf64 ");
+#endif
+		printf("\n");
+	}
+	printf("Running! Hang up with ^C!\n\n");
+	fflush(stdout);
+
+	bug_on(gettimeofday(&start, NULL));
+
+	for (i = 0; i < ctx->fanout_workers; i++) {
+		pipe_or_die(pipefd, O_CLOEXEC);
+
+		pid = fork();
+
+		switch (pid) {
+		case 0:
+			close(pipefd[0]);
+
+			ctx->worker = i;
+			cpu = fanout_worker_cpu(&cpus, i);
+			cpu_affinity(cpu);
+
+			read_pcap_worker(ctx, &map, &bpf_jit, chunks,
+					 pipefd[1], st);
+
+			exit(EXIT_SUCCESS);
+		case -1:
+			panic("Cannot fork processes!\n");
+		default:
+			close(pipefd[1]);
+			fds[i] = pipefd[0];
+			pids[i] = pid;
+		}
+	}
+
+	again = read_pcap_merge(ctx, &map, &bpf_jit, fds, chunks, st);
+
+	/* A ^C from the terminal hits all workers anyway, a kill(1) does not */
+	for (i = 0; i < ctx->fanout_workers; i++) {
+		if (sigint)
+			kill(pids[i], SIGINT);
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	for (i = 0; i < ctx->fanout_workers; i++)
+		waitpid(pids[i], &status, 0);
+
+	bug_on(gettimeofday(&end, NULL));
+	diff = tv_subtract(end, start);
+
+	fmemset(&sum, 0, sizeof(sum));
+	for (i = 0; i < chunks; i++) {
+		sum.packets += st[i].packets;
+		sum.bytes += st[i].bytes;
+		sum.trunced += st[i].trunced;
+		sum.skipped += st[i].skipped;
+		sum.allocs += st[i].allocs;
+	}
+
+	ctx->tx_packets = sum.packets;
+	ctx->tx_bytes = sum.bytes;
+
+	bpf_jit_release(&bpf_jit);
+	bpf_release(&bpf_ops);
+
+	dissector_cleanup_all();
+
+	munmap(st, chunks * sizeof(*st));
+	munmap(map.base, map.size);
+
+	fflush(stdout);
+	printf("\n");
+	printf("\r%12lu packets outgoing\n", ctx->tx_packets);
+	printf("\r%12lu packets truncated in file\n", sum.trunced);
+	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
+	if (sum.skipped)
+		whine("Skipped %lu bytes of broken records in %s!\n",
+		      sum.skipped, ctx->device_in);
+	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+	if (ctx->verbose) {
+		printf("\r%12lu heap allocations in packet loop\n",
+		       sum.allocs);
+		printf("\r%12u chunks read again at false boundaries\n",
+		       again);
+	}
+}
+
+static void read_pcap(struct ctx *ctx)
+{
+	__label__ out;
+	uint8_t *out;
+	int fdo = 0;
+	ssize_t ret;
+	unsigned long trunced = 0, allocs;
+	size_t out_len;
+	struct pcap_pkthdr phdr;
+	struct pcap_pkt_meta meta;
+	struct sock_fprog bpf_ops;
+	struct bpf_jit bpf_jit;
+	struct frame_map fm;
+	struct timeval start, end, diff;
+	struct pcap_in in;
+	struct flow_table ft, *flows = NULL;
+
+	if (ctx->fanout_workers > 1) {
+		if (read_pcap_splittable(ctx)) {
+			read_pcap_parallel(ctx);
+			return;
+		}
+
+		whine("Can only split a single pcap file without -n, --out or "
+		      "--flows, reading it with one thread!\n");
+	}
+
+	bug_on(!__pcap_io);
+
+	pcap_in_open(ctx, &in);
+
+	fmemset(&fm, 0, sizeof(fm));
+	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+
+	bpf_parse_rules(ctx->filter, &bpf_ops);
+	bpf_jit_compile(&bpf_ops, &bpf_jit);
+
+	dissector_init_all(ctx->print_mode);
+
+	if (ctx->flows) {
+		flows_check_link_type(ctx);
+		flow_table_init(&ft, ctx->flow_idle, ctx->flow_active,
+				ctx->print_mode);
+		flows = &ft;
+	}
+
+	out_len = PCAP_READ_BUFSIZ;
+	out = xmalloc_aligned(out_len, CO_CACHE_LINE_SIZE);
+
+	if (ctx->verbose) {
+		printf("BPF:\n");
+		bpf_dump_all(&bpf_ops);
+
+		printf("MD: RD %s ", __pcap_io->name);
+		if (bpf_jit.func)
+			printf("jit ");
+		if (in.nr > 1)
+			printf("%u files ", in.nr);
+		if (pcap_magic_is_nsec(ctx->magic))
+			printf("nsec ");
+#ifdef _LARGEFILE64_SOURCE
+		printf("lf64 ");
+#endif 
+		ioprio_print();
+		printf("\n");
+	}
+	printf("Running! Hang up with ^C!\n\n");
+	fflush(stdout);
+
+	if (ctx->device_out)
+		fdo = open_or_die_m(ctx->device_out, O_RDWR | O_CREAT |
+				    O_TRUNC | O_LARGEFILE, DEFFILEMODE);
+
+	bug_on(gettimeofday(&start, NULL));
+	allocs = xmalloc_count();
+
+	while (likely(sigint == 0)) {
+		do {
+			ret = pcap_in_read(ctx, &in, &phdr, &meta, out, out_len,
+					   !flows);
+			if (unlikely(ret <= 0))
+				goto out;
+
+			if (unlikely(phdr.caplen == 0)) {
+				trunced++;
+				continue;
+			}
+
+			if (unlikely(phdr.caplen > out_len)) {
+				phdr.caplen = out_len;
+				trunced++;
+			}
+		} while (ctx->filter && !bpf_jit_run(&bpf_jit, out, phdr.caplen));
+
+		pcap_pkthdr_to_tpacket_hdr(&phdr, &fm.tp_h, ctx->magic);
+
+		ctx->tx_bytes += fm.tp_h.tp_len;
+		ctx->tx_packets++;
+
+		if (flows) {
+			flow_table_update(flows, out, fm.tp_h.tp_snaplen,
+					  fm.tp_h.tp_len, fm.tp_h.tp_sec,
+					  fm.tp_h.tp_nsec);
+		} else {
+			show_frame_hdr(&fm, ctx->print_mode, RING_MODE_EGRESS);
+
+			dissector_entry_point(out, fm.tp_h.tp_snaplen,
+					      meta.linktype, ctx->print_mode);
+		}
+
+		if (ctx->device_out)
+			translate_pcap_to_txf(fdo, out, fm.tp_h.tp_snaplen);
+
+		if (frame_count_max != 0) {
+			if (ctx->tx_packets >= frame_count_max) {
+				sigint = 1;
+				break;
+			}
+		}
+	}
+
+	out:
+
+	allocs = xmalloc_count() - allocs;
+	if (flows)
+		flow_table_destroy(flows);
+	tprintf_flush();
+
+	bug_on(gettimeofday(&end, NULL));
+	diff = tv_subtract(end, start);
+
+	bpf_jit_release(&bpf_jit);
+	bpf_release(&bpf_ops);
+
+	dissector_cleanup_all();
+
+	pcap_in_close(ctx, &in);
+	if (ctx->device_out)
+		close(fdo);
+
+	xfree(out);
+
+	fflush(stdout);
+	printf("\n");
+	printf("\r%12lu packets outgoing\n", ctx->tx_packets);
+	printf("\r%12lu packets truncated in file\n", trunced);
+	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
+	if (flows)
+		flow_table_print_stats(flows);
+	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+	if (ctx->verbose)
+		printf("\r%12lu heap allocations in packet loop\n", allocs);
+}
+
+static inline int pcap_write_flags(struct ctx *ctx)
+{
+	int flags = O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE;
+
+	/* Only the io_uring backend keeps its writes block aligned */
+	if (ctx->odirect && ctx->pcap == PCAP_OPS_URING)
+		flags |= O_DIRECT;
+
+	return flags;
+}
+
+static inline uint32_t pcap_snaplen(struct ctx *ctx)
+{
+	return ctx->snaplen ? : PCAP_DEFAULT_SNAPSHOT_LEN;
+}
+
+static inline const char *pcap_file_ext(struct ctx *ctx)
+{
+	return ctx->pcap == PCAP_OPS_NG ? "pcapng" : "pcap";
+}
+
+static void finish_multi_pcap_file(struct ctx *ctx, int fd)
 {
 	__pcap_io->fsync_pcap(fd);
 
@@ -689,13 +1602,13 @@ static int next_multi_pcap_file(struct ctx *ctx, int fd)
 
 	close(fd);
 
-	slprintf(fname, sizeof(fname), "%s/%s%lu.pcap", ctx->device_out,
-		 ctx->prefix ? : "dump-", time(0));
+	slprintf(fname, sizeof(fname), "%s/%s%lu.%s", ctx->device_out,
+		 ctx->prefix ? : "dump-", time(0), pcap_file_ext(ctx));
 
-	fd = open_or_die_m(fname, O_RDWR | O_CREAT | O_TRUNC |
-			   O_LARGEFILE, DEFFILEMODE);
+	fd = open_or_die_m(fname, pcap_write_flags(ctx), DEFFILEMODE);
 
-	ret = __pcap_io->push_file_header(fd, ctx->link_type);
+	ret = __pcap_io->push_file_header(fd, ctx->magic, ctx->link_type,
+					  pcap_snaplen(ctx));
 	if (ret)
 		panic("Error writing pcap header!\n");
 
@@ -713,139 +1626,515 @@ static int begin_multi_pcap_file(struct ctx *ctx)
 	int fd, ret;
 	char fname[256];
 
-	bug_on(!__pcap_io);
+	bug_on(!__pcap_io);
+
+	if (ctx->device_out[strlen(ctx->device_out) - 1] == '/')
+		ctx->device_out[strlen(ctx->device_out) - 1] = 0;
+
+	slprintf(fname, sizeof(fname), "%s/%s%lu.%s", ctx->device_out,
+		 ctx->prefix ? : "dump-", time(0), pcap_file_ext(ctx));
+
+	fd = open_or_die_m(fname, pcap_write_flags(ctx), DEFFILEMODE);
+
+	ret = __pcap_io->push_file_header(fd, ctx->magic, ctx->link_type,
+					  pcap_snaplen(ctx));
+	if (ret)
+		panic("Error writing pcap header!\n");
+
+	if (__pcap_io->prepare_writing_pcap) {
+		ret = __pcap_io->prepare_writing_pcap(fd);
+		if (ret)
+			panic("Error prepare writing pcap!\n");
+	}
+
+	if (ctx->dump_mode == DUMP_INTERVAL_TIME) {
+		interval = ctx->dump_interval;
+
+		itimer.it_interval.tv_sec = interval;
+		itimer.it_interval.tv_usec = 0;
+
+		itimer.it_value.tv_sec = interval;
+		itimer.it_value.tv_usec = 0;
+
+		setitimer(ITIMER_REAL, &itimer, NULL);
+	} else {
+		interval = 0;
+	}
+
+	return fd;
+}
+
+static void finish_single_pcap_file(struct ctx *ctx, int fd)
+{
+	__pcap_io->fsync_pcap(fd);
+
+	if (__pcap_io->prepare_close_pcap)
+		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_WRITE);
+
+	close(fd);
+}
+
+static int begin_single_pcap_file(struct ctx *ctx)
+{
+	int fd, ret;
+
+	bug_on(!__pcap_io);
+
+	fd = open_or_die_m(ctx->device_out, pcap_write_flags(ctx),
+			   DEFFILEMODE);
+
+	ret = __pcap_io->push_file_header(fd, ctx->magic, ctx->link_type,
+					  pcap_snaplen(ctx));
+	if (ret)
+		panic("Error writing pcap header!\n");
+
+	if (__pcap_io->prepare_writing_pcap) {
+		ret = __pcap_io->prepare_writing_pcap(fd);
+		if (ret)
+			panic("Error prepare writing pcap!\n");
+	}
+
+	return fd;
+}
+
+static void print_pcap_file_stats(int sock, struct ctx *ctx)
+{
+	unsigned long good, bad;
+	struct tpacket_stats kstats;
+	socklen_t slen = sizeof(kstats);
+
+	fmemset(&kstats, 0, sizeof(kstats));
+	getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &kstats, &slen);
+
+	if (ctx->print_mode == PRINT_NONE) {
+		good = kstats.tp_packets - kstats.tp_drops;
+		bad = kstats.tp_drops;
+
+		printf(".(+%lu/-%lu)", good, bad);
+		fflush(stdout);
+	}
+}
+
+/*
+ * Only the capture thread gets SIGALRM, so it alone looks at next_dump and
+ * interval and tells the writer to move on to the next file.
+ */
+static inline bool update_pcap_next_dump(struct ctx *ctx, unsigned long snaplen,
+					 int sock)
+{
+	if (!dump_to_pcap(ctx))
+		return false;
+
+	if (ctx->dump_mode == DUMP_INTERVAL_SIZE) {
+		interval += snaplen;
+
+		if (interval > ctx->dump_interval) {
+			next_dump = true;
+			interval = 0;
+		}
+	}
+
+	if (!next_dump)
+		return false;
+
+	next_dump = false;
+
+	if (ctx->verbose)
+		print_pcap_file_stats(sock, ctx);
+
+	return true;
+}
+
+/* iovecs pointing straight into an RX ring block, two per packet */
+struct zc_batch {
+	struct pcap_pkthdr *hdrs;
+	struct iovec *iov;
+	unsigned int num, max;
+	size_t bytes;
+	uint32_t magic;
+	ssize_t (*write_pcap_pkts)(int fd, struct iovec *iov, int iovcnt);
+};
+
+static void zc_batch_init(struct zc_batch *zc, struct ring *ring,
+			  const struct pcap_file_ops *ops, uint32_t magic)
+{
+	/* Upper bound of packets a block can hold: empty frames */
+	zc->max = ring->layout3.tp_block_size / TPACKET_ALIGN(TPACKET3_HDRLEN);
+	zc->hdrs = xmalloc_aligned(zc->max * sizeof(*zc->hdrs),
+				   CO_CACHE_LINE_SIZE);
+	zc->iov = xmalloc_aligned(2 * zc->max * sizeof(*zc->iov),
+				  CO_CACHE_LINE_SIZE);
+	zc->num = 0;
+	zc->bytes = 0;
+	zc->magic = magic;
+	zc->write_pcap_pkts = ops->write_pcap_pkts;
+}
+
+static void zc_batch_destroy(struct zc_batch *zc)
+{
+	xfree(zc->hdrs);
+	xfree(zc->iov);
+}
+
+static void zc_batch_flush(struct zc_batch *zc, int fd)
+{
+	ssize_t ret;
+
+	if (zc->num == 0)
+		return;
+
+	ret = zc->write_pcap_pkts(fd, zc->iov, 2 * zc->num);
+	if (unlikely(ret != zc->bytes))
+		panic("Write error to pcap!\n");
+
+	zc->num = 0;
+	zc->bytes = 0;
+}
+
+static inline void zc_batch_add(struct zc_batch *zc, int fd,
+				struct tpacket3_hdr *thdr, uint8_t *packet)
+{
+	struct pcap_pkthdr *phdr;
+	struct iovec *iov;
+
+	if (unlikely(zc->num == zc->max))
+		zc_batch_flush(zc, fd);
+
+	phdr = &zc->hdrs[zc->num];
+	tpacket3_hdr_to_pcap_pkthdr(thdr, phdr, zc->magic);
+
+	iov = &zc->iov[2 * zc->num];
+	iov[0].iov_base = phdr;
+	iov[0].iov_len = sizeof(*phdr);
+	iov[1].iov_base = packet;
+	iov[1].iov_len = phdr->caplen;
+
+	zc->bytes += sizeof(*phdr) + phdr->caplen;
+	zc->num++;
+}
+
+/* One RX ring block handed over from the capture to the writer thread */
+struct rx_desc {
+	struct block_desc *pbd;
+	uint32_t num_pkts;
+	/* Start the next dump file once the block is written */
+	bool rotate;
+};
+
+/*
+ * The capture thread walks the ring and does the dissection, the writer
+ * thread gets the blocks through a lock-free queue and dumps them, so that
+ * slow fdatasync() calls or dump file rotation don't back up the ring.
+ * Blocks are given back to the kernel by the writer once written out.
+ */
+struct rx_writer {
+	struct ctx *ctx;
+	struct spsc_queue queue;
+	struct rx_desc *descs;
+	struct zc_batch zc_batch, *zc;
+	unsigned int nr;
+	int sock, fd, efd_in, efd_out;
+	int sleeping, waiting, stop;
+	pthread_t tid;
+};
+
+#define RX_WRITER_WAIT_MS	1
+
+static void write_t3_block(struct rx_writer *wr, struct rx_desc *desc)
+{
+	ssize_t ret;
+	uint8_t *packet;
+	uint32_t i;
+	struct ctx *ctx = wr->ctx;
+	struct frame_map_v3 *hdr;
+	struct pcap_pkthdr phdr;
+	struct pcap_pkt_meta meta;
+
+	hdr = (void *) ((uint8_t *) desc->pbd +
+			desc->pbd->h1.offset_to_first_pkt);
+
+	for (i = 0; i < desc->num_pkts; ++i) {
+		packet = ((uint8_t *) hdr) + hdr->tp_h.tp_mac;
+
+		if (ctx->packet_type == -1 ||
+		    ctx->packet_type == hdr->s_ll.sll_pkttype) {
+			if (wr->zc) {
+				zc_batch_add(wr->zc, wr->fd, &hdr->tp_h, packet);
+			} else {
+				tpacket3_hdr_to_pcap_pkthdr(&hdr->tp_h, &phdr,
+							    ctx->magic);
+
+				if (__pcap_io->write_pcap_pkt_meta) {
+					meta.tv_nsec = hdr->tp_h.tp_nsec;
+					meta.ifindex = hdr->s_ll.sll_ifindex;
+					meta.linktype = ctx->link_type;
+
+					ret = __pcap_io->write_pcap_pkt_meta(wr->fd,
+							&phdr, &meta, packet,
+							phdr.caplen);
+				} else {
+					ret = __pcap_io->write_pcap_pkt(wr->fd,
+							&phdr, packet, phdr.caplen);
+				}
+				if (unlikely(ret != sizeof(phdr) + phdr.caplen))
+					panic("Write error to pcap!\n");
+			}
+		}
+
+		hdr = (void *) ((uint8_t *) hdr + hdr->tp_h.tp_next_offset);
+	}
+
+	/*
+	 * The block is only handed back to the kernel after we return, so
+	 * the iovecs stay valid until the batch has been written out.
+	 */
+	if (wr->zc)
+		zc_batch_flush(wr->zc, wr->fd);
+
+	/* Dump files are rotated on block boundaries */
+	if (desc->rotate)
+		wr->fd = next_multi_pcap_file(ctx, wr->fd);
+}
+
+static void rx_writer_sleep(struct rx_writer *wr)
+{
+	uint64_t val;
+
+	__atomic_store_n(&wr->sleeping, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (!spsc_front(&wr->queue) &&
+	    !__atomic_load_n(&wr->stop, __ATOMIC_ACQUIRE))
+		read(wr->efd_in, &val, sizeof(val));
+
+	__atomic_store_n(&wr->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+static void *rx_writer_main(void *arg)
+{
+	uint64_t val = 1;
+	struct rx_writer *wr = arg;
+	struct rx_desc *desc;
+
+	while (1) {
+		desc = spsc_front(&wr->queue);
+		if (!desc) {
+			if (__atomic_load_n(&wr->stop, __ATOMIC_ACQUIRE)) {
+				if (!spsc_front(&wr->queue))
+					break;
+				continue;
+			}
+
+			rx_writer_sleep(wr);
+			continue;
+		}
+
+		write_t3_block(wr, desc);
+		kernel_may_pull_from_rx_block(desc->pbd);
+		spsc_pop(&wr->queue);
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&wr->waiting, __ATOMIC_RELAXED))
+			write(wr->efd_out, &val, sizeof(val));
+	}
+
+	return NULL;
+}
+
+static void rx_writer_start(struct rx_writer *wr, struct ctx *ctx,
+			    struct ring *ring, int sock, int fd)
+{
+	int ret;
+	sigset_t all, old;
+
+	fmemset(wr, 0, sizeof(*wr));
+
+	wr->ctx = ctx;
+	wr->sock = sock;
+	wr->fd = fd;
+	wr->nr = ring->layout3.tp_block_nr;
+	wr->descs = xzmalloc(wr->nr * sizeof(*wr->descs));
+
+	spsc_init(&wr->queue, wr->nr);
+
+	wr->efd_in = eventfd(0, 0);
+	wr->efd_out = eventfd(0, EFD_NONBLOCK);
+	if (wr->efd_in < 0 || wr->efd_out < 0)
+		panic("Cannot create eventfd: %s!\n", strerror(errno));
+
+	/* Backends that take iovecs get the packets straight from the ring */
+	if (__pcap_io->write_pcap_pkts) {
+		zc_batch_init(&wr->zc_batch, ring, __pcap_io, ctx->magic);
+		wr->zc = &wr->zc_batch;
+	}
+
+	/* Signals, i.e. ^C and the dump timer, are left to the capture thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	ret = pthread_create(&wr->tid, NULL, rx_writer_main, wr);
+	if (ret)
+		panic("Cannot create writer thread: %s!\n", strerror(ret));
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static int rx_writer_stop(struct rx_writer *wr)
+{
+	uint64_t val = 1;
+
+	__atomic_store_n(&wr->stop, 1, __ATOMIC_RELEASE);
+	write(wr->efd_in, &val, sizeof(val));
+
+	pthread_join(wr->tid, NULL);
+
+	if (wr->zc)
+		zc_batch_destroy(wr->zc);
+
+	close(wr->efd_in);
+	close(wr->efd_out);
+
+	spsc_destroy(&wr->queue);
+	xfree(wr->descs);
 
-	if (ctx->device_out[strlen(ctx->device_out) - 1] == '/')
-		ctx->device_out[strlen(ctx->device_out) - 1] = 0;
+	return wr->fd;
+}
 
-	slprintf(fname, sizeof(fname), "%s/%s%lu.pcap", ctx->device_out,
-		 ctx->prefix ? : "dump-", time(0));
+static inline bool rx_writer_full(struct rx_writer *wr)
+{
+	return spsc_len(&wr->queue) >= wr->nr;
+}
 
-	fd = open_or_die_m(fname, O_RDWR | O_CREAT | O_TRUNC |
-			   O_LARGEFILE, DEFFILEMODE);
+static inline unsigned long rx_block_snaplen(struct block_desc *pbd,
+					     uint32_t num_pkts)
+{
+	uint32_t i;
+	unsigned long bytes = 0;
+	struct frame_map_v3 *hdr;
 
-	ret = __pcap_io->push_file_header(fd, ctx->link_type);
-	if (ret)
-		panic("Error writing pcap header!\n");
+	hdr = (void *) ((uint8_t *) pbd + pbd->h1.offset_to_first_pkt);
 
-	if (__pcap_io->prepare_writing_pcap) {
-		ret = __pcap_io->prepare_writing_pcap(fd);
-		if (ret)
-			panic("Error prepare writing pcap!\n");
+	for (i = 0; i < num_pkts; ++i) {
+		bytes += hdr->tp_h.tp_snaplen;
+		hdr = (void *) ((uint8_t *) hdr + hdr->tp_h.tp_next_offset);
 	}
 
-	if (ctx->dump_mode == DUMP_INTERVAL_TIME) {
-		interval = ctx->dump_interval;
+	return bytes;
+}
 
-		itimer.it_interval.tv_sec = interval;
-		itimer.it_interval.tv_usec = 0;
+static inline void rx_writer_queue(struct rx_writer *wr, unsigned int idx,
+				   struct block_desc *pbd, uint32_t num_pkts)
+{
+	uint64_t val = 1;
+	unsigned long bytes = 0;
+	struct rx_desc *desc = &wr->descs[idx];
 
-		itimer.it_value.tv_sec = interval;
-		itimer.it_value.tv_usec = 0;
+	if (wr->ctx->dump_mode == DUMP_INTERVAL_SIZE)
+		bytes = rx_block_snaplen(pbd, num_pkts);
 
-		setitimer(ITIMER_REAL, &itimer, NULL);
-	} else {
-		interval = 0;
-	}
+	desc->pbd = pbd;
+	desc->num_pkts = num_pkts;
+	desc->rotate = likely(sigint == 0) &&
+		       update_pcap_next_dump(wr->ctx, bytes, wr->sock);
 
-	return fd;
+	bug_on(!spsc_push(&wr->queue, desc));
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&wr->sleeping, __ATOMIC_RELAXED))
+		write(wr->efd_in, &val, sizeof(val));
 }
 
-static void finish_single_pcap_file(struct ctx *ctx, int fd)
+/*
+ * While the writer holds blocks, the socket always polls readable, so wait
+ * for it to release one instead, but don't miss newly retired blocks.
+ */
+static void rx_writer_wait(struct rx_writer *wr)
 {
-	__pcap_io->fsync_pcap(fd);
+	uint64_t val;
+	struct pollfd pfd = { .fd = wr->efd_out, .events = POLLIN, };
 
-	if (__pcap_io->prepare_close_pcap)
-		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_WRITE);
+	__atomic_store_n(&wr->waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-	close(fd);
+	if (spsc_len(&wr->queue) > 0 && poll(&pfd, 1, RX_WRITER_WAIT_MS) > 0)
+		read(wr->efd_out, &val, sizeof(val));
+
+	__atomic_store_n(&wr->waiting, 0, __ATOMIC_SEQ_CST);
 }
 
-static int begin_single_pcap_file(struct ctx *ctx)
+/* Capture side of a block, returns how many packets were taken from it */
+static uint32_t walk_t3_block(struct block_desc *pbd, struct ctx *ctx,
+			      struct flow_table *flows,
+			      unsigned long *frame_count)
 {
-	int fd, ret;
+	uint8_t *packet;
+	uint32_t i, num_pkts = pbd->h1.num_pkts;
+	struct frame_map_v3 *hdr;
 
-	bug_on(!__pcap_io);
+	hdr = (void *) ((uint8_t *) pbd + pbd->h1.offset_to_first_pkt);
 
-	fd = open_or_die_m(ctx->device_out, O_RDWR | O_CREAT | O_TRUNC |
-			   O_LARGEFILE, DEFFILEMODE);
+	/* One status check per block, packets follow each other back to back */
+	for (i = 0; i < num_pkts; ++i) {
+		__label__ next;
 
-	ret = __pcap_io->push_file_header(fd, ctx->link_type);
-	if (ret)
-		panic("Error writing pcap header!\n");
+		packet = ((uint8_t *) hdr) + hdr->tp_h.tp_mac;
+		(*frame_count)++;
 
-	if (__pcap_io->prepare_writing_pcap) {
-		ret = __pcap_io->prepare_writing_pcap(fd);
-		if (ret)
-			panic("Error prepare writing pcap!\n");
-	}
+		if (ctx->packet_type != -1)
+			if (ctx->packet_type != hdr->s_ll.sll_pkttype)
+				goto next;
 
-	return fd;
-}
+		if (flows) {
+			flow_table_update(flows, packet, hdr->tp_h.tp_snaplen,
+					  hdr->tp_h.tp_len, hdr->tp_h.tp_sec,
+					  hdr->tp_h.tp_nsec);
+		} else {
+			show_frame_hdr_v3(hdr, ctx->print_mode,
+					  RING_MODE_INGRESS);
 
-static void print_pcap_file_stats(int sock, struct ctx *ctx, unsigned long skipped)
-{
-	unsigned long good, bad;
-	struct tpacket_stats kstats;
-	socklen_t slen = sizeof(kstats);
+			dissector_entry_point(packet, hdr->tp_h.tp_snaplen,
+					      ctx->link_type, ctx->print_mode);
+		}
 
-	fmemset(&kstats, 0, sizeof(kstats));
-	getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &kstats, &slen);
-	
-	if (ctx->print_mode == PRINT_NONE) {
-		good = kstats.tp_packets - kstats.tp_drops - skipped;
-		bad = kstats.tp_drops + skipped;
+		if (frame_count_max != 0) {
+			if (*frame_count >= frame_count_max) {
+				sigint = 1;
+				return i + 1;
+			}
+		}
 
-		printf(".(+%lu/-%lu)", good, bad);
-		fflush(stdout);
+		next:
+
+		if (unlikely(sigint == 1))
+			return i + 1;
+
+		hdr = (void *) ((uint8_t *) hdr + hdr->tp_h.tp_next_offset);
 	}
+
+	return num_pkts;
 }
 
-static void recv_only_or_dump(struct ctx *ctx)
+static void recv_ring(struct ctx *ctx, struct fanout_stats *fst)
 {
-	uint8_t *packet;
-	short ifflags = 0;
-	int sock, irq, ifindex, fd = 0, ret;
+	int sock, irq, ifindex, fd = 0;
 	unsigned int size, it = 0;
-	unsigned long frame_count = 0, skipped = 0;
+	unsigned long frame_count = 0;
 	struct ring rx_ring;
 	struct pollfd rx_poll;
-	struct frame_map *hdr;
+	struct block_desc *pbd;
 	struct sock_fprog bpf_ops;
 	struct timeval start, end, diff;
-	struct pcap_pkthdr phdr;
-
-	if (!device_up_and_running(ctx->device_in) && !ctx->rfraw)
-		panic("Device not up and running!\n");
+	struct rx_writer writer, *wr = NULL;
+	struct flow_table ft, *flows = NULL;
+	uint32_t num_pkts;
 
 	sock = pf_socket();
 
-	if (ctx->rfraw) {
-		ctx->device_trans = xstrdup(ctx->device_in);
-		xfree(ctx->device_in);
-
-		enter_rfmon_mac80211(ctx->device_trans, &ctx->device_in);
-		ctx->link_type = LINKTYPE_IEEE802_11;
-	}
-
 	if (dump_to_pcap(ctx)) {
-		__label__ try_file;
-		struct stat stats;
-
-		fmemset(&stats, 0, sizeof(stats));
-		ret = stat(ctx->device_out, &stats);
-		if (ret < 0) {
-			ctx->dump_dir = 0;
-			goto try_file;
-		}
-
-		ctx->dump_dir = S_ISDIR(stats.st_mode);
-		if (ctx->dump_dir) {
+		if (ctx->dump_dir)
 			fd = begin_multi_pcap_file(ctx);
-		} else {
-		try_file:
+		else
 			fd = begin_single_pcap_file(ctx);
-		}
 	}
 
 	fmemset(&rx_ring, 0, sizeof(rx_ring));
@@ -855,24 +2144,48 @@ static void recv_only_or_dump(struct ctx *ctx)
 	ifindex = device_ifindex(ctx->device_in);
 
 	size = ring_size(ctx->device_in, ctx->reserve_size);
+	if (fst)
+		size = round_up_cacheline(size / ctx->fanout_workers);
 
 	enable_kernel_bpf_jit_compiler();
 
 	bpf_parse_rules(ctx->filter, &bpf_ops);
-	bpf_attach_to_sock(sock, &bpf_ops);
+	if (ctx->snaplen)
+		bpf_set_snaplen(&bpf_ops, ctx->snaplen);
+	if (ctx->ebpf)
+		bpf_attach_ebpf_to_sock(sock, &bpf_ops, &ctx->ebpf_opts);
+	else
+		bpf_attach_to_sock(sock, &bpf_ops);
 
 	set_sockopt_hwtimestamp(sock, ctx->device_in);
 
-	setup_rx_ring_layout(sock, &rx_ring, size, ctx->jumbo_support);
-	create_rx_ring(sock, &rx_ring, ctx->verbose);
+	setup_rx_ring_layout(sock, &rx_ring, size, ctx->jumbo_support, 1);
+	create_rx_ring(sock, &rx_ring, ctx->verbose && ctx->worker <= 0);
 	mmap_rx_ring(sock, &rx_ring);
 	alloc_rx_ring_frames(&rx_ring);
 	bind_rx_ring(sock, &rx_ring, ifindex);
 
+	if (fst)
+		set_sockopt_fanout(sock, ctx->fanout_group,
+				   PACKET_FANOUT_POLICY_DEFAULT);
+
+	if (dump_to_pcap(ctx)) {
+		rx_writer_start(&writer, ctx, &rx_ring, sock, fd);
+		wr = &writer;
+	}
+
 	prepare_polling(sock, &rx_poll);
 	dissector_init_all(ctx->print_mode);
 
-	if (ctx->cpu >= 0 && ifindex > 0) {
+	if (ctx->flows) {
+		flows_check_link_type(ctx);
+		flow_table_init(&ft, ctx->flow_idle, ctx->flow_active,
+				ctx->print_mode);
+		flows = &ft;
+	}
+
+	/* Multiqueue NICs spread their IRQs themselves in fanout mode */
+	if (!fst && ctx->cpu >= 0 && ifindex > 0) {
 		irq = device_irq_number(ctx->device_in);
 		device_bind_irq_to_cpu(irq, ctx->cpu);
 
@@ -881,104 +2194,93 @@ static void recv_only_or_dump(struct ctx *ctx)
 			       ctx->device_in, irq, ctx->cpu);
 	}
 
-	if (ctx->promiscuous)
-		ifflags = enter_promiscuous_mode(ctx->device_in);
-
-	if (ctx->verbose) {
+	if (ctx->verbose && ctx->worker <= 0) {
 		printf("BPF:\n");
 		bpf_dump_all(&bpf_ops);
 
 		printf("MD: RX %s ", ctx->dump ? pcap_ops[ctx->pcap]->name : "");
+		if (ctx->dump && pcap_magic_is_nsec(ctx->magic))
+			printf("nsec ");
 		if (ctx->rfraw)
 			printf("802.11 raw via %s ", ctx->device_in);
+		if (fst)
+			printf("fanout %u workers ", ctx->fanout_workers);
+		if (wr && wr->zc)
+			printf("zero-copy ");
 #ifdef _LARGEFILE64_SOURCE
 		printf("lf64 ");
 #endif 
 		ioprio_print();
 		printf("\n");
 	}
-	printf("Running! Hang up with ^C!\n\n");
-	fflush(stdout);
+	if (ctx->worker <= 0) {
+		printf("Running! Hang up with ^C!\n\n");
+		fflush(stdout);
+	}
 
 	bug_on(gettimeofday(&start, NULL));
 
 	while (likely(sigint == 0)) {
-		while (user_may_pull_from_rx(rx_ring.frames[it].iov_base)) {
-			__label__ next;
-
-			hdr = rx_ring.frames[it].iov_base;
-			packet = ((uint8_t *) hdr) + hdr->tp_h.tp_mac;
-			frame_count++;
-
-			if (ctx->packet_type != -1)
-				if (ctx->packet_type != hdr->s_ll.sll_pkttype)
-					goto next;
-
-			if (unlikely(ring_frame_size(&rx_ring) < hdr->tp_h.tp_snaplen)) {
-				skipped++;
-				goto next;
-			}
-
-			if (dump_to_pcap(ctx)) {
-				tpacket_hdr_to_pcap_pkthdr(&hdr->tp_h, &phdr);
-
-				ret = __pcap_io->write_pcap_pkt(fd, &phdr, packet, phdr.len);
-				if (unlikely(ret != sizeof(phdr) + phdr.len))
-					panic("Write error to pcap!\n");
-			}
-
-			show_frame_hdr(hdr, ctx->print_mode, RING_MODE_INGRESS);
-
-			dissector_entry_point(packet, hdr->tp_h.tp_snaplen,
-					      ctx->link_type, ctx->print_mode);
-
-			if (frame_count_max != 0) {
-				if (frame_count >= frame_count_max) {
-					sigint = 1;
-					break;
-				}
-			}
+		while (user_may_pull_from_rx_block((pbd = (void *)
+				rx_ring.frames[it].iov_base))) {
+			/* All blocks are still queued up for the writer */
+			if (wr && rx_writer_full(wr))
+				break;
 
-			next:
+			num_pkts = walk_t3_block(pbd, ctx, flows,
+						 &frame_count);
 
-			kernel_may_pull_from_rx(&hdr->tp_h);
+			if (wr)
+				rx_writer_queue(wr, it, pbd, num_pkts);
+			else
+				kernel_may_pull_from_rx_block(pbd);
 
 			it++;
-			if (it >= rx_ring.layout.tp_frame_nr)
+			if (it >= rx_ring.layout3.tp_block_nr)
 				it = 0;
 
 			if (unlikely(sigint == 1))
 				break;
+		}
 
-			if (dump_to_pcap(ctx)) {
-				if (ctx->dump_mode == DUMP_INTERVAL_SIZE) {
-					interval += hdr->tp_h.tp_snaplen;
-
-					if (interval > ctx->dump_interval) {
-						next_dump = true;
-						interval = 0;
-					}
-				}
-
-				if (next_dump) {
-					fd = next_multi_pcap_file(ctx, fd);
-					next_dump = false;
-
-					if (ctx->verbose)
-						print_pcap_file_stats(sock, ctx, skipped);
-				}
-			}
+		if (wr && spsc_len(&wr->queue) > 0) {
+			rx_writer_wait(wr);
+			continue;
 		}
 
-		poll(&rx_poll, 1, -1);
+		/* Nothing to do for a while, show what is there so far */
+		if (flows)
+			flow_table_idle(flows);
+		tprintf_flush();
+		poll(&rx_poll, 1, flows ? FLOW_SCAN_MS : -1);
 		poll_error_maybe_die(sock, &rx_poll);
 	}
 
+	if (flows)
+		flow_table_destroy(flows);
+	tprintf_flush();
+
+	if (wr)
+		fd = rx_writer_stop(wr);
+
 	bug_on(gettimeofday(&end, NULL));
 	diff = tv_subtract(end, start);
 
-	if (!(ctx->dump_dir && ctx->print_mode == PRINT_NONE)) {
-		sock_print_net_stats(sock, skipped);
+	if (fst) {
+		struct tpacket_stats kstats;
+		socklen_t slen = sizeof(kstats);
+
+		fmemset(&kstats, 0, sizeof(kstats));
+		getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &kstats, &slen);
+
+		fst->packets = kstats.tp_packets;
+		fst->drops = kstats.tp_drops;
+		fst->tv_sec = diff.tv_sec;
+		fst->tv_usec = diff.tv_usec;
+	} else if (!(ctx->dump_dir && ctx->print_mode == PRINT_NONE)) {
+		sock_print_net_stats(sock, 0);
+		if (flows)
+			flow_table_print_stats(flows);
 
 		printf("\r%12lu  sec, %lu usec in total\n",
 		       diff.tv_sec, diff.tv_usec);
@@ -991,12 +2293,6 @@ static void recv_only_or_dump(struct ctx *ctx)
 	dissector_cleanup_all();
 	destroy_rx_ring(sock, &rx_ring);
 
-	if (ctx->promiscuous)
-		leave_promiscuous_mode(ctx->device_in, ifflags);
-
-	if (ctx->rfraw)
-		leave_rfmon_mac80211(ctx->device_trans, ctx->device_in);
-
 	close(sock);
 
 	if (dump_to_pcap(ctx)) {
@@ -1004,7 +2300,167 @@ static void recv_only_or_dump(struct ctx *ctx)
 			finish_multi_pcap_file(ctx, fd);
 		else
 			finish_single_pcap_file(ctx, fd);
+
+		if (ctx->verbose && __pcap_io->print_stats)
+			__pcap_io->print_stats();
+	}
+}
+
+static void fanout_worker_sink(struct ctx *ctx)
+{
+	char *ext, name[512];
+
+	/*
+	 * Each worker dumps into its own file, i.e. dump.pcap becomes
+	 * dump-<worker>.pcap, resp. <dir>/<prefix><worker>-<time>.pcap.
+	 */
+	if (ctx->dump_dir) {
+		slprintf(name, sizeof(name), "%s%d-",
+			 ctx->prefix ? : "dump-", ctx->worker);
+		if (ctx->prefix)
+			xfree(ctx->prefix);
+		ctx->prefix = xstrdup(name);
+		return;
+	}
+
+	ext = strrchr(ctx->device_out, '.');
+	if (ext && ext != ctx->device_out && !strchr(ext, '/'))
+		slprintf(name, sizeof(name), "%.*s-%d%s",
+			 (int) (ext - ctx->device_out), ctx->device_out,
+			 ctx->worker, ext);
+	else
+		slprintf(name, sizeof(name), "%s-%d", ctx->device_out,
+			 ctx->worker);
+
+	xfree(ctx->device_out);
+	ctx->device_out = xstrdup(name);
+}
+
+static void recv_fanout(struct ctx *ctx)
+{
+	int i, cpu, status;
+	unsigned int alive = 0;
+	bool forwarded = false;
+	pid_t pid, pids[MAX_FANOUT_WORKERS];
+	struct fanout_stats *fst;
+	unsigned long packets = 0, drops = 0;
+	cpu_set_t cpus;
+
+	/* Workers inherit the mask given by --bind-cpu/--unbind-cpu */
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) || CPU_COUNT(&cpus) == 0)
+		panic("Cannot get cpu affinity!\n");
+
+	fst = mmap(0, ctx->fanout_workers * sizeof(*fst), PROT_READ |
+		   PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (fst == MAP_FAILED)
+		panic("Cannot setup shared worker stats!\n");
+
+	fmemset(fst, 0, ctx->fanout_workers * sizeof(*fst));
+
+	ctx->fanout_group = getpid() & 0xffff;
+
+	fflush(stdout);
+
+	for (i = 0; i < ctx->fanout_workers; i++) {
+		pid = fork();
+
+		switch (pid) {
+		case 0:
+			ctx->worker = i;
+			cpu = fanout_worker_cpu(&cpus, i);
+			fst[i].cpu = cpu;
+
+			cpu_affinity(cpu);
+			if (dump_to_pcap(ctx))
+				fanout_worker_sink(ctx);
+
+			recv_ring(ctx, &fst[i]);
+
+			munmap(fst, ctx->fanout_workers * sizeof(*fst));
+			exit(EXIT_SUCCESS);
+		case -1:
+			panic("Cannot fork processes!\n");
+		default:
+			pids[alive++] = pid;
+		}
+	}
+
+	/* A ^C from the terminal hits all workers anyway, a kill(1) does not */
+	while (alive > 0) {
+		pid = waitpid(-1, &status, WNOHANG);
+		if (pid > 0) {
+			alive--;
+			continue;
+		}
+
+		if (sigint && !forwarded) {
+			for (i = 0; i < ctx->fanout_workers; i++)
+				kill(pids[i], SIGINT);
+			forwarded = true;
+		}
+
+		usleep(100000);
+	}
+
+	fflush(stdout);
+	printf("\n");
+	for (i = 0; i < ctx->fanout_workers; i++) {
+		packets += fst[i].packets;
+		drops += fst[i].drops;
+
+		printf("\r%12lu  packets incoming, %lu dropped on CPU%d "
+		       "(%lu sec, %lu usec)\n", fst[i].packets, fst[i].drops,
+		       fst[i].cpu, fst[i].tv_sec, fst[i].tv_usec);
+	}
+
+	printf("\r%12lu  packets incoming\n", packets);
+	printf("\r%12lu  packets passed filter\n", packets - drops);
+	printf("\r%12lu  packets failed filter (out of space)\n", drops);
+	if (packets > 0)
+		printf("\r%12.4f%% packet droprate\n",
+		       1.f * drops / packets * 100.f);
+
+	munmap(fst, ctx->fanout_workers * sizeof(*fst));
+}
+
+static void recv_only_or_dump(struct ctx *ctx)
+{
+	int ret;
+	short ifflags = 0;
+
+	if (!device_up_and_running(ctx->device_in) && !ctx->rfraw)
+		panic("Device not up and running!\n");
+
+	if (ctx->rfraw) {
+		ctx->device_trans = xstrdup(ctx->device_in);
+		xfree(ctx->device_in);
+
+		enter_rfmon_mac80211(ctx->device_trans, &ctx->device_in);
+		ctx->link_type = LINKTYPE_IEEE802_11;
+	}
+
+	if (dump_to_pcap(ctx)) {
+		struct stat stats;
+
+		fmemset(&stats, 0, sizeof(stats));
+		ret = stat(ctx->device_out, &stats);
+
+		ctx->dump_dir = (ret == 0 && S_ISDIR(stats.st_mode));
 	}
+
+	if (ctx->promiscuous)
+		ifflags = enter_promiscuous_mode(ctx->device_in);
+
+	if (ctx->fanout_workers > 1)
+		recv_fanout(ctx);
+	else
+		recv_ring(ctx, NULL);
+
+	if (ctx->promiscuous)
+		leave_promiscuous_mode(ctx->device_in, ifflags);
+
+	if (ctx->rfraw)
+		leave_rfmon_mac80211(ctx->device_trans, ctx->device_in);
 }
 
 static void help(void)
@@ -1013,9 +2469,14 @@ static void help(void)
 	puts("http://www.netsniff-ng.org\n\n"
 	     "Usage: netsniff-ng [options]\n"
 	     "Options:\n"
-	     "  -i|-d|--dev|--in <dev|pcap> Input source as netdev or pcap\n"
+	     "  -i|-d|--dev|--in <dev|pcap|dir> Input source as netdev, pcap\n"
+	     "                              or directory of pcaps\n"
 	     "  -o|--out <dev|pcap|dir|txf> Output sink as netdev, pcap, directory, txf file\n"
 	     "  -f|--filter <bpf-file>      Use BPF filter file from bpfc\n"
+	     "  -e|--ebpf                   Attach the filter to the socket as eBPF\n"
+	     "  -y|--sample <uint>          Only capture 1 in <uint> flows, implies -e\n"
+	     "  -C|--ebpf-counters          Count packets and bytes per flow in the\n"
+	     "                              kernel and print them on exit, implies -e\n"
 	     "  -t|--type <type>            Only handle packets of defined type:\n"
 	     "                              host|broadcast|multicast|others|outgoing\n"
 	     "  -F|--interval <size/time>   Dump interval in time or size if -o is a directory\n"
@@ -1031,6 +2492,9 @@ static void help(void)
 	     "  -q|--less                   Print less-verbose packet information\n"
 	     "  -X|--hex                    Print packet data in hex format\n"
 	     "  -l|--ascii                  Print human-readable packet data\n"
+	     "  -E|--export <json|bin>      Print packets as JSON or binary records\n"
+	     "  -w|--flows                  Print flows instead of packets\n"
+	     "  -W|--flow-timeouts <i,a>    Idle and active flow timeouts in seconds\n"
 	     "Options, advanced:\n"
 	     "  -P|--prefix <name>          Prefix for pcaps stored in directory\n"
 	     "  -r|--rand                   Randomize packet forwarding order\n"
@@ -1039,6 +2503,10 @@ static void help(void)
 	     "  -m|--mmap                   Mmap pcap file i.e., for replaying\n"
 	     "  -g|--sg                     Scatter/gather pcap file I/O\n"
 	     "  -c|--clrw                   Use slower read(2)/write(2) I/O\n"
+	     "  -u|--uring                  Asynchronous pcap writes via io_uring\n"
+	     "  -D|--odirect                Bypass page cache with O_DIRECT, implies -u\n"
+	     "  -N|--pcapng                 Write pcapng instead of pcap files\n"
+	     "  -Z|--nsec                   Write pcap files with nanosecond timestamps\n"
 	     "  -S|--ring-size <size>       Manually set ring size to <size>:\n"
 	     "                              mmap space in KiB/MiB/GiB, e.g. \'10MiB\'\n"
 	     "  -k|--kernel-pull <uint>     Kernel pull from user interval in us\n"
@@ -1046,6 +2514,13 @@ static void help(void)
 	     "                              is populated with payload from uspace\n"
 	     "  -b|--bind-cpu <cpu>         Bind to specific CPU (or CPU-range)\n"
 	     "  -B|--unbind-cpu <cpu>       Forbid to use specific CPU (or CPU-range)\n"
+	     "  -T|--threads <uint>         Capture with <uint> fanout workers\n"
+	     "                              or analyze a pcap with <uint> workers\n"
+	     "  -L|--snaplen <uint>         Only capture the first <uint> bytes\n"
+	     "  -x|--speed <factor>         Replay with original timing, <factor>\n"
+	     "                              times as fast, e.g. 1, 0.5, 10\n"
+	     "  -p|--rate <rate>            Replay no faster than <rate>, e.g.\n"
+	     "                              100kpps, 500Mbit, 1Gbit\n"
 	     "  -H|--prio-high              Make this high priority process\n"
 	     "  -Q|--notouch-irq            Do not touch IRQ CPU affinity of NIC\n"
 	     "  -V|--verbose                Be more verbose\n"
@@ -1055,6 +2530,7 @@ static void help(void)
 	     "  netsniff-ng --in eth0 --out dump.pcap --silent --bind-cpu 0\n"
 	     "  netsniff-ng --in wlan0 --rfraw --out dump.pcap --silent --bind-cpu 0\n"
 	     "  netsniff-ng --in dump.pcap --mmap --out eth0 -k1000 --silent --bind-cpu 0\n"
+	     "  netsniff-ng --in dump.pcap --out eth0 --speed 2 --rate 1Gbit -s -b 0\n"
 	     "  netsniff-ng --in dump.pcap --out dump.txf --silent --bind-cpu 0\n"
 	     "  netsniff-ng --in eth0 --out eth1 --silent --bind-cpu 0 --type host\n"
 	     "  netsniff-ng --in eth1 --out /opt/probe/ -s -m -J --interval 100MiB -b 0\n"
@@ -1076,6 +2552,36 @@ static void help(void)
 	die();
 }
 
+static void parse_rate(char *arg, struct ctx *ctx)
+{
+	char *ptr;
+	double rate = strtod(arg, &ptr);
+
+	if (rate <= 0)
+		panic("Replay rate must be positive!\n");
+
+	switch (*ptr) {
+	case 'G':
+		rate *= 1000;
+		/* fall through */
+	case 'M':
+		rate *= 1000;
+		/* fall through */
+	case 'k':
+		rate *= 1000;
+		ptr++;
+	}
+
+	if (!strcmp(ptr, "pps"))
+		ctx->rate_unit = PACER_PPS;
+	else if (!strcmp(ptr, "bit"))
+		ctx->rate_unit = PACER_BPS;
+	else
+		panic("Syntax error in rate param, use pps or bit!\n");
+
+	ctx->rate = (uint64_t) rate;
+}
+
 static void version(void)
 {
 	printf("\nnetsniff-ng %s, the packet sniffing beast\n", VERSION_STRING);
@@ -1098,19 +2604,27 @@ static void header(void)
 int main(int argc, char **argv)
 {
 	char *ptr;
-	int c, i, j, opt_index, ops_touched = 0, vals[4] = {0};
-	bool prio_high = false, setsockmem = true;
+	int c, i, j, fd, opt_index, ops_touched = 0, vals[4] = {0};
+	bool prio_high = false, setsockmem = true, ebpf_counters = false;
 	void (*main_loop)(struct ctx *ctx) = NULL;
 	struct ctx ctx = {
 		.link_type = LINKTYPE_EN10MB,
+		.magic = PCAP_DEFAULT_MAGIC,
 		.print_mode = PRINT_NORM,
 		.cpu = -1,
+		.worker = -1,
+		.fanout_workers = 1,
+		.flow_idle = FLOW_IDLE_DEF,
+		.flow_active = FLOW_ACTIVE_DEF,
 		.packet_type = -1,
 		.promiscuous = true,
 		.randomize = false,
 		.pcap = PCAP_OPS_SG,
 		.dump_interval = 60,
 		.dump_mode = DUMP_INTERVAL_TIME,
+		.ebpf_opts = {
+			.map_fd = -1,
+		},
 	};
 
 	setfsuid(getuid());
@@ -1210,6 +2724,20 @@ int main(int argc, char **argv)
 			ctx.pcap = PCAP_OPS_SG;
 			ops_touched = 1;
 			break;
+		case 'D':
+			ctx.odirect = true;
+			/* fall through */
+		case 'u':
+			ctx.pcap = PCAP_OPS_URING;
+			ops_touched = 1;
+			break;
+		case 'N':
+			ctx.pcap = PCAP_OPS_NG;
+			ops_touched = 1;
+			break;
+		case 'Z':
+			ctx.magic = NSEC_TCPDUMP_MAGIC;
+			break;
 		case 'Q':
 			ctx.cpu = -2;
 			break;
@@ -1229,12 +2757,69 @@ int main(int argc, char **argv)
 				(ctx.print_mode == PRINT_HEX) ?
 				 PRINT_HEX_ASCII : PRINT_ASCII;
 			break;
+		case 'E':
+			if (!strcmp(optarg, "json"))
+				ctx.print_mode = PRINT_JSON;
+			else if (!strcmp(optarg, "bin") ||
+				 !strcmp(optarg, "binary"))
+				ctx.print_mode = PRINT_BIN;
+			else
+				panic("Unknown export format: %s!\n", optarg);
+			break;
+		case 'w':
+			ctx.flows = true;
+			break;
+		case 'e':
+			ctx.ebpf = true;
+			break;
+		case 'y':
+			ctx.ebpf = true;
+			ctx.ebpf_opts.sample = strtoul(optarg, NULL, 0);
+			if (ctx.ebpf_opts.sample == 0)
+				panic("Sample rate must be at least 1!\n");
+			break;
+		case 'C':
+			ctx.ebpf = true;
+			ebpf_counters = true;
+			break;
+		case 'W':
+			ctx.flows = true;
+			ctx.flow_idle = strtoul(optarg, &ptr, 0);
+			if (*ptr == ',')
+				ctx.flow_active = strtoul(ptr + 1, &ptr, 0);
+			if (*ptr != '\0' || ctx.flow_idle == 0 ||
+			    ctx.flow_active == 0)
+				panic("Flow timeouts must be <idle>[,<active>] "
+				      "in seconds!\n");
+			break;
 		case 'k':
 			ctx.kpull = strtol(optarg, NULL, 0);
 			break;
 		case 'n':
 			frame_count_max = strtol(optarg, NULL, 0);
 			break;
+		case 'T':
+			ctx.fanout_workers = strtoul(optarg, NULL, 0);
+			if (ctx.fanout_workers == 0 ||
+			    ctx.fanout_workers > MAX_FANOUT_WORKERS)
+				panic("Number of threads must be in [1,%d]!\n",
+				      MAX_FANOUT_WORKERS);
+			break;
+		case 'L':
+			ctx.snaplen = strtoul(optarg, NULL, 0);
+			if (ctx.snaplen == 0 ||
+			    ctx.snaplen > PCAP_DEFAULT_SNAPSHOT_LEN)
+				panic("Snaplen must be in [1,%d]!\n",
+				      PCAP_DEFAULT_SNAPSHOT_LEN);
+			break;
+		case 'x':
+			ctx.speed = strtod(optarg, NULL);
+			if (ctx.speed <= 0)
+				panic("Replay speed must be positive!\n");
+			break;
+		case 'p':
+			parse_rate(optarg, &ctx);
+			break;
 		case 'F':
 			ptr = optarg;
 			ctx.dump_interval = 0;
@@ -1296,7 +2881,14 @@ int main(int argc, char **argv)
 			case 'b':
 			case 'k':
 			case 'B':
+			case 'T':
+			case 'L':
+			case 'x':
+			case 'p':
 			case 'e':
+			case 'y':
+			case 'E':
+			case 'W':
 				panic("Option -%c requires an argument!\n",
 				      optopt);
 			default:
@@ -1316,6 +2908,14 @@ int main(int argc, char **argv)
 	register_signal(SIGINT, signal_handler);
 	register_signal(SIGHUP, signal_handler);
 
+	if (print_mode_is_struct(ctx.print_mode)) {
+		/* Records own stdout, everything else goes to stderr */
+		fd = dup(STDOUT_FILENO);
+		if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+			panic("Cannot set up record output!\n");
+		tprintf_set_fd(fd);
+	}
+
 	header();
 
 	init_pcap(ctx.jumbo_support);
@@ -1356,6 +2956,12 @@ int main(int argc, char **argv)
 
 	bug_on(!main_loop);
 
+	if ((ctx.ebpf_opts.sample > 1 || ebpf_counters) &&
+	    (main_loop == read_pcap || main_loop == pcap_to_xmit))
+		panic("--sample and --ebpf-counters need a netdev as input!\n");
+	if (ebpf_counters)
+		ctx.ebpf_opts.map_fd = bpf_flow_map_create();
+
 	if (setsockmem)
 		set_system_socket_memory(vals);
 
@@ -1364,6 +2970,11 @@ int main(int argc, char **argv)
 	if (setsockmem)
 		reset_system_socket_memory(vals);
 
+	if (ebpf_counters) {
+		bpf_flow_map_dump(ctx.ebpf_opts.map_fd);
+		close(ctx.ebpf_opts.map_fd);
+	}
+
 	tprintf_cleanup();
 	cleanup_pcap();
 
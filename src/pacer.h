@@ -0,0 +1,141 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+
+#include "built_in.h"
+
+#define NSEC_PER_SEC		1000000000ULL
+
+/* Sleep in the kernel until this close to the deadline, then spin */
+#define PACER_SPIN_NS		50000ULL
+/* How far the token bucket may run ahead of the rate, i.e. burst size */
+#define PACER_BURST_NS		100000ULL
+/* Kick the kernel at least every that many packets that are due */
+#define PACER_BATCH		32
+
+enum pacer_unit {
+	PACER_PPS,
+	PACER_BPS,
+};
+
+/*
+ * Transmit scheduler for replaying traces. Every packet gets a departure
+ * time on CLOCK_MONOTONIC, which is the later of its original offset in
+ * the trace scaled by speed (if speed is set) and what a token bucket of
+ * the given rate allows (if rate is set). The bucket is kept as the time
+ * at which it would be empty (GCRA), so there is no refill to do.
+ */
+struct pacer {
+	double speed;
+	uint64_t rate;
+	enum pacer_unit unit;
+	bool started;
+	uint64_t t0, ts0, last, tat;
+};
+
+static inline uint64_t pacer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline void pacer_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline void pacer_init(struct pacer *p, double speed, uint64_t rate,
+			      enum pacer_unit unit)
+{
+	fmemset(p, 0, sizeof(*p));
+
+	p->speed = speed;
+	p->rate = rate;
+	p->unit = unit;
+}
+
+static inline bool pacer_enabled(const struct pacer *p)
+{
+	return p->speed > 0 || p->rate > 0;
+}
+
+/* Departure time of a packet with trace timestamp ts_ns and len bytes */
+static inline uint64_t pacer_deadline(struct pacer *p, uint64_t ts_ns,
+				      uint32_t len)
+{
+	uint64_t now = pacer_now(), when = now, cost;
+
+	if (unlikely(!p->started)) {
+		p->t0 = p->last = p->tat = now;
+		p->ts0 = ts_ns;
+		p->started = true;
+	}
+
+	if (p->speed > 0) {
+		/* Traces are not always sorted, never go back in time */
+		if (ts_ns > p->ts0)
+			when = p->t0 + (uint64_t) ((ts_ns - p->ts0) / p->speed);
+		else
+			when = p->t0;
+		if (when < p->last)
+			when = p->last;
+	}
+
+	if (p->rate > 0) {
+		if (p->unit == PACER_BPS)
+			cost = (uint64_t) len * 8 * NSEC_PER_SEC / p->rate;
+		else
+			cost = NSEC_PER_SEC / p->rate;
+
+		if (p->tat > PACER_BURST_NS && when < p->tat - PACER_BURST_NS)
+			when = p->tat - PACER_BURST_NS;
+		p->tat = (p->tat > when ? p->tat : when) + cost;
+	}
+
+	p->last = when;
+
+	return when;
+}
+
+/*
+ * Sleep on a high resolution timer for the bulk of the gap and busy wait
+ * for the rest, since wakeup latency is in the tens of microseconds. Gives
+ * up early on signals, so the caller can check for ^C.
+ */
+static inline void pacer_wait_until(uint64_t deadline)
+{
+	uint64_t now = pacer_now();
+	struct timespec ts;
+
+	if (deadline > now + PACER_SPIN_NS) {
+		deadline -= PACER_SPIN_NS;
+		ts.tv_sec = deadline / NSEC_PER_SEC;
+		ts.tv_nsec = deadline % NSEC_PER_SEC;
+		deadline += PACER_SPIN_NS;
+
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				    &ts, NULL) == EINTR)
+			return;
+	}
+
+	while (pacer_now() < deadline)
+		pacer_cpu_relax();
+}
+
+#endif /* PACER_H */
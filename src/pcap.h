@@ -11,18 +11,30 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <linux/if_packet.h>
 
 #include "built_in.h"
 #include "die.h"
 
 #define TCPDUMP_MAGIC              0xa1b2c3d4
+#define NSEC_TCPDUMP_MAGIC         0xa1b23c4d
 #define PCAP_VERSION_MAJOR         2
 #define PCAP_VERSION_MINOR         4
 #define PCAP_DEFAULT_SNAPSHOT_LEN  65535
 
+/* Don't throw away the precision of hardware timestamps */
+#if defined(__WITH_HARDWARE_TIMESTAMPING)
+# define PCAP_DEFAULT_MAGIC        NSEC_TCPDUMP_MAGIC
+#else
+# define PCAP_DEFAULT_MAGIC        TCPDUMP_MAGIC
+#endif
+
+#define PCAPNG_BLOCK_SHB           0x0a0d0d0a
+
 #define LINKTYPE_NULL              0   /* BSD loopback encapsulation */
 #define LINKTYPE_EN10MB            1   /* Ethernet (10Mb) */
 #define LINKTYPE_EN3MB             2   /* Experimental Ethernet (3Mb) */
@@ -48,7 +60,10 @@ struct pcap_filehdr {
 
 struct pcap_timeval {
 	int32_t tv_sec;
-	int32_t tv_usec;
+	union {
+		int32_t tv_usec;
+		int32_t tv_nsec;	/* NSEC_TCPDUMP_MAGIC files */
+	};
 };
 
 struct pcap_nsf_pkthdr {
@@ -63,26 +78,69 @@ struct pcap_pkthdr {
 	uint32_t len;
 };
 
+/*
+ * What a classic pcap record has no room for, used by the pcapng backend.
+ * Written packets carry the ifindex of the device, read ones the number of
+ * their interface within the file, and the link type of that interface.
+ */
+struct pcap_pkt_meta {
+	uint32_t tv_nsec;
+	uint32_t ifindex;
+	uint32_t linktype;
+};
+
+static inline bool pcap_magic_is_nsec(uint32_t magic)
+{
+	return magic == NSEC_TCPDUMP_MAGIC;
+}
+
 static inline void tpacket_hdr_to_pcap_pkthdr(struct tpacket2_hdr *thdr,
-					      struct pcap_pkthdr *phdr)
+					      struct pcap_pkthdr *phdr,
+					      uint32_t magic)
+{
+	phdr->ts.tv_sec = thdr->tp_sec;
+	if (pcap_magic_is_nsec(magic))
+		phdr->ts.tv_nsec = thdr->tp_nsec;
+	else
+		phdr->ts.tv_usec = (thdr->tp_nsec / 1000);
+	phdr->caplen = thdr->tp_snaplen;
+	phdr->len = thdr->tp_len;
+}
+
+static inline void tpacket3_hdr_to_pcap_pkthdr(struct tpacket3_hdr *thdr,
+					       struct pcap_pkthdr *phdr,
+					       uint32_t magic)
 {
 	phdr->ts.tv_sec = thdr->tp_sec;
-	phdr->ts.tv_usec = (thdr->tp_nsec / 1000);
+	if (pcap_magic_is_nsec(magic))
+		phdr->ts.tv_nsec = thdr->tp_nsec;
+	else
+		phdr->ts.tv_usec = (thdr->tp_nsec / 1000);
 	phdr->caplen = thdr->tp_snaplen;
-/* FIXME */
-/*	phdr->len = thdr->tp_len; */
-	phdr->len = thdr->tp_snaplen;
+	phdr->len = thdr->tp_len;
 }
 
 static inline void pcap_pkthdr_to_tpacket_hdr(struct pcap_pkthdr *phdr,
-					      struct tpacket2_hdr *thdr)
+					      struct tpacket2_hdr *thdr,
+					      uint32_t magic)
 {
 	thdr->tp_sec = phdr->ts.tv_sec;
-	thdr->tp_nsec = phdr->ts.tv_usec * 1000;
+	if (pcap_magic_is_nsec(magic))
+		thdr->tp_nsec = phdr->ts.tv_nsec;
+	else
+		thdr->tp_nsec = phdr->ts.tv_usec * 1000;
 	thdr->tp_snaplen = phdr->caplen;
 	thdr->tp_len = phdr->len;
 }
 
+static inline uint64_t pcap_pkthdr_ts_ns(struct pcap_pkthdr *phdr,
+					 uint32_t magic)
+{
+	return (uint64_t) phdr->ts.tv_sec * 1000000000ULL +
+	       (pcap_magic_is_nsec(magic) ? (uint64_t) phdr->ts.tv_nsec :
+					    (uint64_t) phdr->ts.tv_usec * 1000);
+}
+
 enum pcap_ops_groups {
 	PCAP_OPS_RW = 0,
 #define PCAP_OPS_RW PCAP_OPS_RW
@@ -90,6 +148,10 @@ enum pcap_ops_groups {
 #define PCAP_OPS_SG PCAP_OPS_SG
 	PCAP_OPS_MMAP,
 #define PCAP_OPS_MMAP PCAP_OPS_MMAP
+	PCAP_OPS_URING,
+#define PCAP_OPS_URING PCAP_OPS_URING
+	PCAP_OPS_NG,
+#define PCAP_OPS_NG PCAP_OPS_NG
 	__PCAP_OPS_MAX,
 };
 #define PCAP_OPS_MAX (__PCAP_OPS_MAX - 1)
@@ -100,18 +162,28 @@ enum pcap_mode {
 	PCAP_MODE_WRITE,
 };
 
+/* Backends keep their state unlocked, a file is only driven by one thread */
 struct pcap_file_ops {
 	const char *name;
-	int (*pull_file_header)(int fd, uint32_t *linktype);
-	int (*push_file_header)(int fd, uint32_t linktype);
+	int (*pull_file_header)(int fd, uint32_t *magic, uint32_t *linktype);
+	int (*push_file_header)(int fd, uint32_t magic, uint32_t linktype,
+				uint32_t snaplen);
 	int (*prepare_writing_pcap)(int fd);
 	ssize_t (*write_pcap_pkt)(int fd, struct pcap_pkthdr *hdr,
 				  uint8_t *packet, size_t len);
+	ssize_t (*write_pcap_pkts)(int fd, struct iovec *iov, int iovcnt);
+	ssize_t (*write_pcap_pkt_meta)(int fd, struct pcap_pkthdr *hdr,
+				       struct pcap_pkt_meta *meta,
+				       uint8_t *packet, size_t len);
 	void (*fsync_pcap)(int fd);
 	int (*prepare_reading_pcap)(int fd);
 	ssize_t (*read_pcap_pkt)(int fd, struct pcap_pkthdr *hdr,
 				 uint8_t *packet, size_t len);
+	ssize_t (*read_pcap_pkt_meta)(int fd, struct pcap_pkthdr *hdr,
+				      struct pcap_pkt_meta *meta,
+				      uint8_t *packet, size_t len);
 	void (*prepare_close_pcap)(int fd, enum pcap_mode mode);
+	void (*print_stats)(void);
 };
 
 extern const struct pcap_file_ops *pcap_ops[PCAP_OPS_SIZ];
@@ -127,10 +199,10 @@ pcap_ops_group_get(enum pcap_ops_groups group)
 }
 
 static inline void pcap_prepare_header(struct pcap_filehdr *hdr,
-				       uint32_t linktype,
+				       uint32_t magic, uint32_t linktype,
 				       int32_t thiszone, uint32_t snaplen)
 {
-	hdr->magic = TCPDUMP_MAGIC;
+	hdr->magic = magic;
 	hdr->version_major = PCAP_VERSION_MAJOR;
 	hdr->version_minor = PCAP_VERSION_MINOR;
 	hdr->thiszone = thiszone;
@@ -139,29 +211,49 @@ static inline void pcap_prepare_header(struct pcap_filehdr *hdr,
 	hdr->linktype = linktype;
 }
 
+static inline bool pcap_is_pcapng(int fd)
+{
+	uint32_t magic;
+
+	return pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+	       magic == PCAPNG_BLOCK_SHB;
+}
+
+static inline bool pcap_header_is_valid(const struct pcap_filehdr *hdr)
+{
+	return (hdr->magic == TCPDUMP_MAGIC ||
+		hdr->magic == NSEC_TCPDUMP_MAGIC) &&
+	       hdr->version_major == PCAP_VERSION_MAJOR &&
+	       hdr->version_minor == PCAP_VERSION_MINOR &&
+	       (hdr->linktype == LINKTYPE_EN10MB ||
+		hdr->linktype == LINKTYPE_IEEE802_11);
+}
+
 static inline void pcap_validate_header(struct pcap_filehdr *hdr)
 {
-	if (unlikely(hdr->magic != TCPDUMP_MAGIC ||
-		     hdr->version_major != PCAP_VERSION_MAJOR ||
-		     hdr->version_minor != PCAP_VERSION_MINOR ||
- 		     (hdr->linktype != LINKTYPE_EN10MB &&
- 		     hdr->linktype != LINKTYPE_IEEE802_11)))
+	if (unlikely(!pcap_header_is_valid(hdr)))
 		panic("This file has not a valid pcap header\n");
 }
 
 extern int init_pcap_mmap(int jumbo_support);
 extern int init_pcap_rw(int jumbo_support);
 extern int init_pcap_sg(int jumbo_support);
+extern int init_pcap_uring(int jumbo_support);
+extern int init_pcap_ng(int jumbo_support);
 
 extern void cleanup_pcap_mmap(void);
 extern void cleanup_pcap_rw(void);
 extern void cleanup_pcap_sg(void);
+extern void cleanup_pcap_uring(void);
+extern void cleanup_pcap_ng(void);
 
 static inline int init_pcap(int jumbo_support)
 {
 	init_pcap_rw(jumbo_support);
 	init_pcap_sg(jumbo_support);
 	init_pcap_mmap(jumbo_support);
+	init_pcap_uring(jumbo_support);
+	init_pcap_ng(jumbo_support);
 
 	return 0;
 }
@@ -171,6 +263,8 @@ static inline void cleanup_pcap(void)
 	cleanup_pcap_rw();
 	cleanup_pcap_sg();
 	cleanup_pcap_mmap();
+	cleanup_pcap_uring();
+	cleanup_pcap_ng();
 }
 
 #endif /* PCAP_H */
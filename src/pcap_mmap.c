@@ -16,12 +16,10 @@
 #include "pcap.h"
 #include "xio.h"
 #include "xutils.h"
-#include "locking.h"
 #include "built_in.h"
 
 #define DEFAULT_SLOTS     1000
 
-static struct spinlock lock;
 static off_t map_size = 0;
 static char *pstart, *pcurr;
 static int jumbo_frames = 0;
@@ -33,7 +31,8 @@ static inline off_t get_map_size(void)
 			  (PAGE_SIZE * allocsz) * DEFAULT_SLOTS);
 }
 
-static int pcap_mmap_pull_file_header(int fd, uint32_t *linktype)
+static int pcap_mmap_pull_file_header(int fd, uint32_t *magic,
+				      uint32_t *linktype)
 {
 	ssize_t ret;
 	struct pcap_filehdr hdr;
@@ -44,18 +43,20 @@ static int pcap_mmap_pull_file_header(int fd, uint32_t *linktype)
 
 	pcap_validate_header(&hdr);
 
+	*magic = hdr.magic;
 	*linktype = hdr.linktype;
 
 	return 0;
 }
 
-static int pcap_mmap_push_file_header(int fd, uint32_t linktype)
+static int pcap_mmap_push_file_header(int fd, uint32_t magic,
+				      uint32_t linktype, uint32_t snaplen)
 {
 	ssize_t ret;
 	struct pcap_filehdr hdr;
 
 	fmemset(&hdr, 0, sizeof(hdr));
-	pcap_prepare_header(&hdr, linktype, 0, PCAP_DEFAULT_SNAPSHOT_LEN);
+	pcap_prepare_header(&hdr, magic, linktype, 0, snaplen);
 
 	ret = write_or_die(fd, &hdr, sizeof(hdr));
 	if (unlikely(ret != sizeof(hdr))) {
@@ -74,8 +75,6 @@ static int pcap_mmap_prepare_writing_pcap(int fd)
 
 	set_ioprio_be();
 
-	spinlock_lock(&lock);
-
 	map_size = get_map_size();
 
 	ret = fstat(fd, &sb);
@@ -103,8 +102,6 @@ static int pcap_mmap_prepare_writing_pcap(int fd)
 
 	pcurr = pstart + sizeof(struct pcap_filehdr);
 
-	spinlock_unlock(&lock);
-
 	return 0;
 }
 
@@ -114,8 +111,6 @@ static ssize_t pcap_mmap_write_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 	int ret;
 	off_t pos;
 
-	spinlock_lock(&lock);
-
 	if ((off_t) (pcurr - pstart) + sizeof(*hdr) + len > map_size) {
 		off_t map_size_old = map_size;
 		off_t offset = (pcurr - pstart);
@@ -147,8 +142,6 @@ static ssize_t pcap_mmap_write_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 	fmemcpy(pcurr, packet, len);
 	pcurr += len;
 
-	spinlock_unlock(&lock);
-
 	return sizeof(*hdr) + len;
 }
 
@@ -159,8 +152,6 @@ static int pcap_mmap_prepare_reading_pcap(int fd)
 
 	set_ioprio_be();
 
-	spinlock_lock(&lock);
-
 	ret = fstat(fd, &sb);
 	if (ret < 0)
 		panic("Cannot fstat pcap file!\n");
@@ -181,8 +172,6 @@ static int pcap_mmap_prepare_reading_pcap(int fd)
 
 	pcurr = pstart + sizeof(struct pcap_filehdr);
 
-	spinlock_unlock(&lock);
-
 	return 0;
 }
 
@@ -190,12 +179,11 @@ static ssize_t pcap_mmap_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 				       uint8_t *packet, size_t len)
 {
 	ssize_t ret;
-	spinlock_lock(&lock);
 
-	if (unlikely((off_t) (pcurr + sizeof(*hdr) - pstart) > map_size)) {
-		spinlock_unlock(&lock);
+	if (unlikely((off_t) (pcurr - pstart) == map_size))
+		return 0; /* EOF */
+	if (unlikely((off_t) (pcurr + sizeof(*hdr) - pstart) > map_size))
 		return -ENOMEM;
-	}
 
 	fmemcpy(hdr, pcurr, sizeof(*hdr));
 	pcurr += sizeof(*hdr);
@@ -213,30 +201,21 @@ static ssize_t pcap_mmap_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 	fmemcpy(packet, pcurr, hdr->caplen);
 	pcurr += hdr->caplen;
 
-	spinlock_unlock(&lock);
-
 	return sizeof(*hdr) + hdr->caplen;
 
 out_err:
-	spinlock_unlock(&lock);
 	return ret;
 }
 
 static void pcap_mmap_fsync_pcap(int fd)
 {
-	spinlock_lock(&lock);
-
 	msync(pstart, (off_t) (pcurr - pstart), MS_ASYNC);
-
-	spinlock_unlock(&lock);
 }
 
 static void pcap_mmap_prepare_close_pcap(int fd, enum pcap_mode mode)
 {
 	int ret;
 
-	spinlock_lock(&lock);
-
 	ret = munmap(pstart, map_size);
 	if (ret < 0)
 		panic("Cannot unmap the pcap file!\n");
@@ -246,8 +225,6 @@ static void pcap_mmap_prepare_close_pcap(int fd, enum pcap_mode mode)
 		if (ret)
 			panic("Cannot truncate the pcap file!\n");
 	}
-
-	spinlock_unlock(&lock);
 }
 
 const struct pcap_file_ops pcap_mmap_ops = {
@@ -264,8 +241,6 @@ const struct pcap_file_ops pcap_mmap_ops = {
 
 int init_pcap_mmap(int jumbo_support)
 {
-	spinlock_init(&lock);
-
 	jumbo_frames = jumbo_support;
 
 	return pcap_ops_group_register(&pcap_mmap_ops, PCAP_OPS_MMAP);
@@ -273,8 +248,6 @@ int init_pcap_mmap(int jumbo_support)
 
 void cleanup_pcap_mmap(void)
 {
-	spinlock_destroy(&lock);
-
 	pcap_ops_group_unregister(PCAP_OPS_MMAP);
 }
 
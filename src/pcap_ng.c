@@ -0,0 +1,645 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ *
+ * pcapng files: a Section Header Block, an Interface Description Block
+ * for each interface as it shows up, and one Enhanced Packet Block per
+ * packet carrying a nanosecond timestamp, the original length and the
+ * interface. Reading parses the file block by block through one fixed
+ * buffer, so there is no allocation per packet. Each packet comes with
+ * its interface and that interface's link type; readers that cannot take
+ * them only get packets of the first interface's link type.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <byteswap.h>
+#include <net/if.h>
+#include <sys/uio.h>
+
+#include "pcap.h"
+#include "xmalloc.h"
+#include "xio.h"
+#include "xutils.h"
+#include "built_in.h"
+#include "die.h"
+
+#define PCAPNG_BLOCK_IDB	0x00000001
+#define PCAPNG_BLOCK_SPB	0x00000003
+#define PCAPNG_BLOCK_EPB	0x00000006
+
+#define PCAPNG_BYTE_ORDER_MAGIC	0x1a2b3c4d
+#define PCAPNG_VERSION_MAJOR	1
+#define PCAPNG_VERSION_MINOR	0
+
+#define PCAPNG_OPT_END		0
+#define PCAPNG_OPT_IF_NAME	2
+#define PCAPNG_OPT_IF_TSRESOL	9
+
+#define PCAPNG_TSRESOL_NSEC	9
+#define PCAPNG_MAX_IFS		256
+#define PCAPNG_RDBUFSIZ		(1 << 18)
+#define PCAPNG_OPTBUFSIZ	1024
+
+struct pcapng_block_hdr {
+	uint32_t type;
+	uint32_t len;
+};
+
+struct pcapng_shb {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int64_t section_len;
+};
+
+struct pcapng_idb {
+	uint16_t linktype;
+	uint16_t reserved;
+	uint32_t snaplen;
+};
+
+struct pcapng_epb {
+	uint32_t ifid;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+struct pcapng_opt {
+	uint16_t code;
+	uint16_t len;
+};
+
+struct pcapng_if {
+	uint32_t ifindex;
+	uint32_t linktype;
+	uint64_t ts_per_sec;
+};
+
+static struct pcapng_if ifs[PCAPNG_MAX_IFS];
+static unsigned int num_ifs;
+static uint32_t magic_wr, linktype_wr, snaplen_wr;
+
+static uint8_t *rbuf;
+static size_t rlen, rpos;
+static int swapped;
+
+static inline uint16_t ng16(uint16_t val)
+{
+	return swapped ? bswap_16(val) : val;
+}
+
+static inline uint32_t ng32(uint32_t val)
+{
+	return swapped ? bswap_32(val) : val;
+}
+
+static int pcapng_read(int fd, void *dst, size_t len)
+{
+	size_t n;
+	ssize_t ret;
+
+	while (len > 0) {
+		if (rpos == rlen) {
+			ret = read(fd, rbuf, PCAPNG_RDBUFSIZ);
+			if (ret <= 0)
+				return -EIO;
+
+			rlen = ret;
+			rpos = 0;
+		}
+
+		n = min(len, rlen - rpos);
+		if (dst) {
+			fmemcpy(dst, rbuf + rpos, n);
+			dst += n;
+		}
+
+		rpos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static inline int pcapng_skip(int fd, size_t len)
+{
+	return pcapng_read(fd, NULL, len);
+}
+
+static int pcapng_read_shb(int fd, struct pcapng_block_hdr *bh)
+{
+	struct pcapng_shb shb;
+
+	if (pcapng_read(fd, &shb, sizeof(shb)))
+		return -EIO;
+
+	if (shb.magic == PCAPNG_BYTE_ORDER_MAGIC)
+		swapped = 0;
+	else if (shb.magic == bswap_32(PCAPNG_BYTE_ORDER_MAGIC))
+		swapped = 1;
+	else
+		return -EINVAL;
+
+	bh->len = ng32(bh->len);
+	if (ng16(shb.version_major) != PCAPNG_VERSION_MAJOR ||
+	    bh->len < sizeof(*bh) + sizeof(shb) + sizeof(uint32_t))
+		return -EINVAL;
+
+	/* A new section starts over with its interfaces */
+	num_ifs = 0;
+
+	return pcapng_skip(fd, bh->len - sizeof(*bh) - sizeof(shb));
+}
+
+/* True if nothing is left, a read error is left to the next pcapng_read() */
+static bool pcapng_eof(int fd)
+{
+	ssize_t ret;
+
+	if (rpos < rlen)
+		return false;
+
+	ret = read(fd, rbuf, PCAPNG_RDBUFSIZ);
+	if (ret <= 0)
+		return ret == 0;
+
+	rlen = ret;
+	rpos = 0;
+
+	return false;
+}
+
+static int pcapng_read_block_hdr(int fd, struct pcapng_block_hdr *bh)
+{
+	int ret;
+
+	while (1) {
+		if (pcapng_read(fd, bh, sizeof(*bh)))
+			return -EIO;
+
+		/* Palindromic, so independent of the section's byte order */
+		if (bh->type != PCAPNG_BLOCK_SHB)
+			break;
+
+		ret = pcapng_read_shb(fd, bh);
+		if (ret)
+			return ret;
+	}
+
+	bh->type = ng32(bh->type);
+	bh->len = ng32(bh->len);
+
+	if (unlikely(bh->len < sizeof(*bh) + sizeof(uint32_t) ||
+		     bh->len & 3))
+		return -EINVAL;
+
+	return 0;
+}
+
+static uint64_t pcapng_tsresol_to_hz(uint8_t tsresol)
+{
+	uint64_t hz = 1;
+	uint8_t exp = tsresol & 0x7f;
+
+	if (tsresol & 0x80)
+		return 1ULL << min(exp, 63);
+
+	while (exp-- > 0 && hz <= UINT64_MAX / 10)
+		hz *= 10;
+
+	return hz;
+}
+
+static int pcapng_read_idb(int fd, struct pcapng_block_hdr *bh)
+{
+	static uint8_t opts[PCAPNG_OPTBUFSIZ];
+	struct pcapng_idb idb;
+	struct pcapng_opt *opt;
+	struct pcapng_if *iface;
+	size_t len, optlen, off = 0;
+
+	len = bh->len - sizeof(*bh) - sizeof(uint32_t);
+	if (len < sizeof(idb) || num_ifs == PCAPNG_MAX_IFS)
+		return -EINVAL;
+
+	if (pcapng_read(fd, &idb, sizeof(idb)))
+		return -EIO;
+
+	iface = &ifs[num_ifs++];
+	iface->ifindex = num_ifs - 1;
+	iface->linktype = ng16(idb.linktype);
+	iface->ts_per_sec = 1000000;
+
+	len -= sizeof(idb);
+	optlen = min(len, sizeof(opts));
+	if (pcapng_read(fd, opts, optlen))
+		return -EIO;
+
+	while (off + sizeof(*opt) <= optlen) {
+		opt = (struct pcapng_opt *) (opts + off);
+		off += sizeof(*opt);
+
+		if (ng16(opt->code) == PCAPNG_OPT_END ||
+		    off + ng16(opt->len) > optlen)
+			break;
+		if (ng16(opt->code) == PCAPNG_OPT_IF_TSRESOL &&
+		    ng16(opt->len) == 1)
+			iface->ts_per_sec = pcapng_tsresol_to_hz(opts[off]);
+
+		off += round_up(ng16(opt->len), 4);
+	}
+
+	return pcapng_skip(fd, len - optlen + sizeof(uint32_t));
+}
+
+static inline void pcapng_ts_to_timeval(uint64_t ts, uint64_t hz,
+					struct pcap_timeval *tv)
+{
+	tv->tv_sec = ts / hz;
+	ts %= hz;
+
+	if (hz <= UINT64_MAX / 1000000000ULL)
+		tv->tv_nsec = ts * 1000000000ULL / hz;
+	else
+		tv->tv_nsec = ts / (hz / 1000000000ULL);
+}
+
+static ssize_t pcapng_read_epb(int fd, struct pcapng_block_hdr *bh,
+			       struct pcap_pkthdr *hdr,
+			       struct pcap_pkt_meta *meta, uint8_t *packet,
+			       size_t len)
+{
+	struct pcapng_epb epb;
+	struct pcapng_if *iface;
+	uint64_t ts;
+
+	if (bh->len < sizeof(*bh) + sizeof(epb) + sizeof(uint32_t))
+		return -EINVAL;
+
+	if (pcapng_read(fd, &epb, sizeof(epb)))
+		return -EIO;
+
+	if (unlikely(ng32(epb.ifid) >= num_ifs))
+		return -EINVAL;
+
+	iface = &ifs[ng32(epb.ifid)];
+	/* Would be dissected as something it is not */
+	if (unlikely(!meta && iface->linktype != ifs[0].linktype))
+		return -EINVAL;
+
+	ts = ((uint64_t) ng32(epb.ts_high) << 32) | ng32(epb.ts_low);
+	pcapng_ts_to_timeval(ts, iface->ts_per_sec, &hdr->ts);
+
+	hdr->caplen = ng32(epb.caplen);
+	hdr->len = ng32(epb.len);
+
+	if (unlikely(hdr->caplen == 0 || hdr->caplen > len ||
+		     sizeof(*bh) + sizeof(epb) + hdr->caplen +
+		     sizeof(uint32_t) > bh->len))
+		return -EINVAL; /* Bogus packet */
+
+	if (pcapng_read(fd, packet, hdr->caplen))
+		return -EIO;
+
+	/* Padding, options and trailing length */
+	if (pcapng_skip(fd, bh->len - sizeof(*bh) - sizeof(epb) - hdr->caplen))
+		return -EIO;
+
+	if (meta) {
+		meta->tv_nsec = hdr->ts.tv_nsec;
+		meta->ifindex = ng32(epb.ifid);
+		meta->linktype = iface->linktype;
+	}
+
+	return sizeof(*hdr) + hdr->caplen;
+}
+
+static ssize_t pcapng_read_spb(int fd, struct pcapng_block_hdr *bh,
+			       struct pcap_pkthdr *hdr,
+			       struct pcap_pkt_meta *meta, uint8_t *packet,
+			       size_t len)
+{
+	uint32_t wire_len;
+
+	if (bh->len < sizeof(*bh) + 2 * sizeof(uint32_t))
+		return -EINVAL;
+
+	if (pcapng_read(fd, &wire_len, sizeof(wire_len)))
+		return -EIO;
+
+	/* No timestamp here, and the capture length is implied */
+	fmemset(&hdr->ts, 0, sizeof(hdr->ts));
+	hdr->len = ng32(wire_len);
+	hdr->caplen = min(hdr->len, bh->len - sizeof(*bh) -
+			  2 * sizeof(uint32_t));
+
+	if (unlikely(hdr->caplen == 0 || hdr->caplen > len))
+		return -EINVAL; /* Bogus packet */
+
+	if (pcapng_read(fd, packet, hdr->caplen))
+		return -EIO;
+
+	if (pcapng_skip(fd, bh->len - sizeof(*bh) - sizeof(wire_len) -
+			hdr->caplen))
+		return -EIO;
+
+	/* Simple packets always belong to the first interface */
+	if (meta) {
+		meta->tv_nsec = 0;
+		meta->ifindex = 0;
+		meta->linktype = ifs[0].linktype;
+	}
+
+	return sizeof(*hdr) + hdr->caplen;
+}
+
+static int pcapng_pull_file_header(int fd, uint32_t *magic,
+				   uint32_t *linktype)
+{
+	int ret;
+	struct pcapng_block_hdr bh;
+
+	rlen = rpos = 0;
+	num_ifs = 0;
+	swapped = 0;
+
+	if (pcapng_read(fd, &bh, sizeof(bh)) || bh.type != PCAPNG_BLOCK_SHB ||
+	    pcapng_read_shb(fd, &bh))
+		return -EINVAL;
+
+	/* The first interface determines what we are going to dissect */
+	while (num_ifs == 0) {
+		ret = pcapng_read_block_hdr(fd, &bh);
+		if (ret)
+			return ret;
+
+		switch (bh.type) {
+		case PCAPNG_BLOCK_IDB:
+			ret = pcapng_read_idb(fd, &bh);
+			if (ret)
+				return ret;
+			break;
+		case PCAPNG_BLOCK_EPB:
+		case PCAPNG_BLOCK_SPB:
+			return -EINVAL;
+		default:
+			ret = pcapng_skip(fd, bh.len - sizeof(bh));
+			if (ret)
+				return ret;
+			break;
+		}
+	}
+
+	if (ifs[0].linktype != LINKTYPE_EN10MB &&
+	    ifs[0].linktype != LINKTYPE_IEEE802_11)
+		return -EINVAL;
+
+	/* Timestamps are handed out in nanoseconds, whatever the file has */
+	*magic = NSEC_TCPDUMP_MAGIC;
+	*linktype = ifs[0].linktype;
+
+	return 0;
+}
+
+static ssize_t pcapng_read_pcap_pkt_meta(int fd, struct pcap_pkthdr *hdr,
+					 struct pcap_pkt_meta *meta,
+					 uint8_t *packet, size_t len)
+{
+	int ret;
+	struct pcapng_block_hdr bh;
+
+	while (1) {
+		if (unlikely(pcapng_eof(fd)))
+			return 0;
+
+		ret = pcapng_read_block_hdr(fd, &bh);
+		if (unlikely(ret))
+			return ret;
+
+		switch (bh.type) {
+		case PCAPNG_BLOCK_EPB:
+			return pcapng_read_epb(fd, &bh, hdr, meta, packet,
+					       len);
+		case PCAPNG_BLOCK_SPB:
+			if (unlikely(num_ifs == 0))
+				return -EINVAL;
+			return pcapng_read_spb(fd, &bh, hdr, meta, packet,
+					       len);
+		case PCAPNG_BLOCK_IDB:
+			ret = pcapng_read_idb(fd, &bh);
+			break;
+		default:
+			ret = pcapng_skip(fd, bh.len - sizeof(bh));
+			break;
+		}
+
+		if (unlikely(ret))
+			return ret;
+	}
+}
+
+static ssize_t pcapng_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
+				    uint8_t *packet, size_t len)
+{
+	return pcapng_read_pcap_pkt_meta(fd, hdr, NULL, packet, len);
+}
+
+static int pcapng_push_file_header(int fd, uint32_t magic,
+				   uint32_t linktype, uint32_t snaplen)
+{
+	ssize_t ret;
+	struct {
+		struct pcapng_block_hdr bh;
+		struct pcapng_shb shb;
+		uint32_t len;
+	} __packed blk;
+
+	fmemset(&blk, 0, sizeof(blk));
+
+	blk.bh.type = PCAPNG_BLOCK_SHB;
+	blk.bh.len = blk.len = sizeof(blk);
+	blk.shb.magic = PCAPNG_BYTE_ORDER_MAGIC;
+	blk.shb.version_major = PCAPNG_VERSION_MAJOR;
+	blk.shb.version_minor = PCAPNG_VERSION_MINOR;
+	blk.shb.section_len = -1;
+
+	/* Interface blocks follow as we see packets from them */
+	num_ifs = 0;
+	magic_wr = magic;
+	linktype_wr = linktype;
+	snaplen_wr = snaplen;
+
+	ret = write_or_die(fd, &blk, sizeof(blk));
+	if (unlikely(ret != sizeof(blk))) {
+		whine("Failed to write pkt file header!\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static size_t pcapng_push_opt(uint8_t *blk, size_t off, uint16_t code,
+			      const void *data, uint16_t len)
+{
+	struct pcapng_opt *opt = (struct pcapng_opt *) (blk + off);
+
+	opt->code = code;
+	opt->len = len;
+
+	if (len)
+		fmemcpy(blk + off + sizeof(*opt), data, len);
+
+	return off + sizeof(*opt) + round_up(len, 4);
+}
+
+static int pcapng_if_id(int fd, uint32_t ifindex)
+{
+	ssize_t ret;
+	unsigned int i;
+	char name[IF_NAMESIZE];
+	uint8_t tsresol = PCAPNG_TSRESOL_NSEC;
+	uint8_t blk[64 + IF_NAMESIZE];
+	struct pcapng_block_hdr *bh = (struct pcapng_block_hdr *) blk;
+	struct pcapng_idb *idb = (struct pcapng_idb *) (blk + sizeof(*bh));
+	size_t off = sizeof(*bh) + sizeof(*idb);
+
+	for (i = 0; i < num_ifs; ++i) {
+		if (ifs[i].ifindex == ifindex)
+			return i;
+	}
+
+	if (num_ifs == PCAPNG_MAX_IFS)
+		panic("Too many interfaces for one pcapng section!\n");
+
+	fmemset(blk, 0, sizeof(blk));
+
+	idb->linktype = linktype_wr;
+	idb->snaplen = snaplen_wr;
+
+	if (ifindex > 0 && if_indextoname(ifindex, name))
+		off = pcapng_push_opt(blk, off, PCAPNG_OPT_IF_NAME, name,
+				      strlen(name));
+	off = pcapng_push_opt(blk, off, PCAPNG_OPT_IF_TSRESOL, &tsresol,
+			      sizeof(tsresol));
+	off = pcapng_push_opt(blk, off, PCAPNG_OPT_END, NULL, 0);
+	off += sizeof(uint32_t);
+
+	bh->type = PCAPNG_BLOCK_IDB;
+	bh->len = off;
+	fmemcpy(blk + off - sizeof(uint32_t), &bh->len, sizeof(uint32_t));
+
+	ret = write_or_die(fd, blk, off);
+	if (unlikely(ret != off))
+		panic("Failed to write pcapng interface block!\n");
+
+	ifs[num_ifs].ifindex = ifindex;
+
+	return num_ifs++;
+}
+
+static ssize_t pcapng_write_pcap_pkt_meta(int fd, struct pcap_pkthdr *hdr,
+					  struct pcap_pkt_meta *meta,
+					  uint8_t *packet, size_t len)
+{
+	static const uint8_t pad[4] = { 0 };
+	ssize_t ret;
+	uint64_t ts;
+	struct pcapng_block_hdr bh;
+	struct pcapng_epb epb;
+	struct iovec iov[5];
+	size_t padlen = round_up(len, 4) - len;
+
+	epb.ifid = pcapng_if_id(fd, meta->ifindex);
+
+	ts = (uint64_t) hdr->ts.tv_sec * 1000000000ULL + meta->tv_nsec;
+	epb.ts_high = ts >> 32;
+	epb.ts_low = (uint32_t) ts;
+	epb.caplen = len;
+	epb.len = max((size_t) hdr->len, len);
+
+	bh.type = PCAPNG_BLOCK_EPB;
+	bh.len = sizeof(bh) + sizeof(epb) + len + padlen + sizeof(uint32_t);
+
+	iov[0].iov_base = &bh;
+	iov[0].iov_len = sizeof(bh);
+	iov[1].iov_base = &epb;
+	iov[1].iov_len = sizeof(epb);
+	iov[2].iov_base = packet;
+	iov[2].iov_len = len;
+	iov[3].iov_base = (void *) pad;
+	iov[3].iov_len = padlen;
+	iov[4].iov_base = &bh.len;
+	iov[4].iov_len = sizeof(bh.len);
+
+	ret = writev_or_die(fd, iov, array_size(iov));
+	if (unlikely(ret != bh.len)) {
+		whine("Failed to write pkt block!\n");
+		return -EIO;
+	}
+
+	return sizeof(*hdr) + len;
+}
+
+static ssize_t pcapng_write_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
+				     uint8_t *packet, size_t len)
+{
+	struct pcap_pkt_meta meta = {
+		.tv_nsec = pcap_magic_is_nsec(magic_wr) ? hdr->ts.tv_nsec :
+			   hdr->ts.tv_usec * 1000,
+		.ifindex = 0,
+	};
+
+	return pcapng_write_pcap_pkt_meta(fd, hdr, &meta, packet, len);
+}
+
+static void pcapng_fsync_pcap(int fd)
+{
+	fdatasync(fd);
+}
+
+static int pcapng_prepare_writing_pcap(int fd)
+{
+	set_ioprio_rt();
+	return 0;
+}
+
+static int pcapng_prepare_reading_pcap(int fd)
+{
+	set_ioprio_rt();
+	return 0;
+}
+
+const struct pcap_file_ops pcap_ng_ops = {
+	.name = "pcapng",
+	.pull_file_header = pcapng_pull_file_header,
+	.push_file_header = pcapng_push_file_header,
+	.write_pcap_pkt = pcapng_write_pcap_pkt,
+	.write_pcap_pkt_meta = pcapng_write_pcap_pkt_meta,
+	.read_pcap_pkt = pcapng_read_pcap_pkt,
+	.read_pcap_pkt_meta = pcapng_read_pcap_pkt_meta,
+	.fsync_pcap = pcapng_fsync_pcap,
+	.prepare_writing_pcap = pcapng_prepare_writing_pcap,
+	.prepare_reading_pcap = pcapng_prepare_reading_pcap,
+};
+
+int init_pcap_ng(int jumbo_support)
+{
+	rbuf = xmalloc_aligned(PCAPNG_RDBUFSIZ, CO_CACHE_LINE_SIZE);
+	rlen = rpos = 0;
+
+	return pcap_ops_group_register(&pcap_ng_ops, PCAP_OPS_NG);
+}
+
+void cleanup_pcap_ng(void)
+{
+	xfree(rbuf);
+
+	pcap_ops_group_unregister(PCAP_OPS_NG);
+}
@@ -17,7 +17,8 @@
 #include "xio.h"
 #include "die.h"
 
-static int pcap_rw_pull_file_header(int fd, uint32_t *linktype)
+static int pcap_rw_pull_file_header(int fd, uint32_t *magic,
+				    uint32_t *linktype)
 {
 	ssize_t ret;
 	struct pcap_filehdr hdr;
@@ -28,18 +29,20 @@ static int pcap_rw_pull_file_header(int fd, uint32_t *linktype)
 
 	pcap_validate_header(&hdr);
 
+	*magic = hdr.magic;
 	*linktype = hdr.linktype;
 
 	return 0;
 }
 
-static int pcap_rw_push_file_header(int fd, uint32_t linktype)
+static int pcap_rw_push_file_header(int fd, uint32_t magic,
+				    uint32_t linktype, uint32_t snaplen)
 {
 	ssize_t ret;
 	struct pcap_filehdr hdr;
 
 	memset(&hdr, 0, sizeof(hdr));
-	pcap_prepare_header(&hdr, linktype, 0, PCAP_DEFAULT_SNAPSHOT_LEN);
+	pcap_prepare_header(&hdr, magic, linktype, 0, snaplen);
 
 	ret = write_or_die(fd, &hdr, sizeof(hdr));
 	if (unlikely(ret != sizeof(hdr))) {
@@ -59,22 +62,29 @@ static ssize_t pcap_rw_write_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 		return -EIO;
 	}
 
-	if (unlikely(hdr->len != len))
+	if (unlikely(hdr->caplen != len))
 		return -EINVAL;
 
-	ret = write_or_die(fd, packet, hdr->len);
-	if (unlikely(ret != hdr->len)) {
+	ret = write_or_die(fd, packet, len);
+	if (unlikely(ret != len)) {
 		whine("Failed to write pkt payload!\n");
 		return -EIO;
 	}
 
-	return sizeof(*hdr) + hdr->len;
+	return sizeof(*hdr) + len;
+}
+
+static ssize_t pcap_rw_write_pcap_pkts(int fd, struct iovec *iov, int iovcnt)
+{
+	return writev_or_die(fd, iov, iovcnt);
 }
 
 static ssize_t pcap_rw_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 				     uint8_t *packet, size_t len)
 {
 	ssize_t ret = read(fd, hdr, sizeof(*hdr));
+	if (unlikely(ret == 0))
+		return 0; /* EOF */
 	if (unlikely(ret != sizeof(*hdr)))
 		return -EIO;
 
@@ -110,6 +120,7 @@ const struct pcap_file_ops pcap_rw_ops = {
 	.pull_file_header = pcap_rw_pull_file_header,
 	.push_file_header = pcap_rw_push_file_header,
 	.write_pcap_pkt = pcap_rw_write_pcap_pkt,
+	.write_pcap_pkts = pcap_rw_write_pcap_pkts,
 	.read_pcap_pkt = pcap_rw_read_pcap_pkt,
 	.fsync_pcap = pcap_rw_fsync_pcap,
 	.prepare_writing_pcap = pcap_rw_prepare_writing_pcap,
@@ -16,7 +16,6 @@
 #include "xmalloc.h"
 #include "xio.h"
 #include "xutils.h"
-#include "locking.h"
 #include "built_in.h"
 
 #define IOVSIZ		1000
@@ -26,10 +25,12 @@
 
 static struct iovec iov[IOVSIZ];
 static unsigned long c = 0;
-static struct spinlock lock;
 static ssize_t iov_used;
+/* How much the last readv() got, the rest of iov is stale */
+static size_t iov_fill;
 
-static int pcap_sg_pull_file_header(int fd, uint32_t *linktype)
+static int pcap_sg_pull_file_header(int fd, uint32_t *magic,
+				    uint32_t *linktype)
 {
 	ssize_t ret;
 	struct pcap_filehdr hdr;
@@ -40,18 +41,20 @@ static int pcap_sg_pull_file_header(int fd, uint32_t *linktype)
 
 	pcap_validate_header(&hdr);
 
+	*magic = hdr.magic;
 	*linktype = hdr.linktype;
 
 	return 0;
 }
 
-static int pcap_sg_push_file_header(int fd, uint32_t linktype)
+static int pcap_sg_push_file_header(int fd, uint32_t magic,
+				    uint32_t linktype, uint32_t snaplen)
 {
 	ssize_t ret;
 	struct pcap_filehdr hdr;
 
 	fmemset(&hdr, 0, sizeof(hdr));
-	pcap_prepare_header(&hdr, linktype, 0, PCAP_DEFAULT_SNAPSHOT_LEN);
+	pcap_prepare_header(&hdr, magic, linktype, 0, snaplen);
 
 	ret = write_or_die(fd, &hdr, sizeof(hdr));
 	if (unlikely(ret != sizeof(hdr))) {
@@ -73,8 +76,6 @@ static ssize_t pcap_sg_write_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 {
 	ssize_t ret;
 
-	spinlock_lock(&lock);
-
 	if (unlikely(c == IOVSIZ)) {
 		ret = writev(fd, iov, IOVSIZ);
 		if (ret < 0)
@@ -94,23 +95,52 @@ static ssize_t pcap_sg_write_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 
 	c++;
 
-	spinlock_unlock(&lock);
+	return ret;
+}
+
+static ssize_t pcap_sg_write_pcap_pkts(int fd, struct iovec *vec, int vecnt)
+{
+	ssize_t ret;
+
+	/* Keep the ordering with what is still sitting in our buffers */
+	if (c > 0) {
+		ret = writev(fd, iov, c);
+		if (ret < 0)
+			panic("writev I/O error!\n");
+
+		c = 0;
+	}
+
+	ret = writev_or_die(fd, vec, vecnt);
+
+	return ret;
+}
+
+static ssize_t pcap_sg_refill(int fd)
+{
+	ssize_t ret = readv(fd, iov, IOVSIZ);
+
+	if (ret >= 0) {
+		iov_fill = ret;
+		iov_used = 0;
+		c = 0;
+	}
 
 	return ret;
 }
 
+static inline size_t pcap_sg_pos(void)
+{
+	return c * iov[0].iov_len + iov_used;
+}
+
 static int pcap_sg_prepare_reading_pcap(int fd)
 {
 	set_ioprio_rt();
 
-	spinlock_lock(&lock);
-	if (readv(fd, iov, IOVSIZ) <= 0)
+	if (pcap_sg_refill(fd) < 0)
 		return -EIO;
 
-	iov_used = 0;
-	c = 0;
-	spinlock_unlock(&lock);
-
 	return 0;
 }
 
@@ -119,9 +149,17 @@ static ssize_t pcap_sg_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 {
 	ssize_t ret = 0;
 
-	/* In contrast to writing, reading gets really ugly ... */
-	spinlock_lock(&lock);
+	/* All that was read is used up, only a full readv() may have more */
+	if (unlikely(pcap_sg_pos() >= iov_fill)) {
+		if (iov_fill < IOVSIZ * iov[0].iov_len)
+			return 0; /* EOF */
 
+		ret = pcap_sg_refill(fd);
+		if (ret <= 0)
+			return ret == 0 ? 0 : -EIO;
+	}
+
+	/* In contrast to writing, reading gets really ugly ... */
 	if (likely(iov[c].iov_len - iov_used >= sizeof(*hdr))) {
 		fmemcpy(hdr, iov[c].iov_base + iov_used, sizeof(*hdr));
 		iov_used += sizeof(*hdr);
@@ -143,8 +181,7 @@ static ssize_t pcap_sg_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 
 		if (c == IOVSIZ) {
 			/* We need to refetch! */
-			c = 0;
-			if (readv(fd, iov, IOVSIZ) <= 0) {
+			if (pcap_sg_refill(fd) <= 0) {
 				ret = -EIO;
 				goto out_err;
 			}
@@ -158,6 +195,11 @@ static ssize_t pcap_sg_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 
 	/* header read completed */
 
+	if (unlikely(pcap_sg_pos() > iov_fill)) {
+		ret = -EIO; /* Truncated header */
+		goto out_err;
+	}
+
 	if (unlikely(hdr->caplen == 0 || hdr->caplen > len)) {
 		ret = -EINVAL; /* Bogus packet */
 		goto out_err;
@@ -186,8 +228,7 @@ static ssize_t pcap_sg_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 
 		if (c == IOVSIZ) {
 			/* We need to refetch! */
-			c = 0;
-			if (readv(fd, iov, IOVSIZ) <= 0) {
+			if (pcap_sg_refill(fd) <= 0) {
 				ret = -EIO;
 				goto out_err;
 			}
@@ -198,12 +239,14 @@ static ssize_t pcap_sg_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
 		iov_used += remainder;
 	}
 
-	spinlock_unlock(&lock);
+	if (unlikely(pcap_sg_pos() > iov_fill)) {
+		ret = -EIO; /* Truncated packet */
+		goto out_err;
+	}
 
 	return sizeof(*hdr) + hdr->caplen;
 
 out_err:
-	spinlock_unlock(&lock);
 	return ret;
 }
 
@@ -211,7 +254,6 @@ static void pcap_sg_fsync_pcap(int fd)
 {
 	ssize_t ret;
 
-	spinlock_lock(&lock);
 	ret = writev(fd, iov, c);
 	if (ret < 0)
 		panic("writev I/O error!\n");
@@ -219,7 +261,6 @@ static void pcap_sg_fsync_pcap(int fd)
 	c = 0;
 
 	fdatasync(fd);
-	spinlock_unlock(&lock);
 }
 
 const struct pcap_file_ops pcap_sg_ops = {
@@ -227,6 +268,7 @@ const struct pcap_file_ops pcap_sg_ops = {
 	.pull_file_header = pcap_sg_pull_file_header,
 	.push_file_header = pcap_sg_push_file_header,
 	.write_pcap_pkt = pcap_sg_write_pcap_pkt,
+	.write_pcap_pkts = pcap_sg_write_pcap_pkts,
 	.prepare_reading_pcap =  pcap_sg_prepare_reading_pcap,
 	.prepare_writing_pcap =  pcap_sg_prepare_writing_pcap,
 	.read_pcap_pkt = pcap_sg_read_pcap_pkt,
@@ -252,8 +294,6 @@ int init_pcap_sg(int jumbo_support)
 		iov[i].iov_len = allocsz;
 	}
 
-	spinlock_init(&lock);
-
 	return pcap_ops_group_register(&pcap_sg_ops, PCAP_OPS_SG);
 }
 
@@ -261,8 +301,6 @@ void cleanup_pcap_sg(void)
 {
 	unsigned long i;
 
-	spinlock_destroy(&lock);
-
 	for (i = 0; i < IOVSIZ; ++i)
 		xfree(iov[i].iov_base);
 
@@ -0,0 +1,484 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ *
+ * Asynchronous pcap writer on top of io_uring: packets are collected into
+ * a couple of large buffers, full buffers are queued to the kernel and we
+ * go on with the next free one, so that the capture path only stalls when
+ * all buffers are still in flight. Works with O_DIRECT file descriptors as
+ * well, in that case only the unaligned tail goes through the page cache,
+ * or everything after a short write that stopped at an unaligned offset.
+ * We speak to the kernel directly, so there is no liburing dependency.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#include "pcap.h"
+#include "xmalloc.h"
+#include "xio.h"
+#include "xutils.h"
+#include "built_in.h"
+
+#define URING_SLOTS		8
+#define URING_BUFSIZ		(1 << 20)
+#define URING_DIRECT_ALIGN	4096
+
+struct uring_slot {
+	uint8_t *buff;
+	size_t len, done;
+	off_t off;
+	int fd, busy;
+	struct timespec issued;
+};
+
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+struct uring_stats {
+	unsigned long writes, bytes, stalls, short_writes;
+	unsigned int inflight, inflight_max;
+	uint64_t lat_sum, lat_max;
+};
+
+static struct uring ring = { .fd = -1, };
+static struct uring_slot slots[URING_SLOTS];
+static struct uring_stats stats;
+static unsigned int curr;
+static off_t offset;
+static int direct;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static void uring_setup(void)
+{
+	struct io_uring_params p;
+
+	fmemset(&p, 0, sizeof(p));
+
+	ring.fd = sys_io_uring_setup(URING_SLOTS, &p);
+	if (ring.fd < 0)
+		panic("Cannot setup io_uring, kernel too old?\n");
+
+	ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.sq_len = ring.cq_len = max(ring.sq_len, ring.cq_len);
+
+	ring.sq_ptr = mmap(0, ring.sq_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring.fd,
+			   IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED)
+		panic("Cannot mmap io_uring SQ ring!\n");
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ptr = ring.sq_ptr;
+	} else {
+		ring.cq_ptr = mmap(0, ring.cq_len, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, ring.fd,
+				   IORING_OFF_CQ_RING);
+		if (ring.cq_ptr == MAP_FAILED)
+			panic("Cannot mmap io_uring CQ ring!\n");
+	}
+
+	ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(0, ring.sqes_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		panic("Cannot mmap io_uring SQEs!\n");
+
+	ring.sq_head = ring.sq_ptr + p.sq_off.head;
+	ring.sq_tail = ring.sq_ptr + p.sq_off.tail;
+	ring.sq_mask = ring.sq_ptr + p.sq_off.ring_mask;
+	ring.sq_array = ring.sq_ptr + p.sq_off.array;
+
+	ring.cq_head = ring.cq_ptr + p.cq_off.head;
+	ring.cq_tail = ring.cq_ptr + p.cq_off.tail;
+	ring.cq_mask = ring.cq_ptr + p.cq_off.ring_mask;
+	ring.cqes = ring.cq_ptr + p.cq_off.cqes;
+}
+
+static void uring_teardown(void)
+{
+	if (ring.fd < 0)
+		return;
+
+	munmap(ring.sqes, ring.sqes_len);
+	if (ring.cq_ptr != ring.sq_ptr)
+		munmap(ring.cq_ptr, ring.cq_len);
+	munmap(ring.sq_ptr, ring.sq_len);
+
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+static inline uint64_t ts_delta_ns(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000ULL +
+	       b->tv_nsec - a->tv_nsec;
+}
+
+/* Hands what is left of the slot over to the kernel */
+static void uring_queue(struct uring_slot *slot)
+{
+	int ret;
+	unsigned int tail;
+	struct io_uring_sqe *sqe;
+
+	tail = *ring.sq_tail;
+	sqe = &ring.sqes[tail & *ring.sq_mask];
+
+	fmemset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = slot->fd;
+	sqe->addr = (unsigned long) (slot->buff + slot->done);
+	sqe->len = slot->len - slot->done;
+	sqe->off = slot->off + slot->done;
+	sqe->user_data = slot - slots;
+
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = sys_io_uring_enter(ring.fd, 1, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		panic("io_uring_enter failed: %s!\n", strerror(errno));
+	if (ret != 1)
+		panic("io_uring_enter submitted %d of 1 writes!\n", ret);
+}
+
+/* Falls back to the page cache for everything written from now on */
+static void uring_drop_direct(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+	direct = 0;
+}
+
+static void uring_reap(void)
+{
+	unsigned int head, tail;
+	struct io_uring_cqe *cqe;
+	struct uring_slot *slot;
+	struct timespec now;
+	uint64_t lat;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (; head != tail; head++) {
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		slot = &slots[cqe->user_data];
+
+		if (unlikely(cqe->res <= 0))
+			panic("io_uring pcap write error: %s!\n",
+			      cqe->res < 0 ? strerror(-cqe->res) : "no progress");
+
+		/* Short writes are fine, O_DIRECT does them, go on with the rest */
+		slot->done += cqe->res;
+		if (unlikely(slot->done < slot->len)) {
+			stats.short_writes++;
+			/* The rest would start unaligned, O_DIRECT refuses that */
+			if (direct && (slot->done & (URING_DIRECT_ALIGN - 1)))
+				uring_drop_direct(slot->fd);
+			uring_queue(slot);
+			continue;
+		}
+
+		lat = ts_delta_ns(&slot->issued, &now);
+		stats.lat_sum += lat;
+		if (lat > stats.lat_max)
+			stats.lat_max = lat;
+
+		slot->busy = 0;
+		slot->len = 0;
+		stats.inflight--;
+	}
+
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_wait(unsigned int min_complete)
+{
+	int ret;
+
+	do {
+		ret = sys_io_uring_enter(ring.fd, 0, min_complete,
+					 IORING_ENTER_GETEVENTS);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		panic("io_uring_enter failed: %s!\n", strerror(errno));
+
+	uring_reap();
+}
+
+static void uring_submit(int fd, unsigned int idx, size_t len)
+{
+	struct uring_slot *slot = &slots[idx];
+
+	slot->fd = fd;
+	slot->len = len;
+	slot->done = 0;
+	slot->off = offset;
+	slot->busy = 1;
+	clock_gettime(CLOCK_MONOTONIC, &slot->issued);
+
+	uring_queue(slot);
+
+	offset += len;
+
+	stats.writes++;
+	stats.bytes += len;
+	stats.inflight++;
+	if (stats.inflight > stats.inflight_max)
+		stats.inflight_max = stats.inflight;
+}
+
+/* Queue the current buffer and switch over to the next free one */
+static void uring_push_curr(int fd)
+{
+	if (slots[curr].len == 0)
+		return;
+
+	uring_submit(fd, curr, slots[curr].len);
+
+	curr = (curr + 1) % URING_SLOTS;
+
+	uring_reap();
+	if (slots[curr].busy) {
+		stats.stalls++;
+		while (slots[curr].busy)
+			uring_wait(1);
+	}
+}
+
+static void uring_drain(void)
+{
+	while (stats.inflight > 0)
+		uring_wait(stats.inflight);
+}
+
+static int pcap_uring_pull_file_header(int fd, uint32_t *magic,
+				       uint32_t *linktype)
+{
+	ssize_t ret;
+	struct pcap_filehdr hdr;
+
+	ret = read(fd, &hdr, sizeof(hdr));
+	if (unlikely(ret != sizeof(hdr)))
+		return -EIO;
+
+	pcap_validate_header(&hdr);
+
+	*magic = hdr.magic;
+	*linktype = hdr.linktype;
+
+	return 0;
+}
+
+static int pcap_uring_push_file_header(int fd, uint32_t magic,
+				       uint32_t linktype, uint32_t snaplen)
+{
+	struct pcap_filehdr hdr;
+
+	if (ring.fd < 0)
+		uring_setup();
+
+	fmemset(&hdr, 0, sizeof(hdr));
+	pcap_prepare_header(&hdr, magic, linktype, 0, snaplen);
+
+	/* The header goes out with the first batch of packets */
+	uring_drain();
+	offset = 0;
+	curr = 0;
+
+	fmemcpy(slots[curr].buff, &hdr, sizeof(hdr));
+	slots[curr].len = sizeof(hdr);
+
+	return 0;
+}
+
+static int pcap_uring_prepare_writing_pcap(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	set_ioprio_be();
+
+	direct = (flags >= 0 && (flags & O_DIRECT) == O_DIRECT);
+
+	return 0;
+}
+
+static ssize_t pcap_uring_write_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
+					 uint8_t *packet, size_t len)
+{
+	struct uring_slot *slot;
+
+	/* Cheap peek at the CQ ring, keeps the latency counters honest */
+	if (stats.inflight > 0)
+		uring_reap();
+
+	slot = &slots[curr];
+	if (unlikely(slot->len + sizeof(*hdr) + len > URING_BUFSIZ)) {
+		size_t tail = 0, done;
+
+		/* O_DIRECT writes need an aligned length, carry the rest */
+		if (direct)
+			tail = slot->len & (URING_DIRECT_ALIGN - 1);
+
+		slot->len -= tail;
+		done = slot->len;
+		uring_push_curr(fd);
+
+		if (tail) {
+			fmemcpy(slots[curr].buff, slot->buff + done, tail);
+			slots[curr].len = tail;
+		}
+
+		slot = &slots[curr];
+	}
+
+	fmemcpy(slot->buff + slot->len, hdr, sizeof(*hdr));
+	slot->len += sizeof(*hdr);
+
+	fmemcpy(slot->buff + slot->len, packet, len);
+	slot->len += len;
+
+	return sizeof(*hdr) + len;
+}
+
+static void pcap_uring_fsync_pcap(int fd)
+{
+	ssize_t ret;
+	size_t tail = 0, len;
+	struct uring_slot *slot;
+
+	slot = &slots[curr];
+	if (direct) {
+		tail = slot->len & (URING_DIRECT_ALIGN - 1);
+		slot->len -= tail;
+	}
+
+	len = slot->len;
+	uring_push_curr(fd);
+	uring_drain();
+
+	/* Remainder is unaligned, so it goes through the page cache */
+	if (tail) {
+		uring_drop_direct(fd);
+
+		ret = pwrite(fd, slot->buff + len, tail, offset);
+		if (ret != tail)
+			panic("pwrite I/O error!\n");
+
+		offset += tail;
+	}
+
+	fdatasync(fd);
+}
+
+static ssize_t pcap_uring_read_pcap_pkt(int fd, struct pcap_pkthdr *hdr,
+					uint8_t *packet, size_t len)
+{
+	ssize_t ret = read(fd, hdr, sizeof(*hdr));
+	if (unlikely(ret == 0))
+		return 0; /* EOF */
+	if (unlikely(ret != sizeof(*hdr)))
+		return -EIO;
+
+	if (unlikely(hdr->caplen == 0 || hdr->caplen > len))
+		return -EINVAL; /* Bogus packet */
+
+	ret = read(fd, packet, hdr->caplen);
+	if (unlikely(ret != hdr->caplen))
+		return -EIO;
+
+	return sizeof(*hdr) + hdr->caplen;
+}
+
+static int pcap_uring_prepare_reading_pcap(int fd)
+{
+	set_ioprio_be();
+	return 0;
+}
+
+static void pcap_uring_print_stats(void)
+{
+	printf("io_uring: %lu writes, %lu bytes, %u/%u max queue depth, "
+	       "%lu stalls, %lu short writes, "
+	       "%.1f/%.1f us avg/max completion latency\n",
+	       stats.writes, stats.bytes, stats.inflight_max, URING_SLOTS,
+	       stats.stalls, stats.short_writes, stats.writes ?
+	       1.0 * stats.lat_sum / stats.writes / 1000 : 0.0,
+	       1.0 * stats.lat_max / 1000);
+}
+
+const struct pcap_file_ops pcap_uring_ops = {
+	.name = "io_uring",
+	.pull_file_header = pcap_uring_pull_file_header,
+	.push_file_header = pcap_uring_push_file_header,
+	.prepare_writing_pcap = pcap_uring_prepare_writing_pcap,
+	.write_pcap_pkt = pcap_uring_write_pcap_pkt,
+	.prepare_reading_pcap = pcap_uring_prepare_reading_pcap,
+	.read_pcap_pkt = pcap_uring_read_pcap_pkt,
+	.fsync_pcap = pcap_uring_fsync_pcap,
+	.print_stats = pcap_uring_print_stats,
+};
+
+int init_pcap_uring(int jumbo_support)
+{
+	int i;
+
+	fmemset(&stats, 0, sizeof(stats));
+
+	for (i = 0; i < URING_SLOTS; ++i) {
+		slots[i].buff = xmalloc_aligned(URING_BUFSIZ,
+						URING_DIRECT_ALIGN);
+		slots[i].len = 0;
+		slots[i].busy = 0;
+	}
+
+	return pcap_ops_group_register(&pcap_uring_ops, PCAP_OPS_URING);
+}
+
+void cleanup_pcap_uring(void)
+{
+	int i;
+
+	uring_teardown();
+
+	for (i = 0; i < URING_SLOTS; ++i)
+		xfree(slots[i].buff);
+
+	pcap_ops_group_unregister(PCAP_OPS_URING);
+}
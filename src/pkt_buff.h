@@ -22,22 +22,14 @@ struct pkt_buff {
 	struct protocol *proto;
 };
 
-static inline struct pkt_buff *pkt_alloc(uint8_t *packet, unsigned int len)
+static inline void pkt_init(struct pkt_buff *pkt, uint8_t *packet,
+			    unsigned int len)
 {
-	struct pkt_buff *pkt = xmalloc(sizeof(*pkt));
-
 	pkt->head = packet;
 	pkt->data = packet;
 	pkt->tail = packet + len;
 	pkt->size = len;
 	pkt->proto = NULL;
-
-	return pkt;
-}
-
-static inline void pkt_free(struct pkt_buff *pkt)
-{
-	xfree(pkt);
 }
 
 static inline unsigned int pkt_len(struct pkt_buff *pkt)
@@ -99,14 +91,13 @@ static inline uint8_t *pkt_pull_tail(struct pkt_buff *pkt, unsigned int len)
 	return tail;
 }
 
-static inline void pkt_set_proto(struct pkt_buff *pkt, struct hash_table *table,
+static inline void pkt_set_proto(struct pkt_buff *pkt,
+				 const struct proto_table *table,
 				 unsigned int key)
 {
 	bug_on(!pkt || !table);
 
-	pkt->proto = (struct protocol *) lookup_hash(key, table);
-	while (pkt->proto && key != pkt->proto->key)
-		pkt->proto = pkt->proto->next;
+	pkt->proto = proto_table_lookup(table, key);
 }
 
 #endif /* PKT_BUFF_H */
@@ -22,11 +22,35 @@ struct protocol {
 	unsigned int key;
 	void (*print_full)(struct pkt_buff *pkt);
 	void (*print_less)(struct pkt_buff *pkt);
+	void (*print_struct)(struct pkt_buff *pkt);
 	/* Used by program logic */
-	struct protocol *next;
 	void (*process)   (struct pkt_buff *pkt);
 };
 
+/*
+ * Maps the protocol number of the layer below to the protocol that
+ * dissects what follows. The slot of a key is (key * mult) >> shift,
+ * chosen when the table is built so that registered keys do not collide.
+ */
+struct proto_table {
+	struct protocol **slots;
+	uint32_t mult, shift;
+};
+
+static inline unsigned int proto_table_slot(const struct proto_table *table,
+					    unsigned int key)
+{
+	return (uint32_t) (key * table->mult) >> table->shift;
+}
+
+static inline struct protocol *proto_table_lookup(const struct proto_table *table,
+						  unsigned int key)
+{
+	struct protocol *proto = table->slots[proto_table_slot(table, key)];
+
+	return proto && proto->key == key ? proto : NULL;
+}
+
 extern void empty(struct pkt_buff *pkt);
 extern void hex(struct pkt_buff *pkt);
 extern void ascii(struct pkt_buff *pkt);
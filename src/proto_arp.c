@@ -9,6 +9,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "pkt_buff.h"
@@ -116,10 +117,28 @@ static void arp_less(struct pkt_buff *pkt)
 	tprintf(" Op %s", opcode);
 }
 
+static void arp_struct(struct pkt_buff *pkt)
+{
+	struct arphdr *arp = (struct arphdr *) pkt_pull(pkt, sizeof(*arp));
+
+	if (arp == NULL)
+		return;
+
+	record_layer("arp");
+	record_uint("hrd", ntohs(arp->ar_hrd));
+	record_uint("pro", ntohs(arp->ar_pro));
+	record_uint("op", ntohs(arp->ar_op));
+	record_addr("sha", AF_PACKET, arp->ar_sha);
+	record_addr("sip", AF_INET, arp->ar_sip);
+	record_addr("tha", AF_PACKET, arp->ar_tha);
+	record_addr("tip", AF_INET, arp->ar_tip);
+}
+
 struct protocol arp_ops = {
 	.key = 0x0806,
 	.print_full = arp,
 	.print_less = arp_less,
+	.print_struct = arp_struct,
 };
 
 EXPORT_SYMBOL(arp_ops);
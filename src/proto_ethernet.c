@@ -11,6 +11,7 @@
 #include <linux/if_ether.h>
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "pkt_buff.h"
@@ -74,10 +75,26 @@ static void ethernet_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay2, ntohs(eth->h_proto));
 }
 
+static void ethernet_struct(struct pkt_buff *pkt)
+{
+	struct ethhdr *eth = (struct ethhdr *) pkt_pull(pkt, sizeof(*eth));
+
+	if (eth == NULL)
+		return;
+
+	record_layer("eth");
+	record_addr("src", AF_PACKET, eth->h_source);
+	record_addr("dst", AF_PACKET, eth->h_dest);
+	record_uint("type", ntohs(eth->h_proto));
+
+	pkt_set_proto(pkt, &eth_lay2, ntohs(eth->h_proto));
+}
+
 struct protocol ethernet_ops = {
 	.key = 0,
 	.print_full = ethernet,
 	.print_less = ethernet_less,
+	.print_struct = ethernet_struct,
 };
 
 EXPORT_SYMBOL(ethernet_ops);
@@ -10,6 +10,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "pkt_buff.h"
@@ -56,10 +57,23 @@ static void icmp_less(struct pkt_buff *pkt)
 	tprintf(" Type %u Code %u", icmp->type, icmp->code);
 }
 
+static void icmp_struct(struct pkt_buff *pkt)
+{
+	struct icmphdr *icmp = (struct icmphdr *) pkt_pull(pkt, sizeof(*icmp));
+
+	if (icmp == NULL)
+		return;
+
+	record_layer("icmp");
+	record_uint("type", icmp->type);
+	record_uint("code", icmp->code);
+}
+
 struct protocol icmpv4_ops = {
 	.key = 0x01,
 	.print_full = icmp,
 	.print_less = icmp_less,
+	.print_struct = icmp_struct,
 };
 
 EXPORT_SYMBOL(icmp_ops);
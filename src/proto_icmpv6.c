@@ -17,6 +17,7 @@
 #include <asm/byteorder.h>
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "pkt_buff.h"
@@ -1634,10 +1635,24 @@ static void icmpv6_less(struct pkt_buff *pkt)
 	tprintf(" ICMPv6 Type (%u) Code (%u)", icmp->h_type, icmp->h_code);
 }
 
+static void icmpv6_struct(struct pkt_buff *pkt)
+{
+	struct icmpv6_general_hdr *icmp =
+		(struct icmpv6_general_hdr *) pkt_pull(pkt, sizeof(*icmp));
+
+	if (icmp == NULL)
+		return;
+
+	record_layer("icmpv6");
+	record_uint("type", icmp->h_type);
+	record_uint("code", icmp->h_code);
+}
+
 struct protocol icmpv6_ops = {
 	.key = 0x3A,
 	.print_full = icmpv6,
 	.print_less = icmpv6_less,
+	.print_struct = icmpv6_struct,
 };
 
 EXPORT_SYMBOL(icmpv6_ops);
@@ -9,6 +9,7 @@
 #include <netinet/in.h>
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "csum.h"
 #include "dissector_eth.h"
@@ -553,10 +554,22 @@ static void igmp_less(struct pkt_buff *pkt)
 	PRINT_FRIENDLY_NAMED_MSG_TYPE(*pkt_peek(pkt));
 }
 
+static void igmp_struct(struct pkt_buff *pkt)
+{
+	uint8_t *type = pkt_pull(pkt, sizeof(*type));
+
+	if (type == NULL)
+		return;
+
+	record_layer("igmp");
+	record_uint("type", *type);
+}
+
 struct protocol igmp_ops = {
 	.key = 0x02,
 	.print_full = igmp,
 	.print_less = igmp_less,
+	.print_struct = igmp_struct,
 };
 
 EXPORT_SYMBOL(igmp_ops);
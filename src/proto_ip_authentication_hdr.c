@@ -11,6 +11,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -79,10 +80,34 @@ static void auth_hdr_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay3, auth_ops->h_next_header);
 }
 
+static void auth_hdr_struct(struct pkt_buff *pkt)
+{
+	ssize_t hdr_len;
+	struct auth_hdr *auth_ops;
+
+	auth_ops = (struct auth_hdr *) pkt_pull(pkt, sizeof(*auth_ops));
+	if (auth_ops == NULL)
+		return;
+
+	hdr_len = (auth_ops->h_payload_len * 4) + 8;
+	if (hdr_len > pkt_len(pkt) || hdr_len < 0)
+		return;
+
+	record_layer("ah");
+	record_uint("len", hdr_len);
+	record_uint("spi", ntohl(auth_ops->h_spi));
+	record_uint("seq", ntohl(auth_ops->h_snf));
+	record_uint("next", auth_ops->h_next_header);
+
+	pkt_pull(pkt, hdr_len - sizeof(*auth_ops));
+	pkt_set_proto(pkt, &eth_lay3, auth_ops->h_next_header);
+}
+
 struct protocol ip_auth_ops = {
 	.key = 0x33,
 	.print_full = auth_hdr,
 	.print_less = auth_hdr_less,
+	.print_struct = auth_hdr_struct,
 };
 
 EXPORT_SYMBOL(ip_auth_ops);
@@ -11,6 +11,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -46,10 +47,24 @@ static void esp_less(struct pkt_buff *pkt)
 	tprintf(" ESP");
 }
 
+static void esp_struct(struct pkt_buff *pkt)
+{
+	struct esp_hdr *esp_ops;
+
+	esp_ops = (struct esp_hdr *) pkt_pull(pkt, sizeof(*esp_ops));
+	if (esp_ops == NULL)
+		return;
+
+	record_layer("esp");
+	record_uint("spi", ntohl(esp_ops->h_spi));
+	record_uint("seq", ntohl(esp_ops->h_sn));
+}
+
 struct protocol ip_esp_ops = {
 	.key = 0x32,
 	.print_full = esp,
 	.print_less = esp_less,
+	.print_struct = esp_struct,
 };
 
 EXPORT_SYMBOL(ip_esp_ops);
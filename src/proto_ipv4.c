@@ -13,6 +13,7 @@
 #include <asm/byteorder.h>
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "csum.h"
 #include "dissector_eth.h"
@@ -181,10 +182,33 @@ static void ipv4_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay3, ip->h_protocol);
 }
 
+static void ipv4_struct(struct pkt_buff *pkt)
+{
+	struct ipv4hdr *ip = (struct ipv4hdr *) pkt_pull(pkt, sizeof(*ip));
+
+	if (!ip)
+		return;
+
+	record_layer("ipv4");
+	record_addr("src", AF_INET, &ip->h_saddr);
+	record_addr("dst", AF_INET, &ip->h_daddr);
+	record_uint("len", ntohs(ip->h_tot_len));
+	record_uint("id", ntohs(ip->h_id));
+	record_uint("ttl", ip->h_ttl);
+	record_uint("next", ip->h_protocol);
+
+	/* cut off IP options and everything that is not part of IPv4 payload */
+	pkt_pull(pkt, max((uint8_t) ip->h_ihl, sizeof(*ip) / sizeof(uint32_t))
+		* sizeof(uint32_t) - sizeof(*ip));
+
+	pkt_set_proto(pkt, &eth_lay3, ip->h_protocol);
+}
+
 struct protocol ipv4_ops = {
 	.key = 0x0800,
 	.print_full = ipv4,
 	.print_less = ipv4_less,
+	.print_struct = ipv4_struct,
 };
 
 EXPORT_SYMBOL(ipv4_ops);
@@ -13,6 +13,7 @@
 #include <asm/byteorder.h>
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "csum.h"
 #include "dissector_eth.h"
@@ -45,6 +46,7 @@ struct ipv6hdr {
 
 extern void ipv6(struct pkt_buff *pkt);
 extern void ipv6_less(struct pkt_buff *pkt);
+extern void ipv6_struct(struct pkt_buff *pkt);
 
 void ipv6(struct pkt_buff *pkt)
 {
@@ -96,10 +98,28 @@ void ipv6_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay3, ip->nexthdr);
 }
 
+void ipv6_struct(struct pkt_buff *pkt)
+{
+	struct ipv6hdr *ip = (struct ipv6hdr *) pkt_pull(pkt, sizeof(*ip));
+
+	if (ip == NULL)
+		return;
+
+	record_layer("ipv6");
+	record_addr("src", AF_INET6, &ip->saddr);
+	record_addr("dst", AF_INET6, &ip->daddr);
+	record_uint("len", ntohs(ip->payload_len));
+	record_uint("hlim", ip->hop_limit);
+	record_uint("next", ip->nexthdr);
+
+	pkt_set_proto(pkt, &eth_lay3, ip->nexthdr);
+}
+
 struct protocol ipv6_ops = {
 	.key = 0x86DD,
 	.print_full = ipv6,
 	.print_less = ipv6_less,
+	.print_struct = ipv6_struct,
 };
 
 EXPORT_SYMBOL(ipv6_ops);
@@ -11,6 +11,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -94,10 +95,36 @@ static void dest_opts_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay3, dest_ops->h_next_header);
 }
 
+static void dest_opts_struct(struct pkt_buff *pkt)
+{
+	uint16_t hdr_ext_len;
+	ssize_t opt_len;
+	struct dest_optshdr *dest_ops;
+
+	dest_ops = (struct dest_optshdr *) pkt_pull(pkt, sizeof(*dest_ops));
+	if (dest_ops == NULL)
+		return;
+
+	/* Total Header Length in Bytes */
+	hdr_ext_len = (dest_ops->hdr_len + 1) * 8;
+	/* Options length in Bytes */
+	opt_len = hdr_ext_len - sizeof(*dest_ops);
+	if (opt_len > pkt_len(pkt) || opt_len < 0)
+		return;
+
+	record_layer("dstopts");
+	record_uint("len", hdr_ext_len);
+	record_uint("next", dest_ops->h_next_header);
+
+	pkt_pull(pkt, opt_len);
+	pkt_set_proto(pkt, &eth_lay3, dest_ops->h_next_header);
+}
+
 struct protocol ipv6_dest_opts_ops = {
 	.key = 0x3C,
 	.print_full = dest_opts,
 	.print_less = dest_opts_less,
+	.print_struct = dest_opts_struct,
 };
 
 EXPORT_SYMBOL(ipv6_dest_opts_ops);
@@ -11,6 +11,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -63,10 +64,31 @@ static void fragm_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay3, fragm_ops->h_fragm_next_header);
 }
 
+static void fragm_struct(struct pkt_buff *pkt)
+{
+	uint16_t off_res_M;
+	struct fragmhdr *fragm_ops;
+
+	fragm_ops = (struct fragmhdr *) pkt_pull(pkt, sizeof(*fragm_ops));
+	if (fragm_ops == NULL)
+		return;
+
+	off_res_M = ntohs(fragm_ops->h_fragm_off_res_M);
+
+	record_layer("fragment");
+	record_uint("off", off_res_M >> 3);
+	record_uint("more", off_res_M & 0x1);
+	record_uint("id", ntohl(fragm_ops->h_fragm_identification));
+	record_uint("next", fragm_ops->h_fragm_next_header);
+
+	pkt_set_proto(pkt, &eth_lay3, fragm_ops->h_fragm_next_header);
+}
+
 struct protocol ipv6_fragm_ops = {
 	.key = 0x2C,
 	.print_full = fragm,
 	.print_less = fragm_less,
+	.print_struct = fragm_struct,
 };
 
 EXPORT_SYMBOL(ipv6_fragm_ops);
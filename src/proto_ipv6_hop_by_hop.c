@@ -11,6 +11,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -93,10 +94,36 @@ static void hop_by_hop_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay3, hop_ops->h_next_header);
 }
 
+static void hop_by_hop_struct(struct pkt_buff *pkt)
+{
+	uint16_t hdr_ext_len;
+	ssize_t opt_len;
+	struct hop_by_hophdr *hop_ops;
+
+	hop_ops = (struct hop_by_hophdr *) pkt_pull(pkt, sizeof(*hop_ops));
+	if (hop_ops == NULL)
+		return;
+
+	/* Total Header Length in Bytes */
+	hdr_ext_len = (hop_ops->hdr_len + 1) * 8;
+	/* Options length in Bytes */
+	opt_len = hdr_ext_len - sizeof(*hop_ops);
+	if (opt_len > pkt_len(pkt) || opt_len < 0)
+		return;
+
+	record_layer("hopopts");
+	record_uint("len", hdr_ext_len);
+	record_uint("next", hop_ops->h_next_header);
+
+	pkt_pull(pkt, opt_len);
+	pkt_set_proto(pkt, &eth_lay3, hop_ops->h_next_header);
+}
+
 struct protocol ipv6_hop_by_hop_ops = {
 	.key = 0x0,
 	.print_full = hop_by_hop,
 	.print_less = hop_by_hop_less,
+	.print_struct = hop_by_hop_struct,
 };
 
 EXPORT_SYMBOL(ipv6_hop_by_hop_ops);
@@ -17,11 +17,13 @@
 
 extern void ipv6(struct pkt_buff *pkt);
 extern void ipv6_less(struct pkt_buff *pkt);
+extern void ipv6_struct(struct pkt_buff *pkt);
 
 struct protocol ipv6_in_ipv4_ops = {
 	.key = 0x29,
 	.print_full = ipv6,
 	.print_less = ipv6_less,
+	.print_struct = ipv6_struct,
 };
 
 EXPORT_SYMBOL(ipv6_in_ipv4_ops);
@@ -12,6 +12,7 @@
 #include <arpa/inet.h>
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -304,10 +305,37 @@ static void mobility_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay3, mobility->payload_proto);
 }
 
+static void mobility_struct(struct pkt_buff *pkt)
+{
+	uint16_t hdr_ext_len;
+	ssize_t message_data_len;
+	struct mobilityhdr *mobility;
+
+	mobility = (struct mobilityhdr *) pkt_pull(pkt, sizeof(*mobility));
+	if (mobility == NULL)
+		return;
+
+	/* Total Header Length in Bytes */
+	hdr_ext_len = (mobility->hdr_len + 1) * 8;
+	/* Total Message Data length in Bytes*/
+	message_data_len = (hdr_ext_len - sizeof(*mobility));
+	if (message_data_len > pkt_len(pkt) || message_data_len < 0)
+		return;
+
+	record_layer("mobility");
+	record_uint("len", hdr_ext_len);
+	record_uint("type", mobility->MH_type);
+	record_uint("next", mobility->payload_proto);
+
+	pkt_pull(pkt, message_data_len);
+	pkt_set_proto(pkt, &eth_lay3, mobility->payload_proto);
+}
+
 struct protocol ipv6_mobility_ops = {
 	.key = 0x87,
 	.print_full = mobility,
 	.print_less = mobility_less,
+	.print_struct = mobility_struct,
 };
 
 EXPORT_SYMBOL(ipv6_mobility_ops);
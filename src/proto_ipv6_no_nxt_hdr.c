@@ -11,6 +11,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -34,10 +35,16 @@ static void no_next_header_less(struct pkt_buff *pkt)
 	tprintf(" No Next Header");
 }
 
+static void no_next_header_struct(struct pkt_buff *pkt)
+{
+	record_layer("nonext");
+}
+
 struct protocol ipv6_no_next_header_ops = {
 	.key = 0x3B,
 	.print_full = no_next_header,
 	.print_less = no_next_header_less,
+	.print_struct = no_next_header_struct,
 };
 
 EXPORT_SYMBOL(ipv6_no_next_header_ops);
@@ -12,6 +12,7 @@
 #include <arpa/inet.h>     /* for inet_ntop() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -156,10 +157,38 @@ static void routing_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay3, routing->h_next_header);
 }
 
+static void routing_struct(struct pkt_buff *pkt)
+{
+	uint16_t hdr_ext_len;
+	ssize_t data_len;
+	struct routinghdr *routing;
+
+	routing = (struct routinghdr *) pkt_pull(pkt, sizeof(*routing));
+	if (routing == NULL)
+		return;
+
+	/* Total Header Length in Bytes */
+	hdr_ext_len = (routing->h_hdr_ext_len + 1) * 8;
+	/* Data length in Bytes */
+	data_len = hdr_ext_len - sizeof(*routing);
+	if (data_len > pkt_len(pkt) || data_len < 0)
+		return;
+
+	record_layer("routing");
+	record_uint("len", hdr_ext_len);
+	record_uint("type", routing->h_routing_type);
+	record_uint("left", routing->h_segments_left);
+	record_uint("next", routing->h_next_header);
+
+	pkt_pull(pkt, data_len);
+	pkt_set_proto(pkt, &eth_lay3, routing->h_next_header);
+}
+
 struct protocol ipv6_routing_ops = {
 	.key = 0x2B,
 	.print_full = routing,
 	.print_less = routing_less,
+	.print_struct = routing_struct,
 };
 
 EXPORT_SYMBOL(ipv6_routing_ops);
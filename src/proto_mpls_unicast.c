@@ -12,6 +12,7 @@
 #include <errno.h>
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -102,10 +103,40 @@ static void mpls_uc_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay2, (uint16_t) next);
 }
 
+static void mpls_uc_struct(struct pkt_buff *pkt)
+{
+	int next;
+	uint32_t mpls_uc_data;
+	struct mpls_uchdr *mpls_uc;
+	uint8_t s = 0;
+
+	do {
+		mpls_uc = (struct mpls_uchdr *) pkt_pull(pkt, sizeof(*mpls_uc));
+		if (mpls_uc == NULL)
+			return;
+
+		mpls_uc_data = ntohl(mpls_uc->mpls_uc_hdr);
+		s = (mpls_uc_data >> 8) & 0x1;
+
+		record_layer("mpls");
+		record_uint("label", mpls_uc_data >> 12);
+		record_uint("tc", (mpls_uc_data >> 9) & 0x7);
+		record_uint("s", s);
+		record_uint("ttl", mpls_uc_data & 0xFF);
+	} while (!s);
+
+	next = mpls_uc_next_proto(pkt);
+	if (next < 0)
+		return;
+
+	pkt_set_proto(pkt, &eth_lay2, (uint16_t) next);
+}
+
 struct protocol mpls_uc_ops = {
 	.key = 0x8847,
 	.print_full = mpls_uc_full,
 	.print_less = mpls_uc_less,
+	.print_struct = mpls_uc_struct,
 };
 
 EXPORT_SYMBOL(mpls_uc_ops);
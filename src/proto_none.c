@@ -10,6 +10,7 @@
 #include <ctype.h>
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "pkt_buff.h"
 
@@ -77,10 +78,22 @@ static void none_less(struct pkt_buff *pkt)
 	tprintf("\n");
 }
 
+static void none_struct(struct pkt_buff *pkt)
+{
+	size_t len = pkt_len(pkt);
+
+	if (!len)
+		return;
+
+	record_layer("payload");
+	record_uint("len", len);
+}
+
 struct protocol none_ops = {
 	.key = 0x01,
 	.print_full = hex_ascii,
 	.print_less = none_less,
+	.print_struct = none_struct,
 };
 
 EXPORT_SYMBOL(none_ops);
@@ -12,6 +12,7 @@
 #include <asm/byteorder.h>
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -149,10 +150,30 @@ static void tcp_less(struct pkt_buff *pkt)
 		ntohs(tcp->window), ntohl(tcp->seq), ntohl(tcp->ack_seq));
 }
 
+static void tcp_struct(struct pkt_buff *pkt)
+{
+	struct tcphdr *tcp = (struct tcphdr *) pkt_pull(pkt, sizeof(*tcp));
+
+	if (tcp == NULL)
+		return;
+
+	record_layer("tcp");
+	record_uint("sport", ntohs(tcp->source));
+	record_uint("dport", ntohs(tcp->dest));
+	record_uint("seq", ntohl(tcp->seq));
+	record_uint("ack", ntohl(tcp->ack_seq));
+	/* CWR down to FIN, as in the header */
+	record_uint("flags", tcp->cwr << 7 | tcp->ece << 6 | tcp->urg << 5 |
+		    tcp->ack << 4 | tcp->psh << 3 | tcp->rst << 2 |
+		    tcp->syn << 1 | tcp->fin);
+	record_uint("win", ntohs(tcp->window));
+}
+
 struct protocol tcp_ops = {
 	.key = 0x06,
 	.print_full = tcp,
 	.print_less = tcp_less,
+	.print_struct = tcp_struct,
 };
 
 EXPORT_SYMBOL(tcp_ops);
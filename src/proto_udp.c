@@ -10,6 +10,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "pkt_buff.h"
@@ -83,10 +84,24 @@ static void udp_less(struct pkt_buff *pkt)
 			colorize_end());
 }
 
+static void udp_struct(struct pkt_buff *pkt)
+{
+	struct udphdr *udp = (struct udphdr *) pkt_pull(pkt, sizeof(*udp));
+
+	if (udp == NULL)
+		return;
+
+	record_layer("udp");
+	record_uint("sport", ntohs(udp->source));
+	record_uint("dport", ntohs(udp->dest));
+	record_uint("len", ntohs(udp->len));
+}
+
 struct protocol udp_ops = {
 	.key = 0x11,
 	.print_full = udp,
 	.print_less = udp_less,
+	.print_struct = udp_struct,
 };
 
 EXPORT_SYMBOL(udp_ops);
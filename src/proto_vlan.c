@@ -11,6 +11,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "pkt_buff.h"
@@ -55,10 +56,29 @@ static void vlan_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay2, ntohs(vlan->h_vlan_encapsulated_proto));
 }
 
+static void vlan_struct(struct pkt_buff *pkt)
+{
+	uint16_t tci;
+	struct vlanhdr *vlan = (struct vlanhdr *) pkt_pull(pkt, sizeof(*vlan));
+
+	if (vlan == NULL)
+		return;
+
+	tci = ntohs(vlan->h_vlan_TCI);
+
+	record_layer("vlan");
+	record_uint("id", tci & 0x0FFF);
+	record_uint("prio", (tci & 0xE000) >> 13);
+	record_uint("type", ntohs(vlan->h_vlan_encapsulated_proto));
+
+	pkt_set_proto(pkt, &eth_lay2, ntohs(vlan->h_vlan_encapsulated_proto));
+}
+
 struct protocol vlan_ops = {
 	.key = 0x8100,
 	.print_full = vlan,
 	.print_less = vlan_less,
+	.print_struct = vlan_struct,
 };
 
 EXPORT_SYMBOL(vlan_ops);
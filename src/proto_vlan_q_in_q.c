@@ -11,6 +11,7 @@
 #include <netinet/in.h>    /* for ntohs() */
 
 #include "proto.h"
+#include "record.h"
 #include "protos.h"
 #include "dissector_eth.h"
 #include "built_in.h"
@@ -56,10 +57,29 @@ static void QinQ_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay2, ntohs(QinQ->TPID));
 }
 
+static void QinQ_struct(struct pkt_buff *pkt)
+{
+	uint16_t tci;
+	struct QinQhdr *QinQ = (struct QinQhdr *) pkt_pull(pkt, sizeof(*QinQ));
+
+	if (QinQ == NULL)
+		return;
+
+	tci = ntohs(QinQ->TCI);
+
+	record_layer("qinq");
+	record_uint("id", tci & 0x0FFF);
+	record_uint("prio", (tci & 0xE000) >> 13);
+	record_uint("type", ntohs(QinQ->TPID));
+
+	pkt_set_proto(pkt, &eth_lay2, ntohs(QinQ->TPID));
+}
+
 struct protocol QinQ_ops = {
 	.key = 0x88a8,
 	.print_full = QinQ_full,
 	.print_less = QinQ_less,
+	.print_struct = QinQ_struct,
 };
 
 EXPORT_SYMBOL(QinQ_ops);
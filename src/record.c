@@ -0,0 +1,348 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ *
+ * Structured records of dissected packets, for tools that want the
+ * fields and not the text. A record holds the frame header and then one
+ * layer per protocol, each with a name and a list of named fields. It
+ * is built up in a per-thread buffer while the protocols are dissected
+ * and handed to the tprintf buffer as a whole when the packet is done,
+ * either as one line of JSON:
+ *
+ *   {"sec":S,"nsec":N,"len":L,"layers":[{"proto":"eth","src":...},...]}
+ *
+ * or in a binary format, where all integers are in network byte order:
+ *
+ *   record: u32 length of what follows, u32 sec, u32 nsec, u32 len,
+ *           u32 ifindex, u8 pkttype, u8 flags, layers
+ *   layer:  u16 length of what follows, u8 name length, name, fields
+ *   field:  u8 key length, key, u8 type, value
+ *
+ * Values are u8, u16, u32 or u64, whatever is the smallest to hold the
+ * number, a string as u16 length and bytes or an address as u8 length
+ * and bytes. If a record does not fit into the buffer, the fields that
+ * did not fit are left out and the record is marked as truncated.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "record.h"
+#include "tprintf.h"
+#include "built_in.h"
+#include "die.h"
+
+#define RECORD_SIZE		(16 * 1024)
+/* Kept free for closing a JSON record, whatever happened before */
+#define RECORD_RESERVE		32
+#define RECORD_BIN_HDR		22
+
+static enum record_format format = RECORD_JSON;
+
+static __thread char rec[RECORD_SIZE];
+static __thread size_t rec_len, layer_start;
+static __thread bool rec_open, rec_full, layer_open;
+
+static bool record_put(const void *data, size_t len)
+{
+	if (rec_full || rec_len + len > sizeof(rec) - RECORD_RESERVE) {
+		rec_full = true;
+		return false;
+	}
+
+	memcpy(rec + rec_len, data, len);
+	rec_len += len;
+
+	return true;
+}
+
+static bool record_printf(const char *fmt, ...) __check_format_printf(1, 2);
+
+static bool record_printf(const char *fmt, ...)
+{
+	int ret;
+	va_list vl;
+	size_t avail;
+
+	/* Layers may have eaten into the reserve, nothing is left then */
+	if (rec_full || rec_len >= sizeof(rec) - RECORD_RESERVE) {
+		rec_full = true;
+		return false;
+	}
+
+	avail = sizeof(rec) - RECORD_RESERVE - rec_len;
+
+	va_start(vl, fmt);
+	ret = vsnprintf(rec + rec_len, avail, fmt, vl);
+	va_end(vl);
+
+	if (ret < 0 || ret >= avail) {
+		rec_full = true;
+		return false;
+	}
+
+	rec_len += ret;
+	return true;
+}
+
+static inline bool record_put_u8(uint8_t val)
+{
+	return record_put(&val, sizeof(val));
+}
+
+static inline bool record_put_u16(uint16_t val)
+{
+	val = htons(val);
+	return record_put(&val, sizeof(val));
+}
+
+static inline bool record_put_u32(uint32_t val)
+{
+	val = htonl(val);
+	return record_put(&val, sizeof(val));
+}
+
+static inline bool record_put_u64(uint64_t val)
+{
+	return record_put_u32(val >> 32) && record_put_u32(val);
+}
+
+static inline void record_patch_u16(size_t off, uint16_t val)
+{
+	val = htons(val);
+	memcpy(rec + off, &val, sizeof(val));
+}
+
+static inline void record_patch_u32(size_t off, uint32_t val)
+{
+	val = htonl(val);
+	memcpy(rec + off, &val, sizeof(val));
+}
+
+static bool record_put_json_str(const char *str)
+{
+	bool ok = record_put("\"", 1);
+
+	for (; *str && ok; str++) {
+		switch (*str) {
+		case '"':
+			ok = record_put("\\\"", 2);
+			break;
+		case '\\':
+			ok = record_put("\\\\", 2);
+			break;
+		default:
+			if ((unsigned char) *str < 0x20)
+				ok = record_printf("\\u%04x",
+						   (unsigned char) *str);
+			else
+				ok = record_put(str, 1);
+			break;
+		}
+	}
+
+	return ok && record_put("\"", 1);
+}
+
+static bool record_put_bin_str(const char *str, size_t max)
+{
+	size_t len = min(strlen(str), max);
+
+	return (max > UINT8_MAX ? record_put_u16(len) : record_put_u8(len)) &&
+	       record_put(str, len);
+}
+
+/* Starts a field, a failed field is taken back as a whole */
+static bool record_key(const char *key, size_t *start)
+{
+	*start = rec_len;
+
+	if (!rec_open || !layer_open || rec_full)
+		return false;
+
+	if (format == RECORD_JSON)
+		return record_put(",", 1) && record_put_json_str(key) &&
+		       record_put(":", 1);
+
+	return record_put_bin_str(key, UINT8_MAX);
+}
+
+static void record_field_done(bool ok, size_t start)
+{
+	if (!ok)
+		rec_len = start;
+}
+
+static void record_layer_done(void)
+{
+	if (!layer_open)
+		return;
+
+	if (format == RECORD_JSON)
+		rec[rec_len++] = '}';
+	else
+		record_patch_u16(layer_start, rec_len - layer_start - 2);
+
+	layer_open = false;
+}
+
+void record_init(enum record_format fmt)
+{
+	format = fmt;
+	/* Records are not for the eyes, so leave them as they are */
+	tprintf_set_wrap(0);
+}
+
+void record_begin(uint32_t sec, uint32_t nsec, uint32_t len,
+		  const struct sockaddr_ll *s_ll)
+{
+	rec_len = 0;
+	rec_open = true;
+	rec_full = false;
+	layer_open = false;
+
+	if (format == RECORD_JSON) {
+		record_printf("{\"sec\":%u,\"nsec\":%u,\"len\":%u", sec, nsec,
+			      len);
+		if (s_ll)
+			record_printf(",\"ifindex\":%d,\"pkttype\":%u",
+				      s_ll->sll_ifindex, s_ll->sll_pkttype);
+		record_put(",\"layers\":[", 11);
+	} else {
+		record_put_u32(0);
+		record_put_u32(sec);
+		record_put_u32(nsec);
+		record_put_u32(len);
+		record_put_u32(s_ll ? s_ll->sll_ifindex : 0);
+		record_put_u8(s_ll ? s_ll->sll_pkttype : 0xff);
+		record_put_u8(0);
+	}
+}
+
+void record_layer(const char *name)
+{
+	size_t start = rec_len;
+	bool ok;
+
+	if (!rec_open || rec_full)
+		return;
+
+	record_layer_done();
+
+	if (format == RECORD_JSON) {
+		ok = (rec[start - 1] == '[' || record_put(",", 1)) &&
+		     record_put("{\"proto\":", 9) && record_put_json_str(name);
+	} else {
+		ok = record_put_u16(0) && record_put_bin_str(name, UINT8_MAX);
+	}
+
+	if (!ok) {
+		rec_len = start;
+		return;
+	}
+
+	layer_start = start;
+	layer_open = true;
+}
+
+void record_uint(const char *key, uint64_t val)
+{
+	size_t start;
+	bool ok = record_key(key, &start);
+
+	if (ok) {
+		if (format == RECORD_JSON)
+			ok = record_printf("%llu", (unsigned long long) val);
+		else if (val <= UINT8_MAX)
+			ok = record_put_u8(RECORD_U8) && record_put_u8(val);
+		else if (val <= UINT16_MAX)
+			ok = record_put_u8(RECORD_U16) && record_put_u16(val);
+		else if (val <= UINT32_MAX)
+			ok = record_put_u8(RECORD_U32) && record_put_u32(val);
+		else
+			ok = record_put_u8(RECORD_U64) && record_put_u64(val);
+	}
+
+	record_field_done(ok, start);
+}
+
+void record_str(const char *key, const char *str)
+{
+	size_t start;
+	bool ok = record_key(key, &start);
+
+	if (ok) {
+		if (format == RECORD_JSON)
+			ok = record_put_json_str(str);
+		else
+			ok = record_put_u8(RECORD_STR) &&
+			     record_put_bin_str(str, UINT16_MAX);
+	}
+
+	record_field_done(ok, start);
+}
+
+void record_addr(const char *key, int family, const void *addr)
+{
+	size_t start, len;
+	bool ok = record_key(key, &start);
+	char str[INET6_ADDRSTRLEN];
+	const uint8_t *mac = addr;
+
+	switch (family) {
+	case AF_INET:
+		len = 4;
+		break;
+	case AF_INET6:
+		len = 16;
+		break;
+	default:
+		bug_on(family != AF_PACKET);
+		len = 6;
+		break;
+	}
+
+	if (ok) {
+		if (format == RECORD_BIN) {
+			ok = record_put_u8(RECORD_ADDR) && record_put_u8(len) &&
+			     record_put(addr, len);
+		} else if (family == AF_PACKET) {
+			ok = record_printf("\"%02x:%02x:%02x:%02x:%02x:%02x\"",
+					   mac[0], mac[1], mac[2], mac[3],
+					   mac[4], mac[5]);
+		} else {
+			inet_ntop(family, addr, str, sizeof(str));
+			ok = record_printf("\"%s\"", str);
+		}
+	}
+
+	record_field_done(ok, start);
+}
+
+void record_end(void)
+{
+	const char *end;
+
+	if (!rec_open)
+		return;
+
+	/* Only the closing is left, which the reserve is kept for */
+	record_layer_done();
+
+	if (format == RECORD_JSON) {
+		end = rec_full ? "],\"truncated\":1}\n" : "]}\n";
+		memcpy(rec + rec_len, end, strlen(end));
+		rec_len += strlen(end);
+	} else {
+		record_patch_u32(0, rec_len - sizeof(uint32_t));
+		rec[RECORD_BIN_HDR - 1] = rec_full ? RECORD_TRUNCATED : 0;
+	}
+
+	twrite(rec, rec_len);
+	rec_open = false;
+}
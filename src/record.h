@@ -0,0 +1,38 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
+enum record_format {
+	RECORD_JSON,
+	RECORD_BIN,
+};
+
+/* Types of fields in binary records */
+#define RECORD_U8		1
+#define RECORD_U16		2
+#define RECORD_U32		3
+#define RECORD_U64		4
+#define RECORD_STR		5
+#define RECORD_ADDR		6
+
+/* Flags in the header of binary records */
+#define RECORD_TRUNCATED	(1 << 0)
+
+extern void record_init(enum record_format format);
+extern void record_begin(uint32_t sec, uint32_t nsec, uint32_t len,
+			 const struct sockaddr_ll *s_ll);
+extern void record_layer(const char *name);
+extern void record_uint(const char *key, uint64_t val);
+extern void record_str(const char *key, const char *str);
+extern void record_addr(const char *key, int family, const void *addr);
+extern void record_end(void);
+
+#endif /* RECORD_H */
@@ -29,24 +29,58 @@
 
 #ifndef PACKET_FANOUT
 # define PACKET_FANOUT			18
-# define PACKET_FANOUT_POLICY_HASH	0
-# define PACKET_FANOUT_POLICY_LB	1
-# define PACKET_FANOUT_POLICY_DEFAULT	PACKET_FANOUT_HASH
+# define PACKET_FANOUT_HASH		0
+# define PACKET_FANOUT_LB		1
 #endif
+#define PACKET_FANOUT_POLICY_HASH	PACKET_FANOUT_HASH
+#define PACKET_FANOUT_POLICY_LB		PACKET_FANOUT_LB
+#define PACKET_FANOUT_POLICY_DEFAULT	PACKET_FANOUT_HASH
 
 struct frame_map {
 	struct tpacket2_hdr tp_h __aligned_tpacket;
 	struct sockaddr_ll s_ll __align_tpacket(sizeof(struct tpacket2_hdr));
 };
 
+struct frame_map_v3 {
+	struct tpacket3_hdr tp_h __aligned_tpacket;
+	struct sockaddr_ll s_ll __aligned_tpacket;
+};
+
+struct block_desc {
+	uint32_t version;
+	uint32_t offset_to_priv;
+	struct tpacket_hdr_v1 h1;
+};
+
 struct ring {
 	struct iovec *frames;
 	uint8_t *mm_space;
 	size_t mm_len;
-	struct tpacket_req layout;
+	int version;
+	union {
+		struct tpacket_req layout;
+		struct tpacket_req3 layout3;
+	};
 	struct sockaddr_ll s_ll;
 };
 
+static inline int ring_is_v3(struct ring *ring)
+{
+	return ring->version == TPACKET_V3;
+}
+
+static inline size_t ring_layout_size(struct ring *ring)
+{
+	return ring_is_v3(ring) ? sizeof(ring->layout3) : sizeof(ring->layout);
+}
+
+/* With TPACKET_V3, ring->frames holds blocks instead of frames */
+static inline unsigned int ring_slots(struct ring *ring)
+{
+	return ring_is_v3(ring) ? ring->layout3.tp_block_nr :
+				  ring->layout.tp_frame_nr;
+}
+
 static inline void next_rnd_slot(unsigned int *it, struct ring *ring)
 {
 	*it = rand() % ring->layout.tp_frame_nr;
@@ -128,7 +162,7 @@ static inline void set_sockopt_fanout(int sock, unsigned int fanout_id,
 		panic("No packet fanout support!\n");
 }
 
-static inline void set_sockopt_tpacket(int sock)
+static inline void set_sockopt_tpacket_v2(int sock)
 {
 	int ret, val = TPACKET_V2;
 
@@ -137,6 +171,15 @@ static inline void set_sockopt_tpacket(int sock)
 		panic("Cannot set tpacketv2!\n");
 }
 
+static inline void set_sockopt_tpacket_v3(int sock)
+{
+	int ret, val = TPACKET_V3;
+
+	ret = setsockopt(sock, SOL_PACKET, PACKET_VERSION, &val, sizeof(val));
+	if (ret)
+		panic("Cannot set tpacketv3!\n");
+}
+
 #if defined(__WITH_HARDWARE_TIMESTAMPING)
 # include <linux/net_tstamp.h>
 
@@ -22,9 +22,9 @@
 
 void destroy_rx_ring(int sock, struct ring *ring)
 {
-	fmemset(&ring->layout, 0, sizeof(ring->layout));
-	setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &ring->layout,
-		   sizeof(ring->layout));
+	fmemset(&ring->layout3, 0, sizeof(ring->layout3));
+	setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &ring->layout3,
+		   ring_layout_size(ring));
 
 	munmap(ring->mm_space, ring->mm_len);
 	ring->mm_len = 0;
@@ -33,17 +33,34 @@ void destroy_rx_ring(int sock, struct ring *ring)
 }
 
 void setup_rx_ring_layout(int sock, struct ring *ring, unsigned int size,
-			  int jumbo_support)
+			  int jumbo_support, int v3)
 {
-	fmemset(&ring->layout, 0, sizeof(ring->layout));
+	fmemset(&ring->layout3, 0, sizeof(ring->layout3));
+
+	ring->version = v3 ? TPACKET_V3 : TPACKET_V2;
+
+	if (v3) {
+		/*
+		 * Packets are packed back to back into a block, so blocks
+		 * are made large enough to batch a good amount of them. The
+		 * frame size only serves as the kernel's sanity check here.
+		 * A partially filled block is handed over to us after the
+		 * retire timeout, so that low-rate traffic does not starve.
+		 */
+		ring->layout3.tp_block_size = getpagesize() << 6;
+		ring->layout3.tp_retire_blk_tov = RX_RING_V3_BLOCK_TOV;
+		ring->layout3.tp_sizeof_priv = 0;
+		ring->layout3.tp_feature_req_word = 0;
+	} else {
+		ring->layout.tp_block_size = (jumbo_support ?
+					      getpagesize() << 4 :
+					      getpagesize() << 2);
+	}
 
-	ring->layout.tp_block_size = (jumbo_support ?
-				      getpagesize() << 4 :
-				      getpagesize() << 2);
 	ring->layout.tp_frame_size = (jumbo_support ?
 				      TPACKET_ALIGNMENT << 12 :
 				      TPACKET_ALIGNMENT << 7);
-	ring->layout.tp_block_nr = size / ring->layout.tp_block_size;
+	ring->layout.tp_block_nr = max(size / ring->layout.tp_block_size, 1U);
 	ring->layout.tp_frame_nr = ring->layout.tp_block_size /
 				   ring->layout.tp_frame_size *
 				   ring->layout.tp_block_nr;
@@ -57,10 +74,13 @@ void create_rx_ring(int sock, struct ring *ring, int verbose)
 {
 	int ret;
 
-	set_sockopt_tpacket(sock);
+	if (ring_is_v3(ring))
+		set_sockopt_tpacket_v3(sock);
+	else
+		set_sockopt_tpacket_v2(sock);
 retry:
-	ret = setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &ring->layout,
-			 sizeof(ring->layout));
+	ret = setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &ring->layout3,
+			 ring_layout_size(ring));
 	if (errno == ENOMEM && ring->layout.tp_block_nr > 1) {
 		ring->layout.tp_block_nr >>= 1;
 		ring->layout.tp_frame_nr = ring->layout.tp_block_size / 
@@ -75,9 +95,19 @@ retry:
 	ring->mm_len = ring->layout.tp_block_size * ring->layout.tp_block_nr;
 
 	if (verbose) {
-		printf("RX: %.2Lf MiB, %u Frames, each %u Byte allocated\n",
-		       (long double) ring->mm_len / (1 << 20),
-		       ring->layout.tp_frame_nr, ring->layout.tp_frame_size);
+		if (ring_is_v3(ring))
+			printf("RX,V3: %.2Lf MiB, %u Blocks, each %u Byte "
+			       "allocated, %ums retire\n",
+			       (long double) ring->mm_len / (1 << 20),
+			       ring->layout3.tp_block_nr,
+			       ring->layout3.tp_block_size,
+			       ring->layout3.tp_retire_blk_tov);
+		else
+			printf("RX: %.2Lf MiB, %u Frames, each %u Byte "
+			       "allocated\n",
+			       (long double) ring->mm_len / (1 << 20),
+			       ring->layout.tp_frame_nr,
+			       ring->layout.tp_frame_size);
 	}
 }
 
@@ -94,15 +124,17 @@ void mmap_rx_ring(int sock, struct ring *ring)
 void alloc_rx_ring_frames(struct ring *ring)
 {
 	int i;
-	size_t len = ring->layout.tp_frame_nr * sizeof(*ring->frames);
+	unsigned int num = ring_slots(ring);
+	size_t size = ring_is_v3(ring) ? ring->layout3.tp_block_size :
+					 ring->layout.tp_frame_size;
+	size_t len = num * sizeof(*ring->frames);
 
 	ring->frames = xmalloc_aligned(len, CO_CACHE_LINE_SIZE);
 	fmemset(ring->frames, 0, len);
 
-	for (i = 0; i < ring->layout.tp_frame_nr; ++i) {
-		ring->frames[i].iov_len = ring->layout.tp_frame_size;
-		ring->frames[i].iov_base = ring->mm_space +
-					   (i * ring->layout.tp_frame_size);
+	for (i = 0; i < num; ++i) {
+		ring->frames[i].iov_len = size;
+		ring->frames[i].iov_base = ring->mm_space + (i * size);
 	}
 }
 
@@ -11,13 +11,16 @@
 #include "ring.h"
 #include "built_in.h"
 
+/* Kernel hands over a partially filled TPACKET_V3 block after 60ms */
+#define RX_RING_V3_BLOCK_TOV	60
+
 extern void destroy_rx_ring(int sock, struct ring *ring);
 extern void create_rx_ring(int sock, struct ring *ring, int verbose);
 extern void mmap_rx_ring(int sock, struct ring *ring);
 extern void alloc_rx_ring_frames(struct ring *ring);
 extern void bind_rx_ring(int sock, struct ring *ring, int ifindex);
 extern void setup_rx_ring_layout(int sock, struct ring *ring,
-				 unsigned int size, int jumbo_support);
+				 unsigned int size, int jumbo_support, int v3);
 
 static inline int user_may_pull_from_rx(struct tpacket2_hdr *hdr)
 {
@@ -29,4 +32,14 @@ static inline void kernel_may_pull_from_rx(struct tpacket2_hdr *hdr)
 	hdr->tp_status = TP_STATUS_KERNEL;
 }
 
+static inline int user_may_pull_from_rx_block(struct block_desc *pbd)
+{
+	return ((pbd->h1.block_status & TP_STATUS_USER) == TP_STATUS_USER);
+}
+
+static inline void kernel_may_pull_from_rx_block(struct block_desc *pbd)
+{
+	pbd->h1.block_status = TP_STATUS_KERNEL;
+}
+
 #endif /* RX_RING_H */
@@ -47,6 +47,8 @@ void setup_tx_ring_layout(int sock, struct ring *ring, unsigned int size,
 {
 	fmemset(&ring->layout, 0, sizeof(ring->layout));
 
+	ring->version = TPACKET_V2;
+
 	ring->layout.tp_block_size = (jumbo_support ?
 				      getpagesize() << 4 :
 				      getpagesize() << 2);
@@ -67,7 +69,7 @@ void create_tx_ring(int sock, struct ring *ring, int verbose)
 {
 	int ret;
 
-	set_sockopt_tpacket(sock);
+	set_sockopt_tpacket_v2(sock);
 retry:
 	ret = setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &ring->layout,
 			 sizeof(ring->layout));
@@ -0,0 +1,80 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdbool.h>
+
+#include "xmalloc.h"
+#include "built_in.h"
+
+/*
+ * Bounded lock-free queue of pointers for exactly one producer and one
+ * consumer thread. The producer only writes tail, the consumer only writes
+ * head, both live on their own cache line. The consumer looks at an entry
+ * with spsc_front() and only gives the slot back with spsc_pop(), so an
+ * entry can be processed in place.
+ */
+struct spsc_queue {
+	void **slots;
+	unsigned int mask;
+	unsigned int head __cacheline_aligned;
+	unsigned int tail __cacheline_aligned;
+};
+
+static inline void spsc_init(struct spsc_queue *q, unsigned int size)
+{
+	unsigned int n = 1;
+
+	while (n < size)
+		n <<= 1;
+
+	q->slots = xzmalloc(n * sizeof(*q->slots));
+	q->mask = n - 1;
+	q->head = q->tail = 0;
+}
+
+static inline void spsc_destroy(struct spsc_queue *q)
+{
+	xfree(q->slots);
+}
+
+static inline unsigned int spsc_len(struct spsc_queue *q)
+{
+	return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+static inline bool spsc_push(struct spsc_queue *q, void *entry)
+{
+	unsigned int tail = q->tail;
+
+	if (unlikely(tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >
+		     q->mask))
+		return false;
+
+	q->slots[tail & q->mask] = entry;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static inline void *spsc_front(struct spsc_queue *q)
+{
+	unsigned int head = q->head;
+
+	if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return q->slots[head & q->mask];
+}
+
+static inline void spsc_pop(struct spsc_queue *q)
+{
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* SPSC_H */
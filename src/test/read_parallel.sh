@@ -0,0 +1,142 @@
+#!/usr/bin/env bash
+
+# Note: build and _install_ the toolkit first!
+#
+# Reads the same pcap with one and with several threads and checks that
+# the dissector output is identical. The pcap is generated, larger than a
+# few of the 64MB chunks the parallel reader splits it into, and claims a
+# snaplen smaller than most of its records, as files from other tools do.
+# A few records are even larger than the default snaplen of 65535. One
+# record right before the first chunk boundary carries pcap records in its
+# payload, so that the boundary search takes a false record boundary.
+
+set -u
+
+workers=4
+keep=''
+
+if [ $# -gt 0 ] ; then
+	if [ "$1" = '-h' -o "$1" = '--help' -o "$1" = '--usage' ] ; then
+		echo 'Usage: read_parallel [-k (keep generated pcap, default: no)] [threads, default: 4]'
+		exit 0
+	fi
+
+	for opt in $@ ; do
+		if [ "${opt}" = '-k' ] ; then
+			keep='true'
+		else
+			workers="${opt}"
+		fi
+	done
+fi
+
+le32() {
+	printf "\\x$(printf %02x $(($1 & 255)))\\x$(printf %02x $((($1 >> 8) & 255)))"
+	printf "\\x$(printf %02x $((($1 >> 16) & 255)))\\x$(printf %02x $((($1 >> 24) & 255)))"
+}
+
+be16() {
+	printf "\\x$(printf %02x $((($1 >> 8) & 255)))\\x$(printf %02x $(($1 & 255)))"
+}
+
+# Ethernet, IPv4 and UDP with consistent lengths, random payload
+record() {
+	le32 $1
+	le32 $2
+	le32 $3
+	le32 $3
+	printf '\x00\x11\x22\x33\x44\x55\x66\x77\x88\x99\xaa\xbb\x08\x00'
+	printf '\x45\x00'
+	be16 $(($3 - 14))
+	printf '\x00\x00\x40\x00\x40\x11\x00\x00\x0a\x00\x00\x01\x0a\x00\x00\x02'
+	be16 $((1024 + $2 % 1000))
+	be16 9999
+	be16 $(($3 - 34))
+	printf '\x00\x00'
+	head -c $(($3 - 42)) /dev/urandom
+}
+
+# Larger than any snaplen, as captured with GRO/TSO, no IP in there
+record_jumbo() {
+	le32 $1
+	le32 $2
+	le32 $3
+	le32 $3
+	printf '\x00\x11\x22\x33\x44\x55\x66\x77\x88\x99\xaa\xbb\x88\xb5'
+	head -c $(($3 - 14)) /dev/urandom
+}
+
+# Payload starts with zeros up to $3, then pcap records, then zeros again
+record_nested() {
+	le32 $1
+	le32 0
+	le32 $2
+	le32 $2
+	printf '\x00\x11\x22\x33\x44\x55\x66\x77\x88\x99\xaa\xbb\x88\xb5'
+	head -c $(($3 - 14)) /dev/zero
+	for i in $(seq 1 12) ; do
+		record $1 $i 60
+	done
+	head -c $(($2 - $3 - 12 * 76)) /dev/zero
+}
+
+mkdir -p parallel
+cd parallel
+
+# About 1MB of records, repeated into a 200MB file
+rm -f block.pcap test.pcap
+for i in $(seq 1 1400) ; do
+	record $((1400000000 + i)) $((i * 997 % 1000000)) $((60 + i * 31 % 1440))
+	if [ $((i % 700)) -eq 0 ] ; then
+		record_jumbo $((1400000000 + i)) 0 $((65536 + i))
+	fi
+done > block.pcap
+
+chunk=$((64 << 20))
+block=$(stat -c %s block.pcap)
+head=$(((chunk - 24 - 4096) / block))
+
+# The nested record starts 1000 bytes before the boundary, its pcap
+# records 1000 bytes after it
+{
+	printf '\xd4\xc3\xb2\xa1\x02\x00\x04\x00'
+	le32 0
+	le32 0
+	le32 64
+	le32 1
+	for i in $(seq 1 ${head}) ; do
+		cat block.pcap
+	done
+
+	gap=$((chunk - 1000 - 24 - head * block))
+	while [ ${gap} -gt 2000 ] ; do
+		record 1400000000 1 984
+		gap=$((gap - 1000))
+	done
+	record 1400000000 0 $((gap - 16))
+	record_nested 1400000000 30000 1984
+
+	for i in $(seq $((head + 1)) 200) ; do
+		cat block.pcap
+	done
+} > test.pcap
+
+strip_timing() {
+	grep -v 'usec in total'
+}
+
+# The scatter-gather default cannot read records spanning more than two of
+# its buffers, plain read(2) takes anything up to the serial packet buffer
+serial=$(netsniff-ng --in test.pcap --threads 1 --clrw 2>&1 | strip_timing | md5sum)
+parallel=$(netsniff-ng --in test.pcap --threads "${workers}" 2>&1 | strip_timing | md5sum)
+
+if [ ! $keep ] ; then
+	rm -f block.pcap test.pcap
+fi
+
+if [ "${serial}" != "${parallel}" ] ; then
+	echo "Output of ${workers} threads differs from the serial reader!"
+	exit 1
+fi
+
+echo "Output of ${workers} threads matches the serial reader."
@@ -3,85 +3,188 @@
  * By Daniel Borkmann <daniel@netsniff-ng.org>
  * Copyright 2009, 2010 Daniel Borkmann.
  * Subject to the GPL, version 2.
+ *
+ * Every thread formats into a buffer of its own, so no locking is needed.
+ * The buffer is written out with writev(2) in one go, where the line
+ * wrapping for the terminal is done by cutting the text into spans and
+ * putting the indentation in between, instead of going char by char.
+ * Dissected packets are only pushed out when the buffer fills up, when
+ * output has been held back for a while or when the caller goes idle.
  */
 
 #define _BSD_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "xutils.h"
+#include "xio.h"
 #include "tprintf.h"
 #include "die.h"
-#include "locking.h"
 #include "built_in.h"
 
 #define term_trailing_size	5
 #define term_starting_size	3
 #define term_curr_size		(get_tty_size() - term_trailing_size)
 
-static char buffer[1024];
-static volatile size_t buffer_use = 0;
-static struct spinlock buffer_lock;
+#define TPRINTF_BUFF_SIZE	(128 * 1024)
+/* Lazy flushes leave the buffer alone below this and within this time */
+#define TPRINTF_LAZY_MARK	(TPRINTF_BUFF_SIZE / 2)
+#define TPRINTF_LAZY_MS		100
+#define TPRINTF_IOV_NUM		256
 
-static inline void __tprintf_flush_newline(void)
+static __thread char buffer[TPRINTF_BUFF_SIZE];
+static __thread size_t buffer_use = 0;
+static __thread size_t line_count = 0;
+static __thread uint64_t flushed_ms = 0;
+
+static __thread struct iovec iov[TPRINTF_IOV_NUM];
+static __thread int iov_use = 0;
+
+/* Set up once before any output, for all threads */
+static int term_wrap = 1;
+static int term_fd = -1;
+
+static const char term_newline[] = "\n   ";
+
+static void __tprintf_write(void)
+{
+	int i, fd;
+
+	if (iov_use == 0)
+		return;
+
+	/* Whatever went through stdio so far comes first */
+	fflush(stdout);
+
+	fd = term_fd >= 0 ? term_fd : fileno(stdout);
+	if (fd >= 0) {
+		writev_or_die(fd, iov, iov_use);
+	} else {
+		for (i = 0; i < iov_use; ++i)
+			fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout);
+	}
+
+	iov_use = 0;
+}
+
+static inline void __tprintf_span(const char *str, size_t len)
+{
+	if (len == 0)
+		return;
+
+	iov[iov_use].iov_base = (void *) str;
+	iov[iov_use].iov_len = len;
+
+	if (++iov_use == array_size(iov))
+		__tprintf_write();
+}
+
+static inline bool __tprintf_flush_skip(char c)
 {
-	int i;
-	fputc('\n', stdout);
-	for (i = 0; i < term_starting_size; ++i)
-		fputc(' ', stdout);
+	return c == ' ' || c == ',';
 }
 
-static inline int __tprintf_flush_skip(char *buffer, int i, size_t max)
+static inline uint64_t __tprintf_now_ms(void)
 {
-	int val = buffer[i];
-	if (val == ' ' || val == ',')
-		return 1;
-	return 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 static void __tprintf_flush(void)
 {
-	int i;
-	static ssize_t line_count = 0;
-	size_t term_len = term_curr_size;
-
-	for (i = 0; i < buffer_use; ++i) {
-		if (buffer[i] == '\n') {
-			term_len = term_curr_size;
-			line_count = -1;
-		}
-		if (line_count == term_len) {
-			__tprintf_flush_newline();
+	char *nl;
+	int cols = term_curr_size;
+	size_t i = 0, end, room, term_len;
+
+	/* Each wrapped line has to take at least one char */
+	if (cols <= term_starting_size)
+		cols = term_starting_size + 1;
+	term_len = cols;
+
+	if (!term_wrap) {
+		__tprintf_span(buffer, buffer_use);
+		i = buffer_use;
+	}
+
+	while (i < buffer_use) {
+		nl = memchr(buffer + i, '\n', buffer_use - i);
+		end = nl ? nl - buffer : buffer_use;
+
+		while (i < end && line_count + (end - i) > term_len) {
+			room = line_count < term_len ? term_len - line_count : 0;
+
+			__tprintf_span(buffer + i, room);
+			__tprintf_span(term_newline, sizeof(term_newline) - 1);
+
+			i += room;
 			line_count = term_starting_size;
-			while (i < buffer_use &&
-			       __tprintf_flush_skip(buffer, i, buffer_use))
+
+			while (i < end && __tprintf_flush_skip(buffer[i]))
 				i++;
 		}
 
-		fputc(buffer[i], stdout);
-		line_count++;
+		if (nl) {
+			__tprintf_span(buffer + i, end - i + 1);
+			line_count = 0;
+			i = end + 1;
+		} else {
+			__tprintf_span(buffer + i, end - i);
+			line_count += end - i;
+			i = end;
+		}
 	}
 
+	__tprintf_write();
 	fflush(stdout);
-	access_once(buffer_use) = 0;
+
+	buffer_use = 0;
+	flushed_ms = __tprintf_now_ms();
 }
 
 void tprintf_flush(void)
 {
-	spinlock_lock(&buffer_lock);
 	__tprintf_flush();
-	spinlock_unlock(&buffer_lock);
+}
+
+void tprintf_flush_lazy(void)
+{
+	if (buffer_use >= TPRINTF_LAZY_MARK ||
+	    __tprintf_now_ms() - flushed_ms >= TPRINTF_LAZY_MS)
+		__tprintf_flush();
+}
+
+void tprintf_set_wrap(int wrap)
+{
+	term_wrap = wrap;
+}
+
+void tprintf_set_fd(int fd)
+{
+	term_fd = fd;
+}
+
+int tprintf_get_fd(void)
+{
+	return term_fd >= 0 ? term_fd : STDOUT_FILENO;
 }
 
 void tprintf_init(void)
 {
-	spinlock_init(&buffer_lock);
+	flushed_ms = __tprintf_now_ms();
 }
 
 void tprintf_cleanup(void)
 {
 	tprintf_flush();
-	spinlock_destroy(&buffer_lock);
 }
 
 void tprintf(char *msg, ...)
@@ -90,8 +193,6 @@ void tprintf(char *msg, ...)
 	ssize_t avail;
 	va_list vl;
 
-	spinlock_lock(&buffer_lock);
-
 	avail = sizeof(buffer) - buffer_use;
 	bug_on(avail < 0);
 
@@ -101,7 +202,7 @@ void tprintf(char *msg, ...)
 
 	if (ret < 0)
 		panic("vsnprintf screwed up in tprintf!\n");
-	if (ret > sizeof(buffer))
+	if (ret >= sizeof(buffer))
 		panic("No mem in tprintf left!\n");
 	if (ret >= avail) {
 		__tprintf_flush();
@@ -118,6 +219,15 @@ void tprintf(char *msg, ...)
 	}
 
 	buffer_use += ret;
+}
+
+void twrite(const void *data, size_t len)
+{
+	if (len > sizeof(buffer))
+		panic("No mem in tprintf left!\n");
+	if (len > sizeof(buffer) - buffer_use)
+		__tprintf_flush();
 
-	spinlock_unlock(&buffer_lock);
+	memcpy(buffer + buffer_use, data, len);
+	buffer_use += len;
 }
@@ -8,13 +8,20 @@
 #ifndef TPRINTF_H
 #define TPRINTF_H
 
+#include <stddef.h>
+
 #include "built_in.h"
 
 #define DEFAULT_TTY_SIZE	80
 
 extern void tprintf_init(void);
 extern void tprintf(char *msg, ...) __check_format_printf(1, 2);
+extern void twrite(const void *data, size_t len);
 extern void tprintf_flush(void);
+extern void tprintf_flush_lazy(void);
+extern void tprintf_set_wrap(int wrap);
+extern void tprintf_set_fd(int fd);
+extern int tprintf_get_fd(void);
 extern void tprintf_cleanup(void);
 
 #define __reset			"0"
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -24,6 +25,7 @@
 #include "die.h"
 #include "xio.h"
 #include "xutils.h"
+#include "built_in.h"
 
 int open_or_die(const char *file, int flags)
 {
@@ -109,6 +111,38 @@ ssize_t write_or_die(int fd, const void *buf, size_t len)
 	return ret;
 }
 
+/* Writes out all of iov, note that iov itself gets consumed on the way */
+ssize_t writev_or_die(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret, num = 0;
+
+	while (iovcnt > 0) {
+		ret = writev(fd, iov, min(iovcnt, IOV_MAX));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE)
+				die();
+			panic("Cannot write to descriptor!");
+		}
+
+		num += ret;
+
+		while (iovcnt > 0 && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (ret > 0) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return num;
+}
+
 extern volatile sig_atomic_t sigint;
 
 ssize_t read_exact(int fd, void *buf, size_t len, int mayexit)
@@ -20,6 +20,19 @@
 #include "built_in.h"
 #include "die.h"
 
+/* Heap allocations done so far, for checking that hot paths are free of it */
+static unsigned long xmalloc_calls = 0;
+
+static inline void xmalloc_account(void)
+{
+	__atomic_fetch_add(&xmalloc_calls, 1, __ATOMIC_RELAXED);
+}
+
+__hidden unsigned long xmalloc_count(void)
+{
+	return __atomic_load_n(&xmalloc_calls, __ATOMIC_RELAXED);
+}
+
 __hidden void *xmalloc(size_t size)
 {
 	void *ptr;
@@ -27,6 +40,8 @@ __hidden void *xmalloc(size_t size)
 	if (unlikely(size == 0))
 		panic("xmalloc: zero size\n");
 
+	xmalloc_account();
+
 	ptr = malloc(size);
 	if (unlikely(ptr == NULL))
 		panic("xmalloc: out of memory (allocating %zu bytes)\n",
@@ -50,6 +65,8 @@ __hidden void *xmalloc_aligned(size_t size, size_t alignment)
 	if (unlikely(size == 0))
 		panic("xmalloc_aligned: zero size\n");
 
+	xmalloc_account();
+
 	ret = posix_memalign(&ptr, alignment, size);
 	if (unlikely(ret != 0))
 		panic("xmalloc_aligned: out of memory (allocating %zu "
@@ -94,6 +111,8 @@ __hidden void *xrealloc(void *ptr, size_t nmemb, size_t size)
 	if (unlikely(((size_t) ~0) / nmemb < size))
 		panic("xrealloc: nmemb * size > SIZE_T_MAX\n");
 
+	xmalloc_account();
+
 	if (ptr == NULL)
 		new_ptr = malloc(new_size);
 	else
@@ -24,6 +24,7 @@ extern __hidden void xfree_func(void *ptr);
 extern __hidden char *xstrdup(const char *str);
 extern __hidden char *xstrndup(const char *str, size_t size);
 extern __hidden int xdup(int fd);
+extern __hidden unsigned long xmalloc_count(void);
 
 #define xfree(ptr)							\
 do {									\